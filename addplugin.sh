@@ -9,3 +9,5 @@ cd ${JG_PATH}/conf
 ln -s ../../janus-skywayiot-plugin/conf/janus.plugin.skywayiot.cfg.sample .
 cd ../plugins
 ln -s ../../janus-skywayiot-plugin/plugins/janus_skywayiot.c .
+cd ..
+ln -s ../janus-skywayiot-plugin/harness .
@@ -0,0 +1,2403 @@
+/*! \file    janus-skywayiot-harness.c
+ * \author   Kensaku Komatsu <kensaku.komatsu@ntt.com>
+ * \copyright Apache-2.0 license
+ * \brief    Test and benchmark harness for the SkyWay IoT plugin
+ * \details  Loads the plugin outside of Janus, with a mock gateway that
+ * counts (and timestamps) what the plugin relays, and drives its entry
+ * points and its external interface, where the harness plays the backend.
+ * Everything runs on the loopback interface, so it only needs a plain Linux
+ * box. The modes are:
+ *
+ *  - check: functional checks of the data and media paths, which exits
+ *    with an error if any of them fails;
+ *  - features: a check of each feature that needs more than the raw
+ *    external interface (groups, retained values, conflation, rate limits,
+ *    expiry, device spools, chunking, bulk transfers, compression, deltas,
+ *    routes, NDJSON, TLS and failover), with plugin instances configured
+ *    for them, where the harness plays framed or NDJSON backends;
+ *  - bench: microbenchmarks of each entry point; with --baseline, the
+ *    results are compared to those of a previous run (saved with --output)
+ *    and any of them slower than --tolerance percent is an error;
+ *  - scale: unicast and broadcast frames from the backend, at a controlled
+ *    rate, to a growing number of sessions (--sessions), with messages per
+ *    second, CPU time per message and latency percentiles for each count;
+ *  - rtp: synthetic cameras (--cameras, half VP8 and half H.264, plus Opus
+ *    sized audio at 50 packets per second) fed to incoming_rtp by one or
+ *    more threads, with a sink on media_send_port, reporting packets per
+ *    second per core, loss and the latency added on the way to the sink;
+ *  - soak: sessions created and destroyed at a steady rate (--churn) for a
+ *    long time (an hour by default), with data and media flowing, sampling
+ *    the process RSS, the memory the allocator hands out and the destroyed
+ *    sessions not freed yet, and failing if memory keeps growing once
+ *    warmed up, or if sessions aren't freed as they should.
+ *
+ * Usage: janus-skywayiot-harness [options] check|features|bench|scale|rtp|soak
+ */
+
+#include <arpa/inet.h>
+#include <dlfcn.h>
+#include <endian.h>
+#include <errno.h>
+#include <malloc.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <glib.h>
+#include <jansson.h>
+#ifdef HAVE_LIBSSL
+#include <openssl/err.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+#endif
+
+#include "../plugins/plugin.h"
+#include "../debug.h"
+#include "../log.h"
+#include "../utils.h"
+
+int janus_log_level = LOG_WARN;
+gboolean janus_log_timestamps = FALSE;
+gboolean janus_log_colors = FALSE;
+int lock_debug = 0;
+
+static gchar *plugin_path = NULL;
+static gint iterations = 100000;
+static gchar *baseline_file = NULL;
+static gchar *output_file = NULL;
+static gint tolerance = 10;
+static gint log_level = LOG_WARN;
+static gchar *session_counts = NULL;
+static gint unicast_rate = 10000;
+static gint broadcast_rate = 10;
+static gint duration = 0;
+static gint message_size = 64;
+static gint cameras = 16;
+static gint fps = 30;
+static gint bitrate = 1500;
+static gint generators = 1;
+static gboolean unpaced = FALSE;
+static gchar *media_io = NULL;
+static gint churn = 200;
+static gint steady = 1000;
+static gint traffic = 1000;
+static gint sample_interval = 10;
+static gint max_growth = 10;
+
+static GOptionEntry harness_options[] = {
+	{ "plugin", 'p', 0, G_OPTION_ARG_FILENAME, &plugin_path, "Plugin to load (default " PLUGINDIR "/libjanus_skywayiot.so)", "path" },
+	{ "iterations", 'n', 0, G_OPTION_ARG_INT, &iterations, "Calls per microbenchmark (default 100000)", "count" },
+	{ "baseline", 'b', 0, G_OPTION_ARG_FILENAME, &baseline_file, "Results of a previous bench run to compare to", "path" },
+	{ "output", 'o', 0, G_OPTION_ARG_FILENAME, &output_file, "Where to save the bench or scale results", "path" },
+	{ "tolerance", 't', 0, G_OPTION_ARG_INT, &tolerance, "Slowdown (percent) over the baseline that counts as a regression (default 10)", "percent" },
+	{ "sessions", 's', 0, G_OPTION_ARG_STRING, &session_counts, "Session counts to scale to (default 10,100,1000,10000,100000)", "list" },
+	{ "rate", 'r', 0, G_OPTION_ARG_INT, &unicast_rate, "Unicast frames per second while scaling, 0 for as fast as possible (default 10000)", "count" },
+	{ "broadcast-rate", 'B', 0, G_OPTION_ARG_INT, &broadcast_rate, "Broadcast frames per second while scaling, 0 for as fast as possible (default 10)", "count" },
+	{ "duration", 'D', 0, G_OPTION_ARG_INT, &duration, "Seconds of traffic for each step (default 5, 3600 when soaking)", "seconds" },
+	{ "size", 'S', 0, G_OPTION_ARG_INT, &message_size, "Bytes in each message while scaling (default 64)", "bytes" },
+	{ "cameras", 'c', 0, G_OPTION_ARG_INT, &cameras, "Cameras to simulate (default 16)", "count" },
+	{ "fps", 'f', 0, G_OPTION_ARG_INT, &fps, "Video frames per second of each camera (default 30)", "count" },
+	{ "bitrate", 'k', 0, G_OPTION_ARG_INT, &bitrate, "Video bitrate of each camera (default 1500)", "kbps" },
+	{ "threads", 'T', 0, G_OPTION_ARG_INT, &generators, "Threads feeding the cameras to the plugin (default 1)", "count" },
+	{ "unpaced", 'u', 0, G_OPTION_ARG_NONE, &unpaced, "Feed the cameras as fast as possible, instead of in real time", NULL },
+	{ "media-io", 'm', 0, G_OPTION_ARG_STRING, &media_io, "media_io setting of the plugin, to compare forwarding strategies", "syscalls|io_uring" },
+	{ "churn", 'C', 0, G_OPTION_ARG_INT, &churn, "Sessions created (and destroyed) per second when soaking (default 200)", "count" },
+	{ "steady", 'L', 0, G_OPTION_ARG_INT, &steady, "Sessions that live through the whole soak (default 1000)", "count" },
+	{ "traffic", 'M', 0, G_OPTION_ARG_INT, &traffic, "Messages (and media packets) per second when soaking (default 1000)", "count" },
+	{ "sample-interval", 'i', 0, G_OPTION_ARG_INT, &sample_interval, "Seconds between memory samples when soaking (default 10)", "seconds" },
+	{ "max-growth", 'g', 0, G_OPTION_ARG_INT, &max_growth, "Memory growth (percent) after warming up that fails the soak (default 10)", "percent" },
+	{ "debug-level", 'd', 0, G_OPTION_ARG_INT, &log_level, "Debug/logging level of the plugin (0=disable debugging, 7=maximum debug level; default 3)", "level" },
+	{ NULL }
+};
+
+
+/* Messages on the external interface are the handle id (host order) and
+ * the payload, written at once. There's no framing, and the plugin takes
+ * whatever a read gets as one message: so the harness only sends a message
+ * once the previous one got to a data channel, and its data channel
+ * messages are all HARNESS_MESSAGE_SIZE bytes, to split what it gets back */
+#define HARNESS_MESSAGE_SIZE	256
+#define HARNESS_RECORD_SIZE		(sizeof(guint64) + HARNESS_MESSAGE_SIZE)
+#define HARNESS_PAYLOAD_MAX		(65534 - (int)sizeof(guint64))	/* What fits in a read of the plugin */
+#define HARNESS_BROADCAST_ID	0xffffffffffffffff
+
+/* What the harness puts at the start of the messages (and media packet
+ * payloads) it sends, to recognize them and measure how long they took */
+typedef struct harness_stamp {
+	guint32 magic;
+	guint32 seq;
+	gint64 sent;	/* Monotonic time it was sent at */
+} harness_stamp;
+#define HARNESS_MAGIC	0x534b5949
+
+static void harness_stamp_write(char *buf, guint32 seq) {
+	harness_stamp stamp = { HARNESS_MAGIC, seq, g_get_monotonic_time() };
+	memcpy(buf, &stamp, sizeof(stamp));
+}
+
+/* How long a stamped message took, or -1 if it wasn't one of ours */
+static gint64 harness_stamp_age(const char *buf, int len) {
+	harness_stamp stamp;
+	if(len < (int)sizeof(stamp))
+		return -1;
+	memcpy(&stamp, buf, sizeof(stamp));
+	if(stamp.magic != HARNESS_MAGIC)
+		return -1;
+	return g_get_monotonic_time() - stamp.sent;
+}
+
+
+/* Latency samples (usecs), up to a fixed number: the rest are only counted */
+typedef struct harness_latency {
+	gint64 *samples;
+	gint size;
+	volatile gint count;
+} harness_latency;
+static harness_latency relay_latency;		/* From the backend to a data channel */
+static harness_latency backend_latency;		/* From a data channel to the backend */
+static harness_latency media_latency;		/* From incoming_rtp to the media sink */
+
+static void harness_latency_init(harness_latency *latency, gint size) {
+	latency->samples = g_malloc0(size * sizeof(gint64));
+	latency->size = size;
+	latency->count = 0;
+}
+
+static void harness_latency_add(harness_latency *latency, gint64 usecs) {
+	if(usecs < 0 || g_atomic_int_get(&latency->count) >= latency->size)
+		return;
+	gint index = g_atomic_int_add(&latency->count, 1);
+	if(index < latency->size)
+		latency->samples[index] = usecs;
+}
+
+static int harness_latency_compare(const void *a, const void *b) {
+	gint64 x = *(const gint64 *)a, y = *(const gint64 *)b;
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/* Sorts the samples, and returns how many there are and their percentiles */
+static gint harness_latency_percentiles(harness_latency *latency, gint64 *p50, gint64 *p90, gint64 *p99) {
+	gint count = MIN(g_atomic_int_get(&latency->count), latency->size);
+	*p50 = *p90 = *p99 = 0;
+	if(count == 0)
+		return 0;
+	qsort(latency->samples, count, sizeof(gint64), harness_latency_compare);
+	*p50 = latency->samples[(count-1)*50/100];
+	*p90 = latency->samples[(count-1)*90/100];
+	*p99 = latency->samples[(count-1)*99/100];
+	return count;
+}
+
+static void harness_latency_print(harness_latency *latency, const char *what) {
+	gint64 p50 = 0, p90 = 0, p99 = 0;
+	gint count = harness_latency_percentiles(latency, &p50, &p90, &p99);
+	if(count == 0)
+		JANUS_PRINT("  %-28s no samples\n", what);
+	else
+		JANUS_PRINT("  %-28s p50 %"SCNi64"us, p90 %"SCNi64"us, p99 %"SCNi64"us (%d samples)\n", what, p50, p90, p99, count);
+}
+
+static void harness_latency_reset(harness_latency *latency) {
+	g_atomic_int_set(&latency->count, 0);
+}
+
+
+/* The mock gateway: every handle the harness creates is one of these, and
+ * the callbacks just count what the plugin does with it */
+typedef struct harness_handle {
+	janus_plugin_session handle;
+	volatile gint data;		/* relay_data calls */
+	volatile gint rtp;		/* relay_rtp calls */
+	volatile gint rtcp;		/* relay_rtcp calls */
+	volatile gint events;	/* push_event calls */
+	volatile gint errors;	/* Events with an error_code */
+	gint64 destroyed;		/* When destroy_session was called, 0 if it wasn't */
+	GByteArray *last;		/* Last message relayed, with keep_relayed (see harness_last) */
+} harness_handle;
+static harness_handle totals;	/* All of the above, for all handles */
+static GHashTable *handles = NULL;		/* The handles with a session */
+static GQueue graveyard = G_QUEUE_INIT;	/* The destroyed ones, oldest first */
+/* Only the feature checks look at what was relayed, and not just at how much */
+static gboolean keep_relayed = FALSE;
+static GMutex relayed_mutex;
+
+static int harness_push_event(janus_plugin_session *handle, janus_plugin *plugin, const char *transaction, json_t *message, json_t *jsep) {
+	harness_handle *h = (harness_handle *)handle->gateway_handle;
+	gboolean error = message != NULL && json_object_get(message, "error_code") != NULL;
+	g_atomic_int_inc(&h->events);
+	g_atomic_int_inc(&totals.events);
+	if(error) {
+		g_atomic_int_inc(&h->errors);
+		g_atomic_int_inc(&totals.errors);
+	}
+	return 0;
+}
+
+static void harness_relay_rtp(janus_plugin_session *handle, int video, char *buf, int len) {
+	harness_handle *h = (harness_handle *)handle->gateway_handle;
+	g_atomic_int_inc(&h->rtp);
+	g_atomic_int_inc(&totals.rtp);
+}
+
+static void harness_relay_rtcp(janus_plugin_session *handle, int video, char *buf, int len) {
+	harness_handle *h = (harness_handle *)handle->gateway_handle;
+	g_atomic_int_inc(&h->rtcp);
+	g_atomic_int_inc(&totals.rtcp);
+}
+
+static void harness_relay_data(janus_plugin_session *handle, char *buf, int len) {
+	harness_handle *h = (harness_handle *)handle->gateway_handle;
+	if(keep_relayed) {
+		/* Counted with the lock held, so that whoever finds it there finds it counted, and vice versa */
+		g_mutex_lock(&relayed_mutex);
+		if(h->last == NULL)
+			h->last = g_byte_array_new();
+		g_byte_array_set_size(h->last, 0);
+		g_byte_array_append(h->last, (const guint8 *)buf, len);
+		g_atomic_int_inc(&h->data);
+		g_mutex_unlock(&relayed_mutex);
+	} else {
+		g_atomic_int_inc(&h->data);
+	}
+	g_atomic_int_inc(&totals.data);
+	harness_latency_add(&relay_latency, harness_stamp_age(buf, len));
+}
+
+static void harness_close_pc(janus_plugin_session *handle) {
+}
+
+static void harness_end_session(janus_plugin_session *handle) {
+}
+
+static gboolean harness_events_is_enabled(void) {
+	return FALSE;
+}
+
+static void harness_notify_event(janus_plugin *plugin, janus_plugin_session *handle, json_t *event) {
+	json_decref(event);
+}
+
+static janus_callbacks harness_gateway = {
+	.push_event = harness_push_event,
+	.relay_rtp = harness_relay_rtp,
+	.relay_rtcp = harness_relay_rtcp,
+	.relay_data = harness_relay_data,
+	.close_pc = harness_close_pc,
+	.end_session = harness_end_session,
+	.events_is_enabled = harness_events_is_enabled,
+	.notify_event = harness_notify_event,
+};
+
+static janus_plugin *plugin = NULL;
+
+static harness_handle *harness_handle_create(void) {
+	harness_handle *h = g_malloc0(sizeof(harness_handle));
+	h->handle.gateway_handle = h;
+	int error = 0;
+	plugin->create_session(&h->handle, &error);
+	if(error != 0) {
+		JANUS_LOG(LOG_ERR, "Couldn't create a session (%d)\n", error);
+		g_free(h);
+		return NULL;
+	}
+	g_hash_table_add(handles, h);
+	return h;
+}
+
+/* The plugin frees its sessions some time after they're destroyed, so the
+ * handles are only freed later (see harness_graveyard_sweep) */
+static void harness_handle_destroy(harness_handle *h) {
+	if(h->destroyed)
+		return;
+	int error = 0;
+	h->destroyed = g_get_monotonic_time();
+	plugin->destroy_session(&h->handle, &error);
+	g_hash_table_remove(handles, h);
+	g_queue_push_tail(&graveyard, h);
+}
+
+/* Frees the handles destroyed more than age usecs ago: the watchdog of the
+ * plugin frees sessions five seconds after they're destroyed */
+static void harness_graveyard_sweep(gint64 age) {
+	gint64 now = g_get_monotonic_time();
+	harness_handle *h = NULL;
+	while((h = g_queue_peek_head(&graveyard)) != NULL && now - h->destroyed >= age) {
+		g_queue_pop_head(&graveyard);
+		if(h->last != NULL)
+			g_byte_array_free(h->last, TRUE);
+		g_free(h);
+	}
+}
+
+static guint64 harness_handle_id(harness_handle *h) {
+	return (guint64)&h->handle;
+}
+
+/* Sends a request to the plugin, and returns the synchronous response, if any */
+static json_t *harness_request(harness_handle *h, json_t *request) {
+	struct janus_plugin_result *result = plugin->handle_message(&h->handle, g_strdup("harness"), request, NULL);
+	json_t *response = NULL;
+	if(result != NULL) {
+		if(result->type == JANUS_PLUGIN_OK && result->content != NULL)
+			response = json_incref(result->content);
+		janus_plugin_result_destroy(result);
+	}
+	return response;
+}
+
+static harness_handle *control = NULL;	/* The session the harness sends its stats requests on */
+
+static json_t *harness_stats(void) {
+	json_t *response = harness_request(control, json_pack("{ss}", "request", "stats"));
+	json_t *stats = response ? json_incref(json_object_get(response, "stats")) : NULL;
+	if(response)
+		json_decref(response);
+	return stats;
+}
+
+/* A number in the stats, as in "sessions.live" */
+static json_int_t harness_stats_get(json_t *stats, const char *path) {
+	gchar **levels = g_strsplit(path, ".", -1);
+	json_t *value = stats;
+	int i = 0;
+	for(i = 0; levels[i] != NULL && value != NULL; i++)
+		value = json_is_array(value) ? json_array_get(value, atoi(levels[i])) : json_object_get(value, levels[i]);
+	g_strfreev(levels);
+	return json_is_integer(value) ? json_integer_value(value) : -1;
+}
+
+static json_int_t harness_stat(const char *path) {
+	json_t *stats = harness_stats();
+	json_int_t value = harness_stats_get(stats, path);
+	if(stats)
+		json_decref(stats);
+	return value;
+}
+
+/* Waits for a counter to get to a value, for at most timeout usecs */
+static gboolean harness_wait(volatile gint *counter, gint value, gint64 timeout) {
+	gint64 until = g_get_monotonic_time() + timeout;
+	while(g_atomic_int_get(counter) < value) {
+		if(g_get_monotonic_time() > until)
+			return FALSE;
+		g_usleep(500);
+	}
+	return TRUE;
+}
+
+/* Same for a number in the stats */
+static gboolean harness_wait_stat(const char *path, json_int_t value, gint64 timeout) {
+	gint64 until = g_get_monotonic_time() + timeout;
+	while(harness_stat(path) < value) {
+		if(g_get_monotonic_time() > until)
+			return FALSE;
+		g_usleep(10000);
+	}
+	return TRUE;
+}
+
+/* A copy of the last message relayed to a handle (up to size bytes), and
+ * its length, or -1 if nothing was relayed to it yet */
+static int harness_last(harness_handle *h, char *buf, int size) {
+	int len = -1;
+	g_mutex_lock(&relayed_mutex);
+	if(h->last != NULL) {
+		len = MIN((int)h->last->len, size);
+		memcpy(buf, h->last->data, len);
+	}
+	g_mutex_unlock(&relayed_mutex);
+	return len;
+}
+
+/* Waits for the last message relayed to a handle to be this one */
+static gboolean harness_wait_last(harness_handle *h, const char *message, gint64 timeout) {
+	char buf[HARNESS_MESSAGE_SIZE];
+	int len = strlen(message);
+	gint64 until = g_get_monotonic_time() + timeout;
+	while(harness_last(h, buf, sizeof(buf)) != len || memcmp(buf, message, len)) {
+		if(g_get_monotonic_time() > until)
+			return FALSE;
+		g_usleep(500);
+	}
+	return TRUE;
+}
+
+
+/* A connection to the external interface, or -1 */
+static int harness_connect(int port) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons(port);
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(fd < 0 || connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+		JANUS_LOG(LOG_ERR, "Couldn't connect to the external interface on port %d (%d, %s)\n", port, errno, strerror(errno));
+		if(fd >= 0)
+			close(fd);
+		return -1;
+	}
+	int yes = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+	return fd;
+}
+
+
+/* The backend end of the external interface: messages are written by
+ * whoever needs to, and read (and counted) by a thread of its own */
+typedef struct harness_backend {
+	int fd;
+	GMutex mutex;			/* One message at a time */
+	GThread *thread;
+	volatile gint frames;	/* Data channel messages received */
+	volatile gint bytes;	/* Payload bytes received */
+	guint64 last_target;	/* Handle id of the last message received */
+} harness_backend;
+static harness_backend backend = { -1 };
+
+static gpointer harness_backend_thread(gpointer data) {
+	char *buf = g_malloc(HARNESS_RECORD_SIZE);
+	gsize len = 0;
+	while(TRUE) {
+		ssize_t res = recv(backend.fd, buf + len, HARNESS_RECORD_SIZE - len, 0);
+		if(res < 0 && errno == EINTR)
+			continue;
+		if(res <= 0)
+			break;
+		len += res;
+		if(len < HARNESS_RECORD_SIZE)
+			continue;
+		char *payload = buf + sizeof(guint64);
+		memcpy(&backend.last_target, buf, sizeof(guint64));
+		harness_latency_add(&backend_latency, harness_stamp_age(payload, HARNESS_MESSAGE_SIZE));
+		g_atomic_int_add(&backend.bytes, HARNESS_MESSAGE_SIZE);
+		g_atomic_int_inc(&backend.frames);
+		len = 0;
+	}
+	g_free(buf);
+	return NULL;
+}
+
+static gboolean harness_backend_connect(int port) {
+	backend.fd = harness_connect(port);
+	if(backend.fd < 0)
+		return FALSE;
+	g_mutex_init(&backend.mutex);
+	backend.thread = g_thread_new("harness backend", harness_backend_thread, NULL);
+	/* Connecting is not enough, the plugin has to accept us too, and until
+	 * then it drops data channel messages without counting them: so keep
+	 * sending one until it does, and forget about it once it got here */
+	char probe[HARNESS_MESSAGE_SIZE];
+	memset(probe, 0, sizeof(probe));
+	gint64 until = g_get_monotonic_time() + 5*G_USEC_PER_SEC;
+	while(g_get_monotonic_time() < until) {
+		json_int_t written = harness_stat("entry_points.incoming_data.calls");
+		plugin->incoming_data(&control->handle, probe, sizeof(probe));
+		if(harness_stat("entry_points.incoming_data.calls") > written) {
+			gboolean received = harness_wait(&backend.frames, 1, G_USEC_PER_SEC);
+			g_atomic_int_set(&backend.frames, 0);
+			g_atomic_int_set(&backend.bytes, 0);
+			return received;
+		}
+		g_usleep(10000);
+	}
+	return FALSE;
+}
+
+static void harness_backend_disconnect(void) {
+	if(backend.fd < 0)
+		return;
+	shutdown(backend.fd, SHUT_RDWR);
+	g_thread_join(backend.thread);
+	close(backend.fd);
+	backend.fd = -1;
+	g_mutex_clear(&backend.mutex);
+}
+
+/* Sends a message to a handle (or all of them), and waits (for a second
+ * at most) for the plugin to relay it: returns 0 if it did, 1 if it didn't,
+ * and -1 if the message couldn't be sent */
+static int harness_backend_send(guint64 target, const char *payload, int len) {
+	gsize total = sizeof(target) + len, sent = 0;
+	char *message = g_malloc(total);
+	memcpy(message, &target, sizeof(target));
+	memcpy(message + sizeof(target), payload, len);
+	g_mutex_lock(&backend.mutex);
+	gint relayed = g_atomic_int_get(&totals.data);
+	while(sent < total) {
+		ssize_t res = send(backend.fd, message + sent, total - sent, MSG_NOSIGNAL);
+		if(res < 0 && errno == EINTR)
+			continue;
+		if(res < 0)
+			break;
+		sent += res;
+	}
+	int res = sent < total ? -1 : (harness_wait(&totals.data, relayed + 1, G_USEC_PER_SEC) ? 0 : 1);
+	g_mutex_unlock(&backend.mutex);
+	g_free(message);
+	return res;
+}
+
+/* The external interface in framed mode, as the plugin has it: a header (all
+ * of it in network order, the target too), and then the key, if any, and
+ * the payload. Only the feature checks play framed (or NDJSON) backends */
+typedef struct harness_frame_header {
+	guint32 length;		/* Bytes after this field */
+	guint8 type;
+	guint8 flags;
+	guint16 key_length;
+	guint64 target;
+} harness_frame_header;
+#define HARNESS_FRAME_DATA			0
+#define HARNESS_FRAME_HEARTBEAT		1
+#define HARNESS_FRAME_GROUP_ADD		2
+#define HARNESS_FRAME_GROUP_REMOVE	3
+#define HARNESS_FRAME_GROUP_DATA	5
+#define HARNESS_FRAME_PUBLISH		6
+#define HARNESS_FRAME_DEVICE		7
+#define HARNESS_FRAME_BULK			8
+#define HARNESS_FRAME_CREDIT		9
+#define HARNESS_FRAME_HELLO			10
+#define HARNESS_FRAME_FLAG_RETAIN	0x01
+#define HARNESS_FRAME_FLAG_TTL		0x02	/* The payload starts with an expiry, see harness_peer_send */
+#define HARNESS_FRAME_FLAG_DEADLINE	0x04
+#define HARNESS_FRAME_FLAG_LAST		0x08
+#define HARNESS_FRAME_MAX			(sizeof(harness_frame_header) + 65535)
+
+/* What a peer got from the plugin: NDJSON lines are data frames, without
+ * their newline, and anything received is NUL terminated, to compare it */
+typedef struct harness_frame {
+	guint8 type;
+	guint8 flags;
+	guint64 target;
+	int len;
+	char data[];
+} harness_frame;
+
+/* A framed or NDJSON backend: frames are written by whoever needs to, and
+ * read by a thread of its own, that queues them for harness_peer_receive,
+ * except with TLS, where they're read when waited for instead */
+typedef struct harness_peer {
+	int fd;
+	gboolean ndjson;
+	gpointer tls;			/* The SSL of the connection, with TLS */
+	GMutex mutex;			/* One frame at a time */
+	GThread *thread;
+	GAsyncQueue *frames;	/* harness_frame */
+	char *buf;				/* What was read, and isn't a frame yet */
+	gsize len;
+	gboolean broken;		/* Got something that isn't a frame */
+} harness_peer;
+static GList *peers = NULL;
+
+static ssize_t harness_peer_recv(harness_peer *peer, char *buf, gsize len) {
+	ssize_t res = -1;
+#ifdef HAVE_LIBSSL
+	if(peer->tls != NULL)
+		res = SSL_read((SSL *)peer->tls, buf, len);
+#endif
+	if(peer->tls == NULL) {
+		do {
+			res = recv(peer->fd, buf, len, 0);
+		} while(res < 0 && errno == EINTR);
+	}
+	return res;
+}
+
+/* Whether there's data buffered by the TLS library, that poll wouldn't see */
+static gboolean harness_peer_pending(harness_peer *peer) {
+#ifdef HAVE_LIBSSL
+	if(peer->tls != NULL)
+		return SSL_pending((SSL *)peer->tls) > 0;
+#endif
+	return FALSE;
+}
+
+/* The next complete frame (or line) in what was read, if any */
+static harness_frame *harness_peer_parse(harness_peer *peer) {
+	harness_frame *frame = NULL;
+	gsize total = 0;
+	if(peer->ndjson) {
+		char *newline = memchr(peer->buf, '\n', peer->len);
+		if(newline == NULL) {
+			peer->broken = peer->len == 2*HARNESS_FRAME_MAX;
+			return NULL;
+		}
+		total = newline - peer->buf + 1;
+		frame = g_malloc0(sizeof(harness_frame) + total);
+		frame->type = HARNESS_FRAME_DATA;
+		frame->len = total - 1;
+		memcpy(frame->data, peer->buf, frame->len);
+	} else {
+		harness_frame_header header;
+		if(peer->len < sizeof(header))
+			return NULL;
+		memcpy(&header, peer->buf, sizeof(header));
+		total = sizeof(header.length) + ntohl(header.length);
+		if(total < sizeof(header) || total > HARNESS_FRAME_MAX) {
+			JANUS_LOG(LOG_ERR, "Invalid frame length %"SCNu32" from the plugin\n", ntohl(header.length));
+			peer->broken = TRUE;
+			return NULL;
+		}
+		if(peer->len < total)
+			return NULL;
+		frame = g_malloc0(sizeof(harness_frame) + total - sizeof(header) + 1);
+		frame->type = header.type;
+		frame->flags = header.flags;
+		frame->target = be64toh(header.target);
+		frame->len = total - sizeof(header);
+		memcpy(frame->data, peer->buf + sizeof(header), frame->len);
+	}
+	memmove(peer->buf, peer->buf + total, peer->len - total);
+	peer->len -= total;
+	return frame;
+}
+
+/* Reads until there's a whole frame, for at most timeout usecs (forever if
+ * negative): returns NULL on timeouts, and when the connection is gone */
+static harness_frame *harness_peer_read(harness_peer *peer, gint64 timeout) {
+	gint64 until = g_get_monotonic_time() + timeout;
+	while(TRUE) {
+		harness_frame *frame = harness_peer_parse(peer);
+		if(frame != NULL || peer->broken)
+			return frame;
+		if(timeout >= 0 && !harness_peer_pending(peer)) {
+			gint64 left = until - g_get_monotonic_time();
+			struct pollfd fds = { peer->fd, POLLIN, 0 };
+			int ready = left > 0 ? poll(&fds, 1, (left + 999) / 1000) : 0;
+			if(ready < 0 && errno == EINTR)
+				continue;
+			if(ready <= 0)
+				return NULL;
+		}
+		ssize_t res = harness_peer_recv(peer, peer->buf + peer->len, 2*HARNESS_FRAME_MAX - peer->len);
+		if(res <= 0)
+			return NULL;
+		peer->len += res;
+	}
+}
+
+static gpointer harness_peer_thread(gpointer data) {
+	harness_peer *peer = (harness_peer *)data;
+	harness_frame *frame = NULL;
+	while((frame = harness_peer_read(peer, -1)) != NULL)
+		g_async_queue_push(peer->frames, frame);
+	return NULL;
+}
+
+static void harness_peer_close(harness_peer *peer) {
+	peers = g_list_remove(peers, peer);
+	shutdown(peer->fd, SHUT_RDWR);
+	if(peer->thread != NULL)
+		g_thread_join(peer->thread);
+#ifdef HAVE_LIBSSL
+	if(peer->tls != NULL)
+		SSL_free((SSL *)peer->tls);
+#endif
+	close(peer->fd);
+	g_async_queue_unref(peer->frames);
+	g_mutex_clear(&peer->mutex);
+	g_free(peer->buf);
+	g_free(peer);
+}
+
+/* Connects as a backend (over TLS, if given an SSL_CTX), and waits for the
+ * plugin to count it among its backends */
+static harness_peer *harness_peer_connect(int port, gboolean ndjson, gpointer tls) {
+	json_int_t connected = harness_stat("ext.0.backends");
+	int fd = harness_connect(port);
+	if(fd < 0)
+		return NULL;
+	harness_peer *peer = g_malloc0(sizeof(harness_peer));
+	peer->fd = fd;
+	peer->ndjson = ndjson;
+	peer->buf = g_malloc(2*HARNESS_FRAME_MAX);
+	peer->frames = g_async_queue_new_full(g_free);
+	g_mutex_init(&peer->mutex);
+	peers = g_list_prepend(peers, peer);
+#ifdef HAVE_LIBSSL
+	if(tls != NULL) {
+		/* Blocking: the listener of the plugin does its part meanwhile */
+		peer->tls = SSL_new((SSL_CTX *)tls);
+		if(peer->tls == NULL || SSL_set_fd((SSL *)peer->tls, fd) != 1 || SSL_connect((SSL *)peer->tls) != 1) {
+			JANUS_LOG(LOG_ERR, "Couldn't do the TLS handshake with the plugin (%s)\n", ERR_reason_error_string(ERR_get_error()));
+			harness_peer_close(peer);
+			return NULL;
+		}
+	}
+#endif
+	if(peer->tls == NULL)
+		peer->thread = g_thread_new("harness peer", harness_peer_thread, peer);
+	if(!harness_wait_stat("ext.0.backends", connected + 1, 5*G_USEC_PER_SEC)) {
+		JANUS_LOG(LOG_ERR, "The plugin didn't accept the connection\n");
+		harness_peer_close(peer);
+		return NULL;
+	}
+	return peer;
+}
+
+static gboolean harness_peer_write(harness_peer *peer, const char *buf, gsize len) {
+	gsize sent = 0;
+	g_mutex_lock(&peer->mutex);
+	while(sent < len) {
+		ssize_t res = -1;
+#ifdef HAVE_LIBSSL
+		if(peer->tls != NULL)
+			res = SSL_write((SSL *)peer->tls, buf + sent, len - sent);
+#endif
+		if(peer->tls == NULL) {
+			res = send(peer->fd, buf + sent, len - sent, MSG_NOSIGNAL);
+			if(res < 0 && errno == EINTR)
+				continue;
+		}
+		if(res <= 0)
+			break;
+		sent += res;
+	}
+	g_mutex_unlock(&peer->mutex);
+	return sent == len;
+}
+
+/* Sends a frame, with a key if not NULL: with the TTL or deadline flags, the
+ * expiry (milliseconds to live, or since the epoch) goes before the key */
+static gboolean harness_peer_send(harness_peer *peer, guint8 type, guint8 flags, guint64 expiry, guint64 target,
+		const char *key, const char *payload, int len) {
+	gsize key_len = key ? strlen(key) : 0;
+	gsize extra = (flags & (HARNESS_FRAME_FLAG_TTL | HARNESS_FRAME_FLAG_DEADLINE)) ? sizeof(expiry) : 0;
+	gsize total = sizeof(harness_frame_header) + extra + key_len + len;
+	harness_frame_header header;
+	header.length = htonl(total - sizeof(header.length));
+	header.type = type;
+	header.flags = flags;
+	header.key_length = htons(key_len);
+	header.target = htobe64(target);
+	char *frame = g_malloc(total), *p = frame;
+	memcpy(p, &header, sizeof(header));
+	p += sizeof(header);
+	if(extra > 0) {
+		expiry = htobe64(expiry);
+		memcpy(p, &expiry, extra);
+		p += extra;
+	}
+	if(key_len > 0)
+		memcpy(p, key, key_len);
+	p += key_len;
+	if(len > 0)
+		memcpy(p, payload, len);
+	gboolean sent = harness_peer_write(peer, frame, total);
+	g_free(frame);
+	return sent;
+}
+
+/* Same, for text without flags */
+static gboolean harness_peer_text(harness_peer *peer, guint8 type, guint64 target, const char *key, const char *text) {
+	return harness_peer_send(peer, type, 0, 0, target, key, text, strlen(text));
+}
+
+/* The next frame of a type (the others are skipped) the plugin sent, within
+ * timeout usecs: the caller frees it */
+static harness_frame *harness_peer_receive(harness_peer *peer, guint8 type, gint64 timeout) {
+	gint64 until = g_get_monotonic_time() + timeout;
+	while(TRUE) {
+		gint64 left = until - g_get_monotonic_time();
+		if(left <= 0)
+			return NULL;
+		harness_frame *frame = peer->thread ? g_async_queue_timeout_pop(peer->frames, left) : harness_peer_read(peer, left);
+		if(frame == NULL || frame->type == type)
+			return frame;
+		g_free(frame);
+	}
+}
+
+
+/* A plugin instance, with a configuration of its own in a temporary folder */
+static char *config_dir = NULL;
+static int data_port = 0;	/* Where its external interface listens */
+static int sink_fd = -1;	/* Where the plugin forwards media to */
+
+/* A socket bound to a free port on the loopback interface */
+static int harness_bind(int type, int *port) {
+	int fd = socket(AF_INET, type, 0);
+	struct sockaddr_in address;
+	socklen_t address_len = sizeof(address);
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(fd < 0 || bind(fd, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+			getsockname(fd, (struct sockaddr *)&address, &address_len) < 0) {
+		JANUS_LOG(LOG_ERR, "Couldn't bind a socket (%d, %s)\n", errno, strerror(errno));
+		if(fd >= 0)
+			close(fd);
+		return -1;
+	}
+	*port = ntohs(address.sin_port);
+	return fd;
+}
+
+static janus_plugin *harness_load(const char *path) {
+	void *library = dlopen(path, RTLD_NOW | RTLD_GLOBAL);
+	if(library == NULL) {
+		JANUS_LOG(LOG_FATAL, "Couldn't load %s: %s\n", path, dlerror());
+		return NULL;
+	}
+	janus_plugin *(*create)(void) = (janus_plugin *(*)(void))dlsym(library, "create");
+	if(create == NULL) {
+		JANUS_LOG(LOG_FATAL, "No create() in %s: %s\n", path, dlerror());
+		return NULL;
+	}
+	janus_plugin *instance = create();
+	if(instance == NULL || instance->get_api_compatibility() != JANUS_PLUGIN_API_VERSION) {
+		JANUS_LOG(LOG_FATAL, "%s is not a plugin for this version of Janus\n", path);
+		return NULL;
+	}
+	return instance;
+}
+
+/* Initializes the plugin with the external interface on the loopback
+ * interface, plus the given settings (more categories may follow the
+ * external ones), without connecting to it */
+static gboolean harness_launch(const char *general, const char *external) {
+	int sink_port = 0;
+	int fd = harness_bind(SOCK_STREAM, &data_port);
+	if(fd < 0)
+		return FALSE;
+	close(fd);
+	sink_fd = harness_bind(SOCK_DGRAM, &sink_port);
+	if(sink_fd < 0)
+		return FALSE;
+	GError *error = NULL;
+	config_dir = g_dir_make_tmp("skywayiot-harness-XXXXXX", &error);
+	if(config_dir == NULL) {
+		JANUS_LOG(LOG_FATAL, "Couldn't create the configuration folder: %s\n", error ? error->message : "??");
+		g_clear_error(&error);
+		return FALSE;
+	}
+	char *config = g_strdup_printf(
+		"[general]\n"
+		"%s\n"
+		"[external-interface]\n"
+		"data_addr = 127.0.0.1\n"
+		"data_port = %d\n"
+		"media_send_dest = 127.0.0.1\n"
+		"media_send_port = %d\n"
+		"%s\n",
+		general ? general : "", data_port, sink_port, external ? external : "");
+	char *filename = g_strdup_printf("%s/%s.cfg", config_dir, plugin->get_package());
+	gboolean written = g_file_set_contents(filename, config, -1, &error);
+	g_free(filename);
+	g_free(config);
+	if(!written) {
+		JANUS_LOG(LOG_FATAL, "Couldn't write the configuration: %s\n", error ? error->message : "??");
+		g_clear_error(&error);
+		return FALSE;
+	}
+	handles = g_hash_table_new(NULL, NULL);
+	if(plugin->init(&harness_gateway, config_dir) < 0) {
+		JANUS_LOG(LOG_FATAL, "Couldn't initialize the plugin\n");
+		return FALSE;
+	}
+	control = harness_handle_create();
+	if(control == NULL) {
+		JANUS_LOG(LOG_FATAL, "Couldn't create the control session\n");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/* Same, and connects to it as a raw backend */
+static gboolean harness_start(const char *general, const char *external) {
+	if(!harness_launch(general, external))
+		return FALSE;
+	if(!harness_backend_connect(data_port)) {
+		JANUS_LOG(LOG_FATAL, "Couldn't connect to the plugin as its backend\n");
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static void harness_stop(void) {
+	if(config_dir == NULL)
+		return;
+	harness_backend_disconnect();
+	while(peers != NULL)
+		harness_peer_close((harness_peer *)peers->data);
+	if(handles != NULL) {
+		GList *live = g_hash_table_get_keys(handles), *h = NULL;
+		for(h = live; h != NULL; h = h->next)
+			harness_handle_destroy((harness_handle *)h->data);
+		g_list_free(live);
+		g_hash_table_destroy(handles);
+		handles = NULL;
+	}
+	plugin->destroy();
+	harness_graveyard_sweep(0);
+	if(sink_fd >= 0)
+		close(sink_fd);
+	sink_fd = -1;
+	char *filename = g_strdup_printf("%s/%s.cfg", config_dir, plugin->get_package());
+	unlink(filename);
+	g_free(filename);
+	rmdir(config_dir);
+	g_free(config_dir);
+	config_dir = NULL;
+}
+
+/* Waits for a media packet on the sink, and returns its length (or -1) */
+static int harness_sink_receive(char *buf, int len, int timeout) {
+	struct pollfd fds = { sink_fd, POLLIN, 0 };
+	if(poll(&fds, 1, timeout) <= 0)
+		return -1;
+	return recv(sink_fd, buf, len, 0);
+}
+
+/* An RTP packet with a stamp at the start of its payload */
+static int harness_rtp_packet(char *buf, int len, guint8 pt, guint16 seq, guint32 ts, guint32 ssrc) {
+	memset(buf, 0, len);
+	buf[0] = (char)0x80;
+	buf[1] = pt;
+	buf[2] = seq >> 8; buf[3] = seq;
+	buf[4] = ts >> 24; buf[5] = ts >> 16; buf[6] = ts >> 8; buf[7] = ts;
+	buf[8] = ssrc >> 24; buf[9] = ssrc >> 16; buf[10] = ssrc >> 8; buf[11] = ssrc;
+	if(len >= 12 + (int)sizeof(harness_stamp))
+		harness_stamp_write(buf + 12, seq);
+	return len;
+}
+
+
+/* Functional checks */
+static int failures = 0;
+
+static void harness_expect(gboolean ok, const char *what) {
+	JANUS_PRINT("  [%s] %s\n", ok ? " ok " : "FAIL", what);
+	if(!ok)
+		failures++;
+}
+
+static int harness_check(void) {
+	if(!harness_start("stats_timing = yes", NULL))
+		return 1;
+	const gint64 timeout = 2*G_USEC_PER_SEC;
+	harness_handle *a = harness_handle_create(), *b = harness_handle_create();
+	harness_expect(a != NULL && b != NULL, "create_session");
+	if(a == NULL || b == NULL)
+		return failures;
+	harness_expect(harness_stat("sessions.live") == 3, "stats request counts the live sessions");
+
+	/* Asynchronous requests get an event, errors included */
+	harness_request(a, json_pack("{sb}", "audio", 1));
+	harness_expect(harness_wait(&a->events, 1, timeout) && a->errors == 0, "configure request gets an ok event");
+	harness_request(a, json_pack("{ss}", "audio", "yes"));
+	harness_expect(harness_wait(&a->errors, 1, timeout), "invalid request gets an error event");
+
+	/* Data channel to backend */
+	char message[HARNESS_MESSAGE_SIZE];
+	memset(message, 0, sizeof(message));
+	harness_stamp_write(message, 1);
+	g_strlcpy(message + sizeof(harness_stamp), "hello backend", sizeof(message) - sizeof(harness_stamp));
+	plugin->incoming_data(&a->handle, message, sizeof(message));
+	harness_expect(harness_wait(&backend.frames, 1, timeout) && backend.last_target == harness_handle_id(a),
+		"incoming_data reaches the backend with the handle id");
+
+	/* Backend to data channels */
+	harness_stamp_write(message, 2);
+	harness_expect(harness_backend_send(harness_handle_id(a), message, sizeof(message)) == 0 && b->data == 0,
+		"unicast message reaches its session only");
+	harness_backend_send(HARNESS_BROADCAST_ID, message, sizeof(message));
+	harness_expect(harness_wait(&a->data, 2, timeout) && harness_wait(&b->data, 1, timeout) &&
+		harness_wait(&control->data, 1, timeout), "broadcast message reaches every session");
+	harness_expect(harness_backend_send(42, message, sizeof(message)) == 1 &&
+		harness_stat("relay.unknown_target") == 1 && a->data == 2 && b->data == 1,
+		"message for an unknown handle is dropped");
+
+	/* Media */
+	char packet[1200], received[1500];
+	harness_rtp_packet(packet, 160, 111, 1, 960, 0x1234);
+	plugin->incoming_rtp(&a->handle, 0, packet, 160);
+	int len = harness_sink_receive(received, sizeof(received), 1000);
+	harness_expect(len == 160 && !memcmp(packet, received, len), "incoming_rtp forwards audio to media_send_port");
+	harness_rtp_packet(packet, sizeof(packet), 100, 1, 3000, 0x5678);
+	plugin->incoming_rtp(&a->handle, 1, packet, sizeof(packet));
+	len = harness_sink_receive(received, sizeof(received), 1000);
+	harness_expect(len == (int)sizeof(packet) && !memcmp(packet, received, len), "incoming_rtp forwards video to media_send_port");
+	char rtcp[8] = { (char)0x80, (char)201, 0, 1, 0, 0, 0x12, 0x34 };
+	plugin->incoming_rtcp(&a->handle, 0, rtcp, sizeof(rtcp));
+	harness_expect(a->rtcp == 1, "incoming_rtcp is relayed back");
+
+	/* Destroyed sessions get nothing */
+	harness_handle_destroy(b);
+	harness_expect(harness_stat("sessions.live") == 2 && harness_stat("sessions.old") >= 1, "destroy_session");
+	harness_backend_send(HARNESS_BROADCAST_ID, message, sizeof(message));
+	harness_expect(harness_wait(&a->data, 3, timeout) && b->data == 1, "broadcast skips destroyed sessions");
+
+	json_int_t errors = harness_stat("entry_points.ext_receive.errors");
+	harness_expect(errors == 0, "no ext_receive errors");
+	harness_latency_print(&relay_latency, "backend -> data channel");
+	harness_latency_print(&backend_latency, "data channel -> backend");
+	return failures;
+}
+
+/* Feature checks: a plugin instance for most of them, with framed backends,
+ * and one each for NDJSON, TLS and failover */
+#define HARNESS_ENVELOPE_CHUNK		0x01
+#define HARNESS_ENVELOPE_BULK		0x02
+#define HARNESS_ENVELOPE_COMPRESSED	0x04
+#define HARNESS_ENVELOPE_DELTA		0x08
+#define HARNESS_ENVELOPE_STORED		0x10
+#define HARNESS_CHUNK_HEADER		9	/* Flags, message id, chunk index and count */
+#define HARNESS_BULK_HEADER			10	/* Flags, transfer, seq and last */
+
+/* Removes a temporary folder of the feature checks, and what's in it */
+static void harness_remove_dir(char *path) {
+	if(path == NULL)
+		return;
+	GDir *dir = g_dir_open(path, 0, NULL);
+	const char *name = NULL;
+	while(dir != NULL && (name = g_dir_read_name(dir)) != NULL) {
+		char *file = g_build_filename(path, name, NULL);
+		unlink(file);
+		g_free(file);
+	}
+	if(dir != NULL)
+		g_dir_close(dir);
+	rmdir(path);
+	g_free(path);
+}
+
+/* Frames from a peer are handled in order: once a message for the control
+ * session got there, so did everything the peer sent before it */
+static gboolean harness_peer_sync(harness_peer *peer) {
+	gint relayed = g_atomic_int_get(&control->data);
+	if(peer->ndjson) {
+		char *line = g_strdup_printf("{\"target\":\"%"SCNu64"\",\"payload\":\"sync\"}\n", harness_handle_id(control));
+		harness_peer_write(peer, line, strlen(line));
+		g_free(line);
+	} else {
+		harness_peer_text(peer, HARNESS_FRAME_DATA, harness_handle_id(control), NULL, "sync");
+	}
+	return harness_wait(&control->data, relayed + 1, 2*G_USEC_PER_SEC);
+}
+
+/* A data channel message from a handle */
+static void harness_upload(harness_handle *h, const char *message, int len) {
+	char *copy = g_malloc(len);
+	memcpy(copy, message, len);
+	plugin->incoming_data(&h->handle, copy, len);
+	g_free(copy);
+}
+
+/* An asynchronous request, and whether it got an ok event within timeout */
+static gboolean harness_configure(harness_handle *h, json_t *request) {
+	gint events = g_atomic_int_get(&h->events), errors = g_atomic_int_get(&h->errors);
+	json_t *response = harness_request(h, request);
+	if(response)
+		json_decref(response);
+	return harness_wait(&h->events, events + 1, 2*G_USEC_PER_SEC) && g_atomic_int_get(&h->errors) == errors;
+}
+
+/* Whether a message is a delta message in full (mode 0) with this key and data */
+static gboolean harness_delta_full(const char *message, int len, const char *key, const char *data, int data_len) {
+	int key_len = strlen(key);
+	return len == 1 + 2 + key_len + 1 + data_len && (message[0] & HARNESS_ENVELOPE_DELTA) &&
+		(((guint8)message[1] << 8) | (guint8)message[2]) == key_len && !memcmp(message + 3, key, key_len) &&
+		message[3 + key_len] == 0 && !memcmp(message + 4 + key_len, data, data_len);
+}
+
+static void harness_features_groups(harness_peer *peer) {
+	const gint64 timeout = 2*G_USEC_PER_SEC;
+	harness_handle *a = harness_handle_create(), *b = harness_handle_create(), *c = harness_handle_create();
+	if(a == NULL || b == NULL || c == NULL)
+		return;
+	guint64 members[2] = { htobe64(harness_handle_id(a)), htobe64(harness_handle_id(b)) };
+	json_int_t relayed = harness_stat("relay.group");
+	harness_peer_send(peer, HARNESS_FRAME_GROUP_ADD, 0, 0, 42, NULL, (const char *)members, sizeof(members));
+	harness_peer_text(peer, HARNESS_FRAME_GROUP_DATA, 42, NULL, "to the group");
+	harness_expect(harness_wait_last(a, "to the group", timeout) && harness_wait_last(b, "to the group", timeout) &&
+		c->data == 0 && harness_stat("relay.group") == relayed + 1, "groups: group data reaches the members only");
+	harness_peer_send(peer, HARNESS_FRAME_GROUP_REMOVE, 0, 0, 42, NULL, (const char *)&members[1], sizeof(members[1]));
+	harness_peer_text(peer, HARNESS_FRAME_GROUP_DATA, 42, NULL, "after the removal");
+	harness_expect(harness_wait_last(a, "after the removal", timeout) && b->data == 1, "groups: removed members get nothing");
+}
+
+static void harness_features_retained(harness_peer *peer) {
+	const gint64 timeout = 2*G_USEC_PER_SEC;
+	json_int_t sent = harness_stat("relay.retained_sent");
+	harness_peer_send(peer, HARNESS_FRAME_PUBLISH, HARNESS_FRAME_FLAG_RETAIN, 0, 0, "state/door", "open", 4);
+	harness_peer_send(peer, HARNESS_FRAME_PUBLISH, HARNESS_FRAME_FLAG_RETAIN, 0, 0, "state/window", "closed", 6);
+	harness_peer_send(peer, HARNESS_FRAME_PUBLISH, HARNESS_FRAME_FLAG_RETAIN, 0, 0, "state/window", "", 0);
+	harness_peer_send(peer, HARNESS_FRAME_PUBLISH, HARNESS_FRAME_FLAG_RETAIN, 0, 0, "rooms/kitchen", "21", 2);
+	harness_peer_sync(peer);
+	harness_handle *h = harness_handle_create(), *w = harness_handle_create();
+	if(h == NULL || w == NULL)
+		return;
+	harness_expect(harness_configure(h, json_pack("{s[ss]}", "subscribe", "state/door", "state/window")) && h->data == 0,
+		"retained: nothing is sent before the data channel is open");
+	plugin->setup_media(&h->handle);
+	harness_expect(harness_configure(h, json_pack("{sb}", "sync", 1)) && harness_wait_last(h, "open", timeout) && h->data == 1 &&
+		harness_stat("relay.retained_sent") == sent + 1, "retained: last values are sent once the data channel is open, cleared ones aren't");
+	harness_peer_text(peer, HARNESS_FRAME_PUBLISH, 0, "state/door", "closed");
+	harness_expect(harness_wait_last(h, "closed", timeout), "retained: subscribers get what is published");
+	plugin->setup_media(&w->handle);
+	harness_configure(w, json_pack("{sb}", "sync", 1));
+	harness_expect(harness_configure(w, json_pack("{s[s]}", "subscribe", "rooms/#")) && harness_wait_last(w, "21", timeout),
+		"retained: new filters get the last values they match on an open data channel");
+}
+
+static void harness_features_conflation(harness_peer *peer) {
+	harness_handle *h = harness_handle_create();
+	if(h == NULL)
+		return;
+	harness_configure(h, json_pack("{sbsi}", "conflate", 1, "conflate_rate", 2));
+	json_int_t conflated = harness_stat("relay.conflated");
+	int i = 0;
+	for(i = 1; i <= 5; i++) {
+		char value[8];
+		g_snprintf(value, sizeof(value), "%d", i);
+		harness_peer_text(peer, HARNESS_FRAME_DATA, harness_handle_id(h), "temperature", value);
+	}
+	harness_expect(harness_wait_last(h, "5", 2*G_USEC_PER_SEC) && h->data <= 2 && harness_stat("relay.conflated") >= conflated + 3,
+		"conflation: a burst for the same key gets to the session as its latest value");
+}
+
+static void harness_features_throttles(harness_peer *peer) {
+	harness_handle *h = harness_handle_create();
+	if(h == NULL)
+		return;
+	/* Deltas carry the key, which is where a filter shows the topic */
+	harness_configure(h, json_pack("{s[{sssi}]sb}", "subscribe", "topic", "sensors/+", "max_rate", 2, "delta", 1));
+	json_int_t throttled = harness_stat("relay.throttled");
+	harness_peer_text(peer, HARNESS_FRAME_PUBLISH, 0, "sensors/a", "1");
+	harness_peer_text(peer, HARNESS_FRAME_PUBLISH, 0, "sensors/b", "2");
+	harness_peer_text(peer, HARNESS_FRAME_PUBLISH, 0, "sensors/a", "3");
+	harness_peer_text(peer, HARNESS_FRAME_PUBLISH, 0, "sensors/b", "4");
+	char last[HARNESS_MESSAGE_SIZE];
+	gboolean flushed = harness_wait(&h->data, 2, 2*G_USEC_PER_SEC);
+	int len = harness_last(h, last, sizeof(last));
+	harness_expect(flushed && h->data == 2 && harness_stat("relay.throttled") == throttled + 2,
+		"throttles: a rate limited filter gets the first message, then the latest of the window");
+	harness_expect(flushed && harness_delta_full(last, len, "sensors/b", "4", 1),
+		"throttles: the latest message of the window comes with its own topic");
+}
+
+static void harness_features_ttl(harness_peer *peer) {
+	harness_handle *h = harness_handle_create();
+	if(h == NULL)
+		return;
+	guint64 id = harness_handle_id(h), now = g_get_real_time() / 1000;
+	json_int_t expired = harness_stat("relay.expired.received");
+	harness_peer_send(peer, HARNESS_FRAME_DATA, HARNESS_FRAME_FLAG_TTL, 0, id, NULL, "no time to live", 15);
+	harness_peer_send(peer, HARNESS_FRAME_DATA, HARNESS_FRAME_FLAG_DEADLINE, now - 1000, id, NULL, "too late", 8);
+	harness_peer_send(peer, HARNESS_FRAME_DATA, HARNESS_FRAME_FLAG_TTL, 60000, id, NULL, "fresh", 5);
+	harness_peer_send(peer, HARNESS_FRAME_DATA, HARNESS_FRAME_FLAG_DEADLINE, now + 60000, id, NULL, "on time", 7);
+	harness_expect(harness_wait_last(h, "on time", 2*G_USEC_PER_SEC) && h->data == 2 &&
+		harness_stat("relay.expired.received") == expired + 2, "ttl: frames already expired are dropped, the others relayed");
+}
+
+static void harness_features_spool(harness_peer *peer) {
+	const gint64 timeout = 2*G_USEC_PER_SEC;
+	json_int_t spooled = harness_stat("relay.spool.spooled"), unspooled = harness_stat("relay.spool.unspooled");
+	harness_peer_text(peer, HARNESS_FRAME_DEVICE, 0, "meter-1", "reading 1");
+	harness_peer_text(peer, HARNESS_FRAME_DEVICE, 0, "meter-1", "reading 2");
+	harness_peer_sync(peer);
+	harness_expect(harness_stat("relay.spool.spooled") == spooled + 2, "spool: messages for a device that isn't there are spooled");
+	harness_handle *h = harness_handle_create();
+	if(h == NULL)
+		return;
+	harness_configure(h, json_pack("{ss}", "device_id", "meter-1"));
+	plugin->setup_media(&h->handle);
+	harness_configure(h, json_pack("{sb}", "sync", 1));
+	harness_expect(harness_wait_last(h, "reading 2", timeout) && h->data == 2 &&
+		harness_wait_stat("relay.spool.unspooled", unspooled + 2, timeout), "spool: the device gets them in order once connected");
+	harness_peer_text(peer, HARNESS_FRAME_DEVICE, 0, "meter-1", "reading 3");
+	harness_expect(harness_wait_last(h, "reading 3", timeout) && harness_stat("relay.spool.spooled") == spooled + 2,
+		"spool: messages for a connected device go straight to it");
+}
+
+static void harness_features_chunking(harness_peer *peer) {
+	const gint64 timeout = 2*G_USEC_PER_SEC;
+	harness_handle *h = harness_handle_create();
+	if(h == NULL)
+		return;
+	harness_configure(h, json_pack("{sb}", "chunking", 1));
+	/* max_message_size is 512, so 503 bytes per chunk */
+	char payload[1500], last[1024];
+	int i = 0;
+	for(i = 0; i < (int)sizeof(payload); i++)
+		payload[i] = i % 251;
+	json_int_t chunked = harness_stat("relay.chunking.chunked");
+	harness_peer_send(peer, HARNESS_FRAME_DATA, 0, 0, harness_handle_id(h), NULL, payload, sizeof(payload));
+	gboolean relayed = harness_wait(&h->data, 3, timeout);
+	int len = harness_last(h, last, sizeof(last));
+	harness_expect(relayed && h->data == 3 && len == HARNESS_CHUNK_HEADER + 494 && (last[0] & HARNESS_ENVELOPE_CHUNK) &&
+		last[6] == 2 && last[8] == 3 && !memcmp(last + HARNESS_CHUNK_HEADER, payload + 1006, 494) &&
+		harness_stat("relay.chunking.chunked") == chunked + 1, "chunking: messages too large are split in chunks");
+	/* Two chunks of message 7 from the client */
+	char chunk[HARNESS_CHUNK_HEADER + 300] = { HARNESS_ENVELOPE_CHUNK, 0, 0, 0, 7, 0, 0, 0, 2 };
+	memcpy(chunk + HARNESS_CHUNK_HEADER, payload, 300);
+	harness_upload(h, chunk, sizeof(chunk));
+	chunk[6] = 1;
+	memcpy(chunk + HARNESS_CHUNK_HEADER, payload + 300, 300);
+	harness_upload(h, chunk, sizeof(chunk));
+	harness_frame *frame = harness_peer_receive(peer, HARNESS_FRAME_DATA, timeout);
+	harness_expect(frame != NULL && frame->target == harness_handle_id(h) && frame->len == 600 && !memcmp(frame->data, payload, 600),
+		"chunking: chunked uploads reach the backend reassembled");
+	g_free(frame);
+}
+
+static void harness_features_bulk_chunk(harness_peer *peer, guint64 target, guint32 seq, gboolean last) {
+	char payload[2*sizeof(guint32) + 16];
+	guint32 transfer = htonl(1), n = htonl(seq);
+	memcpy(payload, &transfer, sizeof(transfer));
+	memcpy(payload + sizeof(transfer), &n, sizeof(n));
+	int len = 2*sizeof(guint32) + g_snprintf(payload + 2*sizeof(guint32), 16, "chunk %"SCNu32, seq);
+	harness_peer_send(peer, HARNESS_FRAME_BULK, last ? HARNESS_FRAME_FLAG_LAST : 0, 0, target, NULL, payload, len);
+}
+
+/* Whether a frame is the credit for a session, for transfer 1 */
+static gboolean harness_features_bulk_credit(harness_frame *frame, guint64 target, guint32 acked, guint32 window, guint32 next) {
+	guint32 credit[4] = { htonl(1), htonl(acked), htonl(window), htonl(next) };
+	return frame != NULL && frame->target == target && frame->len == sizeof(credit) && !memcmp(frame->data, credit, sizeof(credit));
+}
+
+static void harness_features_bulk(harness_peer *peer) {
+	const gint64 timeout = 2*G_USEC_PER_SEC;
+	harness_handle *h = harness_handle_create();
+	if(h == NULL)
+		return;
+	guint64 id = harness_handle_id(h);
+	harness_configure(h, json_pack("{sb}", "chunking", 1));
+	plugin->setup_media(&h->handle);
+	/* bulk_window is 2: the first two chunks are sent, the fourth is beyond the credit */
+	json_int_t overflow = harness_stat("relay.bulk.overflow");
+	harness_features_bulk_chunk(peer, id, 0, FALSE);
+	harness_features_bulk_chunk(peer, id, 1, FALSE);
+	char last[HARNESS_MESSAGE_SIZE];
+	gboolean relayed = harness_wait(&h->data, 2, timeout);
+	int len = harness_last(h, last, sizeof(last));
+	harness_expect(relayed && len == HARNESS_BULK_HEADER + 7 && last[0] == HARNESS_ENVELOPE_BULK && last[8] == 1 && last[9] == 0 &&
+		!memcmp(last + HARNESS_BULK_HEADER, "chunk 1", 7), "bulk: chunks within the window reach the session");
+	harness_features_bulk_chunk(peer, id, 3, FALSE);
+	harness_frame *frame = harness_peer_receive(peer, HARNESS_FRAME_CREDIT, timeout);
+	harness_expect(harness_features_bulk_credit(frame, id, 0, 2, 2) && h->data == 2 && harness_stat("relay.bulk.overflow") == overflow + 1,
+		"bulk: chunks beyond the credit are dropped, and the backend told where to resume");
+	g_free(frame);
+	char ack[HARNESS_BULK_HEADER] = { HARNESS_ENVELOPE_BULK, 0, 0, 0, 1, 0, 0, 0, 1, 0 };
+	harness_upload(h, ack, sizeof(ack));
+	frame = harness_peer_receive(peer, HARNESS_FRAME_CREDIT, timeout);
+	harness_expect(harness_features_bulk_credit(frame, id, 2, 2, 2), "bulk: acknowledgements are relayed as credit");
+	g_free(frame);
+	harness_features_bulk_chunk(peer, id, 2, FALSE);
+	harness_features_bulk_chunk(peer, id, 3, TRUE);
+	relayed = harness_wait(&h->data, 4, timeout);
+	len = harness_last(h, last, sizeof(last));
+	harness_expect(relayed && len == HARNESS_BULK_HEADER + 7 && last[8] == 3 && last[9] == 1, "bulk: the transfer resumes with the credit");
+}
+
+static void harness_features_compression(harness_peer *peer) {
+	const gint64 timeout = 2*G_USEC_PER_SEC;
+	harness_handle *h = harness_handle_create();
+	if(h == NULL)
+		return;
+	if(!harness_configure(h, json_pack("{ss}", "compression", "deflate")) &&
+			!harness_configure(h, json_pack("{ss}", "compression", "lz4"))) {
+		JANUS_PRINT("  [skip] compression: the plugin was built without deflate and lz4\n");
+		return;
+	}
+	guint64 id = harness_handle_id(h);
+	char text[200], noise[100], last[HARNESS_MESSAGE_SIZE];
+	int i = 0;
+	for(i = 0; i < (int)sizeof(text); i++)
+		text[i] = "{\"temperature\":21.5}"[i % 20];
+	for(i = 0; i < (int)sizeof(noise); i++)
+		noise[i] = g_random_int_range(0, 256);
+	json_int_t compressed = harness_stat("relay.compression.compressed"), stored = harness_stat("relay.compression.stored");
+	harness_peer_send(peer, HARNESS_FRAME_DATA, 0, 0, id, NULL, text, sizeof(text));
+	gboolean relayed = harness_wait(&h->data, 1, timeout);
+	int len = harness_last(h, last, sizeof(last));
+	harness_expect(relayed && len > 1 && len < 100 && last[0] == HARNESS_ENVELOPE_COMPRESSED &&
+		harness_stat("relay.compression.compressed") == compressed + 1, "compression: messages are compressed");
+	harness_peer_send(peer, HARNESS_FRAME_DATA, 0, 0, id, NULL, noise, sizeof(noise));
+	relayed = harness_wait(&h->data, 2, timeout);
+	len = harness_last(h, last, sizeof(last));
+	harness_expect(relayed && len == 1 + (int)sizeof(noise) && last[0] == HARNESS_ENVELOPE_STORED && !memcmp(last + 1, noise, sizeof(noise)) &&
+		harness_stat("relay.compression.stored") == stored + 1, "compression: messages that don't get smaller are sent stored");
+	/* Uploads that aren't compressed are still part of the stream */
+	char upload[1 + 16] = { HARNESS_ENVELOPE_STORED };
+	memcpy(upload + 1, "stored in stream", 16);
+	harness_upload(h, upload, sizeof(upload));
+	harness_frame *frame = harness_peer_receive(peer, HARNESS_FRAME_DATA, timeout);
+	harness_expect(frame != NULL && frame->target == id && frame->len == 16 && !memcmp(frame->data, "stored in stream", 16),
+		"compression: stored uploads reach the backend");
+	g_free(frame);
+	gint events = g_atomic_int_get(&h->events);
+	char garbage[8] = { HARNESS_ENVELOPE_COMPRESSED, (char)0xff, (char)0xff, (char)0xff, (char)0xff, (char)0xff, (char)0xff, (char)0xff };
+	harness_upload(h, garbage, sizeof(garbage));
+	harness_peer_send(peer, HARNESS_FRAME_DATA, 0, 0, id, NULL, text, sizeof(text));
+	relayed = harness_wait(&h->data, 3, timeout);
+	len = harness_last(h, last, sizeof(last));
+	harness_expect(harness_wait(&h->events, events + 1, timeout) && relayed && len == 1 + (int)sizeof(text) && last[0] == 0,
+		"compression: an upload that can't be decompressed turns it off");
+}
+
+static void harness_features_delta(harness_peer *peer) {
+	const gint64 timeout = 2*G_USEC_PER_SEC;
+	harness_handle *h = harness_handle_create();
+	if(h == NULL)
+		return;
+	guint64 id = harness_handle_id(h);
+	harness_configure(h, json_pack("{sb}", "delta", 1));
+	char value[100], last[HARNESS_MESSAGE_SIZE];
+	int i = 0;
+	for(i = 0; i < (int)sizeof(value); i++)
+		value[i] = 'a' + i % 26;
+	json_int_t deltas = harness_stat("relay.delta.deltas");
+	harness_peer_send(peer, HARNESS_FRAME_DATA, 0, 0, id, "meter", value, sizeof(value));
+	gboolean relayed = harness_wait(&h->data, 1, timeout);
+	int len = harness_last(h, last, sizeof(last));
+	harness_expect(relayed && harness_delta_full(last, len, "meter", value, sizeof(value)), "deltas: the first message of a key is sent in full");
+	value[50] = 'Z';
+	harness_peer_send(peer, HARNESS_FRAME_DATA, 0, 0, id, "meter", value, sizeof(value));
+	relayed = harness_wait(&h->data, 2, timeout);
+	len = harness_last(h, last, sizeof(last));
+	harness_expect(relayed && len > 9 && len < 20 && last[0] == HARNESS_ENVELOPE_DELTA && last[8] == 1 &&
+		harness_stat("relay.delta.deltas") == deltas + 1, "deltas: the next ones are sent as a delta");
+	char upload[1 + 2 + 5 + 1 + 7] = { HARNESS_ENVELOPE_DELTA, 0, 5, 'm', 'e', 't', 'e', 'r', 0 };
+	memcpy(upload + 9, "reading", 7);
+	harness_upload(h, upload, sizeof(upload));
+	harness_frame *frame = harness_peer_receive(peer, HARNESS_FRAME_DATA, timeout);
+	harness_expect(frame != NULL && frame->target == id && frame->len == 7 && !memcmp(frame->data, "reading", 7),
+		"deltas: uploads are decoded before reaching the backend");
+	g_free(frame);
+}
+
+static void harness_features_routes(harness_peer *peer) {
+	const gint64 timeout = 2*G_USEC_PER_SEC;
+	harness_handle *h = harness_handle_create();
+	harness_peer *alarms = harness_peer_connect(data_port, FALSE, NULL);
+	if(h == NULL || alarms == NULL) {
+		harness_expect(FALSE, "routes: a second backend connects");
+		return;
+	}
+	harness_peer_text(alarms, HARNESS_FRAME_HELLO, 0, NULL, "alarms");
+	harness_peer_sync(alarms);
+	guint64 id = harness_handle_id(h);
+	json_int_t routed = harness_stat("relay.routes.alarms"), fallback = harness_stat("relay.routes.fallback");
+	harness_upload(h, "ALARM: smoke", 12);
+	harness_frame *frame = harness_peer_receive(alarms, HARNESS_FRAME_DATA, timeout);
+	harness_expect(frame != NULL && frame->target == id && !strcmp(frame->data, "ALARM: smoke") &&
+		harness_stat("relay.routes.alarms") == routed + 1, "routes: matching messages go to the backend named by the route");
+	g_free(frame);
+	harness_upload(h, "reading", 7);
+	frame = harness_peer_receive(peer, HARNESS_FRAME_DATA, timeout);
+	harness_expect(frame != NULL && !strcmp(frame->data, "reading"), "routes: other messages go to the backends without a name");
+	g_free(frame);
+	harness_upload(h, "!reboot", 7);
+	frame = harness_peer_receive(peer, HARNESS_FRAME_DATA, timeout);
+	harness_expect(frame != NULL && !strcmp(frame->data, "!reboot") && harness_stat("relay.routes.fallback") == fallback + 1,
+		"routes: messages for a backend that isn't connected fall back to the others");
+	g_free(frame);
+	harness_peer_close(alarms);
+}
+
+static void harness_features_framed(void) {
+	GError *error = NULL;
+	char *spool = g_dir_make_tmp("skywayiot-spool-XXXXXX", &error);
+	if(spool == NULL) {
+		JANUS_LOG(LOG_FATAL, "Couldn't create the spool folder: %s\n", error ? error->message : "??");
+		g_clear_error(&error);
+		failures++;
+		return;
+	}
+	char *general = g_strdup_printf(
+		"max_message_size = 512\n"
+		"bulk_window = 2\n"
+		"spool_dir = %s\n"
+		"spool_drain_rate = 100\n", spool);
+	gboolean started = harness_launch(general,
+		"data_framing = framed\n"
+		"data_max_backends = 4\n"
+		"[route-alarms]\n"
+		"backend = alarms\n"
+		"prefix = ALARM:\n"
+		"[route-commands]\n"
+		"backend = commands\n"
+		"type = 0x21\n");
+	g_free(general);
+	harness_peer *peer = started ? harness_peer_connect(data_port, FALSE, NULL) : NULL;
+	harness_expect(peer != NULL, "framed: the backend connects");
+	if(peer != NULL) {
+		harness_features_groups(peer);
+		harness_features_retained(peer);
+		harness_features_conflation(peer);
+		harness_features_throttles(peer);
+		harness_features_ttl(peer);
+		harness_features_spool(peer);
+		harness_features_chunking(peer);
+		harness_features_bulk(peer);
+		harness_features_compression(peer);
+		harness_features_delta(peer);
+		harness_features_routes(peer);
+	}
+	harness_stop();
+	harness_remove_dir(spool);
+}
+
+static void harness_features_ndjson(void) {
+	const gint64 timeout = 2*G_USEC_PER_SEC;
+	harness_peer *peer = harness_launch(NULL, "data_framing = ndjson\n") ? harness_peer_connect(data_port, TRUE, NULL) : NULL;
+	harness_handle *h = peer ? harness_handle_create() : NULL;
+	harness_expect(h != NULL, "ndjson: the backend connects");
+	if(h != NULL) {
+		guint64 id = harness_handle_id(h);
+		char *line = g_strdup_printf("{\"target\":\"%"SCNu64"\",\"payload\":\"say \\\"hi\\\"\"}\n", id);
+		harness_peer_write(peer, line, strlen(line));
+		g_free(line);
+		harness_expect(harness_wait_last(h, "say \"hi\"", timeout), "ndjson: string payloads are relayed unescaped");
+		line = g_strdup_printf("{\"target\":%"SCNu64",\"payload\":{\"t\":21}}\n", id);
+		harness_peer_write(peer, line, strlen(line) / 2);
+		g_usleep(50000);
+		harness_peer_write(peer, line + strlen(line) / 2, strlen(line) - strlen(line) / 2);
+		g_free(line);
+		harness_expect(harness_wait_last(h, "{\"t\":21}", timeout), "ndjson: other payloads are relayed as they are, across reads");
+		json_int_t errors = harness_stat("entry_points.ext_receive.errors"), expired = harness_stat("relay.expired.received");
+		line = g_strdup_printf("{\"target\":\"%"SCNu64"\",\"payload\":\"late\",\"ttl\":\"soon\"}\n"
+			"{\"target\":\"%"SCNu64"\",\"payload\":\"late\",\"ttl\":0}\n", id, id);
+		harness_peer_write(peer, line, strlen(line));
+		g_free(line);
+		harness_peer_sync(peer);
+		harness_expect(h->data == 2 && harness_stat("entry_points.ext_receive.errors") == errors + 1 &&
+			harness_stat("relay.expired.received") == expired + 1, "ndjson: invalid and expired lines are dropped");
+		harness_upload(h, "to \"the\" backend", 16);
+		harness_frame *frame = harness_peer_receive(peer, HARNESS_FRAME_DATA, timeout);
+		line = g_strdup_printf("{\"target\":\"%"SCNu64"\",\"payload\":\"to \\\"the\\\" backend\"}", id);
+		harness_expect(frame != NULL && !strcmp(frame->data, line), "ndjson: messages reach the backend as lines");
+		g_free(line);
+		g_free(frame);
+	}
+	harness_stop();
+}
+
+#ifdef HAVE_LIBSSL
+/* A self-signed certificate, and its key, as cert.pem and key.pem in folder */
+static gboolean harness_tls_certificate(const char *folder) {
+	EVP_PKEY *key = NULL;
+	EVP_PKEY_CTX *context = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+	X509 *cert = X509_new();
+	gboolean ok = context != NULL && cert != NULL && EVP_PKEY_keygen_init(context) > 0 &&
+		EVP_PKEY_CTX_set_ec_paramgen_curve_nid(context, NID_X9_62_prime256v1) > 0 && EVP_PKEY_keygen(context, &key) > 0;
+	if(ok) {
+		X509_NAME *name = X509_get_subject_name(cert);
+		ok = X509_set_version(cert, 2) && ASN1_INTEGER_set(X509_get_serialNumber(cert), 1) &&
+			X509_gmtime_adj(X509_getm_notBefore(cert), 0) && X509_gmtime_adj(X509_getm_notAfter(cert), 24*3600) &&
+			X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *)"localhost", -1, -1, 0) &&
+			X509_set_issuer_name(cert, name) && X509_set_pubkey(cert, key) && X509_sign(cert, key, EVP_sha256()) > 0;
+	}
+	char *path = g_strdup_printf("%s/cert.pem", folder);
+	FILE *file = ok ? fopen(path, "w") : NULL;
+	ok = file != NULL && PEM_write_X509(file, cert);
+	if(file != NULL)
+		fclose(file);
+	g_free(path);
+	path = g_strdup_printf("%s/key.pem", folder);
+	file = ok ? fopen(path, "w") : NULL;
+	ok = file != NULL && PEM_write_PrivateKey(file, key, NULL, NULL, 0, NULL, NULL);
+	if(file != NULL)
+		fclose(file);
+	g_free(path);
+	EVP_PKEY_free(key);
+	X509_free(cert);
+	EVP_PKEY_CTX_free(context);
+	return ok;
+}
+#endif
+
+static void harness_features_tls(void) {
+#ifdef HAVE_LIBSSL
+	const gint64 timeout = 2*G_USEC_PER_SEC;
+	GError *error = NULL;
+	char *folder = g_dir_make_tmp("skywayiot-tls-XXXXXX", &error);
+	g_clear_error(&error);
+	if(folder == NULL || !harness_tls_certificate(folder)) {
+		harness_expect(FALSE, "tls: a certificate for the external interface");
+		harness_remove_dir(folder);
+		return;
+	}
+	char *external = g_strdup_printf(
+		"data_framing = framed\n"
+		"data_tls_cert = %s/cert.pem\n"
+		"data_tls_key = %s/key.pem\n", folder, folder);
+	SSL_CTX *context = SSL_CTX_new(TLS_client_method());
+	harness_peer *peer = harness_launch(NULL, external) ? harness_peer_connect(data_port, FALSE, context) : NULL;
+	g_free(external);
+	harness_handle *h = peer ? harness_handle_create() : NULL;
+	harness_expect(h != NULL, "tls: the backend connects with TLS");
+	if(h != NULL) {
+		guint64 id = harness_handle_id(h);
+		json_t *stats = harness_stats();
+		harness_expect(json_is_string(json_object_get(json_array_get(json_object_get(stats, "backends"), 0), "tls")),
+			"tls: the stats tell how the connection is encrypted");
+		json_decref(stats);
+		harness_upload(h, "over tls", 8);
+		harness_frame *frame = harness_peer_receive(peer, HARNESS_FRAME_DATA, timeout);
+		harness_expect(frame != NULL && frame->target == id && !strcmp(frame->data, "over tls"), "tls: messages reach the backend");
+		g_free(frame);
+		harness_peer_text(peer, HARNESS_FRAME_DATA, id, NULL, "from the backend");
+		harness_expect(harness_wait_last(h, "from the backend", timeout), "tls: messages from the backend reach the session");
+		/* A backend that doesn't do TLS is dropped as soon as it sends something */
+		int fd = harness_connect(data_port);
+		harness_frame_header header = { htonl(sizeof(header) - sizeof(header.length)), HARNESS_FRAME_DATA, 0, 0, htobe64(id) };
+		struct pollfd fds = { fd, POLLIN, 0 };
+		char buf[64];
+		harness_expect(fd >= 0 && send(fd, &header, sizeof(header), MSG_NOSIGNAL) == sizeof(header) &&
+			poll(&fds, 1, 5000) == 1 && recv(fd, buf, sizeof(buf), 0) <= 0 && h->data == 1,
+			"tls: backends without TLS are turned away");
+		if(fd >= 0)
+			close(fd);
+	}
+	harness_stop();
+	SSL_CTX_free(context);
+	harness_remove_dir(folder);
+#else
+	JANUS_PRINT("  [skip] tls: the harness was built without OpenSSL\n");
+#endif
+}
+
+static void harness_features_failover(void) {
+	const gint64 timeout = 2*G_USEC_PER_SEC;
+	gboolean started = harness_launch(NULL,
+		"data_framing = framed\n"
+		"data_max_backends = 4\n"
+		"heartbeat_interval = 5000\n"
+		"failover_buffer = 65536\n");
+	harness_peer *first = started ? harness_peer_connect(data_port, FALSE, NULL) : NULL;
+	harness_peer *second = first ? harness_peer_connect(data_port, FALSE, NULL) : NULL;
+	harness_handle *h = second ? harness_handle_create() : NULL;
+	harness_expect(h != NULL, "failover: two backends connect");
+	if(h != NULL) {
+		guint64 id = harness_handle_id(h);
+		json_int_t replayed = harness_stat("failover.replayed");
+		/* Neither backend sends heartbeats, so nothing is ever acknowledged */
+		harness_upload(h, "unacknowledged", 14);
+		harness_peer *owner = first, *other = second;
+		harness_frame *frame = harness_peer_receive(first, HARNESS_FRAME_DATA, G_USEC_PER_SEC/2);
+		if(frame == NULL) {
+			owner = second;
+			other = first;
+			frame = harness_peer_receive(second, HARNESS_FRAME_DATA, timeout);
+		}
+		harness_expect(frame != NULL && frame->target == id, "failover: a message goes to one of the backends");
+		g_free(frame);
+		harness_peer_close(owner);
+		gboolean failed_over = harness_wait_stat("failover.replayed", replayed + 1, timeout);
+		harness_upload(h, "after the failover", 18);
+		frame = harness_peer_receive(other, HARNESS_FRAME_DATA, timeout);
+		harness_expect(failed_over && frame != NULL && frame->target == id && !strcmp(frame->data, "unacknowledged"),
+			"failover: what the backend that left didn't acknowledge is replayed to another one");
+		g_free(frame);
+		frame = harness_peer_receive(other, HARNESS_FRAME_DATA, timeout);
+		harness_expect(frame != NULL && !strcmp(frame->data, "after the failover"), "failover: new messages follow the replayed ones");
+		g_free(frame);
+	}
+	harness_stop();
+}
+
+static int harness_features(void) {
+	keep_relayed = TRUE;
+	harness_features_framed();
+	harness_features_ndjson();
+	harness_features_tls();
+	/* Last, as the heartbeats stay on for any instance that follows */
+	harness_features_failover();
+	return failures;
+}
+
+
+
+/* Microbenchmarks: each one returns how many calls it made in how long */
+typedef struct harness_result {
+	const char *name;
+	gint64 calls;
+	gint64 usecs;
+} harness_result;
+
+static void harness_result_print(harness_result *result) {
+	double usecs = result->usecs > 0 ? (double)result->usecs : 1.0;
+	JANUS_PRINT("  %-28s %10"SCNi64" calls %10.1f ns/call %12.0f calls/s\n", result->name, result->calls,
+		usecs * 1000.0 / (double)result->calls, (double)result->calls * G_USEC_PER_SEC / usecs);
+}
+
+static double harness_result_rate(harness_result *result) {
+	return (double)result->calls * G_USEC_PER_SEC / (double)MAX(result->usecs, 1);
+}
+
+static void harness_bench_sessions(harness_result *result) {
+	gint64 start = g_get_monotonic_time();
+	int i = 0;
+	for(i = 0; i < iterations; i++) {
+		harness_handle *h = harness_handle_create();
+		if(h)
+			harness_handle_destroy(h);
+	}
+	result->calls = iterations;
+	result->usecs = g_get_monotonic_time() - start;
+}
+
+static void harness_bench_stats(harness_result *result) {
+	int i = 0, count = MAX(iterations / 100, 1);
+	gint64 start = g_get_monotonic_time();
+	for(i = 0; i < count; i++) {
+		json_t *stats = harness_stats();
+		if(stats)
+			json_decref(stats);
+	}
+	result->calls = count;
+	result->usecs = g_get_monotonic_time() - start;
+}
+
+/* Asynchronous requests count until their events are pushed */
+static void harness_bench_messages(harness_result *result) {
+	harness_handle *h = harness_handle_create();
+	if(h == NULL)
+		return;
+	int i = 0;
+	gint64 start = g_get_monotonic_time();
+	for(i = 0; i < iterations; i++)
+		harness_request(h, json_pack("{sb}", "audio", 1));
+	harness_wait(&h->events, iterations, 60*G_USEC_PER_SEC);
+	result->calls = g_atomic_int_get(&h->events);
+	result->usecs = g_get_monotonic_time() - start;
+}
+
+static void harness_bench_rtp(harness_result *result, int video, int size) {
+	harness_handle *h = harness_handle_create();
+	if(h == NULL)
+		return;
+	char packet[1500];
+	harness_rtp_packet(packet, size, video ? 100 : 111, 0, 0, 0x1234);
+	int i = 0;
+	gint64 start = g_get_monotonic_time();
+	for(i = 0; i < iterations; i++)
+		plugin->incoming_rtp(&h->handle, video, packet, size);
+	result->calls = iterations;
+	result->usecs = g_get_monotonic_time() - start;
+}
+
+static void harness_bench_audio(harness_result *result) {
+	harness_bench_rtp(result, 0, 160);
+}
+
+static void harness_bench_video(harness_result *result) {
+	harness_bench_rtp(result, 1, 1200);
+}
+
+static void harness_bench_rtcp(harness_result *result) {
+	harness_handle *h = harness_handle_create();
+	if(h == NULL)
+		return;
+	char rtcp[8] = { (char)0x80, (char)201, 0, 1, 0, 0, 0x12, 0x34 };
+	int i = 0;
+	gint64 start = g_get_monotonic_time();
+	for(i = 0; i < iterations; i++)
+		plugin->incoming_rtcp(&h->handle, 0, rtcp, sizeof(rtcp));
+	result->calls = iterations;
+	result->usecs = g_get_monotonic_time() - start;
+}
+
+/* Data channel messages count until the backend has them */
+static void harness_bench_data(harness_result *result) {
+	harness_handle *h = harness_handle_create();
+	if(h == NULL)
+		return;
+	char message[HARNESS_MESSAGE_SIZE];
+	memset(message, 'x', sizeof(message));
+	gint frames = g_atomic_int_get(&backend.frames);
+	int i = 0;
+	gint64 start = g_get_monotonic_time();
+	for(i = 0; i < iterations; i++) {
+		harness_stamp_write(message, i);
+		plugin->incoming_data(&h->handle, message, sizeof(message));
+	}
+	harness_wait(&backend.frames, frames + iterations, 60*G_USEC_PER_SEC);
+	result->calls = g_atomic_int_get(&backend.frames) - frames;
+	result->usecs = g_get_monotonic_time() - start;
+}
+
+/* Backend messages count once they're relayed on the data channel, and
+ * as the next one only goes then, this is a round trip each */
+static void harness_bench_ext(harness_result *result) {
+	harness_handle *h = harness_handle_create();
+	if(h == NULL)
+		return;
+	char message[256];
+	memset(message, 'x', sizeof(message));
+	int i = 0;
+	gint64 start = g_get_monotonic_time();
+	for(i = 0; i < iterations; i++) {
+		harness_stamp_write(message, i);
+		if(harness_backend_send(harness_handle_id(h), message, sizeof(message)) < 0)
+			break;
+	}
+	result->calls = g_atomic_int_get(&h->data);
+	result->usecs = g_get_monotonic_time() - start;
+}
+
+static struct {
+	const char *name;
+	void (*run)(harness_result *result);
+} benchmarks[] = {
+	{ "create_destroy_session", harness_bench_sessions },
+	{ "handle_message_stats", harness_bench_stats },
+	{ "handle_message_async", harness_bench_messages },
+	{ "incoming_rtp_audio", harness_bench_audio },
+	{ "incoming_rtp_video", harness_bench_video },
+	{ "incoming_rtcp", harness_bench_rtcp },
+	{ "incoming_data", harness_bench_data },
+	{ "ext_receive_unicast", harness_bench_ext },
+	{ NULL, NULL }
+};
+
+static int harness_bench(void) {
+	if(!harness_start(NULL, NULL))
+		return 1;
+	json_t *baseline = NULL;
+	if(baseline_file != NULL) {
+		json_error_t error;
+		baseline = json_load_file(baseline_file, 0, &error);
+		if(baseline == NULL) {
+			JANUS_LOG(LOG_FATAL, "Couldn't read the baseline %s: %s\n", baseline_file, error.text);
+			return 1;
+		}
+	}
+	json_t *results = json_object();
+	int i = 0;
+	for(i = 0; benchmarks[i].name != NULL; i++) {
+		harness_result result = { benchmarks[i].name, 0, 0 };
+		harness_latency_reset(&relay_latency);
+		harness_latency_reset(&backend_latency);
+		benchmarks[i].run(&result);
+		if(result.calls == 0) {
+			harness_expect(FALSE, benchmarks[i].name);
+			continue;
+		}
+		harness_result_print(&result);
+		double rate = harness_result_rate(&result);
+		json_object_set_new(results, result.name, json_real(rate));
+		json_t *previous = baseline ? json_object_get(baseline, result.name) : NULL;
+		if(previous && json_is_number(previous) && rate < json_number_value(previous) * (100 - tolerance) / 100) {
+			JANUS_PRINT("  %-28s regression: %.0f calls/s, was %.0f\n", result.name, rate, json_number_value(previous));
+			failures++;
+		}
+	}
+	harness_latency_print(&relay_latency, "ext_receive_unicast latency");
+	if(output_file != NULL && json_dump_file(results, output_file, JSON_INDENT(2)) < 0) {
+		JANUS_LOG(LOG_ERR, "Couldn't save the results to %s\n", output_file);
+		failures++;
+	}
+	json_decref(results);
+	if(baseline)
+		json_decref(baseline);
+	return failures;
+}
+
+
+/* Session scaling: the sessions of each step are kept for the next one */
+static gint64 harness_cpu_usecs(clockid_t clock) {
+	struct timespec ts;
+	if(clock_gettime(clock, &ts) < 0)
+		return 0;
+	return (gint64)ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+/* Sends messages from the backend for duration seconds, at most rate per
+ * second (each one still waits for the previous one to be relayed), round
+ * robin to the sessions (or broadcast, without sessions), and waits for
+ * them to be relayed. The CPU time is the process one minus that of this
+ * thread, which is just the backend side */
+static void harness_scale_step(harness_handle **sessions, int count, int rate, json_t *rows) {
+	char *message = g_malloc0(message_size);
+	json_int_t live = harness_stat("sessions.live");
+	gint relayed = g_atomic_int_get(&totals.data);
+	harness_latency_reset(&relay_latency);
+	gint64 cpu = harness_cpu_usecs(CLOCK_PROCESS_CPUTIME_ID), own = harness_cpu_usecs(CLOCK_THREAD_CPUTIME_ID);
+	gint64 start = g_get_monotonic_time(), end = start + (gint64)(duration ? duration : 5) * G_USEC_PER_SEC, sent = 0;
+	while(TRUE) {
+		gint64 now = g_get_monotonic_time();
+		if(now >= end)
+			break;
+		if(rate > 0 && start + sent * G_USEC_PER_SEC / rate > now) {
+			g_usleep(MIN(start + sent * G_USEC_PER_SEC / rate - now, 1000));
+			continue;
+		}
+		harness_stamp_write(message, sent);
+		guint64 target = sessions ? harness_handle_id(sessions[sent % count]) : HARNESS_BROADCAST_ID;
+		if(harness_backend_send(target, message, message_size) < 0)
+			break;
+		sent++;
+	}
+	gint64 expected = sessions ? sent : sent * live;
+	harness_wait(&totals.data, relayed + expected, 30*G_USEC_PER_SEC);
+	gint64 usecs = g_get_monotonic_time() - start;
+	gint64 delivered = g_atomic_int_get(&totals.data) - relayed;
+	gint64 plugin_cpu = (harness_cpu_usecs(CLOCK_PROCESS_CPUTIME_ID) - cpu) - (harness_cpu_usecs(CLOCK_THREAD_CPUTIME_ID) - own);
+	g_free(message);
+
+	gint64 p50 = 0, p90 = 0, p99 = 0;
+	harness_latency_percentiles(&relay_latency, &p50, &p90, &p99);
+	double rate_out = (double)delivered * G_USEC_PER_SEC / (double)MAX(usecs, 1);
+	double cpu_per_message = delivered > 0 ? (double)plugin_cpu / (double)delivered : 0.0;
+	const char *mode = sessions ? "unicast" : "broadcast";
+	JANUS_PRINT("  %8d %-9s %10"SCNi64" %12"SCNi64" %12.0f %10.2f %8"SCNi64" %8"SCNi64" %8"SCNi64"%s\n",
+		count, mode, sent, delivered, rate_out, cpu_per_message, p50, p90, p99,
+		delivered < expected ? "  (lost messages)" : "");
+	if(delivered < expected)
+		failures++;
+	json_array_append_new(rows, json_pack("{sisssIsIsfsfsIsIsI}",
+		"sessions", count, "mode", mode, "sent", (json_int_t)sent, "delivered", (json_int_t)delivered,
+		"messages_per_sec", rate_out, "cpu_usecs_per_message", cpu_per_message,
+		"p50_usecs", (json_int_t)p50, "p90_usecs", (json_int_t)p90, "p99_usecs", (json_int_t)p99));
+}
+
+static int harness_scale(void) {
+	if(!harness_start(NULL, NULL))
+		return 1;
+	gchar **counts = g_strsplit(session_counts ? session_counts : "10,100,1000,10000,100000", ",", -1);
+	json_t *rows = json_array();
+	harness_handle **sessions = NULL;
+	int created = 0, i = 0;
+	JANUS_PRINT("  %8s %-9s %10s %12s %12s %10s %8s %8s %8s\n", "sessions", "mode", "sent", "delivered",
+		"msgs/s", "cpu us/msg", "p50 us", "p90 us", "p99 us");
+	for(i = 0; counts[i] != NULL; i++) {
+		int count = atoi(counts[i]);
+		if(count <= created) {
+			JANUS_LOG(LOG_WARN, "Skipping session count %s, counts should be growing\n", counts[i]);
+			continue;
+		}
+		sessions = g_realloc(sessions, count * sizeof(harness_handle *));
+		while(created < count) {
+			sessions[created] = harness_handle_create();
+			if(sessions[created] == NULL)
+				break;
+			created++;
+		}
+		if(created < count) {
+			harness_expect(FALSE, "create_session");
+			break;
+		}
+		harness_scale_step(sessions, count, unicast_rate, rows);
+		harness_scale_step(NULL, count, broadcast_rate, rows);
+	}
+	g_strfreev(counts);
+	g_free(sessions);
+	if(output_file != NULL && json_dump_file(rows, output_file, JSON_INDENT(2)) < 0) {
+		JANUS_LOG(LOG_ERR, "Couldn't save the results to %s\n", output_file);
+		failures++;
+	}
+	json_decref(rows);
+	return failures;
+}
+
+
+/* RTP forwarding: each camera is a session sending video frames at a fixed
+ * rate, with a keyframe (six times the size of the others) every two
+ * seconds, split in packets of at most 1200 bytes; H.264 keyframes come
+ * after SPS and PPS packets. Audio is a packet of 60 to 160 bytes (plus
+ * the header) every 20ms, as Opus would be */
+typedef struct harness_camera {
+	harness_handle *handle;
+	gboolean h264;
+	guint32 ssrc;
+	guint16 video_seq, audio_seq;
+	guint32 frames;
+	gint64 next_frame, next_audio;
+} harness_camera;
+
+#define HARNESS_RTP_MAX		1200
+
+typedef struct harness_generator {
+	GThread *thread;
+	int first;				/* Index of the first camera, the rest follow every generators */
+	gint64 end;
+	gint64 packets, video, bytes;
+	gint64 cpu_usecs;		/* Thread CPU time, mostly spent in incoming_rtp */
+} harness_generator;
+static harness_camera *camera_list = NULL;
+
+static void harness_camera_send(harness_generator *generator, harness_camera *camera, int video, int len, guint32 ts) {
+	char packet[HARNESS_RTP_MAX];
+	harness_rtp_packet(packet, len, video ? (camera->h264 ? 107 : 100) : 111,
+		video ? camera->video_seq++ : camera->audio_seq++, ts, camera->ssrc + (video ? 1 : 0));
+	plugin->incoming_rtp(&camera->handle->handle, video, packet, len);
+	generator->packets++;
+	generator->bytes += len;
+	if(video)
+		generator->video++;
+}
+
+static void harness_camera_frame(harness_generator *generator, harness_camera *camera) {
+	int gop = fps * 2;
+	int delta = (bitrate * 1000 / 8 / fps) * gop / (gop + 5);
+	gboolean key = (camera->frames % gop) == 0;
+	int size = key ? delta * 6 : delta * g_random_int_range(70, 131) / 100;
+	guint32 ts = (guint32)((guint64)camera->frames * 90000 / fps);
+	/* VP8 payload descriptor, or H.264 FU-A indicator and header */
+	int header = camera->h264 ? 2 : 1;
+	if(camera->h264 && key) {
+		harness_camera_send(generator, camera, 1, 12 + 20, ts);
+		harness_camera_send(generator, camera, 1, 12 + 8, ts);
+	}
+	while(size > 0) {
+		int chunk = MIN(size, HARNESS_RTP_MAX - 12 - header);
+		harness_camera_send(generator, camera, 1, 12 + header + chunk, ts);
+		size -= chunk;
+	}
+	camera->frames++;
+}
+
+static gpointer harness_generator_thread(gpointer data) {
+	harness_generator *generator = (harness_generator *)data;
+	gint64 frame_interval = G_USEC_PER_SEC / fps, audio_interval = 20000;
+	int i = 0;
+	while(g_get_monotonic_time() < generator->end) {
+		/* Whatever is due first: unpaced, it's sent right away */
+		harness_camera *next = NULL;
+		gboolean video = FALSE;
+		gint64 due = 0;
+		for(i = generator->first; i < cameras; i += generators) {
+			harness_camera *camera = &camera_list[i];
+			if(next == NULL || camera->next_frame < due) {
+				next = camera;
+				video = TRUE;
+				due = camera->next_frame;
+			}
+			if(camera->next_audio < due) {
+				next = camera;
+				video = FALSE;
+				due = camera->next_audio;
+			}
+		}
+		if(next == NULL)
+			break;
+		gint64 now = g_get_monotonic_time();
+		if(!unpaced && due > now) {
+			g_usleep(MIN(due - now, 1000));
+			continue;
+		}
+		if(video) {
+			harness_camera_frame(generator, next);
+			next->next_frame += frame_interval;
+		} else {
+			harness_camera_send(generator, next, 0, 12 + g_random_int_range(60, 161), next->audio_seq * 960);
+			next->next_audio += audio_interval;
+		}
+	}
+	generator->cpu_usecs = harness_cpu_usecs(CLOCK_THREAD_CPUTIME_ID);
+	return NULL;
+}
+
+/* The media sink, counting (and timing) what the plugin forwards */
+static volatile gint sink_running = 0;
+static volatile gint sink_packets = 0;
+static gint64 sink_bytes = 0;	/* Only read once the sink is done */
+
+static gpointer harness_sink_thread(gpointer data) {
+	char packet[1500];
+	while(g_atomic_int_get(&sink_running)) {
+		int len = harness_sink_receive(packet, sizeof(packet), 100);
+		if(len <= 0)
+			continue;
+		if(len > 12)
+			harness_latency_add(&media_latency, harness_stamp_age(packet + 12, len - 12));
+		sink_bytes += len;
+		g_atomic_int_inc(&sink_packets);
+	}
+	return NULL;
+}
+
+static int harness_rtp(void) {
+	char *external = media_io ? g_strdup_printf("media_io = %s", media_io) : NULL;
+	gboolean started = harness_start(NULL, external);
+	g_free(external);
+	if(!started)
+		return 1;
+	/* What gets lost on the way should be the plugin's doing, not ours */
+	int buffer = 8*1024*1024;
+	setsockopt(sink_fd, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+	camera_list = g_malloc0(cameras * sizeof(harness_camera));
+	gint64 start = g_get_monotonic_time();
+	int i = 0;
+	for(i = 0; i < cameras; i++) {
+		harness_camera *camera = &camera_list[i];
+		camera->handle = harness_handle_create();
+		if(camera->handle == NULL) {
+			harness_expect(FALSE, "create_session");
+			g_free(camera_list);
+			camera_list = NULL;
+			return failures;
+		}
+		camera->h264 = i % 2;
+		camera->ssrc = g_random_int() & ~1;
+		camera->next_frame = start + g_random_int_range(0, G_USEC_PER_SEC / fps);
+		camera->next_audio = start + g_random_int_range(0, 20000);
+	}
+	json_t *media = harness_stats();
+	json_int_t would_block = harness_stats_get(media, "media.would_block"), send_errors = harness_stats_get(media, "media.send_errors");
+	if(media)
+		json_decref(media);
+	harness_latency_reset(&media_latency);
+	g_atomic_int_set(&sink_packets, 0);
+	sink_bytes = 0;
+	g_atomic_int_set(&sink_running, 1);
+	GThread *sink = g_thread_new("harness sink", harness_sink_thread, NULL);
+	harness_generator *threads = g_malloc0(generators * sizeof(harness_generator));
+	start = g_get_monotonic_time();
+	for(i = 0; i < generators; i++) {
+		threads[i].first = i;
+		threads[i].end = start + (gint64)(duration ? duration : 5) * G_USEC_PER_SEC;
+		threads[i].thread = g_thread_new("harness camera", harness_generator_thread, &threads[i]);
+	}
+	gint64 packets = 0, video = 0, bytes = 0, cpu = 0;
+	for(i = 0; i < generators; i++) {
+		g_thread_join(threads[i].thread);
+		packets += threads[i].packets;
+		video += threads[i].video;
+		bytes += threads[i].bytes;
+		cpu += threads[i].cpu_usecs;
+	}
+	gint64 usecs = g_get_monotonic_time() - start;
+	g_free(threads);
+	/* Give the sink a moment to get what's still on its way */
+	gint received = -1;
+	while(received != g_atomic_int_get(&sink_packets)) {
+		received = g_atomic_int_get(&sink_packets);
+		g_usleep(200000);
+	}
+	g_atomic_int_set(&sink_running, 0);
+	g_thread_join(sink);
+	media = harness_stats();
+	would_block = harness_stats_get(media, "media.would_block") - would_block;
+	send_errors = harness_stats_get(media, "media.send_errors") - send_errors;
+	if(media)
+		json_decref(media);
+	g_free(camera_list);
+	camera_list = NULL;
+
+	gint64 lost = packets - received;
+	double rate = (double)received * G_USEC_PER_SEC / (double)MAX(usecs, 1);
+	double per_core = (double)packets * G_USEC_PER_SEC / (double)MAX(cpu, 1);
+	double loss = packets > 0 ? (double)lost * 100.0 / (double)packets : 0.0;
+	JANUS_PRINT("  %d cameras (%d VP8, %d H.264), %d fps, %d kbps, %d thread(s), %s, media_io %s\n",
+		cameras, cameras - cameras / 2, cameras / 2, fps, bitrate, generators, unpaced ? "unpaced" : "real time", media_io ? media_io : "default");
+	JANUS_PRINT("  %-16s %"SCNi64" packets (%"SCNi64" video, %"SCNi64" audio), %.1f MB\n", "generated",
+		packets, video, packets - video, (double)bytes / (1024.0 * 1024.0));
+	JANUS_PRINT("  %-16s %.0f packets/s, %.1f Mbps\n", "forwarded",
+		rate, (double)sink_bytes * 8.0 / (double)MAX(usecs, 1));
+	JANUS_PRINT("  %-16s %.0f packets/s (CPU time of the feeding threads)\n", "per core", per_core);
+	JANUS_PRINT("  %-16s %"SCNi64" (%.3f%%), would_block %"SCNi64", send_errors %"SCNi64"\n", "lost",
+		lost, loss, (gint64)would_block, (gint64)send_errors);
+	harness_latency_print(&media_latency, "added latency");
+	harness_expect(received > 0, "media reaches media_send_port");
+	if(output_file != NULL) {
+		gint64 p50 = 0, p90 = 0, p99 = 0;
+		harness_latency_percentiles(&media_latency, &p50, &p90, &p99);
+		json_t *result = json_pack("{sisisisisbsIsIsfsfsIsfsIsIsI}",
+			"cameras", cameras, "fps", fps, "bitrate", bitrate, "threads", generators, "unpaced", unpaced,
+			"generated", (json_int_t)packets, "received", (json_int_t)received,
+			"packets_per_sec", rate, "packets_per_sec_per_core", per_core, "lost", (json_int_t)lost, "loss_percent", loss,
+			"p50_usecs", (json_int_t)p50, "p90_usecs", (json_int_t)p90, "p99_usecs", (json_int_t)p99);
+		if(json_dump_file(result, output_file, JSON_INDENT(2)) < 0) {
+			JANUS_LOG(LOG_ERR, "Couldn't save the results to %s\n", output_file);
+			failures++;
+		}
+		json_decref(result);
+	}
+	return failures;
+}
+
+
+/* Soak: a steady set of sessions, plus short lived ones churning all the
+ * time, each of which gets configured and has its media set up and hung
+ * up, while the backend and the sessions exchange messages and media
+ * flows. Memory is sampled all along, and should stop growing after the
+ * first quarter of the run */
+static volatile gint stop = 0;
+
+static void harness_handle_signal(int signum) {
+	g_atomic_int_set(&stop, 1);
+}
+
+typedef struct harness_sample {
+	gint64 rss;			/* Bytes */
+	gint64 heap;		/* Bytes the allocator handed out */
+	json_int_t live, old, destroyed, freed;
+} harness_sample;
+
+static void harness_sample_take(harness_sample *sample) {
+	memset(sample, 0, sizeof(*sample));
+	long pages = 0, resident = 0;
+	FILE *statm = fopen("/proc/self/statm", "r");
+	if(statm != NULL) {
+		if(fscanf(statm, "%ld %ld", &pages, &resident) == 2)
+			sample->rss = (gint64)resident * sysconf(_SC_PAGESIZE);
+		fclose(statm);
+	}
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 33))
+	struct mallinfo2 info = mallinfo2();
+	sample->heap = info.uordblks + info.hblkhd;
+#elif defined(__GLIBC__)
+	struct mallinfo info = mallinfo();
+	sample->heap = (gint64)(unsigned int)info.uordblks + (unsigned int)info.hblkhd;
+#endif
+	json_t *stats = harness_stats();
+	sample->live = harness_stats_get(stats, "sessions.live");
+	sample->old = harness_stats_get(stats, "sessions.old");
+	sample->destroyed = harness_stats_get(stats, "sessions.destroyed");
+	sample->freed = harness_stats_get(stats, "sessions.freed");
+	if(stats)
+		json_decref(stats);
+}
+
+/* How much (percent) the average of the last quarter of the samples grew
+ * over the second quarter, the first one being the warm up */
+static double harness_samples_growth(GArray *samples, gboolean heap) {
+	guint quarter = samples->len / 4, i = 0;
+	double base = 0, last = 0;
+	for(i = 0; i < quarter; i++) {
+		harness_sample *b = &g_array_index(samples, harness_sample, quarter + i);
+		harness_sample *l = &g_array_index(samples, harness_sample, samples->len - quarter + i);
+		base += heap ? b->heap : b->rss;
+		last += heap ? l->heap : l->rss;
+	}
+	return base > 0 ? (last - base) * 100.0 / base : 0.0;
+}
+
+/* A new short lived session, with one of the settings changed */
+static harness_handle *harness_soak_session(gint64 index) {
+	harness_handle *h = harness_handle_create();
+	if(h == NULL)
+		return NULL;
+	json_t *request = NULL;
+	switch(index % 3) {
+		case 0:
+			request = json_pack("{sb}", "audio", 0);
+			break;
+		case 1:
+			request = json_pack("{sb}", "video", 0);
+			break;
+		default:
+			request = json_pack("{si}", "bitrate", 256000);
+			break;
+	}
+	harness_request(h, request);
+	plugin->setup_media(&h->handle);
+	return h;
+}
+
+/* One message or packet of the soak traffic, whichever is next in turn */
+static void harness_soak_traffic(gint64 index, harness_handle **sessions, GQueue *churning) {
+	harness_handle *h = sessions[g_random_int_range(0, steady)];
+	if(!g_queue_is_empty(churning) && index % 2)
+		h = g_queue_peek_nth(churning, g_random_int_range(0, g_queue_get_length(churning)));
+	/* Not stamped, as latency samples would take more and more memory */
+	char message[HARNESS_MESSAGE_SIZE];
+	memset(message, 'x', sizeof(message));
+	switch(index % 4) {
+		case 0:
+			harness_backend_send(harness_handle_id(h), message, sizeof(message));
+			break;
+		case 1:
+			plugin->incoming_data(&h->handle, message, sizeof(message));
+			break;
+		case 2:
+			harness_rtp_packet(message, sizeof(message), 111, index, index * 960, 0x50a4);
+			plugin->incoming_rtp(&h->handle, index % 3 == 0, message, sizeof(message));
+			break;
+		default:
+			if(index % 1000 == 3)
+				harness_backend_send(HARNESS_BROADCAST_ID, message, sizeof(message));
+			else
+				harness_backend_send(harness_handle_id(h), message, sizeof(message));
+			break;
+	}
+}
+
+static void harness_sample_print(harness_sample *sample, gint64 elapsed, gint64 churned) {
+	JANUS_PRINT("  %8"SCNi64" %10"SCNi64" %10"SCNi64" %10"SCNi64" %8"SCNi64" %8"SCNi64" %10"SCNi64" %10"SCNi64"\n",
+		elapsed / G_USEC_PER_SEC, churned, sample->rss / 1024, sample->heap / 1024,
+		(gint64)sample->live, (gint64)sample->old, (gint64)sample->destroyed, (gint64)sample->freed);
+}
+
+static int harness_soak(void) {
+	if(!harness_start(NULL, NULL))
+		return 1;
+	signal(SIGINT, harness_handle_signal);
+	signal(SIGTERM, harness_handle_signal);
+	/* Nobody reads what's forwarded to the sink, make sure it's dropped right away */
+	int buffer = 0;
+	setsockopt(sink_fd, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+	harness_handle **sessions = g_malloc0(steady * sizeof(harness_handle *));
+	GQueue churning = G_QUEUE_INIT;
+	GArray *samples = g_array_new(FALSE, TRUE, sizeof(harness_sample));
+	int i = 0;
+	for(i = 0; i < steady; i++) {
+		sessions[i] = harness_handle_create();
+		if(sessions[i] == NULL) {
+			harness_expect(FALSE, "create_session");
+			g_free(sessions);
+			g_array_free(samples, TRUE);
+			return failures;
+		}
+		plugin->setup_media(&sessions[i]->handle);
+	}
+	JANUS_PRINT("  %d steady sessions, %d created and destroyed per second, %d messages per second\n", steady, churn, traffic);
+	JANUS_PRINT("  %8s %10s %10s %10s %8s %8s %10s %10s\n", "seconds", "churned", "rss KB", "heap KB", "live", "old", "destroyed", "freed");
+	gint64 start = g_get_monotonic_time(), end = start + (gint64)(duration ? duration : 3600) * G_USEC_PER_SEC;
+	gint64 next_sample = start, churned = 0, sent = 0, max_old = 0;
+	harness_sample sample;
+	while(!g_atomic_int_get(&stop)) {
+		gint64 now = g_get_monotonic_time();
+		if(now >= end)
+			break;
+		/* Each short lived session is around for a second */
+		gint64 due = (now - start) * churn / G_USEC_PER_SEC;
+		for(; churned < due; churned++) {
+			harness_handle *h = harness_soak_session(churned);
+			if(h != NULL)
+				g_queue_push_tail(&churning, h);
+			while(g_queue_get_length(&churning) > (guint)churn) {
+				h = g_queue_pop_head(&churning);
+				plugin->hangup_media(&h->handle);
+				harness_handle_destroy(h);
+			}
+		}
+		due = (now - start) * traffic / G_USEC_PER_SEC;
+		for(; sent < due; sent++)
+			harness_soak_traffic(sent, sessions, &churning);
+		harness_graveyard_sweep(10*G_USEC_PER_SEC);
+		if(now >= next_sample) {
+			harness_sample_take(&sample);
+			harness_sample_print(&sample, now - start, churned);
+			g_array_append_val(samples, sample);
+			if(samples->len > 4 && sample.old > max_old)
+				max_old = sample.old;
+			next_sample += (gint64)sample_interval * G_USEC_PER_SEC;
+		}
+		g_usleep(5000);
+	}
+	harness_handle *h = NULL;
+	while((h = g_queue_pop_head(&churning)) != NULL)
+		harness_handle_destroy(h);
+	g_free(sessions);
+
+	/* Destroyed sessions are freed five seconds later, give or take the watchdog period */
+	harness_expect(max_old <= (gint64)churn * 10 + 100, "destroyed sessions don't pile up");
+	gint64 until = g_get_monotonic_time() + 15*G_USEC_PER_SEC;
+	harness_sample_take(&sample);
+	while(sample.old > 0 && g_get_monotonic_time() < until) {
+		g_usleep(100000);
+		harness_sample_take(&sample);
+	}
+	harness_expect(sample.old == 0 && sample.destroyed == sample.freed, "every destroyed session gets freed");
+	if(samples->len < 8) {
+		JANUS_PRINT("  Only %u samples, too few to tell whether memory plateaus (lower -i or raise -D)\n", samples->len);
+		failures++;
+	} else {
+		double rss = harness_samples_growth(samples, FALSE), heap = harness_samples_growth(samples, TRUE);
+		JANUS_PRINT("  Growth after warming up: rss %.1f%%, heap %.1f%%\n", rss, heap);
+		harness_expect(rss <= max_growth, "RSS plateaus");
+		harness_expect(heap <= max_growth, "allocated memory plateaus");
+	}
+	if(output_file != NULL) {
+		json_t *rows = json_array();
+		guint s = 0;
+		for(s = 0; s < samples->len; s++) {
+			harness_sample *row = &g_array_index(samples, harness_sample, s);
+			json_array_append_new(rows, json_pack("{sIsIsIsIsIsI}", "rss", (json_int_t)row->rss, "heap", (json_int_t)row->heap,
+				"live", row->live, "old", row->old, "destroyed", row->destroyed, "freed", row->freed));
+		}
+		if(json_dump_file(rows, output_file, JSON_INDENT(2)) < 0) {
+			JANUS_LOG(LOG_ERR, "Couldn't save the samples to %s\n", output_file);
+			failures++;
+		}
+		json_decref(rows);
+	}
+	g_array_free(samples, TRUE);
+	return failures;
+}
+
+
+static struct {
+	const char *name;
+	int (*run)(void);
+} modes[] = {
+	{ "check", harness_check },
+	{ "features", harness_features },
+	{ "bench", harness_bench },
+	{ "scale", harness_scale },
+	{ "rtp", harness_rtp },
+	{ "soak", harness_soak },
+	{ NULL, NULL }
+};
+
+int main(int argc, char *argv[]) {
+	GError *error = NULL;
+	GOptionContext *context = g_option_context_new("check|features|bench|scale|rtp|soak");
+	g_option_context_set_summary(context, "Drives the SkyWay IoT plugin with a mock gateway and a mock backend");
+	g_option_context_add_main_entries(context, harness_options, NULL);
+	if(!g_option_context_parse(context, &argc, &argv, &error)) {
+		JANUS_PRINT("%s\n", error->message);
+		g_error_free(error);
+		g_option_context_free(context);
+		exit(1);
+	}
+	int m = 0;
+	for(m = 0; argc == 2 && modes[m].name != NULL; m++) {
+		if(!strcasecmp(argv[1], modes[m].name))
+			break;
+	}
+	if(argc != 2 || modes[m].name == NULL || iterations < 1 || tolerance < 0 || tolerance > 100 ||
+			unicast_rate < 0 || broadcast_rate < 0 || duration < 0 || message_size < (int)sizeof(harness_stamp) || message_size > HARNESS_PAYLOAD_MAX ||
+			cameras < 1 || fps < 1 || bitrate < 1 || generators < 1 || generators > cameras ||
+			churn < 1 || steady < 1 || traffic < 0 || sample_interval < 1 || max_growth < 0) {
+		char *help = g_option_context_get_help(context, TRUE, NULL);
+		JANUS_PRINT("%s", help);
+		g_free(help);
+		g_option_context_free(context);
+		exit(1);
+	}
+	g_option_context_free(context);
+
+	janus_log_init(FALSE, TRUE, NULL);
+	janus_log_level = log_level;
+	if(plugin_path == NULL)
+		plugin_path = g_strdup(PLUGINDIR "/libjanus_skywayiot.so");
+	plugin = harness_load(plugin_path);
+	if(plugin == NULL) {
+		janus_log_destroy();
+		exit(1);
+	}
+	harness_latency_init(&relay_latency, 1000000);
+	harness_latency_init(&backend_latency, 1000000);
+	harness_latency_init(&media_latency, 1000000);
+
+	JANUS_PRINT("%s %s, %s\n", plugin->get_name(), plugin->get_version_string(), modes[m].name);
+	int res = modes[m].run();
+	harness_stop();
+	JANUS_PRINT("%s: %s\n", modes[m].name, res == 0 ? "passed" : "FAILED");
+
+	g_free(relay_latency.samples);
+	g_free(backend_latency.samples);
+	g_free(media_latency.samples);
+	g_free(plugin_path);
+	g_free(session_counts);
+	g_free(media_io);
+	janus_log_destroy();
+	exit(res == 0 ? 0 : 1);
+}
@@ -7,6 +7,36 @@
 
 #include <jansson.h>
 #include <netdb.h>
+#include <endian.h>
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+#ifdef HAVE_LIBSSL
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_LIBLZ4
+#include <lz4.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "../debug.h"
 #include "../apierror.h"
@@ -86,18 +116,48 @@ static janus_callbacks *gateway = NULL;
 static GThread *handler_thread;
 static GThread *watchdog;
 static void *janus_skywayiot_handler(void *data);
-static int create_ext_data_interface(char *addr, int port);
+static int create_ext_data_interface(char *addr, int port, int listeners, const char *cpus, int max_backends, int standby_port);
+static int janus_skywayiot_ext_send(guint64 handle_id, char *buf, int len);
+static int janus_skywayiot_ext_send_frame(guint8 type, guint64 handle_id, char *buf, int len);
+static const char *janus_skywayiot_json_skip(const char *p, const char *end);
+static void janus_skywayiot_routes_load(janus_config *config);
+static void janus_skywayiot_routes_free(void);
+static const char *janus_skywayiot_route_match(const char *buf, int len);
+static GString *janus_skywayiot_ndjson_line(guint64 handle_id, const char *buf, int len);
+static const char *janus_skywayiot_json_string(const char *value, int len, int *out_len, char **copy);
 static int create_media_sender(char *media_recv_addr, int media_recv_port);
+#ifdef HAVE_LIBSSL
+static int janus_skywayiot_tls_setup(const char *cert, const char *key, const char *ca);
+#endif
+#ifdef HAVE_LIBURING
+static int janus_skywayiot_uring_setup(int entries, int batch, gboolean sqpoll, int flush_usecs);
+static int janus_skywayiot_uring_send(char *buf, int len);
+static void janus_skywayiot_uring_teardown(void);
+#endif
 
 static void *thread_receive_ext_data(void *data);
+static void *janus_skywayiot_logger(void *data);
+static void *janus_skywayiot_delivery(void *data);
 
 static void relay_ext_to_datachannel(gpointer handle, gpointer session, gpointer data);
 
+/* Handle id the backend uses to address every connected data channel */
+#define JANUS_SKYWAYIOT_BROADCAST_ID	0xffffffffffffffff
+
 typedef struct data_with_handleid {
  guint64 handle_id;
+ gint64 expires; /* Monotonic time after which the frame must be dropped, 0 if never */
+ const char *key; /* Conflation key, if the frame had one */
+ int key_len;
  char *data;
  int data_len;
 } data_with_handleid;
+static void relay_ext_frame(data_with_handleid *frame);
+static void relay_ext_group(guint64 group_id, gint64 expires, const char *key, int key_len, char *data, int len);
+static void janus_skywayiot_group_control(guint8 type, guint64 group_id, char *payload, int len);
+static void relay_ext_publish(const char *topic, int topic_len, guint8 flags, gint64 expires, char *data, int len);
+static void relay_ext_device(const char *device, int device_len, gint64 expires, char *data, int len);
+static void relay_ext_bulk(guint64 handle_id, gboolean last, char *payload, int len);
 
 typedef struct janus_skywayiot_message {
  janus_plugin_session *handle;
@@ -122,18 +182,715 @@ typedef struct janus_skywayiot_session {
  janus_mutex rec_mutex; /* Mutex to protect the recorders from race conditions */
  guint16 slowlink_count;
  volatile gint hangingup;
- gint64 destroyed; /* Time at which this session was marked as destroyed */
+ gint64 destroyed; /* Time at which this session was marked as destroyed (monotonic, not the plugin clock) */
+ volatile gint ref; /* One for the sessions table (then old_sessions), one per relay waiting for it */
+ GList *groups; /* Groups this session is a member of, protected by sessions_mutex */
+ GHashTable *subscriptions; /* Topic name -> janus_skywayiot_topic, protected by sessions_mutex */
+ GHashTable *wildcards; /* Topic filter -> janus_skywayiot_wildcard, protected by sessions_mutex */
+ gboolean media_ready; /* Whether setup_media was called (and no hangup since), protected by sessions_mutex */
+ volatile gint data_open; /* Whether the data channel is known to be open (the peer sent something, or asked for a sync) since setup_media */
+ struct janus_skywayiot_outbox *outbox; /* Paced delivery queue, once conflation was asked for */
+ GHashTable *throttles; /* Topic name -> janus_skywayiot_throttle, for rate limited subscriptions, protected by sessions_mutex */
+ char *device_id; /* Stable id of the device behind this session, if it told us, protected by sessions_mutex */
+ gboolean envelope; /* Whether data channel messages carry our envelope ("chunking"), see janus_skywayiot_relay_data */
+ volatile gint chunk_id; /* Id of the next chunked message we send */
+ struct janus_skywayiot_reassembly *reassembly; /* Chunked message being received, only touched by incoming_data */
+ struct janus_skywayiot_bulk *bulk; /* Bulk transfer to this session, if any, protected by delivery_mutex */
+ struct janus_skywayiot_compressor *compressor; /* Compression contexts, once compression was asked for */
+ struct janus_skywayiot_delta *delta; /* Delta encoding state, once delta encoding was asked for */
 } janus_skywayiot_session;
+static void janus_skywayiot_deliver(janus_skywayiot_session *session, gint64 expires, const char *key, int key_len, char *data, int len);
 static GHashTable *sessions;
-static GList *old_sessions;
+static GQueue *old_sessions;	/* Destroyed sessions, oldest first, waiting to be freed */
 static janus_mutex sessions_mutex;
 
-int ext_listen_fd = -1;  /* socket for listening external tcp */
-int ext_fd        = -1;  /* socket for tcp data */
-int media_send_fd;  /* socket for external media stream */
+/* Groups of sessions the backend manages, and can then address with a single
+ * frame that is expanded here, instead of sending a copy per session */
+typedef struct janus_skywayiot_group {
+	guint64 id;
+	GHashTable *members;	/* janus_plugin_session -> janus_skywayiot_session */
+} janus_skywayiot_group;
+static GHashTable *groups;	/* Group id -> janus_skywayiot_group, protected by sessions_mutex */
+
+/* Topics the backend publishes to, and sessions subscribe to (with a
+ * "subscribe" request). The last message published to a topic with the
+ * retain flag is kept, and sent right away to new subscribers (or when
+ * their media is set up), so they have the current state without waiting
+ * for the next update. Retained messages are evicted least recently used
+ * first when retain_max_bytes or retain_max_topics are exceeded */
+typedef struct janus_skywayiot_topic {
+	char *name;
+	GHashTable *subscribers;	/* janus_plugin_session -> janus_skywayiot_session */
+	char *retained;
+	gint64 retained_expires;	/* 0 if the retained value never expires */
+	int retained_len;
+	GList *lru_link;			/* Link in retained_lru, if retained is set */
+} janus_skywayiot_topic;
+static GHashTable *topics;		/* Topic name -> janus_skywayiot_topic, protected by sessions_mutex */
+static GQueue retained_lru;		/* Topics with a retained message, least recently used first */
+static gsize retained_bytes = 0;
+static gsize retain_max_bytes = 1024*1024;
+static guint retain_max_topics = 1024;
+
+/* Wildcard subscriptions: topic filters as in MQTT, where topics are levels
+ * separated by slashes, + stands for any one level and # (only as the last
+ * level) for any number of them, including none. Filters are kept in a trie
+ * of their levels, with separate children for + and #, so finding the ones
+ * a topic matches takes a walk as deep as the topic, whatever the number of
+ * filters. What a topic matches (the subscribers, without duplicates) is
+ * also cached, up to wildcard_cache_size topics: any change to the wildcard
+ * subscriptions bumps a generation counter, which makes every entry stale.
+ * Sessions matching a topic both directly and through a filter only get
+ * each message once, and a rate limit on a filter applies to everything it
+ * matches together. All of this is protected by sessions_mutex */
+typedef struct janus_skywayiot_wildcard {
+	char *filter;
+	GHashTable *subscribers;	/* janus_plugin_session -> janus_skywayiot_session */
+	struct janus_skywayiot_filter_node *node;
+} janus_skywayiot_wildcard;
+typedef struct janus_skywayiot_filter_node {
+	char *level;
+	struct janus_skywayiot_filter_node *parent;
+	GHashTable *children;		/* Level -> node */
+	struct janus_skywayiot_filter_node *plus;
+	struct janus_skywayiot_filter_node *hash;
+	janus_skywayiot_wildcard *wildcard;	/* Subscribers of the filter ending here */
+} janus_skywayiot_filter_node;
+typedef struct janus_skywayiot_wildcard_match {
+	janus_skywayiot_session *session;
+	janus_skywayiot_wildcard *wildcard;
+} janus_skywayiot_wildcard_match;
+typedef struct janus_skywayiot_wildcard_cached {
+	guint64 generation;
+	GArray *matches;			/* janus_skywayiot_wildcard_match */
+} janus_skywayiot_wildcard_cached;
+static janus_skywayiot_filter_node *filter_root = NULL;
+static guint wildcards_count = 0;
+static guint64 wildcard_generation = 0;
+static GHashTable *wildcard_cache = NULL;	/* Topic name -> janus_skywayiot_wildcard_cached */
+static guint wildcard_cache_size = 1024;
+
+/* Conflation: a session that asks for it ("conflate") gets its data through
+ * a queue, drained by the delivery thread at the rate the session says it can
+ * take ("conflate_rate", messages per second). Messages with a key (from the
+ * frame, the topic they were published to, or the conflate_json_field of a
+ * JSON payload, looked up once per message before the fan-out) replace any
+ * older one with the same key that's still in the queue, so a slow
+ * subscriber gets the current state instead of a backlog.
+ * Outboxes are only freed with their session, so that the hot paths can
+ * check them without locking: everything else is protected by delivery_mutex */
+#define JANUS_SKYWAYIOT_CONFLATE_RATE_DEFAULT	20
+#define JANUS_SKYWAYIOT_OUTBOX_MAX				1000	/* Unkeyed messages beyond that drop the oldest */
+
+typedef struct janus_skywayiot_outbound {
+	gint64 expires;
+	char *key;
+	char *data;
+	int len;
+	janus_skywayiot_session *session;	/* Set (with a reference) when it's out of the outbox, waiting to be relayed */
+	gboolean enveloped;		/* Already a whole data channel message (bulk chunks), sent as it is */
+} janus_skywayiot_outbound;
+
+typedef struct janus_skywayiot_outbox {
+	gboolean enabled;
+	gint rate;
+	GQueue queue;			/* janus_skywayiot_outbound, oldest first */
+	GHashTable *keyed;		/* Key -> link in queue */
+	gint64 next_delivery;
+	gboolean scheduled;		/* Whether the session is in delivery_sessions */
+	guint64 delivered;
+	guint64 conflated;
+	guint64 dropped;
+	guint64 expired;
+} janus_skywayiot_outbox;
+
+static GList *delivery_sessions = NULL;	/* Sessions with queued messages */
+static janus_mutex delivery_mutex;
+static GAsyncQueue *delivery_wakeups = NULL;
+static GThread *delivery_thread;
+static char *conflate_json_field = NULL;
+
+/* Subscriptions can also be rate limited ("max_rate" in Hz, or "window" in
+ * ms): at most one message per window is then delivered for that topic,
+ * either the latest one or, for numeric payloads, the min/max/average of
+ * what was published during the window. The first message after a quiet
+ * window goes out right away; what comes after it is kept here, and sent by
+ * the delivery thread when the window ends. On a topic filter, what comes
+ * out goes under the topic of the latest message it's made of. The table of
+ * a session is protected by sessions_mutex, the throttles themselves by
+ * delivery_mutex */
+typedef enum janus_skywayiot_aggregate {
+	JANUS_SKYWAYIOT_AGGREGATE_LATEST = 0,
+	JANUS_SKYWAYIOT_AGGREGATE_MIN,
+	JANUS_SKYWAYIOT_AGGREGATE_MAX,
+	JANUS_SKYWAYIOT_AGGREGATE_AVG,
+	JANUS_SKYWAYIOT_AGGREGATE_MAX_TYPES
+} janus_skywayiot_aggregate;
+static const char *aggregate_names[JANUS_SKYWAYIOT_AGGREGATE_MAX_TYPES] = {
+	"latest", "min", "max", "avg"
+};
+
+typedef struct janus_skywayiot_throttle {
+	janus_skywayiot_session *session;
+	char *topic;			/* Topic, or filter, subscribed to */
+	gint64 window;			/* usecs */
+	janus_skywayiot_aggregate aggregate;
+	char *latest;			/* Latest message of the current window, if any */
+	int latest_len;
+	char *latest_topic;		/* ... and the topic it was published on */
+	gint64 latest_expires;
+	double min, max, sum;	/* Numeric messages of the current window */
+	guint count;
+	gint64 window_end;		/* Nothing is delivered before that */
+	gboolean scheduled;		/* Whether it's in delivery_throttles */
+	guint64 absorbed;		/* Messages that were merged into another one */
+} janus_skywayiot_throttle;
+static GList *delivery_throttles = NULL;	/* Throttles with something to deliver */
+
+/* Store and forward: sessions can say which device they are ("device_id"),
+ * and the backend can then address devices instead of handles, with device
+ * frames. What's sent to a device that isn't connected (or is still being
+ * caught up) goes to its spool, a ring in a memory mapped file in spool_dir
+ * that survives the session (and restarts), dropping the oldest messages
+ * beyond spool_max_bytes. When the device is back, the delivery thread
+ * drains its spool at spool_drain_rate messages per second, so that the
+ * new association isn't flooded. Spools being drained stay open (and mapped),
+ * and so do the spool_max_open most recently written ones, so that a device
+ * that is away while its traffic goes on doesn't cost an open and a mmap per
+ * message: the others are closed, and stay on disk. They're protected by
+ * delivery_mutex */
+typedef struct janus_skywayiot_spool_header {
+	guint32 magic;
+	guint32 version;
+	guint64 capacity;	/* Bytes of ring after the header */
+	guint64 head;		/* Offset of the oldest record (it only grows, the ring position is modulo capacity) */
+	guint64 tail;		/* Offset of the next record */
+	guint64 count;		/* Records in the ring */
+} janus_skywayiot_spool_header;
+#define JANUS_SKYWAYIOT_DEVICE_ID_MAX	128
+#define JANUS_SKYWAYIOT_SPOOL_MAGIC		0x50534b53	/* "SKSP" */
+#define JANUS_SKYWAYIOT_SPOOL_VERSION	1
+
+/* Each record in the ring starts with this */
+typedef struct janus_skywayiot_spool_record {
+	guint32 length;
+	guint32 reserved;
+	gint64 deadline;	/* Wall clock (ms since the epoch) after which it's dropped, 0 if never */
+} janus_skywayiot_spool_record;
+
+typedef struct janus_skywayiot_spool {
+	char *device_id;
+	char *path;
+	int fd;
+	janus_skywayiot_spool_header *header;	/* The mapped file */
+	guint8 *ring;
+	janus_skywayiot_session *session;	/* The device session being drained to, if any */
+	gboolean scheduled;		/* Whether it's in delivery_spools */
+	gint64 next_delivery;
+	GList *idle;			/* Link in spools_idle, if it's only open as a recently written one */
+} janus_skywayiot_spool;
+static GHashTable *devices = NULL;	/* Device id -> janus_skywayiot_session, protected by sessions_mutex */
+static GHashTable *spools = NULL;	/* Device id -> open janus_skywayiot_spool */
+static GList *delivery_spools = NULL;	/* Spools being drained */
+static GQueue spools_idle = G_QUEUE_INIT;	/* Open spools nobody drains, most recently written first */
+static guint spool_max_open = 64;
+static char *spool_dir = NULL;
+static gsize spool_max_bytes = 1024*1024;
+static gint spool_drain_rate = 50;
+
+/* Bulk transfers (firmware pushes, log pulls...): the backend sends the
+ * chunks of a transfer as bulk frames, and the plugin keeps at most
+ * bulk_window of them in flight on the data channel of the session, sending
+ * the next ones as the client acknowledges the previous ones. Acks are
+ * relayed to the backend as credit frames, so that it streams the transfer
+ * at the pace of the device without anyone buffering it whole. Since the
+ * window bounds how much bulk data can sit in the association send buffer
+ * ahead of them, interactive messages (sent right away, while bulk chunks go
+ * through the delivery thread) don't wait behind a whole transfer. On the
+ * data channel (sessions need the envelope, see "chunking"), chunks are a
+ * janus_skywayiot_bulk_header followed by the data, and acks are the same
+ * header (last unused) acknowledging all the chunks up to seq */
+typedef struct janus_skywayiot_bulk_header {
+	guint8 flags;		/* JANUS_SKYWAYIOT_ENVELOPE_BULK */
+	guint8 transfer[4];	/* Network order, as everything here */
+	guint8 seq[4];		/* Chunks are numbered from 0 in each transfer */
+	guint8 last;		/* 1 on the last chunk of the transfer */
+} janus_skywayiot_bulk_header;
+
+typedef struct janus_skywayiot_bulk_chunk {
+	guint32 seq;
+	gboolean last;
+	int len;
+	char data[];
+} janus_skywayiot_bulk_chunk;
+
+typedef struct janus_skywayiot_bulk {
+	guint32 transfer;
+	guint32 next;		/* Seq of the next chunk to send to the client */
+	guint32 acked;		/* Chunks the client acknowledged (all of them before that seq) */
+	GQueue queue;		/* janus_skywayiot_bulk_chunk waiting for room in the window */
+	gboolean scheduled;	/* Whether the session is in delivery_bulks */
+	gboolean resuming;	/* The backend was told where to resume, and hasn't yet */
+	guint64 sent;
+	guint64 overflow;	/* Chunks the backend sent beyond the credit it had, or out of order */
+} janus_skywayiot_bulk;
+static GList *delivery_bulks = NULL;	/* Sessions with bulk chunks they have room for */
+static guint32 bulk_window = 16;
+
+/* External interface: backends connect to data_port over TCP. With
+ * data_listeners > 1, that many sockets are bound to the port with
+ * SO_REUSEPORT, each served by its own thread (pinned to a core, if
+ * data_listener_cpus says so), and the kernel spreads the backend connections
+ * across them. Each listener accepts up to data_max_backends connections.
+ * This only pins the receive side: what a backend sends is relayed by its
+ * listener's thread, but data going to the backend is written by whichever
+ * Janus thread got it from the data channel, and the relay_data calls run on
+ * the listener's core rather than on the one serving the peer's PeerConnection */
+typedef struct janus_skywayiot_ext_listener {
+	guint index;
+	int listen_fd;
+	int cpu;				/* Core the thread is pinned to, -1 to let it float */
+	guint max_backends;
+	gboolean standby;		/* Listening on standby_port */
+	GThread *thread;
+} janus_skywayiot_ext_listener;
+static janus_skywayiot_ext_listener *ext_listeners = NULL;
+static guint ext_listeners_count = 0;
+/* Polled by all the listener threads, and signalled when the plugin stops */
+static int ext_stop_fd = -1;
+
+/* Data channel envelope: sessions that ask for it ("chunking") get every
+ * message with a leading flags byte, and send theirs the same way. Messages
+ * that wouldn't fit in max_message_size are split in chunks, each with the
+ * chunk flag and a header (message id, chunk index and chunk count, network
+ * order) after the flags byte. Chunks of a message are sent in order, but
+ * may be interleaved with other messages. Chunked uploads are reassembled
+ * (in order, one message at a time, up to max_reassembly_size) before being
+ * forwarded to the backend */
+#define JANUS_SKYWAYIOT_ENVELOPE_CHUNK	0x01
+#define JANUS_SKYWAYIOT_ENVELOPE_BULK	0x02	/* See janus_skywayiot_bulk */
+#define JANUS_SKYWAYIOT_ENVELOPE_COMPRESSED	0x04	/* See janus_skywayiot_compressor */
+#define JANUS_SKYWAYIOT_ENVELOPE_DELTA	0x08	/* See janus_skywayiot_delta */
+#define JANUS_SKYWAYIOT_ENVELOPE_STORED	0x10	/* See janus_skywayiot_compressor */
+typedef struct janus_skywayiot_chunk_header {
+	guint8 flags;
+	guint8 id[4];
+	guint8 index[2];
+	guint8 count[2];
+} janus_skywayiot_chunk_header;
+typedef struct janus_skywayiot_reassembly {
+	guint32 id;
+	guint16 next;		/* Index of the chunk we expect next */
+	guint16 count;		/* 0 if we're not in the middle of a message */
+	GByteArray *buffer;
+} janus_skywayiot_reassembly;
+static int max_message_size = 16384;
+static gsize max_reassembly_size = 16*1024*1024;
+
+/* Compression: sessions using the envelope can ask for their messages to be
+ * compressed ("compression", deflate or lz4, depending on what the plugin
+ * was built with), in both directions. Each direction of each session is a
+ * stream, so every message is compressed with what came before as its
+ * dictionary (plus compression_dictionary, if configured, to start with),
+ * which is what makes small telemetry messages compress at all: that means
+ * messages have to be decompressed in the order they were compressed, and
+ * that the contexts are reset whenever compression is configured again.
+ * Messages smaller than compression_min_size are sent as they are (without
+ * the compressed flag, and without going through the stream). With deflate,
+ * messages are raw deflate flushed with Z_SYNC_FLUSH, without the trailing
+ * 00 00 ff ff (as in WebSocket permessage-deflate); with lz4, they're the
+ * original size (32 bit, network order) followed by an lz4 block. Messages
+ * that don't get any smaller are sent as they are, flagged as stored: they
+ * still are part of the stream, so the receiver adds them to its history
+ * (with deflate, by inflating them as stored blocks). The deflate window is
+ * compression_window_bits (and uploads must not use a larger one), and most
+ * of the rest of the memory a session takes is compression_mem_level. An
+ * upload that can't be decompressed turns compression off for the session
+ * (the client is told with a compression_disabled event), as the streams
+ * can't be trusted anymore: asking for it again restarts them */
+typedef enum janus_skywayiot_codec {
+	JANUS_SKYWAYIOT_CODEC_NONE = 0,
+	JANUS_SKYWAYIOT_CODEC_DEFLATE,
+	JANUS_SKYWAYIOT_CODEC_LZ4,
+	JANUS_SKYWAYIOT_CODEC_MAX
+} janus_skywayiot_codec;
+static const char *codec_names[JANUS_SKYWAYIOT_CODEC_MAX] = {
+	"none", "deflate", "lz4"
+};
+#define JANUS_SKYWAYIOT_LZ4_HISTORY	65536
+
+typedef struct janus_skywayiot_compressor {
+	janus_mutex mutex;		/* Compressing and sending have to happen in the same order */
+	janus_skywayiot_codec codec;
+#ifdef HAVE_ZLIB
+	z_stream deflate;
+	z_stream inflate;
+	gboolean zlib_ready;
+#endif
+#ifdef HAVE_LIBLZ4
+	LZ4_stream_t *lz4;
+	char *lz4_dict;			/* What we compressed last */
+	char *lz4_history;		/* What we decompressed last */
+	int lz4_history_len;
+#endif
+	guint64 raw_bytes;		/* Outbound, before compression */
+	guint64 compressed_bytes;	/* ... and after */
+} janus_skywayiot_compressor;
+static void janus_skywayiot_compressor_reset(janus_skywayiot_compressor *c, janus_skywayiot_codec codec);
+static int compression_min_size = 64;
+static int compression_window_bits = 15;
+static int compression_mem_level = 5;
+static char *compression_dictionary = NULL;
+static gsize compression_dictionary_len = 0;
+
+/* Delta encoding: sessions using the envelope can ask for messages that have
+ * a key (a keyed frame, or conflate_json_field) to be sent as a delta of the
+ * last message they got with the same key ("delta"), which for telemetry is
+ * usually a handful of bytes. These messages have the delta flag, and the
+ * key (16 bit length, network order, then the key) and a mode byte after
+ * the flags byte: mode 0 is a full message, that clients keep as the base
+ * for that key, mode 1 a delta, that is the message length (varint) and
+ * then, until the end, the number of bytes that didn't change (varint), the
+ * number that did (varint) and these bytes XOR the base ones (the base is
+ * padded with zeroes, or truncated, to the message length). A full message
+ * is sent every delta_full_interval messages of a key, and whenever a delta
+ * wouldn't be any smaller. Clients can send theirs the same way. At most
+ * delta_max_keys keys (each of them up to 64k) are tracked per direction of
+ * a session: messages for other keys are always sent in full. Deltas are
+ * applied before compression, and the state is reset whenever delta encoding
+ * is configured again */
+#define JANUS_SKYWAYIOT_DELTA_FULL	0
+#define JANUS_SKYWAYIOT_DELTA_XOR	1
+#define JANUS_SKYWAYIOT_DELTA_MAX_VALUE	65536
+typedef struct janus_skywayiot_delta_value {
+	char *data;
+	int len;
+	guint count;			/* Deltas sent since the last full message */
+} janus_skywayiot_delta_value;
+typedef struct janus_skywayiot_delta {
+	janus_mutex mutex;		/* Encoding and sending have to happen in the same order */
+	gboolean enabled;
+	GHashTable *sent;		/* Key -> janus_skywayiot_delta_value, what the session got */
+	GHashTable *received;	/* Key -> janus_skywayiot_delta_value, what it sent us */
+	guint64 full;
+	guint64 deltas;
+	guint64 saved;			/* Bytes deltas saved */
+} janus_skywayiot_delta;
+static guint delta_full_interval = 64;
+static guint delta_max_keys = 1024;
+
+/* Framed mode (data_framing = framed): every message, in both directions,
+ * starts with this header, so message boundaries don't depend on how TCP
+ * segments the stream, and control messages can be told apart from data.
+ * All the fields are in network order, the target too (unlike the handle id
+ * leading raw messages) */
+typedef struct janus_skywayiot_frame_header {
+	guint32 length;		/* Bytes after this field, network order */
+	guint8 type;
+	guint8 flags;
+	guint16 key_length;	/* Bytes of key at the start of the payload (network order), for the types that have one */
+	guint64 target;		/* Handle, group or broadcast id (network order) */
+} janus_skywayiot_frame_header;
+
+#define JANUS_SKYWAYIOT_FRAME_DATA		0
+/* Sent every heartbeat_interval by both sides: the payload is the number
+ * (64 bit, network order) of data frames received so far on the connection,
+ * which lets the sender forget about the frames it kept for failover */
+#define JANUS_SKYWAYIOT_FRAME_HEARTBEAT	1
+/* Group management: the target is the group id, and the payload of add and
+ * remove is a list of handle ids (8 bytes each, network order). Adding to a group that
+ * doesn't exist creates it; sessions leave their groups when destroyed */
+#define JANUS_SKYWAYIOT_FRAME_GROUP_ADD		2
+#define JANUS_SKYWAYIOT_FRAME_GROUP_REMOVE	3
+#define JANUS_SKYWAYIOT_FRAME_GROUP_DESTROY	4
+/* Data for all the members of the group in target */
+#define JANUS_SKYWAYIOT_FRAME_GROUP_DATA	5
+/* Data for the subscribers of a topic: the payload starts with the topic
+ * name (key_length bytes), and with the retain flag the message is kept as
+ * the topic last value (an empty retained message clears it) */
+#define JANUS_SKYWAYIOT_FRAME_PUBLISH		6
+/* Data for a device: the payload starts with its device id (key_length
+ * bytes), and if it's not connected the message is spooled until it is */
+#define JANUS_SKYWAYIOT_FRAME_DEVICE		7
+/* Bulk transfer chunk for the handle in target: the payload starts with the
+ * transfer id and the chunk seq (32 bit each, network order), and the last
+ * flag marks the end of the transfer. Chunks must be numbered in order, and
+ * no more than the credit allows should be sent */
+#define JANUS_SKYWAYIOT_FRAME_BULK			8
+/* Sent to the backend when a client acknowledges bulk chunks: the payload is
+ * the transfer id, how many chunks were acknowledged, the window and the seq
+ * of the next chunk expected (32 bit each, network order), so chunks up to
+ * acknowledged + window - 1 can be sent. Chunks out of order or beyond the
+ * credit are dropped, and answered with a credit frame as well: the backend
+ * is expected to send them again, starting from the next seq expected */
+#define JANUS_SKYWAYIOT_FRAME_CREDIT		9
+/* Sent by a backend to give itself a name (the payload): from then on, it
+ * only gets the messages routed to that name (see janus_skywayiot_route) */
+#define JANUS_SKYWAYIOT_FRAME_HELLO		10
+
+#define JANUS_SKYWAYIOT_FRAME_FLAG_RETAIN	0x01
+/* Data frames (data, group data and publish) with one of these flags start
+ * with an expiry (64 bit, network order, before the key): either a time to
+ * live in milliseconds from when the frame is read, or an absolute deadline
+ * in milliseconds since the Unix epoch. Frames are dropped (and counted) as
+ * soon as they are found expired, on receive, while being relayed, or while
+ * waiting in an outbox, a rate limit window or as a retained value */
+#define JANUS_SKYWAYIOT_FRAME_FLAG_TTL		0x02
+#define JANUS_SKYWAYIOT_FRAME_FLAG_DEADLINE	0x04
+#define JANUS_SKYWAYIOT_FRAME_FLAG_LAST		0x08	/* Last chunk of a bulk transfer */
+
+#define JANUS_SKYWAYIOT_FRAME_MAX_PAYLOAD	65535
+
+static gboolean ext_framed = FALSE;
+/* NDJSON mode (data_framing = ndjson): for backends that would rather not
+ * pack binary headers, every message is a line with a JSON object, with the
+ * target handle id (a number, or a string of digits for ids that don't fit
+ * in a double) and the payload: a string is relayed as its contents, any
+ * other JSON value as it is, and binary payloads go in payload_base64. The
+ * backend can also set the key of a message (as in keyed frames) and its
+ * ttl (milliseconds). Messages from sessions are sent to the backend the
+ * same way. There are no control messages, as in raw mode */
+static gboolean ext_ndjson = FALSE;
+static guint32 ext_max_payload = JANUS_SKYWAYIOT_FRAME_MAX_PAYLOAD;	/* data_max_frame_size */
+static gint64 heartbeat_interval = 0;	/* usecs, 0 disables heartbeats */
+static gint heartbeat_misses = 3;		/* Silent intervals after which a backend is considered dead */
+/* usecs a write to a backend may wait for room (data_write_timeout, or as
+ * long as it takes the heartbeats to declare it dead): the writer holds the
+ * backend lock meanwhile, so one that stops reading is dropped instead */
+static gint64 backend_write_timeout = 5 * G_USEC_PER_SEC;
+static gsize failover_buffer = 0;		/* Bytes of unacknowledged data kept per backend */
+
+/* A data frame sent to a backend and not acknowledged yet */
+typedef struct janus_skywayiot_pending {
+	guint64 seq;
+	guint64 target;
+	int len;
+	char data[];
+} janus_skywayiot_pending;
+
+/* A connected backend: it's read by the thread of the listener that accepted
+ * it, and written by the Janus threads relaying data to it, so it's reference
+ * counted, and the socket is only closed when the last reference goes away */
+typedef struct janus_skywayiot_backend {
+	guint64 id;
+	int fd;
+	guint listener;
+	gboolean standby;
+	janus_mutex mutex;		/* Keeps writes from different threads from interleaving */
+	gboolean closed;		/* Set (under mutex) once the backend left the pool */
+	guint64 sent;			/* Data frames sent, under mutex */
+	GQueue *pending;		/* Unacknowledged frames, if failover_buffer is set, under mutex */
+	gsize pending_bytes;
+	guint64 received;		/* Data frames received: only used by the listener thread, like the fields below */
+	gint64 last_heard;
+	char *inbuf;			/* Partial frame (or line, in NDJSON mode), in framed mode */
+	guint inlen;
+	guint insize;
+	guint inscanned;		/* NDJSON: bytes of the partial line already searched for a newline */
+#ifdef HAVE_LIBSSL
+	SSL *ssl;				/* TLS session, if data_tls_cert is set */
+	gboolean ktls_send;		/* Whether the kernel does the crypto for our writes */
+	gboolean ktls_recv;		/* ... and for our reads */
+#endif
+	guint64 frames_in;
+	guint64 frames_out;
+	char *name;				/* Set by a hello, under backends_mutex */
+	volatile gint ref;
+} janus_skywayiot_backend;
+
+/* Sessions are spread across the connected backends by consistent hashing of
+ * their handle id: each backend owns JANUS_SKYWAYIOT_RING_VNODES points on a
+ * hash ring, and a session goes to the owner of the first point after its own
+ * hash. All the data of a session then goes to the same backend, in order, and
+ * when a backend joins or leaves, only the sessions that hashed to its points
+ * move, instead of all of them being reshuffled */
+#define JANUS_SKYWAYIOT_RING_VNODES	64
+
+typedef struct janus_skywayiot_ring_point {
+	guint64 hash;
+	janus_skywayiot_backend *backend;
+} janus_skywayiot_ring_point;
+
+static GList *backends = NULL;
+static janus_skywayiot_ring_point *backend_ring = NULL;
+static guint backend_ring_size = 0;
+static guint64 backend_next_id = 0;
+static gboolean backend_ring_standby = FALSE;	/* Whether the ring is made of standby backends */
+static GHashTable *named_backends = NULL;	/* Name -> GPtrArray of the backends that said hello with it */
+static janus_mutex backends_mutex;	/* Protects the five above */
+static janus_skywayiot_backend *janus_skywayiot_backend_for_locked(guint64 handle_id);
+static janus_skywayiot_backend *janus_skywayiot_backend_named_locked(const char *name, guint64 handle_id);
+static int janus_skywayiot_backend_send_locked(janus_skywayiot_backend *backend, guint8 type, guint64 handle_id,
+	GString *line, char *buf, int len);
+
+/* Content based routing: [route-<name>] categories send the messages from
+ * sessions that match them to the backends that said hello with the name in
+ * "backend", rather than to the owner of the session in the ring. A rule
+ * matches on the first byte of the message ("type", e.g. 0x03), on how it
+ * starts ("prefix") or on the value of a top level field of a JSON object
+ * ("json_field" and "json_value", compared as written, quotes aside): one of
+ * those per rule, as the indexes below can't combine them.
+ * Rules are compiled at startup in a table indexed by the first byte, a
+ * trie of the prefixes (one table per node, so matching is a lookup per
+ * byte) and a hash table of fields and values, and the first rule (in the
+ * order of the configuration) that matches wins. If no backend with that
+ * name is connected, the message goes to the ring as usual */
+typedef struct janus_skywayiot_route {
+	char *name;
+	char *backend;
+	guint64 matched;
+} janus_skywayiot_route;
+typedef struct janus_skywayiot_route_node {
+	guint16 route;			/* Rule whose prefix ends here (index + 1), if any */
+	guint32 next[256];		/* Child for each byte (node index), 0 if none */
+} janus_skywayiot_route_node;
+static janus_skywayiot_route *routes = NULL;
+static guint routes_count = 0;
+static guint16 route_by_type[256];	/* Rule for each first byte (index + 1), if any */
+static janus_skywayiot_route_node *route_trie = NULL;	/* Node 0 is the root */
+static guint route_trie_size = 0;
+static GHashTable *route_json = NULL;	/* Field -> (value -> rule index + 1) */
+static guint16 route_json_first = 0;	/* Best rule among the JSON ones */
+/* Threads sending to the backends, that may be looking at the rules: they're
+ * only freed when there's none left, and new ones don't route once we stop.
+ * The last one out while we're stopping wakes up whoever is waiting for that */
+static volatile gint route_users = 0;
+static janus_mutex route_users_mutex;
+static janus_condition route_users_cond;
+
+static void janus_skywayiot_route_release(void) {
+	if(g_atomic_int_dec_and_test(&route_users) && g_atomic_int_get(&stopping)) {
+		janus_mutex_lock(&route_users_mutex);
+		janus_condition_broadcast(&route_users_cond);
+		janus_mutex_unlock(&route_users_mutex);
+	}
+}
+
+#ifdef HAVE_LIBSSL
+/* TLS on the external interface: after the handshake the symmetric crypto is
+ * handed to the kernel (kTLS) when OpenSSL and the kernel support it for the
+ * negotiated cipher, so that reads and writes on the backend connections stay
+ * plain syscalls. If they don't, records are processed by OpenSSL instead */
+static SSL_CTX *ext_tls_ctx = NULL;
+#if defined(SSL_OP_ENABLE_KTLS) && defined(BIO_get_ktls_send) && defined(BIO_get_ktls_recv)
+#define JANUS_SKYWAYIOT_KTLS_SEND(ssl)	(BIO_get_ktls_send(SSL_get_wbio(ssl)) ? TRUE : FALSE)
+#define JANUS_SKYWAYIOT_KTLS_RECV(ssl)	(BIO_get_ktls_recv(SSL_get_rbio(ssl)) ? TRUE : FALSE)
+#else
+#define JANUS_SKYWAYIOT_KTLS_SEND(ssl)	FALSE
+#define JANUS_SKYWAYIOT_KTLS_RECV(ssl)	FALSE
+#endif
+#endif
+
+/* Backends dropped for missing heartbeats, and what happened to their unacknowledged frames */
+static struct {
+	guint64 timeouts;
+	guint64 replayed;
+	guint64 lost;			/* Unacknowledged frames with nobody left to replay them to */
+	guint64 overflow;		/* Frames that didn't fit in failover_buffer */
+} failover_stats;
+
+int media_send_fd = -1;  /* socket for external media stream (connected to media_send_dest) */
 
 struct sockaddr_in g_media_sender;
 
+/* Session lifecycle counters, to check memory plateaus under churn */
+static struct {
+	guint64 created;
+	guint64 destroyed;
+	guint64 freed;
+} session_stats;
+
+static void janus_skywayiot_session_unref(janus_skywayiot_session *session);
+
+static void janus_skywayiot_outbound_free(janus_skywayiot_outbound *msg) {
+	if(msg->session != NULL)
+		janus_skywayiot_session_unref(msg->session);
+	g_free(msg->key);
+	g_free(msg->data);
+	g_free(msg);
+}
+
+/* Drop whatever is queued: the caller holds delivery_mutex (or is the last user) */
+static void janus_skywayiot_outbox_clear(janus_skywayiot_outbox *outbox) {
+	g_hash_table_remove_all(outbox->keyed);
+	janus_skywayiot_outbound *msg = NULL;
+	while((msg = g_queue_pop_head(&outbox->queue)) != NULL)
+		janus_skywayiot_outbound_free(msg);
+}
+
+static void janus_skywayiot_session_free(janus_skywayiot_session *session) {
+	if(!session)
+		return;
+	session->handle = NULL;
+	g_list_free(session->groups);
+	if(session->subscriptions != NULL)
+		g_hash_table_destroy(session->subscriptions);
+	if(session->wildcards != NULL)
+		g_hash_table_destroy(session->wildcards);
+	if(session->throttles != NULL)
+		g_hash_table_destroy(session->throttles);
+	g_free(session->device_id);
+	if(session->reassembly != NULL) {
+		if(session->reassembly->buffer != NULL)
+			g_byte_array_free(session->reassembly->buffer, TRUE);
+		g_free(session->reassembly);
+	}
+	if(session->outbox != NULL) {
+		janus_skywayiot_outbox_clear(session->outbox);
+		g_hash_table_destroy(session->outbox->keyed);
+		g_free(session->outbox);
+	}
+	if(session->compressor != NULL) {
+		janus_skywayiot_compressor_reset(session->compressor, JANUS_SKYWAYIOT_CODEC_NONE);
+		janus_mutex_destroy(&session->compressor->mutex);
+		g_free(session->compressor);
+	}
+	if(session->delta != NULL) {
+		g_hash_table_destroy(session->delta->sent);
+		g_hash_table_destroy(session->delta->received);
+		janus_mutex_destroy(&session->delta->mutex);
+		g_free(session->delta);
+	}
+	if(session->bulk != NULL) {
+		gpointer chunk = NULL;
+		while((chunk = g_queue_pop_head(&session->bulk->queue)) != NULL)
+			g_free(chunk);
+		g_free(session->bulk);
+	}
+	janus_mutex_destroy(&session->rec_mutex);
+	g_free(session);
+	__atomic_fetch_add(&session_stats.freed, 1, __ATOMIC_RELAXED);
+}
+
+/* Relays waiting to be done (see janus_skywayiot_relay_queued) keep their
+ * session around: the last one to let go of it frees it, with no lock held
+ * but sessions_mutex, if any */
+static janus_skywayiot_session *janus_skywayiot_session_ref(janus_skywayiot_session *session) {
+	g_atomic_int_inc(&session->ref);
+	return session;
+}
+
+static void janus_skywayiot_session_unref(janus_skywayiot_session *session) {
+	if(g_atomic_int_dec_and_test(&session->ref))
+		janus_skywayiot_session_free(session);
+}
+
+static void janus_skywayiot_group_free(janus_skywayiot_group *group) {
+	g_hash_table_destroy(group->members);
+	g_free(group);
+}
+
+/* Remove a session from all its groups: the caller holds sessions_mutex */
+static void janus_skywayiot_group_leave(janus_skywayiot_session *session) {
+	GList *gl = NULL;
+	for(gl = session->groups; gl != NULL; gl = gl->next) {
+		janus_skywayiot_group *group = (janus_skywayiot_group *)gl->data;
+		g_hash_table_remove(group->members, session->handle);
+	}
+	g_list_free(session->groups);
+	session->groups = NULL;
+}
+
 static void janus_skywayiot_message_free(janus_skywayiot_message *msg) {
  if(!msg || msg == &exit_message)
   return;
@@ -153,196 +910,3117 @@ static void janus_skywayiot_message_free(janus_skywayiot_message *msg) {
 }
 
 
-/* Error codes */
-#define JANUS_SKYWAYIOT_ERROR_NO_MESSAGE   411
-#define JANUS_SKYWAYIOT_ERROR_INVALID_JSON  412
-#define JANUS_SKYWAYIOT_ERROR_INVALID_ELEMENT 413
+/* Clock for everything time driven in the plugin (reconnection backoffs,
+ * message TTLs, conflation and rate limit windows, spool draining, ...). By
+ * default it's the gateway monotonic clock, but a simulated clock can be
+ * configured instead: sleeping on it moves virtual time forward, clock_speedup
+ * times faster than real time, so hours of fleet behaviour can be run in
+ * seconds. Log throttling and the stats timings are about real CPU time,
+ * backend heartbeats are about real processes, the grace period before freeing
+ * a destroyed session is there for the gateway threads that may still be
+ * using it, and spool deadlines are stored as wall clock times (so that they
+ * survive restarts): they all stay on real time */
+typedef struct janus_skywayiot_clock {
+	const char *name;
+	gint64 (*now)(void);
+	void (*sleep)(gint64 usecs);
+} janus_skywayiot_clock;
 
+static gint64 janus_skywayiot_real_now(void) {
+	return janus_get_monotonic_time();
+}
 
-/* SkywayIoT watchdog/garbage collector (sort of) */
-void *janus_skywayiot_watchdog(void *data);
-void *janus_skywayiot_watchdog(void *data) {
-	JANUS_LOG(LOG_INFO, "SkywayIoT watchdog started\n");
-	gint64 now = 0;
-	while(g_atomic_int_get(&initialized) && !g_atomic_int_get(&stopping)) {
-		janus_mutex_lock(&sessions_mutex);
-		/* Iterate on all the sessions */
-		now = janus_get_monotonic_time();
-		if(old_sessions != NULL) {
-			GList *sl = old_sessions;
-			JANUS_LOG(LOG_HUGE, "Checking %d old SkywayIoT sessions...\n", g_list_length(old_sessions));
-			while(sl) {
-				janus_skywayiot_session *session = (janus_skywayiot_session *)sl->data;
-				if(!session) {
-					sl = sl->next;
-					continue;
-				}
-				if(now-session->destroyed >= 5*G_USEC_PER_SEC) {
-					/* We're lazy and actually get rid of the stuff only after a few seconds */
-					JANUS_LOG(LOG_VERB, "Freeing old SkywayIoT session\n");
-					GList *rm = sl->next;
-					old_sessions = g_list_delete_link(old_sessions, sl);
-					sl = rm;
-					session->handle = NULL;
-					g_free(session);
-					session = NULL;
-					continue;
-				}
-				sl = sl->next;
-			}
-		}
-		janus_mutex_unlock(&sessions_mutex);
-		g_usleep(500000);
-	}
-	JANUS_LOG(LOG_INFO, "SkywayIoT watchdog stopped\n");
-	return NULL;
+static void janus_skywayiot_real_sleep(gint64 usecs) {
+	g_usleep(usecs);
 }
 
+static gint64 simulated_time = 0;
+#define JANUS_SKYWAYIOT_DEFAULT_SPEEDUP	3600
+static gint simulated_speedup = JANUS_SKYWAYIOT_DEFAULT_SPEEDUP;
 
-/* Plugin implementation */
-int janus_skywayiot_init(janus_callbacks *callback, const char *config_path) {
-	if(g_atomic_int_get(&stopping)) {
-		/* Still stopping from before */
-		return -1;
-	}
-	if(callback == NULL || config_path == NULL) {
-		/* Invalid arguments */
-		return -1;
+/* Wakeup times of the threads sleeping on the simulated clock, earliest
+ * first: time only moves forward to the earliest one, once its (scaled)
+ * real time delay is over, so what is due first always runs first, however
+ * the threads happen to be scheduled */
+static janus_mutex simulated_mutex;
+static janus_condition simulated_cond;
+static GList *simulated_wakeups = NULL;	/* gint64 *, protected by simulated_mutex */
+
+static gint64 janus_skywayiot_simulated_now(void) {
+	return __atomic_load_n(&simulated_time, __ATOMIC_ACQUIRE);
+}
+
+static gint janus_skywayiot_simulated_compare(gconstpointer a, gconstpointer b) {
+	gint64 x = *(const gint64 *)a, y = *(const gint64 *)b;
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/* Moves time forward to when (if it's later), waking up whoever is due */
+static void janus_skywayiot_simulated_advance_to(gint64 when) {
+	janus_mutex_lock(&simulated_mutex);
+	if(when > janus_skywayiot_simulated_now()) {
+		__atomic_store_n(&simulated_time, when, __ATOMIC_RELEASE);
+		janus_condition_broadcast(&simulated_cond);
 	}
+	janus_mutex_unlock(&simulated_mutex);
+}
 
-	/* Read configuration */
-	char filename[255];
-	g_snprintf(filename, 255, "%s/%s.cfg", config_path, JANUS_SKYWAYIOT_PACKAGE);
-	JANUS_LOG(LOG_VERB, "Configuration file: %s\n", filename);
-	janus_config *config = janus_config_parse(filename);
+/* Registers a wakeup time, for sleepers that wait on something else too
+ * (see the delivery thread): the returned link is for the functions below */
+static GList *janus_skywayiot_simulated_register(gint64 *wakeup) {
+	janus_mutex_lock(&simulated_mutex);
+	simulated_wakeups = g_list_insert_sorted(simulated_wakeups, wakeup, janus_skywayiot_simulated_compare);
+	GList *link = g_list_find(simulated_wakeups, wakeup);
+	janus_condition_broadcast(&simulated_cond);
+	janus_mutex_unlock(&simulated_mutex);
+	return link;
+}
 
-	GList *cl = NULL;
-	if(config != NULL) {
-		cl = janus_config_get_categories(config);
+static void janus_skywayiot_simulated_unregister(GList *link) {
+	janus_mutex_lock(&simulated_mutex);
+	simulated_wakeups = g_list_delete_link(simulated_wakeups, link);
+	/* Somebody else may be the earliest now */
+	janus_condition_broadcast(&simulated_cond);
+	janus_mutex_unlock(&simulated_mutex);
+}
+
+/* A registered sleeper whose real time delay is over: time moves to its
+ * wakeup only if nobody is due before */
+static void janus_skywayiot_simulated_expired(GList *link) {
+	janus_mutex_lock(&simulated_mutex);
+	if(simulated_wakeups == link && *(gint64 *)link->data > janus_skywayiot_simulated_now()) {
+		__atomic_store_n(&simulated_time, *(gint64 *)link->data, __ATOMIC_RELEASE);
+		janus_condition_broadcast(&simulated_cond);
 	}
+	janus_mutex_unlock(&simulated_mutex);
+}
 
-	while(cl != NULL) {
-		janus_config_category *cat = (janus_config_category *)cl->data;
-		if(cat->name == NULL || strcasecmp(cat->name, "external-interface") != 0) {
-			cl = cl->next;
+static void janus_skywayiot_simulated_sleep(gint64 usecs) {
+	gint64 wakeup = janus_skywayiot_simulated_now() + usecs;
+	GList *link = janus_skywayiot_simulated_register(&wakeup);
+	janus_mutex_lock(&simulated_mutex);
+	while(janus_skywayiot_simulated_now() < wakeup) {
+		if(simulated_wakeups != link) {
+			/* Somebody is due before us: wait for time to move */
+			janus_condition_wait(&simulated_cond, &simulated_mutex);
 			continue;
 		}
+		gint64 until = g_get_monotonic_time() + MAX(1, (wakeup - janus_skywayiot_simulated_now()) / simulated_speedup);
+		if(!janus_condition_wait_until(&simulated_cond, &simulated_mutex, until) && simulated_wakeups == link) {
+			__atomic_store_n(&simulated_time, wakeup, __ATOMIC_RELEASE);
+			janus_condition_broadcast(&simulated_cond);
+		}
+	}
+	simulated_wakeups = g_list_delete_link(simulated_wakeups, link);
+	janus_condition_broadcast(&simulated_cond);
+	janus_mutex_unlock(&simulated_mutex);
+}
 
-		JANUS_LOG(LOG_INFO, "config:: name of category '%s'\n", cat->name);
+static const janus_skywayiot_clock real_clock = {
+	.name = "monotonic",
+	.now = janus_skywayiot_real_now,
+	.sleep = janus_skywayiot_real_sleep,
+};
+static const janus_skywayiot_clock simulated_clock = {
+	.name = "simulated",
+	.now = janus_skywayiot_simulated_now,
+	.sleep = janus_skywayiot_simulated_sleep,
+};
+static const janus_skywayiot_clock *plugin_clock = &real_clock;
 
-		janus_config_item *data_port = janus_config_get_item(cat, "data_port");
-		janus_config_item *data_addr = janus_config_get_item(cat, "data_addr");
 
-		janus_config_item *media_send_port = janus_config_get_item(cat, "media_send_port");
-		janus_config_item *media_send_dest = janus_config_get_item(cat, "media_send_dest");
+/* Scheduling of the plugin threads: for each class of thread, the [threads]
+ * category of the configuration can set the cores they may run on
+ * (<class>_cpus, e.g. "2-3,6"), their nice level (<class>_nice) and a
+ * SCHED_FIFO priority (<class>_priority, needs CAP_SYS_NICE). This keeps, e.g.,
+ * the data relay on dedicated cores, away from the Janus ICE/DTLS threads */
+typedef enum janus_skywayiot_thread_class {
+	JANUS_SKYWAYIOT_THREAD_WATCHDOG = 0,
+	JANUS_SKYWAYIOT_THREAD_HANDLER,
+	JANUS_SKYWAYIOT_THREAD_EXT,
+	JANUS_SKYWAYIOT_THREAD_LOGGER,
+	JANUS_SKYWAYIOT_THREAD_DELIVERY,
+	JANUS_SKYWAYIOT_THREAD_MAX
+} janus_skywayiot_thread_class;
 
-		if(data_port == NULL || data_port->value == NULL
-				|| data_addr == NULL || data_addr->value == NULL
-				|| media_send_port == NULL || media_send_port->value == NULL
-				|| media_send_dest == NULL || media_send_dest->value == NULL) {
-			JANUS_LOG(LOG_WARN, "  -- Invalid dataport, mediaport, listenaddr, we'll skip opening '%s'. \n", cat->name);
-			cl = cl->next;
-			continue;
-		} else {
-			create_ext_data_interface( (char *)data_addr->value, atoi(data_port->value) );
-			create_media_sender( (char *)media_send_dest->value, atoi(media_send_port->value) );
+typedef struct janus_skywayiot_thread_policy {
+	const char *name;
+	gboolean has_cpus;
+	cpu_set_t cpus;
+	gboolean has_nice;
+	int nice;
+	int priority;	/* SCHED_FIFO priority, 0 to leave the thread on SCHED_OTHER */
+} janus_skywayiot_thread_policy;
 
-			cl = cl->next;
+static janus_skywayiot_thread_policy thread_policies[JANUS_SKYWAYIOT_THREAD_MAX] = {
+	{ .name = "watchdog" },
+	{ .name = "handler" },
+	{ .name = "ext" },
+	{ .name = "logger" },
+	{ .name = "delivery" },
+};
+
+/* Parse a list of cores like "0-3,6" */
+static gboolean janus_skywayiot_parse_cpus(const char *list, cpu_set_t *cpus) {
+	CPU_ZERO(cpus);
+	gchar **ranges = g_strsplit(list, ",", -1);
+	gboolean ok = TRUE;
+	int i = 0;
+	for(i = 0; ranges[i] != NULL; i++) {
+		char *range = g_strstrip(ranges[i]);
+		if(strlen(range) == 0)
+			continue;
+		char *end = NULL;
+		long first = strtol(range, &end, 10), last = first;
+		if(end == range) {
+			ok = FALSE;
+			break;
+		}
+		if(*end == '-') {
+			char *last_start = end+1;
+			last = strtol(last_start, &end, 10);
+			if(end == last_start) {
+				ok = FALSE;
+				break;
+			}
+		}
+		if(*end != '\0' || first < 0 || last < first || last >= CPU_SETSIZE) {
+			ok = FALSE;
+			break;
 		}
+		for(; first <= last; first++)
+			CPU_SET(first, cpus);
 	}
-	janus_config_print(config);
-	/* This plugin actually has nothing to configure... */
-	janus_config_destroy(config);
-	config = NULL;
+	g_strfreev(ranges);
+	return ok && CPU_COUNT(cpus) > 0;
+}
 
-	sessions = g_hash_table_new(NULL, NULL);
-	janus_mutex_init(&sessions_mutex);
-	messages = g_async_queue_new_full((GDestroyNotify) janus_skywayiot_message_free);
-	/* This is the callback we'll need to invoke to contact the gateway */
-	gateway = callback;
-	g_atomic_int_set(&initialized, 1);
+static void janus_skywayiot_thread_policies_parse(janus_config *config) {
+	int i = 0;
+	char key[64];
+	for(i = 0; i < JANUS_SKYWAYIOT_THREAD_MAX; i++) {
+		janus_skywayiot_thread_policy *policy = &thread_policies[i];
+		policy->has_cpus = FALSE;
+		policy->has_nice = FALSE;
+		policy->priority = 0;
+		g_snprintf(key, sizeof(key), "%s_cpus", policy->name);
+		janus_config_item *item = janus_config_get_item_drilldown(config, "threads", key);
+		if(item && item->value) {
+			policy->has_cpus = janus_skywayiot_parse_cpus(item->value, &policy->cpus);
+			if(!policy->has_cpus)
+				JANUS_LOG(LOG_WARN, "Invalid %s '%s', ignoring it\n", key, item->value);
+		}
+		g_snprintf(key, sizeof(key), "%s_nice", policy->name);
+		item = janus_config_get_item_drilldown(config, "threads", key);
+		if(item && item->value) {
+			policy->has_nice = TRUE;
+			policy->nice = atoi(item->value);
+		}
+		g_snprintf(key, sizeof(key), "%s_priority", policy->name);
+		item = janus_config_get_item_drilldown(config, "threads", key);
+		if(item && item->value) {
+			policy->priority = atoi(item->value);
+			if(policy->priority < sched_get_priority_min(SCHED_FIFO) || policy->priority > sched_get_priority_max(SCHED_FIFO)) {
+				JANUS_LOG(LOG_WARN, "Invalid %s '%s', ignoring it\n", key, item->value);
+				policy->priority = 0;
+			}
+		}
+	}
+}
 
-	GError *error = NULL;
-	/* Start the sessions watchdog */
-	watchdog = g_thread_try_new("skywayiot watchdog", &janus_skywayiot_watchdog, NULL, &error);
-	if(error != NULL) {
-		g_atomic_int_set(&initialized, 0);
-		JANUS_LOG(LOG_ERR, "Got error %d (%s) trying to launch the SkywayIoT watchdog thread...\n", error->code, error->message ? error->message : "??");
-		return -1;
+/* Called by each plugin thread when it starts: cpu, if not negative, pins
+ * the thread to that single core instead of the class cores */
+static void janus_skywayiot_thread_policy_apply(janus_skywayiot_thread_class tc, int cpu) {
+	janus_skywayiot_thread_policy *policy = &thread_policies[tc];
+	int res = 0;
+	if(cpu >= 0 || policy->has_cpus) {
+		cpu_set_t pinned, *cpus = &policy->cpus;
+		if(cpu >= 0) {
+			CPU_ZERO(&pinned);
+			CPU_SET(cpu, &pinned);
+			cpus = &pinned;
+		}
+		if((res = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), cpus)) != 0)
+			JANUS_LOG(LOG_WARN, "Couldn't set the cores of the %s thread (%s)\n", policy->name, strerror(res));
 	}
-	/* Launch the thread that will handle incoming messages */
-	handler_thread = g_thread_try_new("skywayiot handler", janus_skywayiot_handler, NULL, &error);
-	if(error != NULL) {
-		g_atomic_int_set(&initialized, 0);
-		JANUS_LOG(LOG_ERR, "Got error %d (%s) trying to launch the SkywayIoT handler thread...\n", error->code, error->message ? error->message : "??");
-		return -1;
+	if(policy->has_nice) {
+		/* On Linux the nice level is per thread, so this only affects the caller */
+		if(setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), policy->nice) < 0)
+			JANUS_LOG(LOG_WARN, "Couldn't set the nice level of the %s thread to %d (%s)\n", policy->name, policy->nice, strerror(errno));
+	}
+	if(policy->priority > 0) {
+		struct sched_param param = { .sched_priority = policy->priority };
+		if((res = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param)) != 0)
+			JANUS_LOG(LOG_WARN, "Couldn't set SCHED_FIFO priority %d for the %s thread (%s)\n", policy->priority, policy->name, strerror(res));
 	}
-	JANUS_LOG(LOG_INFO, "%s initialized!\n", JANUS_SKYWAYIOT_NAME);
-	return 0;
 }
 
-void janus_skywayiot_destroy(void) {
-	if(!g_atomic_int_get(&initialized))
-		return;
-	g_atomic_int_set(&stopping, 1);
 
-	g_async_queue_push(messages, &exit_message);
-	if(handler_thread != NULL) {
-		g_thread_join(handler_thread);
-		handler_thread = NULL;
+/* Deferred logging for the media and data hot paths: call sites only push a
+ * compact record (static format plus up to four integer arguments) to a
+ * lock-free ring, and the logger thread does the formatting. Each call site is
+ * also rate limited, so an error condition can't turn into a logging storm */
+#define JANUS_SKYWAYIOT_HOTLOG_RING_SIZE	1024	/* Must be a power of two */
+#define JANUS_SKYWAYIOT_HOTLOG_RATE_DEFAULT	10		/* Records per second per call site */
+
+typedef struct janus_skywayiot_log_site {
+	int level;
+	const char *format;		/* Takes up to four 64-bit unsigned arguments */
+	gint64 window_start;
+	volatile gint window_count;
+	volatile gint suppressed;
+} janus_skywayiot_log_site;
+
+typedef struct janus_skywayiot_log_record {
+	volatile gint sequence;
+	janus_skywayiot_log_site *site;
+	guint64 args[4];
+	gint suppressed;
+} janus_skywayiot_log_record;
+
+static janus_skywayiot_log_record hotlog_ring[JANUS_SKYWAYIOT_HOTLOG_RING_SIZE];
+static volatile gint hotlog_enqueue_pos = 0;
+static guint hotlog_dequeue_pos = 0;
+static volatile gint hotlog_dropped = 0, hotlog_suppressed = 0;
+static gint hotlog_rate = JANUS_SKYWAYIOT_HOTLOG_RATE_DEFAULT;
+static GThread *logger_thread;
+
+#define JANUS_SKYWAYIOT_HOT_LOG(lvl, fmt, ...) \
+	do { \
+		static janus_skywayiot_log_site hotlog_site = { .level = lvl, .format = fmt }; \
+		if(lvl <= janus_log_level) \
+			janus_skywayiot_hot_log(&hotlog_site, (guint64[4]){ __VA_ARGS__ }); \
+	} while(0)
+
+static void janus_skywayiot_hotlog_reset(void) {
+	guint i = 0;
+	for(i = 0; i < JANUS_SKYWAYIOT_HOTLOG_RING_SIZE; i++)
+		g_atomic_int_set(&hotlog_ring[i].sequence, i);
+	g_atomic_int_set(&hotlog_enqueue_pos, 0);
+	hotlog_dequeue_pos = 0;
+}
+
+static void janus_skywayiot_hot_log(janus_skywayiot_log_site *site, const guint64 *args) {
+	/* Per call site rate limiting: races on the window reset only make it approximate */
+	gint64 now = janus_get_monotonic_time();
+	if(now - site->window_start >= G_USEC_PER_SEC) {
+		site->window_start = now;
+		g_atomic_int_set(&site->window_count, 0);
 	}
-	if(watchdog != NULL) {
-		g_thread_join(watchdog);
-		watchdog = NULL;
+	if(g_atomic_int_add(&site->window_count, 1) >= hotlog_rate) {
+		g_atomic_int_inc(&site->suppressed);
+		g_atomic_int_inc(&hotlog_suppressed);
+		return;
 	}
+	/* Bounded multi-producer ring: claim a slot, or drop the record if we're full */
+	janus_skywayiot_log_record *record = NULL;
+	guint pos = (guint)g_atomic_int_get(&hotlog_enqueue_pos);
+	while(TRUE) {
+		record = &hotlog_ring[pos & (JANUS_SKYWAYIOT_HOTLOG_RING_SIZE-1)];
+		gint diff = (gint)((guint)g_atomic_int_get(&record->sequence) - pos);
+		if(diff == 0) {
+			if(g_atomic_int_compare_and_exchange(&hotlog_enqueue_pos, (gint)pos, (gint)(pos+1)))
+				break;
+		} else if(diff < 0) {
+			g_atomic_int_inc(&hotlog_dropped);
+			return;
+		}
+		pos = (guint)g_atomic_int_get(&hotlog_enqueue_pos);
+	}
+	record->site = site;
+	memcpy(record->args, args, sizeof(record->args));
+	record->suppressed = 0;
+	/* Piggyback how many records this site lost since the last one that got through */
+	gint suppressed = g_atomic_int_get(&site->suppressed);
+	if(suppressed > 0 && g_atomic_int_compare_and_exchange(&site->suppressed, suppressed, 0))
+		record->suppressed = suppressed;
+	g_atomic_int_set(&record->sequence, (gint)(pos+1));
+}
 
-	/* FIXME We should destroy the sessions cleanly */
-	janus_mutex_lock(&sessions_mutex);
-	g_hash_table_destroy(sessions);
-	janus_mutex_unlock(&sessions_mutex);
-	g_async_queue_unref(messages);
-	messages = NULL;
-	sessions = NULL;
+static gboolean janus_skywayiot_hotlog_flush(void) {
+	gboolean flushed = FALSE;
+	char line[512];
+	while(TRUE) {
+		janus_skywayiot_log_record *record = &hotlog_ring[hotlog_dequeue_pos & (JANUS_SKYWAYIOT_HOTLOG_RING_SIZE-1)];
+		if((guint)g_atomic_int_get(&record->sequence) != hotlog_dequeue_pos+1)
+			break;
+		janus_skywayiot_log_site *site = record->site;
+		/* Formats are literals at the call sites, they're just stored in the record */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-nonliteral"
+		g_snprintf(line, sizeof(line), site->format, record->args[0], record->args[1], record->args[2], record->args[3]);
+#pragma GCC diagnostic pop
+		if(record->suppressed > 0) {
+			JANUS_LOG(site->level, "%s (%d similar messages suppressed)\n", line, record->suppressed);
+		} else {
+			JANUS_LOG(site->level, "%s\n", line);
+		}
+		g_atomic_int_set(&record->sequence, (gint)(hotlog_dequeue_pos + JANUS_SKYWAYIOT_HOTLOG_RING_SIZE));
+		hotlog_dequeue_pos++;
+		flushed = TRUE;
+	}
+	return flushed;
+}
 
-	g_atomic_int_set(&initialized, 0);
-	g_atomic_int_set(&stopping, 0);
-	JANUS_LOG(LOG_INFO, "%s destroyed!\n", JANUS_SKYWAYIOT_NAME);
+/* Thread formatting the records pushed by the hot paths */
+static void *janus_skywayiot_logger(void *data) {
+	JANUS_LOG(LOG_VERB, "Joining SkywayIoT logger thread\n");
+	janus_skywayiot_thread_policy_apply(JANUS_SKYWAYIOT_THREAD_LOGGER, -1);
+	gint64 last_report = janus_get_monotonic_time();
+	while(g_atomic_int_get(&initialized) && !g_atomic_int_get(&stopping)) {
+		if(!janus_skywayiot_hotlog_flush())
+			g_usleep(10000);
+		gint64 now = janus_get_monotonic_time();
+		if(now - last_report >= 10*G_USEC_PER_SEC) {
+			last_report = now;
+			gint suppressed = g_atomic_int_get(&hotlog_suppressed);
+			gint dropped = g_atomic_int_get(&hotlog_dropped);
+			g_atomic_int_add(&hotlog_suppressed, -suppressed);
+			g_atomic_int_add(&hotlog_dropped, -dropped);
+			if(suppressed > 0 || dropped > 0)
+				JANUS_LOG(LOG_WARN, "Hot path logging: %d records suppressed by rate limiting, %d dropped (queue full)\n", suppressed, dropped);
+		}
+	}
+	janus_skywayiot_hotlog_flush();
+	JANUS_LOG(LOG_VERB, "Leaving SkywayIoT logger thread\n");
+	return NULL;
 }
 
-int janus_skywayiot_get_api_compatibility(void) {
-	/* Important! This is what your plugin MUST always return: don't lie here or bad things will happen */
-	return JANUS_PLUGIN_API_VERSION;
+
+/* Per entry point counters, so that throughput regressions in the hot paths
+ * can be spotted on a running gateway (see the "stats" request). Timing every
+ * call costs two clock reads, so that part is only done if stats_timing is set */
+typedef enum janus_skywayiot_entry {
+	JANUS_SKYWAYIOT_ENTRY_CREATE_SESSION = 0,
+	JANUS_SKYWAYIOT_ENTRY_HANDLE_MESSAGE,
+	JANUS_SKYWAYIOT_ENTRY_SETUP_MEDIA,
+	JANUS_SKYWAYIOT_ENTRY_INCOMING_RTP,
+	JANUS_SKYWAYIOT_ENTRY_INCOMING_RTCP,
+	JANUS_SKYWAYIOT_ENTRY_INCOMING_DATA,
+	JANUS_SKYWAYIOT_ENTRY_EXT_RECEIVE,
+	JANUS_SKYWAYIOT_ENTRY_RELAY_DATA,
+	JANUS_SKYWAYIOT_ENTRY_MAX
+} janus_skywayiot_entry;
+
+#define JANUS_SKYWAYIOT_LATENCY_BUCKETS	24
+
+typedef struct janus_skywayiot_entry_stats {
+	const char *name;
+	guint64 calls;		/* Calls that went through the whole path */
+	guint64 errors;		/* Calls rejected or failed on the way */
+	guint64 bytes;
+	guint64 usecs;		/* Time spent in the timed calls */
+	guint64 timed;
+	guint64 latency[JANUS_SKYWAYIOT_LATENCY_BUCKETS];	/* Timed calls by power of two of usecs */
+} janus_skywayiot_entry_stats;
+
+static janus_skywayiot_entry_stats entry_stats[JANUS_SKYWAYIOT_ENTRY_MAX] = {
+	{ .name = "create_session" },
+	{ .name = "handle_message" },
+	{ .name = "setup_media" },
+	{ .name = "incoming_rtp" },
+	{ .name = "incoming_rtcp" },
+	{ .name = "incoming_data" },
+	{ .name = "ext_receive" },
+	{ .name = "relay_data" },
+};
+static gboolean stats_timing = FALSE;
+
+/* What happened to the RTP packets we were asked to forward */
+static struct {
+	guint64 audio_packets;
+	guint64 video_packets;
+	guint64 inactive;		/* Not forwarded because of the audio/video active flags */
+	guint64 would_block;	/* Dropped because the socket buffer (or io_uring ring) was full */
+	guint64 send_errors;
+	guint64 submits;		/* io_uring_submit calls, when using io_uring */
+	guint64 idle_flushes;	/* Submits done by the flusher because traffic paused mid-batch */
+} media_stats;
+static gboolean media_uring = FALSE;	/* Whether RTP is forwarded via io_uring */
+
+/* How frames coming from the backend were fanned out */
+static struct {
+	guint64 unicast;
+	guint64 broadcast;
+	guint64 group;
+	guint64 published;
+	guint64 retained_sent;	/* Last values sent to new subscribers */
+	guint64 conflated;		/* Replaced by a newer message with the same key before delivery */
+	guint64 outbox_dropped;
+	guint64 throttled;		/* Absorbed by a subscription rate limit */
+	guint64 expired_received;	/* Already expired when the frame was read */
+	guint64 expired_fanout;		/* Expired while being relayed to many sessions */
+	guint64 expired_queued;		/* Expired in an outbox, a rate limit window, a spool or as a retained value */
+	guint64 spooled;		/* Device messages written to a spool */
+	guint64 unspooled;		/* Device messages delivered from a spool */
+	guint64 spool_dropped;	/* Oldest spooled messages dropped to make room */
+	guint64 chunked;		/* Messages split in chunks for the data channel */
+	guint64 chunks;
+	guint64 reassembled;	/* Chunked uploads put back together */
+	guint64 reassembly_errors;	/* Chunks out of order, or messages too large */
+	guint64 bulk_chunks;	/* Bulk chunks sent to clients */
+	guint64 bulk_acks;		/* Acks from clients, relayed as credit */
+	guint64 bulk_overflow;	/* Bulk chunks dropped for lack of credit */
+	guint64 compressed;		/* Messages compressed for the data channel */
+	guint64 compressed_in;	/* ... their size before */
+	guint64 compressed_out;	/* ... and after */
+	guint64 compress_stored;	/* Messages compression didn't make smaller, sent as they were */
+	guint64 decompressed;	/* Compressed uploads */
+	guint64 decompress_errors;
+	guint64 delta_full;		/* Keyed messages sent in full to delta sessions */
+	guint64 delta_deltas;	/* ... and as deltas */
+	guint64 delta_saved;	/* Bytes deltas saved */
+	guint64 delta_decoded;	/* Delta uploads */
+	guint64 delta_errors;
+	guint64 wildcard_cache_hits;	/* Publishes whose filter matches were cached */
+	guint64 wildcard_cache_misses;
+	guint64 route_fallback;	/* Routed messages no backend with that name was there for */
+	guint64 unknown_target;
+} relay_stats;
+
+#define JANUS_SKYWAYIOT_STATS_ADD(counter, value) __atomic_fetch_add(&(counter), (guint64)(value), __ATOMIC_RELAXED)
+#define JANUS_SKYWAYIOT_STATS_START() (stats_timing ? janus_get_monotonic_time() : 0)
+
+static void janus_skywayiot_stats_done(janus_skywayiot_entry entry, gint64 start, int bytes) {
+	janus_skywayiot_entry_stats *stats = &entry_stats[entry];
+	JANUS_SKYWAYIOT_STATS_ADD(stats->calls, 1);
+	if(bytes > 0)
+		JANUS_SKYWAYIOT_STATS_ADD(stats->bytes, bytes);
+	if(start > 0) {
+		guint64 elapsed = janus_get_monotonic_time()-start;
+		int bucket = 0;
+		while(bucket < JANUS_SKYWAYIOT_LATENCY_BUCKETS-1 && elapsed >= (1ULL << bucket))
+			bucket++;
+		JANUS_SKYWAYIOT_STATS_ADD(stats->usecs, elapsed);
+		JANUS_SKYWAYIOT_STATS_ADD(stats->timed, 1);
+		JANUS_SKYWAYIOT_STATS_ADD(stats->latency[bucket], 1);
+	}
 }
 
-int janus_skywayiot_get_version(void) {
-	return JANUS_SKYWAYIOT_VERSION;
+/* Upper bound (in usecs) of the bucket the given percentile of timed calls falls in */
+static guint64 janus_skywayiot_stats_percentile(janus_skywayiot_entry_stats *stats, guint64 timed, int percentile) {
+	guint64 wanted = (timed * percentile + 99) / 100, seen = 0;
+	int bucket = 0;
+	for(bucket = 0; bucket < JANUS_SKYWAYIOT_LATENCY_BUCKETS; bucket++) {
+		seen += __atomic_load_n(&stats->latency[bucket], __ATOMIC_RELAXED);
+		if(seen >= wanted)
+			break;
+	}
+	return 1ULL << MIN(bucket, JANUS_SKYWAYIOT_LATENCY_BUCKETS-1);
 }
 
-const char *janus_skywayiot_get_version_string(void) {
-	return JANUS_SKYWAYIOT_VERSION_STRING;
+static void janus_skywayiot_stats_error(janus_skywayiot_entry entry) {
+	JANUS_SKYWAYIOT_STATS_ADD(entry_stats[entry].errors, 1);
 }
 
-const char *janus_skywayiot_get_description(void) {
-	return JANUS_SKYWAYIOT_DESCRIPTION;
+static json_t *janus_skywayiot_stats_json(gboolean reset) {
+	json_t *entries = json_object();
+	int i = 0;
+	for(i = 0; i < JANUS_SKYWAYIOT_ENTRY_MAX; i++) {
+		janus_skywayiot_entry_stats *stats = &entry_stats[i];
+		guint64 calls = __atomic_load_n(&stats->calls, __ATOMIC_RELAXED);
+		guint64 usecs = __atomic_load_n(&stats->usecs, __ATOMIC_RELAXED);
+		guint64 timed = __atomic_load_n(&stats->timed, __ATOMIC_RELAXED);
+		json_t *entry = json_object();
+		json_object_set_new(entry, "calls", json_integer(calls));
+		json_object_set_new(entry, "errors", json_integer(__atomic_load_n(&stats->errors, __ATOMIC_RELAXED)));
+		json_object_set_new(entry, "bytes", json_integer(__atomic_load_n(&stats->bytes, __ATOMIC_RELAXED)));
+		if(timed > 0) {
+			json_object_set_new(entry, "avg_usecs", json_real((double)usecs/(double)timed));
+			json_object_set_new(entry, "p50_usecs", json_integer(janus_skywayiot_stats_percentile(stats, timed, 50)));
+			json_object_set_new(entry, "p90_usecs", json_integer(janus_skywayiot_stats_percentile(stats, timed, 90)));
+			json_object_set_new(entry, "p99_usecs", json_integer(janus_skywayiot_stats_percentile(stats, timed, 99)));
+		}
+		json_object_set_new(entries, stats->name, entry);
+		if(reset) {
+			__atomic_store_n(&stats->calls, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&stats->errors, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&stats->bytes, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&stats->usecs, 0, __ATOMIC_RELAXED);
+			__atomic_store_n(&stats->timed, 0, __ATOMIC_RELAXED);
+			memset(stats->latency, 0, sizeof(stats->latency));
+		}
+	}
+	json_t *relay = json_object();
+	json_object_set_new(relay, "unicast", json_integer(__atomic_load_n(&relay_stats.unicast, __ATOMIC_RELAXED)));
+	json_object_set_new(relay, "broadcast", json_integer(__atomic_load_n(&relay_stats.broadcast, __ATOMIC_RELAXED)));
+	json_object_set_new(relay, "group", json_integer(__atomic_load_n(&relay_stats.group, __ATOMIC_RELAXED)));
+	json_object_set_new(relay, "published", json_integer(__atomic_load_n(&relay_stats.published, __ATOMIC_RELAXED)));
+	json_object_set_new(relay, "retained_sent", json_integer(__atomic_load_n(&relay_stats.retained_sent, __ATOMIC_RELAXED)));
+	json_object_set_new(relay, "conflated", json_integer(__atomic_load_n(&relay_stats.conflated, __ATOMIC_RELAXED)));
+	json_object_set_new(relay, "outbox_dropped", json_integer(__atomic_load_n(&relay_stats.outbox_dropped, __ATOMIC_RELAXED)));
+	json_object_set_new(relay, "throttled", json_integer(__atomic_load_n(&relay_stats.throttled, __ATOMIC_RELAXED)));
+	json_t *expired = json_object();
+	json_object_set_new(expired, "received", json_integer(__atomic_load_n(&relay_stats.expired_received, __ATOMIC_RELAXED)));
+	json_object_set_new(expired, "fanout", json_integer(__atomic_load_n(&relay_stats.expired_fanout, __ATOMIC_RELAXED)));
+	json_object_set_new(expired, "queued", json_integer(__atomic_load_n(&relay_stats.expired_queued, __ATOMIC_RELAXED)));
+	json_object_set_new(relay, "expired", expired);
+	json_t *spool = json_object();
+	json_object_set_new(spool, "spooled", json_integer(__atomic_load_n(&relay_stats.spooled, __ATOMIC_RELAXED)));
+	json_object_set_new(spool, "unspooled", json_integer(__atomic_load_n(&relay_stats.unspooled, __ATOMIC_RELAXED)));
+	json_object_set_new(spool, "dropped", json_integer(__atomic_load_n(&relay_stats.spool_dropped, __ATOMIC_RELAXED)));
+	janus_mutex_lock(&delivery_mutex);
+	json_object_set_new(spool, "open", json_integer(spools ? g_hash_table_size(spools) : 0));
+	janus_mutex_unlock(&delivery_mutex);
+	json_object_set_new(relay, "spool", spool);
+	json_t *chunking = json_object();
+	json_object_set_new(chunking, "chunked", json_integer(__atomic_load_n(&relay_stats.chunked, __ATOMIC_RELAXED)));
+	json_object_set_new(chunking, "chunks", json_integer(__atomic_load_n(&relay_stats.chunks, __ATOMIC_RELAXED)));
+	json_object_set_new(chunking, "reassembled", json_integer(__atomic_load_n(&relay_stats.reassembled, __ATOMIC_RELAXED)));
+	json_object_set_new(chunking, "reassembly_errors", json_integer(__atomic_load_n(&relay_stats.reassembly_errors, __ATOMIC_RELAXED)));
+	json_object_set_new(relay, "chunking", chunking);
+	json_t *bulk = json_object();
+	json_object_set_new(bulk, "chunks", json_integer(__atomic_load_n(&relay_stats.bulk_chunks, __ATOMIC_RELAXED)));
+	json_object_set_new(bulk, "acks", json_integer(__atomic_load_n(&relay_stats.bulk_acks, __ATOMIC_RELAXED)));
+	json_object_set_new(bulk, "overflow", json_integer(__atomic_load_n(&relay_stats.bulk_overflow, __ATOMIC_RELAXED)));
+	json_object_set_new(relay, "bulk", bulk);
+	json_t *compression = json_object();
+	json_object_set_new(compression, "compressed", json_integer(__atomic_load_n(&relay_stats.compressed, __ATOMIC_RELAXED)));
+	json_object_set_new(compression, "bytes_in", json_integer(__atomic_load_n(&relay_stats.compressed_in, __ATOMIC_RELAXED)));
+	json_object_set_new(compression, "bytes_out", json_integer(__atomic_load_n(&relay_stats.compressed_out, __ATOMIC_RELAXED)));
+	json_object_set_new(compression, "stored", json_integer(__atomic_load_n(&relay_stats.compress_stored, __ATOMIC_RELAXED)));
+	json_object_set_new(compression, "decompressed", json_integer(__atomic_load_n(&relay_stats.decompressed, __ATOMIC_RELAXED)));
+	json_object_set_new(compression, "errors", json_integer(__atomic_load_n(&relay_stats.decompress_errors, __ATOMIC_RELAXED)));
+	json_object_set_new(relay, "compression", compression);
+	json_t *delta = json_object();
+	json_object_set_new(delta, "full", json_integer(__atomic_load_n(&relay_stats.delta_full, __ATOMIC_RELAXED)));
+	json_object_set_new(delta, "deltas", json_integer(__atomic_load_n(&relay_stats.delta_deltas, __ATOMIC_RELAXED)));
+	json_object_set_new(delta, "bytes_saved", json_integer(__atomic_load_n(&relay_stats.delta_saved, __ATOMIC_RELAXED)));
+	json_object_set_new(delta, "decoded", json_integer(__atomic_load_n(&relay_stats.delta_decoded, __ATOMIC_RELAXED)));
+	json_object_set_new(delta, "errors", json_integer(__atomic_load_n(&relay_stats.delta_errors, __ATOMIC_RELAXED)));
+	json_object_set_new(relay, "delta", delta);
+	if(routes_count > 0) {
+		json_t *routing = json_object();
+		guint r = 0;
+		for(r = 0; r < routes_count; r++) {
+			json_object_set_new(routing, routes[r].name, json_integer(__atomic_load_n(&routes[r].matched, __ATOMIC_RELAXED)));
+			if(reset)
+				__atomic_store_n(&routes[r].matched, 0, __ATOMIC_RELAXED);
+		}
+		json_object_set_new(routing, "fallback", json_integer(__atomic_load_n(&relay_stats.route_fallback, __ATOMIC_RELAXED)));
+		json_object_set_new(relay, "routes", routing);
+	}
+	json_object_set_new(relay, "wildcard_cache_hits", json_integer(__atomic_load_n(&relay_stats.wildcard_cache_hits, __ATOMIC_RELAXED)));
+	json_object_set_new(relay, "wildcard_cache_misses", json_integer(__atomic_load_n(&relay_stats.wildcard_cache_misses, __ATOMIC_RELAXED)));
+	json_object_set_new(relay, "unknown_target", json_integer(__atomic_load_n(&relay_stats.unknown_target, __ATOMIC_RELAXED)));
+	json_t *media = json_object();
+	json_object_set_new(media, "audio_packets", json_integer(__atomic_load_n(&media_stats.audio_packets, __ATOMIC_RELAXED)));
+	json_object_set_new(media, "video_packets", json_integer(__atomic_load_n(&media_stats.video_packets, __ATOMIC_RELAXED)));
+	json_object_set_new(media, "inactive", json_integer(__atomic_load_n(&media_stats.inactive, __ATOMIC_RELAXED)));
+	json_object_set_new(media, "would_block", json_integer(__atomic_load_n(&media_stats.would_block, __ATOMIC_RELAXED)));
+	json_object_set_new(media, "send_errors", json_integer(__atomic_load_n(&media_stats.send_errors, __ATOMIC_RELAXED)));
+	json_object_set_new(media, "io", json_string(media_uring ? "io_uring" : "syscalls"));
+	if(media_uring) {
+		json_object_set_new(media, "submits", json_integer(__atomic_load_n(&media_stats.submits, __ATOMIC_RELAXED)));
+		json_object_set_new(media, "idle_flushes", json_integer(__atomic_load_n(&media_stats.idle_flushes, __ATOMIC_RELAXED)));
+	}
+	if(reset) {
+		memset(&relay_stats, 0, sizeof(relay_stats));
+		memset(&media_stats, 0, sizeof(media_stats));
+	}
+	json_t *lifecycle = json_object();
+	janus_mutex_lock(&sessions_mutex);
+	json_object_set_new(lifecycle, "live", json_integer(sessions ? g_hash_table_size(sessions) : 0));
+	json_object_set_new(lifecycle, "old", json_integer(old_sessions ? g_queue_get_length(old_sessions) : 0));
+	json_object_set_new(lifecycle, "groups", json_integer(groups ? g_hash_table_size(groups) : 0));
+	json_object_set_new(lifecycle, "topics", json_integer(topics ? g_hash_table_size(topics) : 0));
+	json_object_set_new(lifecycle, "devices", json_integer(devices ? g_hash_table_size(devices) : 0));
+	json_object_set_new(lifecycle, "retained", json_integer(g_queue_get_length(&retained_lru)));
+	json_object_set_new(lifecycle, "retained_bytes", json_integer(retained_bytes));
+	janus_mutex_unlock(&sessions_mutex);
+	json_object_set_new(lifecycle, "created", json_integer(__atomic_load_n(&session_stats.created, __ATOMIC_RELAXED)));
+	json_object_set_new(lifecycle, "destroyed", json_integer(__atomic_load_n(&session_stats.destroyed, __ATOMIC_RELAXED)));
+	json_object_set_new(lifecycle, "freed", json_integer(__atomic_load_n(&session_stats.freed, __ATOMIC_RELAXED)));
+	/* Resident memory of the whole gateway, to see whether it plateaus under churn */
+	FILE *statm = fopen("/proc/self/statm", "r");
+	if(statm != NULL) {
+		unsigned long size = 0, resident = 0;
+		if(fscanf(statm, "%lu %lu", &size, &resident) == 2)
+			json_object_set_new(lifecycle, "process_rss_kb", json_integer(resident * (sysconf(_SC_PAGESIZE) / 1024)));
+		fclose(statm);
+	}
+	json_t *info = json_object();
+	json_object_set_new(info, "timing", stats_timing ? json_true() : json_false());
+	json_object_set_new(info, "sessions", lifecycle);
+	json_object_set_new(info, "entry_points", entries);
+	json_object_set_new(info, "relay", relay);
+	json_object_set_new(info, "media", media);
+	json_t *ext = json_array();
+	guint i_ext = 0;
+	janus_mutex_lock(&backends_mutex);
+	for(i_ext = 0; i_ext < ext_listeners_count; i_ext++) {
+		janus_skywayiot_ext_listener *listener = &ext_listeners[i_ext];
+		json_t *l = json_object();
+		json_object_set_new(l, "listener", json_integer(listener->index));
+		guint connected = 0;
+		GList *bl = NULL;
+		for(bl = backends; bl != NULL; bl = bl->next) {
+			if(((janus_skywayiot_backend *)bl->data)->listener == listener->index)
+				connected++;
+		}
+		json_object_set_new(l, "connected", connected > 0 ? json_true() : json_false());
+		json_object_set_new(l, "backends", json_integer(connected));
+		json_object_set_new(l, "max_backends", json_integer(listener->max_backends));
+		if(listener->cpu >= 0)
+			json_object_set_new(l, "cpu", json_integer(listener->cpu));
+		json_array_append_new(ext, l);
+	}
+	json_t *pool = json_array();
+	GList *bl = NULL;
+	for(bl = backends; bl != NULL; bl = bl->next) {
+		janus_skywayiot_backend *backend = (janus_skywayiot_backend *)bl->data;
+		json_t *b = json_object();
+		json_object_set_new(b, "id", json_integer(backend->id));
+		json_object_set_new(b, "listener", json_integer(backend->listener));
+		json_object_set_new(b, "standby", backend->standby ? json_true() : json_false());
+#ifdef HAVE_LIBSSL
+		if(backend->ssl != NULL)
+			json_object_set_new(b, "tls", json_string(backend->ktls_send && backend->ktls_recv ? "ktls" :
+				(backend->ktls_send || backend->ktls_recv ? "ktls_partial" : "userspace")));
+#endif
+		json_object_set_new(b, "frames_in", json_integer(__atomic_load_n(&backend->frames_in, __ATOMIC_RELAXED)));
+		json_object_set_new(b, "frames_out", json_integer(__atomic_load_n(&backend->frames_out, __ATOMIC_RELAXED)));
+		janus_mutex_lock(&backend->mutex);
+		if(backend->pending != NULL)
+			json_object_set_new(b, "unacked", json_integer(g_queue_get_length(backend->pending)));
+		janus_mutex_unlock(&backend->mutex);
+		json_array_append_new(pool, b);
+	}
+	json_t *failover = json_object();
+	json_object_set_new(failover, "on_standby", backend_ring_standby ? json_true() : json_false());
+	janus_mutex_unlock(&backends_mutex);
+	json_object_set_new(failover, "timeouts", json_integer(__atomic_load_n(&failover_stats.timeouts, __ATOMIC_RELAXED)));
+	json_object_set_new(failover, "replayed", json_integer(__atomic_load_n(&failover_stats.replayed, __ATOMIC_RELAXED)));
+	json_object_set_new(failover, "lost", json_integer(__atomic_load_n(&failover_stats.lost, __ATOMIC_RELAXED)));
+	json_object_set_new(failover, "overflow", json_integer(__atomic_load_n(&failover_stats.overflow, __ATOMIC_RELAXED)));
+	if(reset)
+		memset(&failover_stats, 0, sizeof(failover_stats));
+	json_object_set_new(info, "ext", ext);
+	json_object_set_new(info, "backends", pool);
+	json_object_set_new(info, "failover", failover);
+	return info;
 }
 
-const char *janus_skywayiot_get_name(void) {
-	return JANUS_SKYWAYIOT_NAME;
+
+static void janus_skywayiot_topic_free(janus_skywayiot_topic *topic) {
+	g_hash_table_destroy(topic->subscribers);
+	g_free(topic->retained);
+	g_free(topic->name);
+	g_free(topic);
 }
 
-const char *janus_skywayiot_get_author(void) {
-	return JANUS_SKYWAYIOT_AUTHOR;
+/* Forget a topic nobody cares about anymore: the caller holds sessions_mutex */
+static void janus_skywayiot_topic_release(janus_skywayiot_topic *topic) {
+	if(topic->retained == NULL && g_hash_table_size(topic->subscribers) == 0)
+		g_hash_table_remove(topics, topic->name);
 }
 
-const char *janus_skywayiot_get_package(void) {
-	return JANUS_SKYWAYIOT_PACKAGE;
+static void janus_skywayiot_topic_forget_retained(janus_skywayiot_topic *topic) {
+	if(topic->retained == NULL)
+		return;
+	g_queue_delete_link(&retained_lru, topic->lru_link);
+	topic->lru_link = NULL;
+	retained_bytes -= topic->retained_len + strlen(topic->name);
+	g_free(topic->retained);
+	topic->retained = NULL;
+	topic->retained_len = 0;
 }
 
-void janus_skywayiot_create_session(janus_plugin_session *handle, int *error) {
-	if(g_atomic_int_get(&stopping) || !g_atomic_int_get(&initialized)) {
-		*error = -1;
+/* Keep the last value of a topic, evicting the least recently used ones if
+ * we go over the limits: the caller holds sessions_mutex */
+static void janus_skywayiot_topic_retain(janus_skywayiot_topic *topic, gint64 expires, char *data, int len) {
+	janus_skywayiot_topic_forget_retained(topic);
+	if(len == 0 || len + strlen(topic->name) > retain_max_bytes || retain_max_topics == 0)
 		return;
+	topic->retained_expires = expires;
+	topic->retained = g_malloc(len);
+	memcpy(topic->retained, data, len);
+	topic->retained_len = len;
+	g_queue_push_tail(&retained_lru, topic);
+	topic->lru_link = g_queue_peek_tail_link(&retained_lru);
+	retained_bytes += len + strlen(topic->name);
+	while(retained_bytes > retain_max_bytes || g_queue_get_length(&retained_lru) > retain_max_topics) {
+		janus_skywayiot_topic *oldest = (janus_skywayiot_topic *)g_queue_peek_head(&retained_lru);
+		janus_skywayiot_topic_forget_retained(oldest);
+		janus_skywayiot_topic_release(oldest);
 	}
+}
+
+/* Mark a retained value as recently used */
+static void janus_skywayiot_topic_touch(janus_skywayiot_topic *topic) {
+	if(topic->lru_link == NULL)
+		return;
+	g_queue_unlink(&retained_lru, topic->lru_link);
+	g_queue_push_tail_link(&retained_lru, topic->lru_link);
+}
+
+static janus_skywayiot_topic *janus_skywayiot_topic_get(const char *name, gboolean create) {
+	janus_skywayiot_topic *topic = g_hash_table_lookup(topics, name);
+	if(topic == NULL && create) {
+		topic = g_malloc0(sizeof(janus_skywayiot_topic));
+		topic->name = g_strdup(name);
+		topic->subscribers = g_hash_table_new(NULL, NULL);
+		g_hash_table_insert(topics, topic->name, topic);
+	}
+	return topic;
+}
+
+/* Rate limits: the caller holds sessions_mutex (the throttles of a session
+ * are freed with their table, so this takes them off the delivery thread) */
+static void janus_skywayiot_throttle_free(gpointer data) {
+	janus_skywayiot_throttle *throttle = (janus_skywayiot_throttle *)data;
+	janus_mutex_lock(&delivery_mutex);
+	if(throttle->scheduled)
+		delivery_throttles = g_list_remove(delivery_throttles, throttle);
+	janus_mutex_unlock(&delivery_mutex);
+	g_free(throttle->latest);
+	g_free(throttle->latest_topic);
+	g_free(throttle->topic);
+	g_free(throttle);
+}
+
+static void janus_skywayiot_throttle_remove(janus_skywayiot_session *session, const char *name) {
+	g_hash_table_remove(session->throttles, name);
+}
+
+static void janus_skywayiot_throttle_set(janus_skywayiot_session *session, const char *name,
+		gint64 window, janus_skywayiot_aggregate aggregate) {
+	janus_skywayiot_throttle *throttle = g_hash_table_lookup(session->throttles, name);
+	if(window <= 0) {
+		janus_skywayiot_throttle_remove(session, name);
+		return;
+	}
+	if(throttle == NULL) {
+		throttle = g_malloc0(sizeof(janus_skywayiot_throttle));
+		throttle->session = session;
+		throttle->topic = g_strdup(name);
+		g_hash_table_insert(session->throttles, throttle->topic, throttle);
+	}
+	janus_mutex_lock(&delivery_mutex);
+	throttle->window = window;
+	throttle->aggregate = aggregate;
+	janus_mutex_unlock(&delivery_mutex);
+}
+
+/* Whether a subscription is a topic filter rather than a topic */
+static gboolean janus_skywayiot_is_filter(const char *name) {
+	return strchr(name, '+') != NULL || strchr(name, '#') != NULL;
+}
+
+/* Whether a topic filter is valid: + and # must be whole levels, and # the last one */
+static gboolean janus_skywayiot_filter_valid(const char *filter) {
+	const char *c = filter;
+	for(c = filter; *c != '\0'; c++) {
+		if(*c != '+' && *c != '#')
+			continue;
+		if(c > filter && *(c-1) != '/')
+			return FALSE;
+		if(*c == '+' && *(c+1) != '\0' && *(c+1) != '/')
+			return FALSE;
+		if(*c == '#' && *(c+1) != '\0')
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static janus_skywayiot_filter_node *janus_skywayiot_filter_node_new(janus_skywayiot_filter_node *parent, const char *level) {
+	janus_skywayiot_filter_node *node = g_malloc0(sizeof(janus_skywayiot_filter_node));
+	node->parent = parent;
+	node->level = g_strdup(level);
+	return node;
+}
+
+/* The trie node of a filter, created if needed */
+static janus_skywayiot_filter_node *janus_skywayiot_filter_node_get(const char *filter) {
+	if(filter_root == NULL)
+		filter_root = janus_skywayiot_filter_node_new(NULL, "");
+	janus_skywayiot_filter_node *node = filter_root;
+	gchar **levels = g_strsplit(filter, "/", -1);
+	int i = 0;
+	for(i = 0; levels[i] != NULL; i++) {
+		janus_skywayiot_filter_node **wild = !strcmp(levels[i], "+") ? &node->plus : (!strcmp(levels[i], "#") ? &node->hash : NULL);
+		if(wild != NULL) {
+			if(*wild == NULL)
+				*wild = janus_skywayiot_filter_node_new(node, levels[i]);
+			node = *wild;
+			continue;
+		}
+		if(node->children == NULL)
+			node->children = g_hash_table_new(g_str_hash, g_str_equal);
+		janus_skywayiot_filter_node *child = g_hash_table_lookup(node->children, levels[i]);
+		if(child == NULL) {
+			child = janus_skywayiot_filter_node_new(node, levels[i]);
+			g_hash_table_insert(node->children, child->level, child);
+		}
+		node = child;
+	}
+	g_strfreev(levels);
+	return node;
+}
+
+/* Free the nodes that don't lead to any filter anymore, from a leaf up */
+static void janus_skywayiot_filter_node_prune(janus_skywayiot_filter_node *node) {
+	while(node != NULL && node != filter_root && node->wildcard == NULL && node->plus == NULL && node->hash == NULL &&
+			(node->children == NULL || g_hash_table_size(node->children) == 0)) {
+		janus_skywayiot_filter_node *parent = node->parent;
+		if(parent->plus == node)
+			parent->plus = NULL;
+		else if(parent->hash == node)
+			parent->hash = NULL;
+		else
+			g_hash_table_remove(parent->children, node->level);
+		if(node->children != NULL)
+			g_hash_table_destroy(node->children);
+		g_free(node->level);
+		g_free(node);
+		node = parent;
+	}
+}
+
+static void janus_skywayiot_wildcard_cached_free(gpointer data) {
+	janus_skywayiot_wildcard_cached *cached = (janus_skywayiot_wildcard_cached *)data;
+	g_array_free(cached->matches, TRUE);
+	g_free(cached);
+}
+
+/* Collect the filters a topic (split in levels) matches */
+static void janus_skywayiot_filter_match(janus_skywayiot_filter_node *node, gchar **levels, int i, GPtrArray *found) {
+	if(node == NULL)
+		return;
+	/* # also matches its parent level, e.g. a/# matches a */
+	if(node->hash != NULL && node->hash->wildcard != NULL)
+		g_ptr_array_add(found, node->hash->wildcard);
+	if(levels[i] == NULL) {
+		if(node->wildcard != NULL)
+			g_ptr_array_add(found, node->wildcard);
+		return;
+	}
+	if(node->children != NULL)
+		janus_skywayiot_filter_match(g_hash_table_lookup(node->children, levels[i]), levels, i+1, found);
+	janus_skywayiot_filter_match(node->plus, levels, i+1, found);
+}
+
+/* The sessions that get a topic through a filter, each once: from the
+ * cache, if nothing changed since it was filled */
+static GArray *janus_skywayiot_wildcard_matches(const char *topic) {
+	if(wildcards_count == 0)
+		return NULL;
+	if(wildcard_cache == NULL)
+		wildcard_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, janus_skywayiot_wildcard_cached_free);
+	janus_skywayiot_wildcard_cached *cached = g_hash_table_lookup(wildcard_cache, topic);
+	if(cached != NULL && cached->generation == wildcard_generation) {
+		JANUS_SKYWAYIOT_STATS_ADD(relay_stats.wildcard_cache_hits, 1);
+		return cached->matches;
+	}
+	JANUS_SKYWAYIOT_STATS_ADD(relay_stats.wildcard_cache_misses, 1);
+	if(cached == NULL) {
+		if(g_hash_table_size(wildcard_cache) >= wildcard_cache_size)
+			g_hash_table_remove_all(wildcard_cache);
+		cached = g_malloc0(sizeof(janus_skywayiot_wildcard_cached));
+		cached->matches = g_array_new(FALSE, FALSE, sizeof(janus_skywayiot_wildcard_match));
+		g_hash_table_insert(wildcard_cache, g_strdup(topic), cached);
+	}
+	cached->generation = wildcard_generation;
+	g_array_set_size(cached->matches, 0);
+	GPtrArray *found = g_ptr_array_new();
+	gchar **levels = g_strsplit(topic, "/", -1);
+	janus_skywayiot_filter_match(filter_root, levels, 0, found);
+	g_strfreev(levels);
+	GHashTable *seen = found->len > 1 ? g_hash_table_new(NULL, NULL) : NULL;
+	guint i = 0;
+	for(i = 0; i < found->len; i++) {
+		janus_skywayiot_wildcard *wildcard = g_ptr_array_index(found, i);
+		GHashTableIter iter;
+		gpointer value;
+		g_hash_table_iter_init(&iter, wildcard->subscribers);
+		while(g_hash_table_iter_next(&iter, NULL, &value)) {
+			if(seen != NULL) {
+				if(g_hash_table_contains(seen, value))
+					continue;
+				g_hash_table_add(seen, value);
+			}
+			janus_skywayiot_wildcard_match match = { .session = value, .wildcard = wildcard };
+			g_array_append_val(cached->matches, match);
+		}
+	}
+	if(seen != NULL)
+		g_hash_table_destroy(seen);
+	g_ptr_array_free(found, TRUE);
+	return cached->matches;
+}
+
+/* Whether a topic matches a filter, level by level */
+static gboolean janus_skywayiot_filter_matches(const char *filter, const char *topic) {
+	const char *f = filter, *t = topic;
+	while(TRUE) {
+		if(f[0] == '#')
+			return TRUE;
+		const char *f_end = strchr(f, '/'), *t_end = strchr(t, '/');
+		gsize f_len = f_end ? (gsize)(f_end - f) : strlen(f), t_len = t_end ? (gsize)(t_end - t) : strlen(t);
+		if(!(f_len == 1 && f[0] == '+') && (f_len != t_len || memcmp(f, t, f_len)))
+			return FALSE;
+		if(f_end == NULL || t_end == NULL) {
+			/* a/# also matches a */
+			return t_end == NULL && (f_end == NULL || !strcmp(f_end + 1, "#"));
+		}
+		f = f_end + 1;
+		t = t_end + 1;
+	}
+}
+
+/* Send a session the last values of the topics a filter matches (or any of
+ * its filters, if wildcard is NULL), except those it subscribed to directly.
+ * The filters are matched against the retained topics right here: going
+ * through janus_skywayiot_wildcard_matches would fill the cache with every
+ * retained topic, pushing out the ones actually being published */
+static void janus_skywayiot_wildcard_sync(janus_skywayiot_session *session, janus_skywayiot_wildcard *wildcard) {
+	if(g_hash_table_size(session->wildcards) == 0 || g_queue_get_length(&retained_lru) == 0)
+		return;
+	GList *tl = NULL;
+	for(tl = retained_lru.head; tl != NULL; tl = tl->next) {
+		janus_skywayiot_topic *topic = (janus_skywayiot_topic *)tl->data;
+		if(g_hash_table_contains(topic->subscribers, session->handle))
+			continue;
+		gboolean matched = FALSE;
+		if(wildcard != NULL) {
+			matched = janus_skywayiot_filter_matches(wildcard->filter, topic->name);
+		} else {
+			GHashTableIter iter;
+			gpointer key;
+			g_hash_table_iter_init(&iter, session->wildcards);
+			while(!matched && g_hash_table_iter_next(&iter, &key, NULL))
+				matched = janus_skywayiot_filter_matches((const char *)key, topic->name);
+		}
+		if(matched && (topic->retained_expires == 0 || plugin_clock->now() <= topic->retained_expires)) {
+			janus_skywayiot_deliver(session, topic->retained_expires, topic->name, strlen(topic->name),
+				topic->retained, topic->retained_len);
+			JANUS_SKYWAYIOT_STATS_ADD(relay_stats.retained_sent, 1);
+		}
+	}
+}
+
+/* Free a whole subtree, filters included, when the plugin goes away */
+static void janus_skywayiot_filter_node_free(janus_skywayiot_filter_node *node) {
+	if(node == NULL)
+		return;
+	if(node->children != NULL) {
+		GHashTableIter iter;
+		gpointer value;
+		g_hash_table_iter_init(&iter, node->children);
+		while(g_hash_table_iter_next(&iter, NULL, &value))
+			janus_skywayiot_filter_node_free((janus_skywayiot_filter_node *)value);
+		g_hash_table_destroy(node->children);
+	}
+	janus_skywayiot_filter_node_free(node->plus);
+	janus_skywayiot_filter_node_free(node->hash);
+	if(node->wildcard != NULL) {
+		g_hash_table_destroy(node->wildcard->subscribers);
+		g_free(node->wildcard->filter);
+		g_free(node->wildcard);
+	}
+	g_free(node->level);
+	g_free(node);
+}
+
+static void janus_skywayiot_wildcard_subscribe(janus_skywayiot_session *session, const char *filter) {
+	if(g_hash_table_contains(session->wildcards, filter))
+		return;
+	janus_skywayiot_filter_node *node = janus_skywayiot_filter_node_get(filter);
+	if(node->wildcard == NULL) {
+		node->wildcard = g_malloc0(sizeof(janus_skywayiot_wildcard));
+		node->wildcard->filter = g_strdup(filter);
+		node->wildcard->subscribers = g_hash_table_new(NULL, NULL);
+		node->wildcard->node = node;
+		wildcards_count++;
+	}
+	g_hash_table_insert(node->wildcard->subscribers, session->handle, session);
+	g_hash_table_insert(session->wildcards, node->wildcard->filter, node->wildcard);
+	wildcard_generation++;
+	/* Same as topics, new subscribers get the last values right away */
+	if(g_atomic_int_get(&session->data_open))
+		janus_skywayiot_wildcard_sync(session, node->wildcard);
+}
+
+static void janus_skywayiot_wildcard_leave(janus_skywayiot_session *session, janus_skywayiot_wildcard *wildcard) {
+	g_hash_table_remove(wildcard->subscribers, session->handle);
+	wildcard_generation++;
+	if(g_hash_table_size(wildcard->subscribers) > 0)
+		return;
+	janus_skywayiot_filter_node *node = wildcard->node;
+	node->wildcard = NULL;
+	g_hash_table_destroy(wildcard->subscribers);
+	g_free(wildcard->filter);
+	g_free(wildcard);
+	wildcards_count--;
+	janus_skywayiot_filter_node_prune(node);
+}
+
+/* Subscriptions: the caller holds sessions_mutex */
+static janus_skywayiot_topic *janus_skywayiot_subscribe(janus_skywayiot_session *session, const char *name) {
+	if(janus_skywayiot_is_filter(name)) {
+		janus_skywayiot_wildcard_subscribe(session, name);
+		return NULL;
+	}
+	if(g_hash_table_contains(session->subscriptions, name))
+		return NULL;
+	janus_skywayiot_topic *topic = janus_skywayiot_topic_get(name, TRUE);
+	g_hash_table_insert(topic->subscribers, session->handle, session);
+	g_hash_table_insert(session->subscriptions, topic->name, topic);
+	return topic;
+}
+
+static void janus_skywayiot_unsubscribe(janus_skywayiot_session *session, const char *name) {
+	janus_skywayiot_wildcard *wildcard = g_hash_table_lookup(session->wildcards, name);
+	if(wildcard != NULL) {
+		g_hash_table_remove(session->wildcards, name);
+		janus_skywayiot_throttle_remove(session, name);
+		janus_skywayiot_wildcard_leave(session, wildcard);
+		return;
+	}
+	janus_skywayiot_topic *topic = g_hash_table_lookup(session->subscriptions, name);
+	if(topic == NULL)
+		return;
+	g_hash_table_remove(session->subscriptions, name);
+	g_hash_table_remove(topic->subscribers, session->handle);
+	janus_skywayiot_throttle_remove(session, name);
+	janus_skywayiot_topic_release(topic);
+}
+
+static void janus_skywayiot_unsubscribe_all(janus_skywayiot_session *session) {
+	GHashTableIter iter;
+	gpointer value;
+	g_hash_table_iter_init(&iter, session->subscriptions);
+	while(g_hash_table_iter_next(&iter, NULL, &value)) {
+		janus_skywayiot_topic *topic = (janus_skywayiot_topic *)value;
+		g_hash_table_iter_remove(&iter);
+		g_hash_table_remove(topic->subscribers, session->handle);
+		janus_skywayiot_throttle_remove(session, topic->name);
+		janus_skywayiot_topic_release(topic);
+	}
+	g_hash_table_iter_init(&iter, session->wildcards);
+	while(g_hash_table_iter_next(&iter, NULL, &value)) {
+		janus_skywayiot_wildcard *wildcard = (janus_skywayiot_wildcard *)value;
+		g_hash_table_iter_remove(&iter);
+		janus_skywayiot_throttle_remove(session, wildcard->filter);
+		janus_skywayiot_wildcard_leave(session, wildcard);
+	}
+}
+
+/* Send a session the last values of one of its topics, or of all of them
+ * if topic is NULL: the caller holds sessions_mutex */
+static void janus_skywayiot_topics_sync(janus_skywayiot_session *session, janus_skywayiot_topic *topic) {
+	GHashTableIter iter;
+	gpointer value = topic;
+	if(topic == NULL)
+		g_hash_table_iter_init(&iter, session->subscriptions);
+	while(topic != NULL || g_hash_table_iter_next(&iter, NULL, &value)) {
+		janus_skywayiot_topic *t = (janus_skywayiot_topic *)value;
+		if(t->retained != NULL && t->retained_expires > 0 && plugin_clock->now() > t->retained_expires) {
+			/* Too old to be the current state anymore */
+			janus_skywayiot_topic_forget_retained(t);
+			JANUS_SKYWAYIOT_STATS_ADD(relay_stats.expired_queued, 1);
+		}
+		if(t->retained != NULL) {
+			janus_skywayiot_deliver(session, t->retained_expires, t->name, strlen(t->name), t->retained, t->retained_len);
+			janus_skywayiot_topic_touch(t);
+			JANUS_SKYWAYIOT_STATS_ADD(relay_stats.retained_sent, 1);
+		}
+		if(topic != NULL)
+			break;
+	}
+}
+
+/* Parse an entry of a "subscribe" array: either a topic name, or an object
+ * with the topic and its optional rate limit. Returns the topic name, or NULL
+ * (and why in error) if the entry is invalid */
+static const char *janus_skywayiot_parse_subscription(json_t *entry, gint64 *window,
+		janus_skywayiot_aggregate *aggregate, const char **error) {
+	*window = 0;
+	*aggregate = JANUS_SKYWAYIOT_AGGREGATE_LATEST;
+	json_t *topic = json_is_object(entry) ? json_object_get(entry, "topic") : entry;
+	if(!json_is_string(topic)) {
+		*error = "subscribe should be an array of topics, or objects with a topic";
+		return NULL;
+	}
+	if(!janus_skywayiot_filter_valid(json_string_value(topic))) {
+		*error = "+ and # in topic filters should be whole levels, and # the last one";
+		return NULL;
+	}
+	if(json_is_string(entry))
+		return json_string_value(entry);
+	json_t *max_rate = json_object_get(entry, "max_rate");
+	json_t *window_ms = json_object_get(entry, "window");
+	json_t *agg = json_object_get(entry, "aggregate");
+	if(max_rate) {
+		if(!json_is_number(max_rate) || json_number_value(max_rate) <= 0) {
+			*error = "max_rate should be a positive number";
+			return NULL;
+		}
+		*window = (gint64)(G_USEC_PER_SEC / json_number_value(max_rate));
+	}
+	if(window_ms) {
+		if(!json_is_integer(window_ms) || json_integer_value(window_ms) < 0) {
+			*error = "window should be a positive integer";
+			return NULL;
+		}
+		*window = json_integer_value(window_ms) * 1000;
+	}
+	if(agg) {
+		int i = 0;
+		for(i = 0; i < JANUS_SKYWAYIOT_AGGREGATE_MAX_TYPES; i++) {
+			if(json_is_string(agg) && !strcasecmp(json_string_value(agg), aggregate_names[i]))
+				break;
+		}
+		if(i == JANUS_SKYWAYIOT_AGGREGATE_MAX_TYPES) {
+			*error = "aggregate should be latest, min, max or avg";
+			return NULL;
+		}
+		*aggregate = i;
+	}
+	return json_string_value(topic);
+}
+
+static gboolean janus_skywayiot_is_string_array(json_t *array) {
+	if(!json_is_array(array))
+		return FALSE;
+	size_t index = 0;
+	json_t *value = NULL;
+	json_array_foreach(array, index, value) {
+		if(!json_is_string(value))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+
+/* (Re)start the compression streams of a session with a codec (none just
+ * frees them): the caller holds the compressor mutex, or is its last user */
+static void janus_skywayiot_compressor_reset(janus_skywayiot_compressor *c, janus_skywayiot_codec codec) {
+#ifdef HAVE_ZLIB
+	if(c->zlib_ready) {
+		deflateEnd(&c->deflate);
+		inflateEnd(&c->inflate);
+		c->zlib_ready = FALSE;
+	}
+#endif
+#ifdef HAVE_LIBLZ4
+	if(c->lz4 != NULL) {
+		LZ4_freeStream(c->lz4);
+		c->lz4 = NULL;
+	}
+	g_free(c->lz4_dict);
+	c->lz4_dict = NULL;
+	g_free(c->lz4_history);
+	c->lz4_history = NULL;
+	c->lz4_history_len = 0;
+#endif
+	c->codec = JANUS_SKYWAYIOT_CODEC_NONE;
+#ifdef HAVE_ZLIB
+	if(codec == JANUS_SKYWAYIOT_CODEC_DEFLATE) {
+		memset(&c->deflate, 0, sizeof(c->deflate));
+		memset(&c->inflate, 0, sizeof(c->inflate));
+		if(deflateInit2(&c->deflate, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -compression_window_bits,
+				compression_mem_level, Z_DEFAULT_STRATEGY) != Z_OK)
+			return;
+		if(inflateInit2(&c->inflate, -compression_window_bits) != Z_OK) {
+			deflateEnd(&c->deflate);
+			return;
+		}
+		if(compression_dictionary != NULL) {
+			deflateSetDictionary(&c->deflate, (const Bytef *)compression_dictionary, compression_dictionary_len);
+			inflateSetDictionary(&c->inflate, (const Bytef *)compression_dictionary, compression_dictionary_len);
+		}
+		c->zlib_ready = TRUE;
+		c->codec = codec;
+	}
+#endif
+#ifdef HAVE_LIBLZ4
+	if(codec == JANUS_SKYWAYIOT_CODEC_LZ4) {
+		c->lz4 = LZ4_createStream();
+		if(c->lz4 == NULL)
+			return;
+		c->lz4_dict = g_malloc(JANUS_SKYWAYIOT_LZ4_HISTORY);
+		c->lz4_history = g_malloc(JANUS_SKYWAYIOT_LZ4_HISTORY);
+		if(compression_dictionary != NULL) {
+			/* Only the last 64k of a dictionary are of any use to lz4 */
+			int len = MIN(compression_dictionary_len, JANUS_SKYWAYIOT_LZ4_HISTORY);
+			const char *dict = compression_dictionary + compression_dictionary_len - len;
+			memcpy(c->lz4_dict, dict, len);
+			LZ4_loadDict(c->lz4, c->lz4_dict, len);
+			memcpy(c->lz4_history, dict, len);
+			c->lz4_history_len = len;
+		}
+		c->codec = codec;
+	}
+#endif
+}
+
+/* Whether this plugin can do a codec */
+static gboolean janus_skywayiot_codec_supported(janus_skywayiot_codec codec) {
+	switch(codec) {
+		case JANUS_SKYWAYIOT_CODEC_NONE:
+			return TRUE;
+#ifdef HAVE_ZLIB
+		case JANUS_SKYWAYIOT_CODEC_DEFLATE:
+			return TRUE;
+#endif
+#ifdef HAVE_LIBLZ4
+		case JANUS_SKYWAYIOT_CODEC_LZ4:
+			return TRUE;
+#endif
+		default:
+			return FALSE;
+	}
+}
+
+static void janus_skywayiot_compression_configure(janus_skywayiot_session *session, janus_skywayiot_codec codec) {
+	janus_skywayiot_compressor *c = session->compressor;
+	if(c == NULL) {
+		if(codec == JANUS_SKYWAYIOT_CODEC_NONE)
+			return;
+		c = g_malloc0(sizeof(janus_skywayiot_compressor));
+		janus_mutex_init(&c->mutex);
+		__atomic_store_n(&session->compressor, c, __ATOMIC_RELEASE);
+	}
+	janus_mutex_lock(&c->mutex);
+	janus_skywayiot_compressor_reset(c, codec);
+	janus_mutex_unlock(&c->mutex);
+	JANUS_LOG(LOG_VERB, "Setting compression property: %s\n", codec_names[c->codec]);
+}
+
+/* Compress a message with the outbound stream of a session: the caller holds
+ * the compressor mutex. Returns a buffer to free, or NULL on errors */
+static char *janus_skywayiot_compress(janus_skywayiot_compressor *c, char *data, int len, int *out_len) {
+#ifdef HAVE_ZLIB
+	if(c->codec == JANUS_SKYWAYIOT_CODEC_DEFLATE) {
+		uLong bound = deflateBound(&c->deflate, len) + 16;
+		char *out = g_malloc(bound);
+		c->deflate.next_in = (Bytef *)data;
+		c->deflate.avail_in = len;
+		c->deflate.next_out = (Bytef *)out;
+		c->deflate.avail_out = bound;
+		if(deflate(&c->deflate, Z_SYNC_FLUSH) != Z_OK || c->deflate.avail_in > 0 || c->deflate.avail_out == 0) {
+			g_free(out);
+			return NULL;
+		}
+		/* Strip the 00 00 ff ff the flush ends with, the receiver puts it back */
+		*out_len = bound - c->deflate.avail_out - 4;
+		return out;
+	}
+#endif
+#ifdef HAVE_LIBLZ4
+	if(c->codec == JANUS_SKYWAYIOT_CODEC_LZ4) {
+		int bound = LZ4_compressBound(len);
+		char *out = g_malloc(sizeof(guint32) + bound);
+		guint32 size = htonl(len);
+		memcpy(out, &size, sizeof(size));
+		int n = LZ4_compress_fast_continue(c->lz4, data, out + sizeof(guint32), len, bound, 1);
+		if(n <= 0) {
+			g_free(out);
+			return NULL;
+		}
+		/* The stream refers to the data it compressed: keep what it needs */
+		LZ4_saveDict(c->lz4, c->lz4_dict, JANUS_SKYWAYIOT_LZ4_HISTORY);
+		*out_len = sizeof(guint32) + n;
+		return out;
+	}
+#endif
+	return NULL;
+}
+
+/* Decompress an upload with the inbound stream of a session (or, if stored,
+ * just add it to the stream history): returns a buffer to free, or NULL if
+ * it's invalid (or too large), in which case compression is turned off */
+static char *janus_skywayiot_decompress(janus_skywayiot_session *session, gboolean stored, char *data, int len, int *out_len) {
+	janus_skywayiot_compressor *c = session->compressor;
+	if(c == NULL)
+		return NULL;
+	char *out = NULL, *blocks = NULL;
+	janus_mutex_lock(&c->mutex);
+	janus_skywayiot_codec codec = c->codec;
+#ifdef HAVE_ZLIB
+	if(c->codec == JANUS_SKYWAYIOT_CODEC_DEFLATE && stored) {
+		/* As non-final stored blocks (the stream is byte aligned after a
+		 * flush), each a header (00, length and its complement, 16 bit
+		 * little endian) followed by up to 64k of the message: these leave
+		 * the stream aligned, so there's no flush marker to put back */
+		int count = MAX(1, (len + 65534) / 65535), i = 0, size = 0;
+		blocks = g_malloc(len + 5*count);
+		for(i = 0; i < count; i++) {
+			int n = MIN(65535, len - i*65535);
+			guint8 *header = (guint8 *)blocks + size;
+			header[0] = 0x00;
+			header[1] = n & 0xff;
+			header[2] = n >> 8;
+			header[3] = ~n & 0xff;
+			header[4] = (~n >> 8) & 0xff;
+			memcpy(blocks + size + 5, data + i*65535, n);
+			size += 5 + n;
+		}
+		data = blocks;
+		len = size;
+	}
+	if(c->codec == JANUS_SKYWAYIOT_CODEC_DEFLATE) {
+		static const Bytef tail[4] = { 0x00, 0x00, 0xff, 0xff };
+		gsize size = MAX(1024, (gsize)len * 4);
+		out = g_malloc(size);
+		*out_len = 0;
+		int i = 0, res = Z_OK;
+		for(i = 0; i < (stored ? 1 : 2) && out != NULL; i++) {
+			/* The message, and then the flush marker it was sent without */
+			c->inflate.next_in = i == 0 ? (Bytef *)data : (Bytef *)tail;
+			c->inflate.avail_in = i == 0 ? (uInt)len : (uInt)sizeof(tail);
+			/* Having consumed all the input doesn't mean all the output is
+			 * out: if the buffer got filled, there may be more pending */
+			gboolean full = FALSE;
+			while(c->inflate.avail_in > 0 || full) {
+				if((gsize)*out_len == size) {
+					if(size >= max_reassembly_size) {
+						g_free(out);
+						out = NULL;
+						break;
+					}
+					size = MIN(size * 2, max_reassembly_size);
+					out = g_realloc(out, size);
+				}
+				c->inflate.next_out = (Bytef *)out + *out_len;
+				c->inflate.avail_out = size - *out_len;
+				res = inflate(&c->inflate, Z_SYNC_FLUSH);
+				*out_len = size - c->inflate.avail_out;
+				if(res != Z_OK && res != Z_BUF_ERROR) {
+					g_free(out);
+					out = NULL;
+					break;
+				}
+				full = c->inflate.avail_out == 0;
+			}
+		}
+	}
+#endif
+#ifdef HAVE_LIBLZ4
+	if(c->codec == JANUS_SKYWAYIOT_CODEC_LZ4 && (stored || len > (int)sizeof(guint32))) {
+		guint32 size = 0;
+		int n = -1;
+		if(stored) {
+			out = g_malloc(len);
+			memcpy(out, data, len);
+			n = len;
+			size = len;
+		} else {
+			memcpy(&size, data, sizeof(size));
+			size = ntohl(size);
+			if(size > 0 && size <= max_reassembly_size) {
+				out = g_malloc(size);
+				n = LZ4_decompress_safe_usingDict(data + sizeof(guint32), out, len - sizeof(guint32), size,
+					c->lz4_history, c->lz4_history_len);
+			}
+		}
+		if(out != NULL && n != (int)size) {
+			g_free(out);
+			out = NULL;
+		} else if(out != NULL) {
+			/* What we just decompressed is the dictionary of the next message */
+			int keep = MIN(n, JANUS_SKYWAYIOT_LZ4_HISTORY), old = MIN(c->lz4_history_len, JANUS_SKYWAYIOT_LZ4_HISTORY - keep);
+			memmove(c->lz4_history, c->lz4_history + c->lz4_history_len - old, old);
+			memcpy(c->lz4_history + old, out + n - keep, keep);
+			c->lz4_history_len = old + keep;
+			*out_len = n;
+		}
+	}
+#endif
+	/* Whatever comes next from the client was compressed with a history we
+	 * don't have anymore: stop here, until it asks for compression again */
+	gboolean disabled = (out == NULL && codec != JANUS_SKYWAYIOT_CODEC_NONE);
+	if(disabled)
+		janus_skywayiot_compressor_reset(c, JANUS_SKYWAYIOT_CODEC_NONE);
+	janus_mutex_unlock(&c->mutex);
+	g_free(blocks);
+	if(out != NULL)
+		JANUS_SKYWAYIOT_STATS_ADD(relay_stats.decompressed, 1);
+	else
+		JANUS_SKYWAYIOT_STATS_ADD(relay_stats.decompress_errors, 1);
+	if(disabled) {
+		JANUS_SKYWAYIOT_HOT_LOG(LOG_WARN, "[%"SCNu64"] Compression turned off, an upload couldn't be decompressed", (guint64)session->handle);
+		json_t *event = json_object();
+		json_object_set_new(event, "skywayiot", json_string("event"));
+		json_t *result = json_object();
+		json_object_set_new(result, "status", json_string("compression_disabled"));
+		json_object_set_new(result, "compression", json_string(codec_names[codec]));
+		json_object_set_new(event, "result", result);
+		gateway->push_event(session->handle, &janus_skywayiot_plugin, NULL, event, NULL);
+		json_decref(event);
+	}
+	return out;
+}
+
+/* Send a message in the envelope, with some flags, in chunks if needed */
+static void janus_skywayiot_relay_envelope(janus_skywayiot_session *session, guint8 flags, char *data, int len) {
+	if(len + 1 <= max_message_size) {
+		char small[2048], *msg = len + 1 <= (int)sizeof(small) ? small : g_malloc(len + 1);
+		msg[0] = flags;
+		memcpy(msg + 1, data, len);
+		gateway->relay_data(session->handle, msg, len + 1);
+		if(msg != small)
+			g_free(msg);
+	} else {
+		int chunk = max_message_size - sizeof(janus_skywayiot_chunk_header);
+		int count = (len + chunk - 1) / chunk;
+		if(count > G_MAXUINT16) {
+			JANUS_SKYWAYIOT_HOT_LOG(LOG_WARN, "Message too large to be chunked (%"SCNu64" bytes)", len);
+			janus_skywayiot_stats_error(JANUS_SKYWAYIOT_ENTRY_RELAY_DATA);
+			return;
+		}
+		guint32 id = g_atomic_int_add(&session->chunk_id, 1);
+		char *msg = g_malloc(max_message_size);
+		janus_skywayiot_chunk_header *header = (janus_skywayiot_chunk_header *)msg;
+		header->flags = JANUS_SKYWAYIOT_ENVELOPE_CHUNK | flags;
+		header->id[0] = id >> 24; header->id[1] = id >> 16; header->id[2] = id >> 8; header->id[3] = id;
+		header->count[0] = count >> 8; header->count[1] = count;
+		int index = 0;
+		for(index = 0; index < count; index++) {
+			int offset = index * chunk, size = MIN(chunk, len - offset);
+			header->index[0] = index >> 8; header->index[1] = index;
+			memcpy(msg + sizeof(*header), data + offset, size);
+			gateway->relay_data(session->handle, msg, sizeof(*header) + size);
+		}
+		g_free(msg);
+		JANUS_SKYWAYIOT_STATS_ADD(relay_stats.chunked, 1);
+		JANUS_SKYWAYIOT_STATS_ADD(relay_stats.chunks, count);
+	}
+}
+
+/* Send a message on the data channel of a session, in the envelope (with
+ * some flags, compressed, and in chunks, if it's too large) if the session
+ * asked for it */
+static void janus_skywayiot_relay_message(janus_skywayiot_session *session, guint8 flags, char *data, int len) {
+	janus_skywayiot_compressor *c = __atomic_load_n(&session->compressor, __ATOMIC_ACQUIRE);
+	if(!session->envelope) {
+		gateway->relay_data(session->handle, data, len);
+	} else if(c != NULL && c->codec != JANUS_SKYWAYIOT_CODEC_NONE && len >= compression_min_size) {
+		janus_mutex_lock(&c->mutex);
+		int compressed_len = 0;
+		char *compressed = janus_skywayiot_compress(c, data, len, &compressed_len);
+		if(compressed != NULL && compressed_len >= len) {
+			/* Not worth it: the receiver still needs it in its history */
+			janus_skywayiot_relay_envelope(session, JANUS_SKYWAYIOT_ENVELOPE_STORED | flags, data, len);
+			c->raw_bytes += len;
+			c->compressed_bytes += len;
+			g_free(compressed);
+			JANUS_SKYWAYIOT_STATS_ADD(relay_stats.compress_stored, 1);
+		} else if(compressed != NULL) {
+			/* Sent before unlocking, so that the receiver gets them in the order of the stream */
+			janus_skywayiot_relay_envelope(session, JANUS_SKYWAYIOT_ENVELOPE_COMPRESSED | flags, compressed, compressed_len);
+			c->raw_bytes += len;
+			c->compressed_bytes += compressed_len;
+			g_free(compressed);
+			JANUS_SKYWAYIOT_STATS_ADD(relay_stats.compressed, 1);
+			JANUS_SKYWAYIOT_STATS_ADD(relay_stats.compressed_in, len);
+			JANUS_SKYWAYIOT_STATS_ADD(relay_stats.compressed_out, compressed_len);
+		} else {
+			janus_skywayiot_relay_envelope(session, flags, data, len);
+		}
+		janus_mutex_unlock(&c->mutex);
+	} else {
+		janus_skywayiot_relay_envelope(session, flags, data, len);
+	}
+	janus_skywayiot_stats_done(JANUS_SKYWAYIOT_ENTRY_RELAY_DATA, 0, len);
+}
+
+static void janus_skywayiot_relay_data(janus_skywayiot_session *session, char *data, int len) {
+	janus_skywayiot_relay_message(session, 0, data, len);
+}
+
+static void janus_skywayiot_delta_value_free(gpointer data) {
+	janus_skywayiot_delta_value *value = (janus_skywayiot_delta_value *)data;
+	if(value == NULL)
+		return;
+	g_free(value->data);
+	g_free(value);
+}
+
+static void janus_skywayiot_delta_configure(janus_skywayiot_session *session, gboolean enable) {
+	janus_skywayiot_delta *delta = session->delta;
+	if(delta == NULL) {
+		if(!enable)
+			return;
+		delta = g_malloc0(sizeof(janus_skywayiot_delta));
+		janus_mutex_init(&delta->mutex);
+		delta->sent = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, janus_skywayiot_delta_value_free);
+		delta->received = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, janus_skywayiot_delta_value_free);
+		__atomic_store_n(&session->delta, delta, __ATOMIC_RELEASE);
+	}
+	janus_mutex_lock(&delta->mutex);
+	/* Whatever the client had as bases is gone */
+	g_hash_table_remove_all(delta->sent);
+	g_hash_table_remove_all(delta->received);
+	delta->enabled = enable;
+	janus_mutex_unlock(&delta->mutex);
+	JANUS_LOG(LOG_VERB, "Setting delta property: %s\n", enable ? "true" : "false");
+}
+
+static int janus_skywayiot_varint_write(guint8 *buf, guint64 value) {
+	int n = 0;
+	while(value >= 0x80) {
+		buf[n++] = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+	buf[n++] = value;
+	return n;
+}
+
+static gboolean janus_skywayiot_varint_read(const guint8 *buf, int len, int *pos, guint64 *value) {
+	*value = 0;
+	int shift = 0;
+	while(*pos < len && shift < 64) {
+		guint8 b = buf[(*pos)++];
+		*value |= (guint64)(b & 0x7f) << shift;
+		if(!(b & 0x80))
+			return TRUE;
+		shift += 7;
+	}
+	return FALSE;
+}
+
+/* XOR byte of a message against its base (padded with zeroes) */
+#define JANUS_SKYWAYIOT_DELTA_BYTE(data, base, base_len, i) \
+	((guint8)(data)[i] ^ ((i) < (base_len) ? (guint8)(base)[i] : 0))
+
+/* Write the delta of a message against a base, in at most max bytes:
+ * returns its length, or -1 if it wouldn't fit */
+static int janus_skywayiot_delta_encode(const char *base, int base_len, const char *data, int len, guint8 *out, int max) {
+	guint8 varints[20];
+	int n = janus_skywayiot_varint_write(varints, len);
+	if(n > max)
+		return -1;
+	memcpy(out, varints, n);
+	int pos = 0;
+	while(pos < len) {
+		int start = pos;
+		while(pos < len && JANUS_SKYWAYIOT_DELTA_BYTE(data, base, base_len, pos) == 0)
+			pos++;
+		if(pos == len)
+			break;
+		int skip = pos - start;
+		start = pos;
+		while(pos < len) {
+			/* A run of changed bytes only ends for a few unchanged ones, or the end */
+			int zeroes = pos;
+			while(zeroes < len && zeroes - pos < 3 && JANUS_SKYWAYIOT_DELTA_BYTE(data, base, base_len, zeroes) == 0)
+				zeroes++;
+			if(zeroes == len || zeroes - pos >= 3)
+				break;
+			pos = zeroes + 1;
+		}
+		int count = janus_skywayiot_varint_write(varints, skip);
+		count += janus_skywayiot_varint_write(varints + count, pos - start);
+		if(n + count + (pos - start) > max)
+			return -1;
+		memcpy(out + n, varints, count);
+		n += count;
+		int i = 0;
+		for(i = start; i < pos; i++)
+			out[n++] = JANUS_SKYWAYIOT_DELTA_BYTE(data, base, base_len, i);
+	}
+	return n;
+}
+
+/* Keep a message as the base of a key, if we can: the caller holds the delta mutex */
+static void janus_skywayiot_delta_keep(GHashTable *table, const char *key, const char *data, int len, gboolean full) {
+	janus_skywayiot_delta_value *value = g_hash_table_lookup(table, key);
+	if(len > JANUS_SKYWAYIOT_DELTA_MAX_VALUE || (value == NULL && g_hash_table_size(table) >= delta_max_keys)) {
+		/* The other end has a new base we don't track: forget the old one */
+		if(value != NULL)
+			g_hash_table_remove(table, key);
+		return;
+	}
+	if(value == NULL) {
+		value = g_malloc0(sizeof(janus_skywayiot_delta_value));
+		g_hash_table_insert(table, g_strdup(key), value);
+	}
+	g_free(value->data);
+	value->data = g_malloc(len > 0 ? len : 1);
+	memcpy(value->data, data, len);
+	value->len = len;
+	value->count = full ? 0 : value->count + 1;
+}
+
+/* Send a keyed message to a delta session, as a delta if we can */
+static void janus_skywayiot_relay_delta(janus_skywayiot_session *session, janus_skywayiot_delta *delta, const char *key, char *data, int len) {
+	int key_len = strlen(key);
+	if(key_len > G_MAXUINT16) {
+		janus_skywayiot_relay_data(session, data, len);
+		return;
+	}
+	janus_mutex_lock(&delta->mutex);
+	if(!delta->enabled) {
+		janus_mutex_unlock(&delta->mutex);
+		janus_skywayiot_relay_data(session, data, len);
+		return;
+	}
+	int header_len = 2 + key_len + 1;
+	char small[2048], *msg = header_len + len <= (int)sizeof(small) ? small : g_malloc(header_len + len);
+	msg[0] = (key_len >> 8) & 0xff;
+	msg[1] = key_len & 0xff;
+	memcpy(msg + 2, key, key_len);
+	janus_skywayiot_delta_value *base = g_hash_table_lookup(delta->sent, key);
+	int n = -1;
+	if(base != NULL && base->count + 1 < delta_full_interval)
+		n = janus_skywayiot_delta_encode(base->data, base->len, data, len, (guint8 *)msg + header_len, len - 1);
+	if(n >= 0) {
+		msg[header_len - 1] = JANUS_SKYWAYIOT_DELTA_XOR;
+		delta->deltas++;
+		delta->saved += len - n;
+		JANUS_SKYWAYIOT_STATS_ADD(relay_stats.delta_deltas, 1);
+		JANUS_SKYWAYIOT_STATS_ADD(relay_stats.delta_saved, len - n);
+	} else {
+		msg[header_len - 1] = JANUS_SKYWAYIOT_DELTA_FULL;
+		memcpy(msg + header_len, data, len);
+		n = len;
+		delta->full++;
+		JANUS_SKYWAYIOT_STATS_ADD(relay_stats.delta_full, 1);
+	}
+	janus_skywayiot_delta_keep(delta->sent, key, data, len, msg[header_len - 1] == JANUS_SKYWAYIOT_DELTA_FULL);
+	/* Sent before unlocking, so that the client gets them in the order of their bases */
+	janus_skywayiot_relay_message(session, JANUS_SKYWAYIOT_ENVELOPE_DELTA, msg, header_len + n);
+	janus_mutex_unlock(&delta->mutex);
+	if(msg != small)
+		g_free(msg);
+}
+
+/* Decode a delta upload: returns the message to forward (to free), or NULL
+ * if it's invalid or refers to a base we don't have */
+static char *janus_skywayiot_delta_decode(janus_skywayiot_session *session, char *buf, int len, int *out_len) {
+	janus_skywayiot_delta *delta = session->delta;
+	if(delta == NULL || len < 3) {
+		JANUS_SKYWAYIOT_STATS_ADD(relay_stats.delta_errors, 1);
+		return NULL;
+	}
+	int key_len = ((guint8)buf[0] << 8) | (guint8)buf[1];
+	if(len < 2 + key_len + 1) {
+		JANUS_SKYWAYIOT_STATS_ADD(relay_stats.delta_errors, 1);
+		return NULL;
+	}
+	char *key = g_strndup(buf + 2, key_len);
+	guint8 mode = buf[2 + key_len];
+	const guint8 *body = (const guint8 *)buf + 2 + key_len + 1;
+	int body_len = len - (2 + key_len + 1);
+	char *out = NULL;
+	janus_mutex_lock(&delta->mutex);
+	janus_skywayiot_delta_value *base = g_hash_table_lookup(delta->received, key);
+	if(mode == JANUS_SKYWAYIOT_DELTA_FULL) {
+		out = g_malloc(body_len > 0 ? body_len : 1);
+		memcpy(out, body, body_len);
+		*out_len = body_len;
+	} else if(mode == JANUS_SKYWAYIOT_DELTA_XOR && base != NULL) {
+		int pos = 0;
+		guint64 size = 0, skip = 0, count = 0;
+		if(janus_skywayiot_varint_read(body, body_len, &pos, &size) && size <= max_reassembly_size) {
+			out = g_malloc0(size > 0 ? size : 1);
+			memcpy(out, base->data, MIN((guint64)base->len, size));
+			guint64 offset = 0;
+			while(out != NULL && pos < body_len) {
+				if(!janus_skywayiot_varint_read(body, body_len, &pos, &skip) ||
+						!janus_skywayiot_varint_read(body, body_len, &pos, &count) ||
+						count > (guint64)(body_len - pos) || skip > size - offset || count > size - offset - skip) {
+					g_free(out);
+					out = NULL;
+					break;
+				}
+				offset += skip;
+				guint64 i = 0;
+				for(i = 0; i < count; i++)
+					out[offset + i] ^= body[pos + i];
+				offset += count;
+				pos += count;
+			}
+			*out_len = size;
+		}
+	}
+	if(out != NULL)
+		janus_skywayiot_delta_keep(delta->received, key, out, *out_len, mode == JANUS_SKYWAYIOT_DELTA_FULL);
+	janus_mutex_unlock(&delta->mutex);
+	g_free(key);
+	if(out != NULL)
+		JANUS_SKYWAYIOT_STATS_ADD(relay_stats.delta_decoded, 1);
+	else
+		JANUS_SKYWAYIOT_STATS_ADD(relay_stats.delta_errors, 1);
+	return out;
+}
+
+static void janus_skywayiot_reassembly_reset(janus_skywayiot_reassembly *r) {
+	r->count = 0;
+	r->next = 0;
+	if(r->buffer != NULL && r->buffer->len > 65536) {
+		/* Don't keep a large buffer around for each session */
+		g_byte_array_free(r->buffer, TRUE);
+		r->buffer = NULL;
+	} else if(r->buffer != NULL) {
+		g_byte_array_set_size(r->buffer, 0);
+	}
+}
+
+/* Open the envelope of a message from a session that uses it: returns TRUE
+ * and what to forward to the backend, or FALSE if there's nothing to forward
+ * (yet, for chunks, or ever, for invalid messages). When done forwarding a
+ * reassembled message, call janus_skywayiot_reassembly_reset */
+static gboolean janus_skywayiot_unwrap(janus_skywayiot_session *session, char *buf, int len, char **payload, int *payload_len) {
+	guint8 flags = buf[0];
+	if(flags & ~(JANUS_SKYWAYIOT_ENVELOPE_CHUNK | JANUS_SKYWAYIOT_ENVELOPE_COMPRESSED |
+			JANUS_SKYWAYIOT_ENVELOPE_STORED | JANUS_SKYWAYIOT_ENVELOPE_DELTA))
+		return FALSE;
+	if(!(flags & JANUS_SKYWAYIOT_ENVELOPE_CHUNK)) {
+		if(len < 2)
+			return FALSE;
+		*payload = buf + 1;
+		*payload_len = len - 1;
+		return TRUE;
+	}
+	if(len <= (int)sizeof(janus_skywayiot_chunk_header))
+		return FALSE;
+	janus_skywayiot_chunk_header *header = (janus_skywayiot_chunk_header *)buf;
+	guint32 id = ((guint32)header->id[0] << 24) | ((guint32)header->id[1] << 16) | ((guint32)header->id[2] << 8) | header->id[3];
+	guint16 index = (header->index[0] << 8) | header->index[1];
+	guint16 count = (header->count[0] << 8) | header->count[1];
+	if(session->reassembly == NULL)
+		session->reassembly = g_malloc0(sizeof(janus_skywayiot_reassembly));
+	janus_skywayiot_reassembly *r = session->reassembly;
+	if(index == 0) {
+		if(r->count > 0)
+			JANUS_SKYWAYIOT_STATS_ADD(relay_stats.reassembly_errors, 1);
+		janus_skywayiot_reassembly_reset(r);
+		r->id = id;
+		r->count = count;
+	} else if(r->count == 0 || id != r->id || index != r->next || count != r->count) {
+		/* We missed something: whatever we have of this message is useless */
+		if(r->count > 0)
+			janus_skywayiot_reassembly_reset(r);
+		JANUS_SKYWAYIOT_STATS_ADD(relay_stats.reassembly_errors, 1);
+		return FALSE;
+	}
+	if(count == 0)
+		return FALSE;
+	if(r->buffer == NULL)
+		r->buffer = g_byte_array_new();
+	if(r->buffer->len + len - sizeof(*header) > max_reassembly_size) {
+		JANUS_SKYWAYIOT_HOT_LOG(LOG_WARN, "Chunked message larger than %"SCNu64" bytes, dropping it", max_reassembly_size);
+		janus_skywayiot_reassembly_reset(r);
+		JANUS_SKYWAYIOT_STATS_ADD(relay_stats.reassembly_errors, 1);
+		return FALSE;
+	}
+	g_byte_array_append(r->buffer, (guint8 *)buf + sizeof(*header), len - sizeof(*header));
+	r->next++;
+	if(r->next < r->count)
+		return FALSE;
+	JANUS_SKYWAYIOT_STATS_ADD(relay_stats.reassembled, 1);
+	*payload = (char *)r->buffer->data;
+	*payload_len = r->buffer->len;
+	return TRUE;
+}
+
+/* The conflation key of a message whose frame had none: the conflate_json_field
+ * of its payload, if that's a JSON object with such a string or integer field.
+ * The object is scanned up to that field rather than parsed, and the key
+ * points in the payload, unless it had to be unescaped (then *copy has it,
+ * to free). Callers do it once per message, before fanning it out */
+static const char *janus_skywayiot_json_key(const char *data, int len, int *key_len, char **copy) {
+	*copy = NULL;
+	if(conflate_json_field == NULL)
+		return NULL;
+	int wanted = strlen(conflate_json_field);
+	const char *p = data, *end = data + len;
+	while(p < end && g_ascii_isspace(*p))
+		p++;
+	if(p == end || *p != '{')
+		return NULL;
+	p++;
+	while(1) {
+		while(p < end && g_ascii_isspace(*p))
+			p++;
+		const char *name_end = janus_skywayiot_json_skip(p, end);
+		if(name_end == NULL || *p != '"')
+			return NULL;
+		char *name_copy = NULL;
+		int name_len = 0;
+		const char *name = janus_skywayiot_json_string(p, name_end - p, &name_len, &name_copy);
+		gboolean found = name != NULL && name_len == wanted && !memcmp(name, conflate_json_field, wanted);
+		g_free(name_copy);
+		p = name_end;
+		while(p < end && g_ascii_isspace(*p))
+			p++;
+		if(p == end || *p != ':')
+			return NULL;
+		p++;
+		while(p < end && g_ascii_isspace(*p))
+			p++;
+		const char *value_end = janus_skywayiot_json_skip(p, end);
+		if(value_end == NULL)
+			return NULL;
+		if(found) {
+			if(*p == '"')
+				return janus_skywayiot_json_string(p, value_end - p, key_len, copy);
+			/* Integers only, as written (JSON has no leading zeros to strip) */
+			const char *c = (*p == '-') ? p + 1 : p;
+			if(c == value_end)
+				return NULL;
+			for(; c < value_end; c++) {
+				if(!g_ascii_isdigit(*c))
+					return NULL;
+			}
+			*key_len = value_end - p;
+			return p;
+		}
+		p = value_end;
+		while(p < end && g_ascii_isspace(*p))
+			p++;
+		if(p == end || *p != ',')
+			return NULL;
+		p++;
+	}
+}
+
+/* Queue a message on a conflating session: the caller holds delivery_mutex */
+static void janus_skywayiot_outbox_push(janus_skywayiot_session *session, gint64 expires, const char *key, int key_len, char *data, int len) {
+	janus_skywayiot_outbox *outbox = session->outbox;
+	char *k = key ? g_strndup(key, key_len) : NULL;
+	if(k != NULL) {
+		GList *link = g_hash_table_lookup(outbox->keyed, k);
+		if(link != NULL) {
+			/* Newer value for a key that's still queued: replace it where it is */
+			janus_skywayiot_outbound *msg = (janus_skywayiot_outbound *)link->data;
+			g_free(msg->data);
+			msg->data = g_malloc(len);
+			memcpy(msg->data, data, len);
+			msg->len = len;
+			msg->expires = expires;
+			outbox->conflated++;
+			JANUS_SKYWAYIOT_STATS_ADD(relay_stats.conflated, 1);
+			g_free(k);
+			return;
+		}
+	}
+	janus_skywayiot_outbound *msg = g_malloc0(sizeof(janus_skywayiot_outbound));
+	msg->expires = expires;
+	msg->key = k;
+	msg->data = g_malloc(len);
+	memcpy(msg->data, data, len);
+	msg->len = len;
+	g_queue_push_tail(&outbox->queue, msg);
+	if(k != NULL)
+		g_hash_table_insert(outbox->keyed, k, g_queue_peek_tail_link(&outbox->queue));
+	if(g_queue_get_length(&outbox->queue) > JANUS_SKYWAYIOT_OUTBOX_MAX) {
+		janus_skywayiot_outbound *oldest = g_queue_pop_head(&outbox->queue);
+		if(oldest->key != NULL)
+			g_hash_table_remove(outbox->keyed, oldest->key);
+		janus_skywayiot_outbound_free(oldest);
+		outbox->dropped++;
+		JANUS_SKYWAYIOT_STATS_ADD(relay_stats.outbox_dropped, 1);
+	}
+	if(!outbox->scheduled) {
+		outbox->scheduled = TRUE;
+		delivery_sessions = g_list_prepend(delivery_sessions, session);
+		g_async_queue_push(delivery_wakeups, GINT_TO_POINTER(1));
+	}
+}
+
+/* Send a message that may have a key (not NUL terminated) on the data
+ * channel of a session, delta encoded if the session asked for it and the
+ * message has one (from the frame, or janus_skywayiot_json_key) */
+static void janus_skywayiot_relay_keyed(janus_skywayiot_session *session, const char *key, int key_len, char *data, int len) {
+	janus_skywayiot_delta *delta = __atomic_load_n(&session->delta, __ATOMIC_ACQUIRE);
+	if(delta == NULL || !delta->enabled || !session->envelope) {
+		janus_skywayiot_relay_data(session, data, len);
+		return;
+	}
+	if(key == NULL) {
+		janus_skywayiot_relay_data(session, data, len);
+		return;
+	}
+	char *k = g_strndup(key, key_len);
+	janus_skywayiot_relay_delta(session, delta, k, data, len);
+	g_free(k);
+}
+
+/* Relays decided under delivery_mutex are only done once it's released, so
+ * that a data channel being slow doesn't hold up every other delivery: the
+ * messages are collected in a queue, and sent in order afterwards */
+static void janus_skywayiot_relay_queued(GQueue *relays) {
+	janus_skywayiot_outbound *msg = NULL;
+	while((msg = g_queue_pop_head(relays)) != NULL) {
+		/* The gateway may be done with the handle of a session destroyed in the meantime */
+		if(msg->session->destroyed) {
+			/* Nothing to send it to */
+		} else if(msg->enveloped) {
+			gateway->relay_data(msg->session->handle, msg->data, msg->len);
+			janus_skywayiot_stats_done(JANUS_SKYWAYIOT_ENTRY_RELAY_DATA, 0, msg->len);
+		} else {
+			janus_skywayiot_relay_keyed(msg->session, msg->key, msg->key ? strlen(msg->key) : 0, msg->data, msg->len);
+		}
+		janus_skywayiot_outbound_free(msg);
+	}
+}
+
+/**
+ * Hand a message for a session to the data channel, or to its outbox if it
+ * asked for conflation. key (not NUL terminated) is the message conflation
+ * key, if it came with one; messages past expires (if not 0) are dropped.
+ */
+static void janus_skywayiot_deliver(janus_skywayiot_session *session, gint64 expires, const char *key, int key_len, char *data, int len) {
+	if(expires > 0 && plugin_clock->now() > expires) {
+		JANUS_SKYWAYIOT_STATS_ADD(relay_stats.expired_fanout, 1);
+		return;
+	}
+	janus_skywayiot_outbox *outbox = __atomic_load_n(&session->outbox, __ATOMIC_ACQUIRE);
+	if(outbox != NULL && outbox->enabled) {
+		janus_mutex_lock(&delivery_mutex);
+		if(outbox->enabled) {
+			janus_skywayiot_outbox_push(session, expires, key, key_len, data, len);
+			janus_mutex_unlock(&delivery_mutex);
+			return;
+		}
+		janus_mutex_unlock(&delivery_mutex);
+	}
+	janus_skywayiot_relay_keyed(session, key, key_len, data, len);
+}
+
+/* Same as janus_skywayiot_deliver, for callers already holding delivery_mutex:
+ * what's not for an outbox is added to relays, for after the lock is released */
+static void janus_skywayiot_deliver_locked(janus_skywayiot_session *session, gint64 expires, const char *key, int key_len,
+		char *data, int len, GQueue *relays) {
+	if(session->outbox != NULL && session->outbox->enabled) {
+		janus_skywayiot_outbox_push(session, expires, key, key_len, data, len);
+		return;
+	}
+	janus_skywayiot_outbound *msg = g_malloc0(sizeof(janus_skywayiot_outbound));
+	msg->session = janus_skywayiot_session_ref(session);
+	msg->key = key ? g_strndup(key, key_len) : NULL;
+	msg->data = g_malloc(len);
+	memcpy(msg->data, data, len);
+	msg->len = len;
+	g_queue_push_tail(relays, msg);
+}
+
+/* Parse a numeric payload (a plain number, possibly surrounded by blanks) */
+static gboolean janus_skywayiot_parse_number(const char *data, int len, double *number) {
+	char buf[64];
+	if(len <= 0 || len >= (int)sizeof(buf))
+		return FALSE;
+	memcpy(buf, data, len);
+	buf[len] = '\0';
+	char *end = NULL;
+	*number = g_ascii_strtod(buf, &end);
+	if(end == buf)
+		return FALSE;
+	while(*end == ' ' || *end == '\t' || *end == '\r' || *end == '\n')
+		end++;
+	return *end == '\0' && isfinite(*number);
+}
+
+/* Deliver what a throttle collected during the window that just ended:
+ * the caller holds delivery_mutex, and relays what ends up in relays */
+static void janus_skywayiot_throttle_flush(janus_skywayiot_throttle *throttle, GQueue *relays) {
+	if(throttle->latest == NULL)
+		return;
+	if(throttle->latest_expires > 0 && plugin_clock->now() > throttle->latest_expires) {
+		/* What we have is stale already, and so would be anything made out of it */
+		JANUS_SKYWAYIOT_STATS_ADD(relay_stats.expired_queued, 1);
+		g_free(throttle->latest);
+		throttle->latest = NULL;
+		throttle->latest_len = 0;
+		throttle->count = 0;
+		return;
+	}
+	char buf[64];
+	char *data = throttle->latest;
+	int len = throttle->latest_len;
+	if(throttle->aggregate != JANUS_SKYWAYIOT_AGGREGATE_LATEST && throttle->count > 0) {
+		double value = throttle->aggregate == JANUS_SKYWAYIOT_AGGREGATE_MIN ? throttle->min :
+			(throttle->aggregate == JANUS_SKYWAYIOT_AGGREGATE_MAX ? throttle->max : throttle->sum / throttle->count);
+		g_ascii_formatd(buf, sizeof(buf), "%.17g", value);
+		data = buf;
+		len = strlen(buf);
+	}
+	janus_skywayiot_deliver_locked(throttle->session, throttle->latest_expires,
+		throttle->latest_topic, strlen(throttle->latest_topic), data, len, relays);
+	g_free(throttle->latest);
+	throttle->latest = NULL;
+	throttle->latest_len = 0;
+	throttle->count = 0;
+	throttle->window_end = plugin_clock->now() + throttle->window;
+}
+
+/* A message was published (on topic, not NUL terminated) on a rate limited
+ * subscription: deliver it if the window allows, keep it for later otherwise */
+static void janus_skywayiot_throttle_push(janus_skywayiot_throttle *throttle, const char *topic, int topic_len,
+		gint64 expires, char *data, int len) {
+	janus_mutex_lock(&delivery_mutex);
+	gint64 now = plugin_clock->now();
+	if(throttle->latest == NULL && now >= throttle->window_end) {
+		/* Quiet so far: no need to wait */
+		GQueue relays = G_QUEUE_INIT;
+		throttle->window_end = now + throttle->window;
+		janus_skywayiot_deliver_locked(throttle->session, expires, topic, topic_len, data, len, &relays);
+		janus_mutex_unlock(&delivery_mutex);
+		janus_skywayiot_relay_queued(&relays);
+		return;
+	}
+	if(throttle->latest != NULL) {
+		throttle->absorbed++;
+		JANUS_SKYWAYIOT_STATS_ADD(relay_stats.throttled, 1);
+	}
+	g_free(throttle->latest);
+	throttle->latest = g_malloc(len);
+	memcpy(throttle->latest, data, len);
+	throttle->latest_len = len;
+	throttle->latest_expires = expires;
+	if(throttle->latest_topic == NULL || strncmp(throttle->latest_topic, topic, topic_len) ||
+			throttle->latest_topic[topic_len] != '\0') {
+		/* Only a filter sees different topics, keep the name otherwise */
+		g_free(throttle->latest_topic);
+		throttle->latest_topic = g_strndup(topic, topic_len);
+	}
+	double number = 0;
+	if(throttle->aggregate != JANUS_SKYWAYIOT_AGGREGATE_LATEST && janus_skywayiot_parse_number(data, len, &number)) {
+		if(throttle->count == 0 || number < throttle->min)
+			throttle->min = number;
+		if(throttle->count == 0 || number > throttle->max)
+			throttle->max = number;
+		throttle->sum = (throttle->count == 0 ? 0 : throttle->sum) + number;
+		throttle->count++;
+	}
+	if(!throttle->scheduled) {
+		throttle->scheduled = TRUE;
+		delivery_throttles = g_list_prepend(delivery_throttles, throttle);
+		g_async_queue_push(delivery_wakeups, GINT_TO_POINTER(1));
+	}
+	janus_mutex_unlock(&delivery_mutex);
+}
+
+/* Turn conflation on or off (enable < 0 leaves it as it is), and/or change its rate */
+static void janus_skywayiot_outbox_configure(janus_skywayiot_session *session, int enable, int rate) {
+	GQueue relays = G_QUEUE_INIT;
+	janus_mutex_lock(&delivery_mutex);
+	janus_skywayiot_outbox *outbox = session->outbox;
+	if(outbox == NULL) {
+		outbox = g_malloc0(sizeof(janus_skywayiot_outbox));
+		outbox->rate = JANUS_SKYWAYIOT_CONFLATE_RATE_DEFAULT;
+		g_queue_init(&outbox->queue);
+		outbox->keyed = g_hash_table_new(g_str_hash, g_str_equal);
+		__atomic_store_n(&session->outbox, outbox, __ATOMIC_RELEASE);
+	}
+	if(rate > 0)
+		outbox->rate = rate;
+	if(enable == 0 && outbox->enabled) {
+		/* Flush what's left, in order, before going back to direct delivery */
+		janus_skywayiot_outbound *msg = NULL;
+		while((msg = g_queue_pop_head(&outbox->queue)) != NULL) {
+			msg->session = janus_skywayiot_session_ref(session);
+			g_queue_push_tail(&relays, msg);
+		}
+		g_hash_table_remove_all(outbox->keyed);
+	}
+	if(enable >= 0)
+		outbox->enabled = enable;
+	JANUS_LOG(LOG_VERB, "Conflation %s (%d messages per second)\n", outbox->enabled ? "enabled" : "disabled", outbox->rate);
+	janus_mutex_unlock(&delivery_mutex);
+	janus_skywayiot_relay_queued(&relays);
+}
+
+static void janus_skywayiot_spool_close(janus_skywayiot_spool *spool) {
+	if(spool->header != NULL)
+		munmap(spool->header, sizeof(janus_skywayiot_spool_header) + spool->header->capacity);
+	if(spool->fd >= 0)
+		close(spool->fd);
+	g_free(spool->device_id);
+	g_free(spool->path);
+	g_free(spool);
+}
+
+/* Get the spool of a device, opening (or, if create is TRUE, creating) its
+ * file if needed: the caller holds delivery_mutex. Returns NULL if store and
+ * forward is disabled, or there's nothing spooled and create is FALSE */
+static janus_skywayiot_spool *janus_skywayiot_spool_get(const char *device_id, gboolean create) {
+	if(spool_dir == NULL)
+		return NULL;
+	janus_skywayiot_spool *spool = g_hash_table_lookup(spools, device_id);
+	if(spool != NULL) {
+		if(spool->idle != NULL) {
+			/* In use again, janus_skywayiot_spool_release puts it back */
+			g_queue_delete_link(&spools_idle, spool->idle);
+			spool->idle = NULL;
+		}
+		return spool;
+	}
+	/* Device ids are escaped, so that they're safe to use as file names */
+	GString *name = g_string_new(NULL);
+	const char *c = NULL;
+	for(c = device_id; *c != '\0'; c++) {
+		if(g_ascii_isalnum(*c) || *c == '-' || *c == '_')
+			g_string_append_c(name, *c);
+		else
+			g_string_append_printf(name, "%%%02X", (guint8)*c);
+	}
+	char *path = g_strdup_printf("%s/%s.spool", spool_dir, name->str);
+	g_string_free(name, TRUE);
+	int fd = open(path, O_RDWR | O_CLOEXEC | (create ? O_CREAT : 0), 0600);
+	if(fd < 0) {
+		if(create)
+			JANUS_LOG(LOG_ERR, "Couldn't open spool %s (%d, %s)\n", path, errno, strerror(errno));
+		g_free(path);
+		return NULL;
+	}
+	struct stat st = { 0 };
+	janus_skywayiot_spool_header existing = { 0 };
+	gsize capacity = spool_max_bytes;
+	/* Whatever is on disk is checked before the ring offsets are trusted */
+	gboolean valid = fstat(fd, &st) == 0 && st.st_size > (off_t)sizeof(existing) &&
+		pread(fd, &existing, sizeof(existing), 0) == (ssize_t)sizeof(existing) &&
+		existing.magic == JANUS_SKYWAYIOT_SPOOL_MAGIC && existing.version == JANUS_SKYWAYIOT_SPOOL_VERSION &&
+		existing.capacity > 0 && st.st_size == (off_t)(sizeof(existing) + existing.capacity) &&
+		existing.head <= existing.tail && existing.tail - existing.head <= existing.capacity &&
+		existing.count <= (existing.tail - existing.head) / sizeof(janus_skywayiot_spool_record);
+	if(!valid && create && st.st_size > 0)
+		JANUS_LOG(LOG_WARN, "Spool %s is damaged, starting over\n", path);
+	if(valid) {
+		/* Keep what a previous run spooled, in the size it was spooled with */
+		capacity = existing.capacity;
+	} else if(!create) {
+		close(fd);
+		g_free(path);
+		return NULL;
+	} else if(ftruncate(fd, 0) < 0 || ftruncate(fd, sizeof(janus_skywayiot_spool_header) + capacity) < 0) {
+		JANUS_LOG(LOG_ERR, "Couldn't size spool %s (%d, %s)\n", path, errno, strerror(errno));
+		close(fd);
+		g_free(path);
+		return NULL;
+	}
+	void *map = mmap(NULL, sizeof(janus_skywayiot_spool_header) + capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(map == MAP_FAILED) {
+		JANUS_LOG(LOG_ERR, "Couldn't map spool %s (%d, %s)\n", path, errno, strerror(errno));
+		close(fd);
+		g_free(path);
+		return NULL;
+	}
+	spool = g_malloc0(sizeof(janus_skywayiot_spool));
+	spool->device_id = g_strdup(device_id);
+	spool->path = path;
+	spool->fd = fd;
+	spool->header = (janus_skywayiot_spool_header *)map;
+	spool->ring = (guint8 *)map + sizeof(janus_skywayiot_spool_header);
+	if(!valid) {
+		spool->header->magic = JANUS_SKYWAYIOT_SPOOL_MAGIC;
+		spool->header->version = JANUS_SKYWAYIOT_SPOOL_VERSION;
+		spool->header->capacity = capacity;
+		spool->header->head = spool->header->tail = spool->header->count = 0;
+	} else {
+		JANUS_LOG(LOG_VERB, "Found %"SCNu64" spooled message(s) for device %s\n", spool->header->count, device_id);
+	}
+	g_hash_table_insert(spools, spool->device_id, spool);
+	return spool;
+}
+
+/* Done with a spool nobody is draining: get rid of it if it's empty, or keep
+ * it open as the most recently written one, closing the least recent if
+ * there are more than spool_max_open */
+static void janus_skywayiot_spool_release(janus_skywayiot_spool *spool) {
+	if(spool->session != NULL || spool->scheduled)
+		return;
+	if(spool->idle != NULL) {
+		g_queue_delete_link(&spools_idle, spool->idle);
+		spool->idle = NULL;
+	}
+	if(spool->header->count == 0) {
+		unlink(spool->path);
+		g_hash_table_remove(spools, spool->device_id);
+		return;
+	}
+	g_queue_push_head(&spools_idle, spool);
+	spool->idle = g_queue_peek_head_link(&spools_idle);
+	while(g_queue_get_length(&spools_idle) > spool_max_open) {
+		janus_skywayiot_spool *oldest = g_queue_pop_tail(&spools_idle);
+		oldest->idle = NULL;
+		g_hash_table_remove(spools, oldest->device_id);
+	}
+}
+
+/* Copy in and out of the ring, wrapping around its end */
+static void janus_skywayiot_spool_write(janus_skywayiot_spool *spool, guint64 offset, const void *data, gsize len) {
+	guint64 capacity = spool->header->capacity, pos = offset % capacity;
+	gsize first = MIN(len, capacity - pos);
+	memcpy(spool->ring + pos, data, first);
+	memcpy(spool->ring, (const guint8 *)data + first, len - first);
+}
+
+static void janus_skywayiot_spool_read(janus_skywayiot_spool *spool, guint64 offset, void *data, gsize len) {
+	guint64 capacity = spool->header->capacity, pos = offset % capacity;
+	gsize first = MIN(len, capacity - pos);
+	memcpy(data, spool->ring + pos, first);
+	memcpy((guint8 *)data + first, spool->ring, len - first);
+}
+
+/* Read the header of the oldest spooled record: the file may have been
+ * damaged on disk, so if it doesn't fit in what's in the ring, the spool
+ * is emptied and FALSE is returned */
+static gboolean janus_skywayiot_spool_peek(janus_skywayiot_spool *spool, janus_skywayiot_spool_record *record) {
+	janus_skywayiot_spool_header *header = spool->header;
+	/* The mapping is shared with the file, so don't trust the offsets blindly */
+	guint64 used = header->tail >= header->head ? header->tail - header->head : G_MAXUINT64;
+	if(header->count > 0 && used >= sizeof(*record) && used <= header->capacity) {
+		janus_skywayiot_spool_read(spool, header->head, record, sizeof(*record));
+		if(record->length <= used - sizeof(*record))
+			return TRUE;
+	}
+	if(header->count > 0 || used > 0) {
+		JANUS_LOG(LOG_WARN, "Spool %s is corrupted, resetting it\n", spool->path);
+		JANUS_SKYWAYIOT_STATS_ADD(relay_stats.spool_dropped, header->count);
+	}
+	header->head = header->tail = header->count = 0;
+	return FALSE;
+}
+
+/* Forget the oldest spooled message */
+static void janus_skywayiot_spool_drop(janus_skywayiot_spool *spool) {
+	janus_skywayiot_spool_record record;
+	if(!janus_skywayiot_spool_peek(spool, &record))
+		return;
+	spool->header->head += sizeof(record) + record.length;
+	spool->header->count--;
+}
+
+static void janus_skywayiot_spool_append(janus_skywayiot_spool *spool, gint64 expires, char *data, int len) {
+	janus_skywayiot_spool_header *header = spool->header;
+	janus_skywayiot_spool_record record = { 0 };
+	record.length = len;
+	if(expires > 0)
+		record.deadline = (expires - plugin_clock->now() + g_get_real_time()) / 1000;
+	if(sizeof(record) + len > header->capacity) {
+		JANUS_SKYWAYIOT_STATS_ADD(relay_stats.spool_dropped, 1);
+		return;
+	}
+	while(header->capacity - (header->tail - header->head) < sizeof(record) + len) {
+		janus_skywayiot_spool_drop(spool);
+		JANUS_SKYWAYIOT_STATS_ADD(relay_stats.spool_dropped, 1);
+	}
+	janus_skywayiot_spool_write(spool, header->tail, &record, sizeof(record));
+	janus_skywayiot_spool_write(spool, header->tail + sizeof(record), data, len);
+	/* Only account for the record when it's all there */
+	__atomic_store_n(&header->tail, header->tail + sizeof(record) + len, __ATOMIC_RELEASE);
+	header->count++;
+	JANUS_SKYWAYIOT_STATS_ADD(relay_stats.spooled, 1);
+}
+
+static void janus_skywayiot_spool_schedule(janus_skywayiot_spool *spool) {
+	if(spool->scheduled || spool->header->count == 0)
+		return;
+	spool->scheduled = TRUE;
+	delivery_spools = g_list_prepend(delivery_spools, spool);
+	g_async_queue_push(delivery_wakeups, GINT_TO_POINTER(1));
+}
+
+/* Send the oldest spooled message that didn't expire yet, if any, to the
+ * device: the caller holds delivery_mutex, and relays what ends up in relays */
+static void janus_skywayiot_spool_deliver(janus_skywayiot_spool *spool, GQueue *relays) {
+	janus_skywayiot_spool_header *header = spool->header;
+	gint64 now = g_get_real_time() / 1000;
+	while(header->count > 0) {
+		janus_skywayiot_spool_record record;
+		if(!janus_skywayiot_spool_peek(spool, &record))
+			break;
+		if(record.deadline > 0 && record.deadline < now) {
+			janus_skywayiot_spool_drop(spool);
+			JANUS_SKYWAYIOT_STATS_ADD(relay_stats.expired_queued, 1);
+			continue;
+		}
+		char *data = g_malloc(record.length);
+		janus_skywayiot_spool_read(spool, header->head + sizeof(record), data, record.length);
+		janus_skywayiot_spool_drop(spool);
+		gint64 expires = record.deadline > 0 ? plugin_clock->now() + (record.deadline - now) * 1000 : 0;
+		char *key_copy = NULL;
+		int key_len = 0;
+		const char *key = janus_skywayiot_json_key(data, record.length, &key_len, &key_copy);
+		janus_skywayiot_deliver_locked(spool->session, expires, key, key_len, data, record.length, relays);
+		g_free(key_copy);
+		g_free(data);
+		JANUS_SKYWAYIOT_STATS_ADD(relay_stats.unspooled, 1);
+		break;
+	}
+}
+
+/* Start draining the spool of a device, if it has one: the caller holds sessions_mutex */
+static void janus_skywayiot_device_attach(janus_skywayiot_session *session) {
+	if(session->device_id == NULL || g_hash_table_lookup(devices, session->device_id) != session)
+		return;
+	janus_mutex_lock(&delivery_mutex);
+	janus_skywayiot_spool *spool = janus_skywayiot_spool_get(session->device_id, FALSE);
+	if(spool != NULL) {
+		spool->session = session;
+		spool->next_delivery = 0;
+		janus_skywayiot_spool_schedule(spool);
+		janus_skywayiot_spool_release(spool);
+	}
+	janus_mutex_unlock(&delivery_mutex);
+}
+
+/* The data channel of a session is open: setup_media only tells us the
+ * PeerConnection is, and what we'd send before the channel is would be
+ * lost, so the last values of its topics (and what was spooled for its
+ * device) wait for the first message from the peer (or a "sync" request) */
+static void janus_skywayiot_data_opened(janus_skywayiot_session *session) {
+	janus_mutex_lock(&sessions_mutex);
+	if(session->media_ready && !g_atomic_int_get(&session->data_open)) {
+		g_atomic_int_set(&session->data_open, 1);
+		janus_skywayiot_topics_sync(session, NULL);
+		janus_skywayiot_wildcard_sync(session, NULL);
+		/* If it's a device we kept messages for, start sending them */
+		janus_skywayiot_device_attach(session);
+	}
+	janus_mutex_unlock(&sessions_mutex);
+}
+
+/* Stop draining to a session (if forget is TRUE, because it's not that
+ * device anymore): the caller holds sessions_mutex */
+static void janus_skywayiot_device_detach(janus_skywayiot_session *session, gboolean forget) {
+	if(session->device_id == NULL)
+		return;
+	if(g_hash_table_lookup(devices, session->device_id) == session) {
+		janus_mutex_lock(&delivery_mutex);
+		janus_skywayiot_spool *spool = spools ? g_hash_table_lookup(spools, session->device_id) : NULL;
+		if(spool != NULL && spool->session == session) {
+			spool->session = NULL;
+			if(spool->scheduled) {
+				delivery_spools = g_list_remove(delivery_spools, spool);
+				spool->scheduled = FALSE;
+			}
+			janus_skywayiot_spool_release(spool);
+		}
+		janus_mutex_unlock(&delivery_mutex);
+		if(forget)
+			g_hash_table_remove(devices, session->device_id);
+	}
+	if(forget) {
+		g_free(session->device_id);
+		session->device_id = NULL;
+	}
+}
+
+/* Map a device id to a session: the caller holds sessions_mutex */
+static void janus_skywayiot_device_set(janus_skywayiot_session *session, const char *device_id) {
+	if(session->device_id != NULL && !strcmp(session->device_id, device_id))
+		return;
+	janus_skywayiot_device_detach(session, TRUE);
+	g_free(session->device_id);
+	session->device_id = g_strdup(device_id);
+	/* The last session to claim a device id gets its messages */
+	janus_skywayiot_session *previous = g_hash_table_lookup(devices, device_id);
+	if(previous != NULL && previous != session)
+		janus_skywayiot_device_detach(previous, TRUE);
+	g_hash_table_insert(devices, session->device_id, session);
+	JANUS_LOG(LOG_VERB, "Session is now device %s\n", device_id);
+	if(g_atomic_int_get(&session->data_open))
+		janus_skywayiot_device_attach(session);
+}
+
+/* Start a new bulk transfer for a session (or, with transfer 0 and no
+ * transfer going on, just forget the current one): the caller holds delivery_mutex */
+static void janus_skywayiot_bulk_reset(janus_skywayiot_session *session, guint32 transfer) {
+	janus_skywayiot_bulk *bulk = session->bulk;
+	if(bulk == NULL) {
+		if(transfer == 0)
+			return;
+		bulk = g_malloc0(sizeof(janus_skywayiot_bulk));
+		g_queue_init(&bulk->queue);
+		session->bulk = bulk;
+	}
+	gpointer chunk = NULL;
+	while((chunk = g_queue_pop_head(&bulk->queue)) != NULL)
+		g_free(chunk);
+	if(bulk->scheduled) {
+		delivery_bulks = g_list_remove(delivery_bulks, session);
+		bulk->scheduled = FALSE;
+	}
+	bulk->transfer = transfer;
+	bulk->next = 0;
+	bulk->acked = 0;
+	bulk->resuming = FALSE;
+}
+
+/* Have the delivery thread send what the window allows: the caller holds delivery_mutex */
+static void janus_skywayiot_bulk_schedule(janus_skywayiot_session *session) {
+	janus_skywayiot_bulk *bulk = session->bulk;
+	if(bulk->scheduled || g_queue_is_empty(&bulk->queue) || bulk->next - bulk->acked >= bulk_window)
+		return;
+	bulk->scheduled = TRUE;
+	delivery_bulks = g_list_prepend(delivery_bulks, session);
+	g_async_queue_push(delivery_wakeups, GINT_TO_POINTER(1));
+}
+
+/* Take the queued chunks of a session the window has room for, adding them
+ * to relays for after the lock is released: the caller holds delivery_mutex */
+static void janus_skywayiot_bulk_send(janus_skywayiot_session *session, GQueue *relays) {
+	janus_skywayiot_bulk *bulk = session->bulk;
+	janus_skywayiot_bulk_chunk *chunk = NULL;
+	while(bulk->next - bulk->acked < bulk_window && (chunk = g_queue_pop_head(&bulk->queue)) != NULL) {
+		janus_skywayiot_outbound *msg = g_malloc0(sizeof(janus_skywayiot_outbound));
+		msg->session = janus_skywayiot_session_ref(session);
+		msg->enveloped = TRUE;
+		msg->len = sizeof(janus_skywayiot_bulk_header) + chunk->len;
+		msg->data = g_malloc(msg->len);
+		janus_skywayiot_bulk_header *header = (janus_skywayiot_bulk_header *)msg->data;
+		guint32 transfer = htonl(bulk->transfer), seq = htonl(chunk->seq);
+		header->flags = JANUS_SKYWAYIOT_ENVELOPE_BULK;
+		memcpy(header->transfer, &transfer, sizeof(transfer));
+		memcpy(header->seq, &seq, sizeof(seq));
+		header->last = chunk->last ? 1 : 0;
+		memcpy(msg->data + sizeof(*header), chunk->data, chunk->len);
+		g_queue_push_tail(relays, msg);
+		bulk->next = chunk->seq + 1;
+		bulk->sent++;
+		JANUS_SKYWAYIOT_STATS_ADD(relay_stats.bulk_chunks, 1);
+		g_free(chunk);
+	}
+}
+
+/* The credit of a bulk transfer, as sent to the backend: the caller holds delivery_mutex */
+static void janus_skywayiot_bulk_credit(janus_skywayiot_bulk *bulk, guint32 credit[4]) {
+	credit[0] = htonl(bulk->transfer);
+	credit[1] = htonl(bulk->acked);
+	credit[2] = htonl(bulk_window);
+	credit[3] = htonl(bulk->next + g_queue_get_length(&bulk->queue));
+}
+
+/* A client acknowledged bulk chunks: make room in its window, and give the
+ * backend the corresponding credit */
+static void janus_skywayiot_bulk_ack(janus_skywayiot_session *session, char *buf, int len) {
+	if(len < (int)sizeof(janus_skywayiot_bulk_header) - 1) {
+		janus_skywayiot_stats_error(JANUS_SKYWAYIOT_ENTRY_INCOMING_DATA);
+		return;
+	}
+	janus_skywayiot_bulk_header *header = (janus_skywayiot_bulk_header *)buf;
+	guint32 transfer = 0, seq = 0;
+	memcpy(&transfer, header->transfer, sizeof(transfer));
+	memcpy(&seq, header->seq, sizeof(seq));
+	transfer = ntohl(transfer);
+	seq = ntohl(seq);
+	guint32 credit[4];
+	janus_mutex_lock(&delivery_mutex);
+	janus_skywayiot_bulk *bulk = session->bulk;
+	if(bulk == NULL || bulk->transfer != transfer || seq >= bulk->next) {
+		/* Not something we sent */
+		janus_mutex_unlock(&delivery_mutex);
+		janus_skywayiot_stats_error(JANUS_SKYWAYIOT_ENTRY_INCOMING_DATA);
+		return;
+	}
+	if(seq + 1 > bulk->acked)
+		bulk->acked = seq + 1;
+	janus_skywayiot_bulk_credit(bulk, credit);
+	janus_skywayiot_bulk_schedule(session);
+	janus_mutex_unlock(&delivery_mutex);
+	JANUS_SKYWAYIOT_STATS_ADD(relay_stats.bulk_acks, 1);
+	janus_skywayiot_ext_send_frame(JANUS_SKYWAYIOT_FRAME_CREDIT, (guint64)session->handle, (char *)credit, sizeof(credit));
+}
+
+/* Thread draining the outboxes of the conflating sessions, each at its own
+ * rate, the spools of the devices that came back and the windows of bulk
+ * transfers, and closing the windows of the rate limited subscriptions */
+static void *janus_skywayiot_delivery(void *data) {
+	JANUS_LOG(LOG_VERB, "Joining SkywayIoT delivery thread\n");
+	janus_skywayiot_thread_policy_apply(JANUS_SKYWAYIOT_THREAD_DELIVERY, -1);
+	GQueue relays = G_QUEUE_INIT;
+	while(g_atomic_int_get(&initialized) && !g_atomic_int_get(&stopping)) {
+		gint64 now = plugin_clock->now(), wakeup = now + G_USEC_PER_SEC;
+		janus_mutex_lock(&delivery_mutex);
+		GList *sl = delivery_sessions;
+		while(sl != NULL) {
+			GList *next = sl->next;
+			janus_skywayiot_session *session = (janus_skywayiot_session *)sl->data;
+			janus_skywayiot_outbox *outbox = session->outbox;
+			if(outbox->next_delivery <= now) {
+				janus_skywayiot_outbound *msg = NULL;
+				while((msg = g_queue_pop_head(&outbox->queue)) != NULL) {
+					if(msg->key != NULL)
+						g_hash_table_remove(outbox->keyed, msg->key);
+					if(msg->expires == 0 || now <= msg->expires)
+						break;
+					/* Waited too long in the queue: this doesn't take a delivery slot */
+					janus_skywayiot_outbound_free(msg);
+					outbox->expired++;
+					JANUS_SKYWAYIOT_STATS_ADD(relay_stats.expired_queued, 1);
+				}
+				if(msg != NULL) {
+					msg->session = janus_skywayiot_session_ref(session);
+					g_queue_push_tail(&relays, msg);
+					outbox->delivered++;
+					outbox->next_delivery = now + G_USEC_PER_SEC / outbox->rate;
+				}
+			}
+			if(g_queue_is_empty(&outbox->queue)) {
+				delivery_sessions = g_list_delete_link(delivery_sessions, sl);
+				outbox->scheduled = FALSE;
+			} else if(outbox->next_delivery < wakeup) {
+				wakeup = outbox->next_delivery;
+			}
+			sl = next;
+		}
+		GList *tl = delivery_throttles;
+		while(tl != NULL) {
+			GList *next = tl->next;
+			janus_skywayiot_throttle *throttle = (janus_skywayiot_throttle *)tl->data;
+			if(throttle->window_end <= now)
+				janus_skywayiot_throttle_flush(throttle, &relays);
+			if(throttle->latest == NULL) {
+				delivery_throttles = g_list_delete_link(delivery_throttles, tl);
+				throttle->scheduled = FALSE;
+			} else if(throttle->window_end < wakeup) {
+				wakeup = throttle->window_end;
+			}
+			tl = next;
+		}
+		GList *pl = delivery_spools;
+		while(pl != NULL) {
+			GList *next = pl->next;
+			janus_skywayiot_spool *spool = (janus_skywayiot_spool *)pl->data;
+			if(spool->next_delivery <= now) {
+				janus_skywayiot_spool_deliver(spool, &relays);
+				spool->next_delivery = now + G_USEC_PER_SEC / spool_drain_rate;
+			}
+			if(spool->header->count == 0) {
+				delivery_spools = g_list_delete_link(delivery_spools, pl);
+				spool->scheduled = FALSE;
+			} else if(spool->next_delivery < wakeup) {
+				wakeup = spool->next_delivery;
+			}
+			pl = next;
+		}
+		/* Bulk chunks go last, and only as many as the windows allow */
+		while(delivery_bulks != NULL) {
+			janus_skywayiot_session *session = (janus_skywayiot_session *)delivery_bulks->data;
+			delivery_bulks = g_list_delete_link(delivery_bulks, delivery_bulks);
+			session->bulk->scheduled = FALSE;
+			janus_skywayiot_bulk_send(session, &relays);
+		}
+		janus_mutex_unlock(&delivery_mutex);
+		janus_skywayiot_relay_queued(&relays);
+		now = plugin_clock->now();
+		if(wakeup > now) {
+			if(plugin_clock == &simulated_clock) {
+				/* Nobody woke us up: it's as if we slept until then, unless
+				 * somebody else is due before, in which case we'll wait again */
+				GList *link = janus_skywayiot_simulated_register(&wakeup);
+				if(g_async_queue_timeout_pop(delivery_wakeups, MAX(1, (wakeup - now) / simulated_speedup)) == NULL)
+					janus_skywayiot_simulated_expired(link);
+				janus_skywayiot_simulated_unregister(link);
+			} else {
+				g_async_queue_timeout_pop(delivery_wakeups, wakeup - now);
+			}
+		}
+	}
+	JANUS_LOG(LOG_VERB, "Leaving SkywayIoT delivery thread\n");
+	return NULL;
+}
+
+
+/* Error codes */
+#define JANUS_SKYWAYIOT_ERROR_NO_MESSAGE   411
+#define JANUS_SKYWAYIOT_ERROR_INVALID_JSON  412
+#define JANUS_SKYWAYIOT_ERROR_INVALID_ELEMENT 413
+
+
+/* SkywayIoT watchdog/garbage collector (sort of) */
+void *janus_skywayiot_watchdog(void *data);
+void *janus_skywayiot_watchdog(void *data) {
+	JANUS_LOG(LOG_INFO, "SkywayIoT watchdog started\n");
+	janus_skywayiot_thread_policy_apply(JANUS_SKYWAYIOT_THREAD_WATCHDOG, -1);
+	gint64 now = 0;
+	while(g_atomic_int_get(&initialized) && !g_atomic_int_get(&stopping)) {
+		janus_mutex_lock(&sessions_mutex);
+		/* Iterate on the old sessions: they're queued in the order they were destroyed,
+		 * so we can stop at the first one that's still too recent to be freed */
+		now = janus_get_monotonic_time();
+		JANUS_LOG(LOG_HUGE, "Checking %u old SkywayIoT sessions...\n", g_queue_get_length(old_sessions));
+		while(!g_queue_is_empty(old_sessions)) {
+			janus_skywayiot_session *session = (janus_skywayiot_session *)g_queue_peek_head(old_sessions);
+			if(now-session->destroyed < 5*G_USEC_PER_SEC)
+				break;
+			/* We're lazy and actually get rid of the stuff only after a few seconds
+			 * (or later, if relays for the session are still on their way) */
+			JANUS_LOG(LOG_VERB, "Freeing old SkywayIoT session\n");
+			g_queue_pop_head(old_sessions);
+			janus_skywayiot_session_unref(session);
+		}
+		janus_mutex_unlock(&sessions_mutex);
+		g_usleep(500000);
+	}
+	JANUS_LOG(LOG_INFO, "SkywayIoT watchdog stopped\n");
+	return NULL;
+}
+
+
+/* Plugin implementation */
+int janus_skywayiot_init(janus_callbacks *callback, const char *config_path) {
+	if(g_atomic_int_get(&stopping)) {
+		/* Still stopping from before */
+		return -1;
+	}
+	if(callback == NULL || config_path == NULL) {
+		/* Invalid arguments */
+		return -1;
+	}
+
+	/* Read configuration */
+	char filename[255];
+	g_snprintf(filename, 255, "%s/%s.cfg", config_path, JANUS_SKYWAYIOT_PACKAGE);
+	JANUS_LOG(LOG_VERB, "Configuration file: %s\n", filename);
+	janus_config *config = janus_config_parse(filename);
+	janus_mutex_init(&backends_mutex);
+	janus_mutex_init(&route_users_mutex);
+	janus_condition_init(&route_users_cond);
+	named_backends = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)g_ptr_array_unref);
+
+	GList *cl = NULL;
+	if(config != NULL) {
+		cl = janus_config_get_categories(config);
+
+		janus_config_item *log_rate = janus_config_get_item_drilldown(config, "general", "log_rate_limit");
+		if(log_rate != NULL && log_rate->value != NULL && atoi(log_rate->value) > 0)
+			hotlog_rate = atoi(log_rate->value);
+		janus_config_item *retain_bytes = janus_config_get_item_drilldown(config, "general", "retain_max_bytes");
+		if(retain_bytes != NULL && retain_bytes->value != NULL && atoi(retain_bytes->value) >= 0)
+			retain_max_bytes = atoi(retain_bytes->value);
+		janus_config_item *retain_topics = janus_config_get_item_drilldown(config, "general", "retain_max_topics");
+		if(retain_topics != NULL && retain_topics->value != NULL && atoi(retain_topics->value) >= 0)
+			retain_max_topics = atoi(retain_topics->value);
+		janus_config_item *spool_path = janus_config_get_item_drilldown(config, "general", "spool_dir");
+		if(spool_path != NULL && spool_path->value != NULL && strlen(spool_path->value) > 0) {
+			if(g_mkdir_with_parents(spool_path->value, 0700) < 0) {
+				JANUS_LOG(LOG_ERR, "Couldn't create spool directory %s (%d, %s), store and forward disabled\n",
+					spool_path->value, errno, strerror(errno));
+			} else {
+				spool_dir = g_strdup(spool_path->value);
+			}
+		}
+		janus_config_item *spool_bytes = janus_config_get_item_drilldown(config, "general", "spool_max_bytes");
+		if(spool_bytes != NULL && spool_bytes->value != NULL && atoi(spool_bytes->value) > 0)
+			spool_max_bytes = atoi(spool_bytes->value);
+		janus_config_item *drain_rate = janus_config_get_item_drilldown(config, "general", "spool_drain_rate");
+		if(drain_rate != NULL && drain_rate->value != NULL && atoi(drain_rate->value) > 0)
+			spool_drain_rate = atoi(drain_rate->value);
+		janus_config_item *max_open = janus_config_get_item_drilldown(config, "general", "spool_max_open");
+		if(max_open != NULL && max_open->value != NULL && atoi(max_open->value) >= 0)
+			spool_max_open = atoi(max_open->value);
+		janus_config_item *json_field = janus_config_get_item_drilldown(config, "general", "conflate_json_field");
+		if(json_field != NULL && json_field->value != NULL && strlen(json_field->value) > 0)
+			conflate_json_field = g_strdup(json_field->value);
+		janus_config_item *timing = janus_config_get_item_drilldown(config, "general", "stats_timing");
+		if(timing != NULL && timing->value != NULL)
+			stats_timing = janus_is_true(timing->value);
+		janus_config_item *message_size = janus_config_get_item_drilldown(config, "general", "max_message_size");
+		if(message_size != NULL && message_size->value != NULL && atoi(message_size->value) > (int)sizeof(janus_skywayiot_chunk_header))
+			max_message_size = atoi(message_size->value);
+		janus_config_item *min_size = janus_config_get_item_drilldown(config, "general", "compression_min_size");
+		if(min_size != NULL && min_size->value != NULL && atoi(min_size->value) >= 0)
+			compression_min_size = atoi(min_size->value);
+		janus_config_item *window_bits = janus_config_get_item_drilldown(config, "general", "compression_window_bits");
+		if(window_bits != NULL && window_bits->value != NULL) {
+			if(atoi(window_bits->value) >= 9 && atoi(window_bits->value) <= 15)
+				compression_window_bits = atoi(window_bits->value);
+			else
+				JANUS_LOG(LOG_WARN, "Invalid compression_window_bits %s (should be 9 to 15), using %d\n", window_bits->value, compression_window_bits);
+		}
+		janus_config_item *mem_level = janus_config_get_item_drilldown(config, "general", "compression_mem_level");
+		if(mem_level != NULL && mem_level->value != NULL) {
+			if(atoi(mem_level->value) >= 1 && atoi(mem_level->value) <= 9)
+				compression_mem_level = atoi(mem_level->value);
+			else
+				JANUS_LOG(LOG_WARN, "Invalid compression_mem_level %s (should be 1 to 9), using %d\n", mem_level->value, compression_mem_level);
+		}
+		janus_config_item *cache_size = janus_config_get_item_drilldown(config, "general", "wildcard_cache_size");
+		if(cache_size != NULL && cache_size->value != NULL && atoi(cache_size->value) > 0)
+			wildcard_cache_size = atoi(cache_size->value);
+		janus_config_item *full_interval = janus_config_get_item_drilldown(config, "general", "delta_full_interval");
+		if(full_interval != NULL && full_interval->value != NULL && atoi(full_interval->value) > 0)
+			delta_full_interval = atoi(full_interval->value);
+		janus_config_item *max_keys = janus_config_get_item_drilldown(config, "general", "delta_max_keys");
+		if(max_keys != NULL && max_keys->value != NULL && atoi(max_keys->value) >= 0)
+			delta_max_keys = atoi(max_keys->value);
+		janus_config_item *dictionary = janus_config_get_item_drilldown(config, "general", "compression_dictionary");
+		if(dictionary != NULL && dictionary->value != NULL && strlen(dictionary->value) > 0) {
+			GError *dict_error = NULL;
+			if(!g_file_get_contents(dictionary->value, &compression_dictionary, &compression_dictionary_len, &dict_error)) {
+				JANUS_LOG(LOG_WARN, "Couldn't read the compression dictionary %s (%s), not using one\n",
+					dictionary->value, dict_error ? dict_error->message : "??");
+				if(dict_error)
+					g_error_free(dict_error);
+				compression_dictionary = NULL;
+				compression_dictionary_len = 0;
+			}
+		}
+		janus_config_item *window = janus_config_get_item_drilldown(config, "general", "bulk_window");
+		if(window != NULL && window->value != NULL && atoi(window->value) > 0)
+			bulk_window = atoi(window->value);
+		janus_config_item *reassembly_size = janus_config_get_item_drilldown(config, "general", "max_reassembly_size");
+		if(reassembly_size != NULL && reassembly_size->value != NULL && atoi(reassembly_size->value) > 0)
+			max_reassembly_size = atoi(reassembly_size->value);
+		janus_config_item *clock_type = janus_config_get_item_drilldown(config, "general", "clock");
+		if(clock_type != NULL && clock_type->value != NULL && !strcasecmp(clock_type->value, "simulated")) {
+			janus_config_item *speedup = janus_config_get_item_drilldown(config, "general", "clock_speedup");
+			if(speedup != NULL && speedup->value != NULL) {
+				/* Without any real sleep, the sleepers would just spin */
+				if(atoi(speedup->value) > 0)
+					simulated_speedup = atoi(speedup->value);
+				else
+					JANUS_LOG(LOG_WARN, "Invalid clock_speedup %s, using %d\n", speedup->value, simulated_speedup);
+			}
+			__atomic_store_n(&simulated_time, janus_get_monotonic_time(), __ATOMIC_RELEASE);
+			plugin_clock = &simulated_clock;
+			JANUS_LOG(LOG_WARN, "Using a simulated clock (speedup %d), don't do this in production\n", simulated_speedup);
+		}
+		janus_skywayiot_thread_policies_parse(config);
+	}
+
+	sessions = g_hash_table_new(NULL, NULL);
+	old_sessions = g_queue_new();
+	groups = g_hash_table_new_full(g_int64_hash, g_int64_equal, NULL, (GDestroyNotify)janus_skywayiot_group_free);
+	topics = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)janus_skywayiot_topic_free);
+	devices = g_hash_table_new(g_str_hash, g_str_equal);
+	spools = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify)janus_skywayiot_spool_close);
+	g_queue_init(&retained_lru);
+	retained_bytes = 0;
+	janus_mutex_init(&sessions_mutex);
+	janus_mutex_init(&delivery_mutex);
+	janus_mutex_init(&simulated_mutex);
+	janus_condition_init(&simulated_cond);
+	delivery_wakeups = g_async_queue_new();
+	messages = g_async_queue_new_full((GDestroyNotify) janus_skywayiot_message_free);
+	/* This is the callback we'll need to invoke to contact the gateway */
+	gateway = callback;
+	janus_skywayiot_hotlog_reset();
+	/* The listeners may route frames as soon as they're up */
+	if(config != NULL)
+		janus_skywayiot_routes_load(config);
+
+	/* Opening the external interface comes last, as its threads use all of the above */
+	while(cl != NULL) {
+		janus_config_category *cat = (janus_config_category *)cl->data;
+		if(cat->name == NULL || strcasecmp(cat->name, "external-interface") != 0) {
+			cl = cl->next;
+			continue;
+		}
+
+		JANUS_LOG(LOG_INFO, "config:: name of category '%s'\n", cat->name);
+
+		janus_config_item *data_port = janus_config_get_item(cat, "data_port");
+		janus_config_item *data_addr = janus_config_get_item(cat, "data_addr");
+
+		janus_config_item *media_send_port = janus_config_get_item(cat, "media_send_port");
+		janus_config_item *media_send_dest = janus_config_get_item(cat, "media_send_dest");
+
+		if(data_port == NULL || data_port->value == NULL
+				|| data_addr == NULL || data_addr->value == NULL
+				|| media_send_port == NULL || media_send_port->value == NULL
+				|| media_send_dest == NULL || media_send_dest->value == NULL) {
+			JANUS_LOG(LOG_WARN, "  -- Invalid dataport, mediaport, listenaddr, we'll skip opening '%s'. \n", cat->name);
+			cl = cl->next;
+			continue;
+		} else {
+			janus_config_item *data_listeners = janus_config_get_item(cat, "data_listeners");
+			janus_config_item *data_listener_cpus = janus_config_get_item(cat, "data_listener_cpus");
+			janus_config_item *data_max_backends = janus_config_get_item(cat, "data_max_backends");
+			janus_config_item *standby_port = janus_config_get_item(cat, "standby_port");
+			janus_config_item *data_framing = janus_config_get_item(cat, "data_framing");
+			ext_framed = data_framing && data_framing->value && !strcasecmp(data_framing->value, "framed");
+			ext_ndjson = data_framing && data_framing->value && !strcasecmp(data_framing->value, "ndjson");
+			janus_config_item *max_frame = janus_config_get_item(cat, "data_max_frame_size");
+			if(max_frame && max_frame->value && atoi(max_frame->value) > 0) {
+				/* Only frames (and lines) have room for more than a read's worth */
+				if(ext_framed || ext_ndjson)
+					ext_max_payload = MIN(atoi(max_frame->value), 64*1024*1024);
+				else
+					JANUS_LOG(LOG_WARN, "data_max_frame_size needs data_framing = framed or ndjson, ignoring it\n");
+			}
+			janus_config_item *hb_interval = janus_config_get_item(cat, "heartbeat_interval");
+			janus_config_item *hb_misses = janus_config_get_item(cat, "heartbeat_misses");
+			janus_config_item *fo_buffer = janus_config_get_item(cat, "failover_buffer");
+			if(hb_interval && hb_interval->value && atoi(hb_interval->value) > 0) {
+				if(ext_framed) {
+					heartbeat_interval = (gint64)atoi(hb_interval->value) * 1000;
+					if(hb_misses && hb_misses->value && atoi(hb_misses->value) > 0)
+						heartbeat_misses = atoi(hb_misses->value);
+					if(fo_buffer && fo_buffer->value && atoi(fo_buffer->value) > 0)
+						failover_buffer = atoi(fo_buffer->value);
+				} else {
+					JANUS_LOG(LOG_WARN, "Heartbeats need data_framing = framed, ignoring heartbeat_interval\n");
+				}
+			}
+			janus_config_item *write_timeout = janus_config_get_item(cat, "data_write_timeout");
+			if(write_timeout && write_timeout->value && atoi(write_timeout->value) > 0)
+				backend_write_timeout = (gint64)atoi(write_timeout->value) * 1000;
+			else if(heartbeat_interval > 0)
+				backend_write_timeout = heartbeat_misses * heartbeat_interval;
+			janus_config_item *tls_cert = janus_config_get_item(cat, "data_tls_cert");
+			janus_config_item *tls_key = janus_config_get_item(cat, "data_tls_key");
+			if(tls_cert && tls_cert->value && tls_key && tls_key->value) {
+#ifdef HAVE_LIBSSL
+				janus_config_item *tls_ca = janus_config_get_item(cat, "data_tls_ca");
+				if(janus_skywayiot_tls_setup(tls_cert->value, tls_key->value, tls_ca ? tls_ca->value : NULL) < 0) {
+					/* Better no external interface than a plaintext one */
+					JANUS_LOG(LOG_ERR, "Couldn't setup TLS for the external interface, not opening it\n");
+					cl = cl->next;
+					continue;
+				}
+#else
+				JANUS_LOG(LOG_ERR, "Plugin built without TLS support, not opening the external interface\n");
+				cl = cl->next;
+				continue;
+#endif
+			}
+			create_ext_data_interface( (char *)data_addr->value, atoi(data_port->value),
+				(data_listeners && data_listeners->value && atoi(data_listeners->value) > 0) ? atoi(data_listeners->value) : 1,
+				data_listener_cpus ? data_listener_cpus->value : NULL,
+				(data_max_backends && data_max_backends->value && atoi(data_max_backends->value) > 0) ? atoi(data_max_backends->value) : 1,
+				(standby_port && standby_port->value) ? atoi(standby_port->value) : 0 );
+			create_media_sender( (char *)media_send_dest->value, atoi(media_send_port->value) );
+
+			janus_config_item *media_io = janus_config_get_item(cat, "media_io");
+			if(media_io != NULL && media_io->value != NULL && !strcasecmp(media_io->value, "io_uring") && media_send_fd >= 0) {
+#ifdef HAVE_LIBURING
+				janus_config_item *entries = janus_config_get_item(cat, "io_uring_entries");
+				janus_config_item *batch = janus_config_get_item(cat, "io_uring_batch");
+				janus_config_item *sqpoll = janus_config_get_item(cat, "io_uring_sqpoll");
+				janus_config_item *flush = janus_config_get_item(cat, "io_uring_flush_usecs");
+				if(janus_skywayiot_uring_setup(
+						(entries && entries->value && atoi(entries->value) > 0) ? atoi(entries->value) : 256,
+						(batch && batch->value && atoi(batch->value) > 0) ? atoi(batch->value) : 1,
+						sqpoll && sqpoll->value && janus_is_true(sqpoll->value),
+						(flush && flush->value && atoi(flush->value) > 0) ? atoi(flush->value) : 1000) == 0) {
+					media_uring = TRUE;
+				} else {
+					JANUS_LOG(LOG_WARN, "io_uring unavailable, falling back to plain sends for media\n");
+				}
+#else
+				JANUS_LOG(LOG_WARN, "Plugin built without io_uring support, using plain sends for media\n");
+#endif
+			}
+
+			cl = cl->next;
+		}
+	}
+	janus_config_print(config);
+	/* This plugin actually has nothing to configure... */
+	janus_config_destroy(config);
+	config = NULL;
+	g_atomic_int_set(&initialized, 1);
+
+	GError *error = NULL;
+	const char *thread = NULL;
+	/* Start the thread formatting hot path log records */
+	thread = "logger";
+	logger_thread = g_thread_try_new("skywayiot logger", &janus_skywayiot_logger, NULL, &error);
+	if(error != NULL)
+		goto thread_error;
+	/* Start the thread pacing the conflated deliveries */
+	thread = "delivery";
+	delivery_thread = g_thread_try_new("skywayiot delivery", &janus_skywayiot_delivery, NULL, &error);
+	if(error != NULL)
+		goto thread_error;
+	/* Start the sessions watchdog */
+	thread = "watchdog";
+	watchdog = g_thread_try_new("skywayiot watchdog", &janus_skywayiot_watchdog, NULL, &error);
+	if(error != NULL)
+		goto thread_error;
+	/* Launch the thread that will handle incoming messages */
+	thread = "handler";
+	handler_thread = g_thread_try_new("skywayiot handler", janus_skywayiot_handler, NULL, &error);
+	if(error != NULL)
+		goto thread_error;
+	JANUS_LOG(LOG_INFO, "%s initialized!\n", JANUS_SKYWAYIOT_NAME);
+	return 0;
+
+thread_error:
+	JANUS_LOG(LOG_ERR, "Got error %d (%s) trying to launch the SkywayIoT %s thread...\n", error->code, error->message ? error->message : "??", thread);
+	g_error_free(error);
+	/* Stop and join the threads that did start (the ext listeners too), and free everything else */
+	janus_skywayiot_destroy();
+	return -1;
+}
+
+void janus_skywayiot_destroy(void) {
+	if(!g_atomic_int_get(&initialized))
+		return;
+	g_atomic_int_set(&stopping, 1);
+
+	/* Stop listening to the backends first, so that nothing comes from there anymore */
+	if(ext_stop_fd >= 0) {
+		guint64 one = 1;
+		if(write(ext_stop_fd, &one, sizeof(one)) < 0)
+			JANUS_LOG(LOG_WARN, "Couldn't signal the ext listeners (%s)\n", strerror(errno));
+	}
+	guint i_ext = 0;
+	for(i_ext = 0; i_ext < ext_listeners_count; i_ext++) {
+		if(ext_listeners[i_ext].thread != NULL)
+			g_thread_join(ext_listeners[i_ext].thread);
+		ext_listeners[i_ext].thread = NULL;
+	}
+	if(ext_stop_fd >= 0) {
+		close(ext_stop_fd);
+		ext_stop_fd = -1;
+	}
+
+	g_async_queue_push(messages, &exit_message);
+	if(handler_thread != NULL) {
+		g_thread_join(handler_thread);
+		handler_thread = NULL;
+	}
+	if(watchdog != NULL) {
+		g_thread_join(watchdog);
+		watchdog = NULL;
+	}
+	if(delivery_thread != NULL) {
+		g_async_queue_push(delivery_wakeups, GINT_TO_POINTER(1));
+		g_thread_join(delivery_thread);
+		delivery_thread = NULL;
+	}
+	if(logger_thread != NULL) {
+		g_thread_join(logger_thread);
+		logger_thread = NULL;
+	}
+	/* The listeners are gone (their backends left with them), and so is the handler reporting on them */
+	janus_mutex_lock(&backends_mutex);
+	g_free(ext_listeners);
+	ext_listeners = NULL;
+	ext_listeners_count = 0;
+	g_list_free(backends);
+	backends = NULL;
+	g_free(backend_ring);
+	backend_ring = NULL;
+	backend_ring_size = 0;
+	backend_ring_standby = FALSE;
+	if(named_backends != NULL)
+		g_hash_table_destroy(named_backends);
+	named_backends = NULL;
+	janus_mutex_unlock(&backends_mutex);
+#ifdef HAVE_LIBSSL
+	/* The backends had a reference to it, so it's gone for good only now */
+	SSL_CTX_free(ext_tls_ctx);
+	ext_tls_ctx = NULL;
+#endif
+
+	/* Get rid of the sessions that are still around (and their subscriptions),
+	 * the ones waiting for the watchdog, and then the groups and topics */
+	janus_mutex_lock(&sessions_mutex);
+	GHashTableIter iter;
+	gpointer value;
+	g_hash_table_iter_init(&iter, sessions);
+	while(g_hash_table_iter_next(&iter, NULL, &value)) {
+		janus_skywayiot_session *session = (janus_skywayiot_session *)value;
+		if(session->handle != NULL)
+			session->handle->plugin_handle = NULL;
+		g_hash_table_iter_remove(&iter);
+		janus_skywayiot_unsubscribe_all(session);
+		janus_skywayiot_session_unref(session);
+	}
+	g_hash_table_destroy(sessions);
+	g_queue_free_full(old_sessions, (GDestroyNotify)janus_skywayiot_session_unref);
+	g_hash_table_destroy(groups);
+	groups = NULL;
+	g_hash_table_destroy(topics);
+	topics = NULL;
+	g_hash_table_destroy(devices);
+	devices = NULL;
+	g_queue_clear(&retained_lru);
+	retained_bytes = 0;
+	janus_skywayiot_filter_node_free(filter_root);
+	filter_root = NULL;
+	wildcards_count = 0;
+	wildcard_generation = 0;
+	if(wildcard_cache != NULL)
+		g_hash_table_destroy(wildcard_cache);
+	wildcard_cache = NULL;
+	janus_mutex_unlock(&sessions_mutex);
+	g_async_queue_unref(messages);
+	messages = NULL;
+	g_list_free(delivery_sessions);
+	delivery_sessions = NULL;
+	g_list_free(delivery_throttles);
+	delivery_throttles = NULL;
+	g_list_free(delivery_spools);
+	delivery_spools = NULL;
+	g_list_free(delivery_bulks);
+	delivery_bulks = NULL;
+	/* The spools are only unmapped: their files are still there for the next run */
+	g_queue_clear(&spools_idle);
+	g_hash_table_destroy(spools);
+	spools = NULL;
+	/* Janus threads may have been relaying data when we started stopping */
+	janus_mutex_lock(&route_users_mutex);
+	while(g_atomic_int_get(&route_users) > 0)
+		janus_condition_wait(&route_users_cond, &route_users_mutex);
+	janus_mutex_unlock(&route_users_mutex);
+	janus_skywayiot_routes_free();
+	g_free(spool_dir);
+	spool_dir = NULL;
+	g_free(compression_dictionary);
+	compression_dictionary = NULL;
+	compression_dictionary_len = 0;
+	g_async_queue_unref(delivery_wakeups);
+	delivery_wakeups = NULL;
+	g_free(conflate_json_field);
+	conflate_json_field = NULL;
+	sessions = NULL;
+	old_sessions = NULL;
+
+	plugin_clock = &real_clock;
+	simulated_speedup = JANUS_SKYWAYIOT_DEFAULT_SPEEDUP;
+	janus_condition_destroy(&simulated_cond);
+	janus_mutex_destroy(&simulated_mutex);
+	janus_condition_destroy(&route_users_cond);
+	janus_mutex_destroy(&route_users_mutex);
+#ifdef HAVE_LIBURING
+	if(media_uring) {
+		media_uring = FALSE;
+		janus_skywayiot_uring_teardown();
+	}
+#endif
+
+	g_atomic_int_set(&initialized, 0);
+	g_atomic_int_set(&stopping, 0);
+	JANUS_LOG(LOG_INFO, "%s destroyed!\n", JANUS_SKYWAYIOT_NAME);
+}
+
+int janus_skywayiot_get_api_compatibility(void) {
+	/* Important! This is what your plugin MUST always return: don't lie here or bad things will happen */
+	return JANUS_PLUGIN_API_VERSION;
+}
+
+int janus_skywayiot_get_version(void) {
+	return JANUS_SKYWAYIOT_VERSION;
+}
+
+const char *janus_skywayiot_get_version_string(void) {
+	return JANUS_SKYWAYIOT_VERSION_STRING;
+}
+
+const char *janus_skywayiot_get_description(void) {
+	return JANUS_SKYWAYIOT_DESCRIPTION;
+}
+
+const char *janus_skywayiot_get_name(void) {
+	return JANUS_SKYWAYIOT_NAME;
+}
+
+const char *janus_skywayiot_get_author(void) {
+	return JANUS_SKYWAYIOT_AUTHOR;
+}
+
+const char *janus_skywayiot_get_package(void) {
+	return JANUS_SKYWAYIOT_PACKAGE;
+}
+
+void janus_skywayiot_create_session(janus_plugin_session *handle, int *error) {
+	if(g_atomic_int_get(&stopping) || !g_atomic_int_get(&initialized)) {
+		janus_skywayiot_stats_error(JANUS_SKYWAYIOT_ENTRY_CREATE_SESSION);
+		*error = -1;
+		return;
+	}
+	gint64 start = JANUS_SKYWAYIOT_STATS_START();
 	janus_skywayiot_session *session = (janus_skywayiot_session *)g_malloc0(sizeof(janus_skywayiot_session));
 	session->handle = handle;
 	session->has_audio = FALSE;
@@ -351,14 +4029,20 @@ void janus_skywayiot_create_session(janus_plugin_session *handle, int *error) {
 	session->audio_active = TRUE;
 	session->video_active = TRUE;
 	janus_mutex_init(&session->rec_mutex);
+	session->subscriptions = g_hash_table_new(g_str_hash, g_str_equal);
+	session->wildcards = g_hash_table_new(g_str_hash, g_str_equal);
+	session->throttles = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, janus_skywayiot_throttle_free);
 	session->bitrate = 0; /* No limit */
 	session->destroyed = 0;
+	g_atomic_int_set(&session->ref, 1);
 	g_atomic_int_set(&session->hangingup, 0);
 	handle->plugin_handle = session;
 	janus_mutex_lock(&sessions_mutex);
 	g_hash_table_insert(sessions, handle, session);
 	janus_mutex_unlock(&sessions_mutex);
+	JANUS_SKYWAYIOT_STATS_ADD(session_stats.created, 1);
 
+	janus_skywayiot_stats_done(JANUS_SKYWAYIOT_ENTRY_CREATE_SESSION, start, 0);
 	return;
 }
 
@@ -378,8 +4062,25 @@ void janus_skywayiot_destroy_session(janus_plugin_session *handle, int *error) {
 	if(!session->destroyed) {
 		session->destroyed = janus_get_monotonic_time();
 		g_hash_table_remove(sessions, handle);
+		janus_skywayiot_group_leave(session);
+		janus_skywayiot_unsubscribe_all(session);
+		janus_skywayiot_device_detach(session, TRUE);
+		if(session->outbox != NULL) {
+			janus_mutex_lock(&delivery_mutex);
+			session->outbox->enabled = FALSE;
+			janus_skywayiot_outbox_clear(session->outbox);
+			if(session->outbox->scheduled) {
+				delivery_sessions = g_list_remove(delivery_sessions, session);
+				session->outbox->scheduled = FALSE;
+			}
+			janus_mutex_unlock(&delivery_mutex);
+		}
+		janus_mutex_lock(&delivery_mutex);
+		janus_skywayiot_bulk_reset(session, 0);
+		janus_mutex_unlock(&delivery_mutex);
 		/* Cleaning up and removing the session is done in a lazy way */
-		old_sessions = g_list_append(old_sessions, session);
+		g_queue_push_tail(old_sessions, session);
+		JANUS_SKYWAYIOT_STATS_ADD(session_stats.destroyed, 1);
 	}
 	janus_mutex_unlock(&sessions_mutex);
 	return;
@@ -400,13 +4101,106 @@ json_t *janus_skywayiot_query_session(janus_plugin_session *handle) {
 	json_object_set_new(info, "video_active", session->video_active ? json_true() : json_false());
 	json_object_set_new(info, "bitrate", json_integer(session->bitrate));
 	json_object_set_new(info, "slowlink_count", json_integer(session->slowlink_count));
+	json_object_set_new(info, "chunking", session->envelope ? json_true() : json_false());
+	json_object_set_new(info, "delta", session->delta != NULL && session->delta->enabled ? json_true() : json_false());
+	if(session->compressor != NULL) {
+		janus_mutex_lock(&session->compressor->mutex);
+		json_object_set_new(info, "compression", json_string(codec_names[session->compressor->codec]));
+		json_object_set_new(info, "compression_in", json_integer(session->compressor->raw_bytes));
+		json_object_set_new(info, "compression_out", json_integer(session->compressor->compressed_bytes));
+		janus_mutex_unlock(&session->compressor->mutex);
+	}
+	janus_mutex_lock(&delivery_mutex);
+	if(session->bulk != NULL) {
+		json_t *bulk = json_object();
+		json_object_set_new(bulk, "transfer", json_integer(session->bulk->transfer));
+		json_object_set_new(bulk, "next", json_integer(session->bulk->next));
+		json_object_set_new(bulk, "acked", json_integer(session->bulk->acked));
+		json_object_set_new(bulk, "queued", json_integer(g_queue_get_length(&session->bulk->queue)));
+		json_object_set_new(bulk, "sent", json_integer(session->bulk->sent));
+		json_object_set_new(bulk, "overflow", json_integer(session->bulk->overflow));
+		json_object_set_new(info, "bulk", bulk);
+	}
+	janus_mutex_unlock(&delivery_mutex);
+	janus_mutex_lock(&sessions_mutex);
+	json_object_set_new(info, "groups", json_integer(g_list_length(session->groups)));
+	if(session->device_id != NULL)
+		json_object_set_new(info, "device_id", json_string(session->device_id));
+	json_t *subscriptions = json_array();
+	GHashTableIter iter;
+	gpointer key, value;
+	g_hash_table_iter_init(&iter, session->subscriptions);
+	while(g_hash_table_iter_next(&iter, &key, NULL))
+		json_array_append_new(subscriptions, json_string((const char *)key));
+	g_hash_table_iter_init(&iter, session->wildcards);
+	while(g_hash_table_iter_next(&iter, &key, NULL))
+		json_array_append_new(subscriptions, json_string((const char *)key));
+	json_object_set_new(info, "subscriptions", subscriptions);
+	if(g_hash_table_size(session->throttles) > 0) {
+		json_t *limits = json_object();
+		janus_mutex_lock(&delivery_mutex);
+		g_hash_table_iter_init(&iter, session->throttles);
+		while(g_hash_table_iter_next(&iter, NULL, &value)) {
+			janus_skywayiot_throttle *throttle = (janus_skywayiot_throttle *)value;
+			json_t *limit = json_object();
+			json_object_set_new(limit, "window", json_integer(throttle->window / 1000));
+			json_object_set_new(limit, "aggregate", json_string(aggregate_names[throttle->aggregate]));
+			json_object_set_new(limit, "absorbed", json_integer(throttle->absorbed));
+			json_object_set_new(limit, "pending", json_integer(throttle->latest != NULL ? 1 : 0));
+			json_object_set_new(limit, "values", json_integer(throttle->count));
+			json_object_set_new(limits, throttle->topic, limit);
+		}
+		janus_mutex_unlock(&delivery_mutex);
+		json_object_set_new(info, "rate_limits", limits);
+	}
+	if(session->outbox != NULL) {
+		janus_mutex_lock(&delivery_mutex);
+		json_object_set_new(info, "conflate", session->outbox->enabled ? json_true() : json_false());
+		json_object_set_new(info, "conflate_rate", json_integer(session->outbox->rate));
+		json_object_set_new(info, "queued", json_integer(g_queue_get_length(&session->outbox->queue)));
+		json_object_set_new(info, "delivered", json_integer(session->outbox->delivered));
+		json_object_set_new(info, "conflated", json_integer(session->outbox->conflated));
+		json_object_set_new(info, "dropped", json_integer(session->outbox->dropped));
+		json_object_set_new(info, "expired", json_integer(session->outbox->expired));
+		janus_mutex_unlock(&delivery_mutex);
+	}
+	janus_mutex_unlock(&sessions_mutex);
 	json_object_set_new(info, "destroyed", json_integer(session->destroyed));
 	return info;
 }
 
 struct janus_plugin_result *janus_skywayiot_handle_message(janus_plugin_session *handle, char *transaction, json_t *message, json_t *jsep) {
-	if(g_atomic_int_get(&stopping) || !g_atomic_int_get(&initialized))
+	if(g_atomic_int_get(&stopping) || !g_atomic_int_get(&initialized)) {
+		janus_skywayiot_stats_error(JANUS_SKYWAYIOT_ENTRY_HANDLE_MESSAGE);
 		return janus_plugin_result_new(JANUS_PLUGIN_ERROR, g_atomic_int_get(&stopping) ? "Shutting down" : "Plugin not initialized", NULL);
+	}
+	gint64 start = JANUS_SKYWAYIOT_STATS_START();
+
+	/* Statistics and clock requests are answered synchronously, everything else goes to the handler thread */
+	json_t *request = json_object_get(message, "request");
+	const char *request_text = json_is_string(request) ? json_string_value(request) : NULL;
+	if(request_text && (!strcasecmp(request_text, "stats") || !strcasecmp(request_text, "clock"))) {
+		json_t *response = json_object();
+		if(!strcasecmp(request_text, "stats")) {
+			json_t *reset = json_object_get(message, "reset");
+			json_object_set_new(response, "skywayiot", json_string("stats"));
+			json_object_set_new(response, "stats", janus_skywayiot_stats_json(reset && json_is_true(reset)));
+		} else {
+			/* In simulation mode, the caller can also jump forward in time */
+			json_t *advance = json_object_get(message, "advance");
+			if(plugin_clock == &simulated_clock && advance && json_is_integer(advance) && json_integer_value(advance) > 0)
+				janus_skywayiot_simulated_advance_to(plugin_clock->now() + json_integer_value(advance));
+			json_object_set_new(response, "skywayiot", json_string("clock"));
+			json_object_set_new(response, "clock", json_string(plugin_clock->name));
+			json_object_set_new(response, "now", json_integer(plugin_clock->now()));
+		}
+		json_decref(message);
+		if(jsep)
+			json_decref(jsep);
+		g_free(transaction);
+		janus_skywayiot_stats_done(JANUS_SKYWAYIOT_ENTRY_HANDLE_MESSAGE, start, 0);
+		return janus_plugin_result_new(JANUS_PLUGIN_OK, NULL, response);
+	}
 
 	janus_skywayiot_message *msg = g_malloc0(sizeof(janus_skywayiot_message));
 	msg->handle = handle;
@@ -414,6 +4208,7 @@ struct janus_plugin_result *janus_skywayiot_handle_message(janus_plugin_session
 	msg->message = message;
 	msg->jsep = jsep;
 	g_async_queue_push(messages, msg);
+	janus_skywayiot_stats_done(JANUS_SKYWAYIOT_ENTRY_HANDLE_MESSAGE, start, 0);
 
 	/* All the requests to this plugin are handled asynchronously: we add a comment
 	 * (a JSON object with a "hint" string in it, that's what the core expects),
@@ -421,61 +4216,36 @@ struct janus_plugin_result *janus_skywayiot_handle_message(janus_plugin_session
 	return janus_plugin_result_new(JANUS_PLUGIN_OK_WAIT, "I'm taking my time!", NULL);
 }
 
-typedef struct my_struct {
-	guint64 handle_id;
-	char* mesg;
-} my_struct;
-
-static void show(gpointer key, gpointer value, gpointer data) {
-	janus_plugin_session *handle = (janus_plugin_session *)key;
-	janus_skywayiot_session *session = (janus_skywayiot_session *)value;
-
-	guint64 handle_id = (guint64)handle;
-	my_struct *search = (my_struct *)data;
-
-	printf("[%ld, %ld] %s\n", handle_id, search->handle_id, search->mesg );
-
-	if(search->handle_id == handle_id) {
-		gboolean has_audio = session->has_audio;
-		gboolean has_video = session->has_video;
-		gboolean has_data = session->has_data;
-
-		printf("[%ld]matched!!!  has_video => %d, has_audio => %d, has_data => %d\n", handle_id, has_video, has_audio, has_data);
-	}
-}
-
 void janus_skywayiot_setup_media(janus_plugin_session *handle) {
-	JANUS_LOG(LOG_INFO, "WebRTC media is now available\n");
 	if(g_atomic_int_get(&stopping) || !g_atomic_int_get(&initialized))
 		return;
+	gint64 start = JANUS_SKYWAYIOT_STATS_START();
 	janus_skywayiot_session *session = (janus_skywayiot_session *)handle->plugin_handle;
 	if(!session) {
-		JANUS_LOG(LOG_ERR, "No session associated with this handle...\n");
+		JANUS_SKYWAYIOT_HOT_LOG(LOG_ERR, "[%"SCNu64"] No session associated with this handle...", (guint64)handle);
+		janus_skywayiot_stats_error(JANUS_SKYWAYIOT_ENTRY_SETUP_MEDIA);
 		return;
 	}
-	if(session->destroyed)
+	if(session->destroyed) {
+		janus_skywayiot_stats_error(JANUS_SKYWAYIOT_ENTRY_SETUP_MEDIA);
 		return;
+	}
 
-	gboolean has_audio = session->has_audio;
-	gboolean has_video = session->has_video;
-	gboolean has_data = session->has_data;
-
-	char *mesg = g_strdup("abc");
-	my_struct search = {
-		handle_id: (guint64)handle,
-		mesg: mesg
-	};
-
-	g_hash_table_foreach(sessions, show, &search);
-
-	JANUS_LOG(LOG_INFO, "[%ld, %ld] WebRTC media : has_audio[%d], has_video[%d], has_data[%d]\n", (guint64)handle, (guint64)session, has_audio, has_video, has_data);
+	JANUS_SKYWAYIOT_HOT_LOG(LOG_INFO, "[%"SCNu64"] WebRTC media is now available: has_audio[%"SCNu64"], has_video[%"SCNu64"], has_data[%"SCNu64"]",
+		(guint64)handle, session->has_audio, session->has_video, session->has_data);
 	g_atomic_int_set(&session->hangingup, 0);
+	/* The last values of its topics wait for the data channel, see janus_skywayiot_data_opened */
+	janus_mutex_lock(&sessions_mutex);
+	session->media_ready = TRUE;
+	janus_mutex_unlock(&sessions_mutex);
 	/* We really don't care, as we only send RTP/RTCP we get in the first place back anyway */
+	janus_skywayiot_stats_done(JANUS_SKYWAYIOT_ENTRY_SETUP_MEDIA, start, 0);
 }
 
 void janus_skywayiot_incoming_rtp(janus_plugin_session *handle, int video, char *buf, int len) {
 	if(handle == NULL || handle->stopped || g_atomic_int_get(&stopping) || !g_atomic_int_get(&initialized))
 		return;
+	gint64 start = JANUS_SKYWAYIOT_STATS_START();
 
 
 	/* Simple echo test */
@@ -483,29 +4253,58 @@ void janus_skywayiot_incoming_rtp(janus_plugin_session *handle, int video, char
 		/* Honour the audio/video active flags */
 		janus_skywayiot_session *session = (janus_skywayiot_session *)handle->plugin_handle;
 		if(!session) {
-			JANUS_LOG(LOG_ERR, "No session associated with this handle...\n");
+			JANUS_SKYWAYIOT_HOT_LOG(LOG_ERR, "[%"SCNu64"] No session associated with this handle...", (guint64)handle);
+			janus_skywayiot_stats_error(JANUS_SKYWAYIOT_ENTRY_INCOMING_RTP);
 			return;
 		}
 		if(session->destroyed)
 			return;
 		if((!video && session->audio_active) || (video && session->video_active)) {
-			socklen_t addrlen = sizeof(g_media_sender);
-
-			if((void *)&g_media_sender != NULL) {
-				sendto(media_send_fd, buf, len, 0, (struct sockaddr *)&g_media_sender, addrlen);
+			if(media_send_fd < 0)
+				return;
+			int res = 0;
+#ifdef HAVE_LIBURING
+			if(media_uring) {
+				/* Queued on the ring, errors for earlier sends are counted when reaped */
+				res = janus_skywayiot_uring_send(buf, len);
+			} else
+#endif
+			/* The socket is connected to the media destination, which saves the kernel
+			 * a route lookup per packet, and we never want to block the media thread:
+			 * if the socket buffer is full the packet is lost anyway */
+			res = send(media_send_fd, buf, len, MSG_DONTWAIT);
+			if(res < 0) {
+				if(errno == EAGAIN || errno == EWOULDBLOCK) {
+					JANUS_SKYWAYIOT_STATS_ADD(media_stats.would_block, 1);
+				} else {
+					JANUS_SKYWAYIOT_STATS_ADD(media_stats.send_errors, 1);
+					JANUS_SKYWAYIOT_HOT_LOG(LOG_ERR, "[%"SCNu64"] Failed to forward RTP packet (errno %"SCNu64")", (guint64)handle, errno);
+				}
+				janus_skywayiot_stats_error(JANUS_SKYWAYIOT_ENTRY_INCOMING_RTP);
+				return;
 			}
+			if(video) {
+				JANUS_SKYWAYIOT_STATS_ADD(media_stats.video_packets, 1);
+			} else {
+				JANUS_SKYWAYIOT_STATS_ADD(media_stats.audio_packets, 1);
+			}
+		} else {
+			JANUS_SKYWAYIOT_STATS_ADD(media_stats.inactive, 1);
 		}
+		janus_skywayiot_stats_done(JANUS_SKYWAYIOT_ENTRY_INCOMING_RTP, start, len);
 	}
 }
 
 void janus_skywayiot_incoming_rtcp(janus_plugin_session *handle, int video, char *buf, int len) {
 	if(handle == NULL || handle->stopped || g_atomic_int_get(&stopping) || !g_atomic_int_get(&initialized))
 		return;
+	gint64 start = JANUS_SKYWAYIOT_STATS_START();
 	/* Simple echo test */
 	if(gateway) {
 		janus_skywayiot_session *session = (janus_skywayiot_session *)handle->plugin_handle;
 		if(!session) {
-			JANUS_LOG(LOG_ERR, "No session associated with this handle...\n");
+			JANUS_SKYWAYIOT_HOT_LOG(LOG_ERR, "[%"SCNu64"] No session associated with this handle...", (guint64)handle);
+			janus_skywayiot_stats_error(JANUS_SKYWAYIOT_ENTRY_INCOMING_RTCP);
 			return;
 		}
 		if(session->destroyed)
@@ -513,6 +4312,7 @@ void janus_skywayiot_incoming_rtcp(janus_plugin_session *handle, int video, char
 		if(session->bitrate > 0)
 			janus_rtcp_cap_remb(buf, len, session->bitrate);
 		gateway->relay_rtcp(handle, video, buf, len);
+		janus_skywayiot_stats_done(JANUS_SKYWAYIOT_ENTRY_INCOMING_RTCP, start, len);
 	}
 }
 
@@ -524,34 +4324,73 @@ void janus_skywayiot_incoming_data(janus_plugin_session *handle, char *buf, int
 	if(handle == NULL || handle->stopped || g_atomic_int_get(&stopping) || !g_atomic_int_get(&initialized))
 		return;
 
+	gint64 start = JANUS_SKYWAYIOT_STATS_START();
+
 	if(gateway) {
 		janus_skywayiot_session *session = (janus_skywayiot_session *)handle->plugin_handle;
 		if(!session) {
-			JANUS_LOG(LOG_ERR, "No session associated with this handle...\n");
+			JANUS_SKYWAYIOT_HOT_LOG(LOG_ERR, "[%"SCNu64"] No session associated with this handle...", (guint64)handle);
+			janus_skywayiot_stats_error(JANUS_SKYWAYIOT_ENTRY_INCOMING_DATA);
 			return;
 		}
 		if(session->destroyed)
 			return;
 		if(buf == NULL || len <= 0)
 			return;
+		if(!g_atomic_int_get(&session->data_open))
+			janus_skywayiot_data_opened(session);
 
-		char* ext_data;
-		int id_len = sizeof(guint64);
-		guint64 handle_id = (guint64)handle;
-
-		ext_data = (char *)malloc( id_len + len );
-		memcpy(ext_data, &handle_id, id_len);
-		memcpy(ext_data + id_len, buf, len);
-
-		int n;
-		if( ext_fd > 0 ) {
-			n = write( ext_fd, ext_data, (id_len + len) );
-
-			if ( n < 0 ) {
-				JANUS_LOG(LOG_ERR, "Failed to write data to ``ext_fd``\n");
+		gboolean reassembled = FALSE;
+		if(session->envelope && (buf[0] & JANUS_SKYWAYIOT_ENVELOPE_BULK)) {
+			janus_skywayiot_bulk_ack(session, buf, len);
+			return;
+		}
+		char *decompressed = NULL, *decoded = NULL;
+		if(session->envelope) {
+			guint8 flags = buf[0];
+			reassembled = (flags & JANUS_SKYWAYIOT_ENVELOPE_CHUNK) != 0;
+			if(!janus_skywayiot_unwrap(session, buf, len, &buf, &len))
+				return;
+			if(flags & (JANUS_SKYWAYIOT_ENVELOPE_COMPRESSED | JANUS_SKYWAYIOT_ENVELOPE_STORED)) {
+				decompressed = janus_skywayiot_decompress(session, (flags & JANUS_SKYWAYIOT_ENVELOPE_STORED) != 0, buf, len, &len);
+				if(reassembled)
+					janus_skywayiot_reassembly_reset(session->reassembly);
+				reassembled = FALSE;
+				if(decompressed == NULL) {
+					JANUS_SKYWAYIOT_HOT_LOG(LOG_WARN, "[%"SCNu64"] Couldn't decompress a message", (guint64)handle);
+					janus_skywayiot_stats_error(JANUS_SKYWAYIOT_ENTRY_INCOMING_DATA);
+					return;
+				}
+				buf = decompressed;
 			}
+			if(flags & JANUS_SKYWAYIOT_ENVELOPE_DELTA) {
+				decoded = janus_skywayiot_delta_decode(session, buf, len, &len);
+				if(reassembled)
+					janus_skywayiot_reassembly_reset(session->reassembly);
+				reassembled = FALSE;
+				g_free(decompressed);
+				decompressed = NULL;
+				if(decoded == NULL) {
+					JANUS_SKYWAYIOT_HOT_LOG(LOG_WARN, "[%"SCNu64"] Couldn't decode a delta message", (guint64)handle);
+					janus_skywayiot_stats_error(JANUS_SKYWAYIOT_ENTRY_INCOMING_DATA);
+					return;
+				}
+				buf = decoded;
+			}
+		}
+
+		guint64 handle_id = (guint64)handle;
+		int n = janus_skywayiot_ext_send(handle_id, buf, len);
+		if(reassembled)
+			janus_skywayiot_reassembly_reset(session->reassembly);
+		g_free(decompressed);
+		g_free(decoded);
+		if(n < 0) {
+			JANUS_SKYWAYIOT_HOT_LOG(LOG_ERR, "[%"SCNu64"] Failed to write data to the external interface (errno %"SCNu64")", handle_id, errno);
+			janus_skywayiot_stats_error(JANUS_SKYWAYIOT_ENTRY_INCOMING_DATA);
+		} else if(n > 0) {
+			janus_skywayiot_stats_done(JANUS_SKYWAYIOT_ENTRY_INCOMING_DATA, start, len);
 		}
-		g_free(ext_data);
 	}
 }
 
@@ -627,6 +4466,17 @@ void janus_skywayiot_hangup_media(janus_plugin_session *handle) {
 	session->vrc = NULL;
 	session->drc = NULL;
 	janus_mutex_unlock(&session->rec_mutex);
+	janus_mutex_lock(&sessions_mutex);
+	session->media_ready = FALSE;
+	g_atomic_int_set(&session->data_open, 0);
+	janus_skywayiot_device_detach(session, FALSE);
+	janus_mutex_unlock(&sessions_mutex);
+	/* Nobody to deliver the queued messages (or the transfer) to anymore */
+	janus_mutex_lock(&delivery_mutex);
+	if(session->outbox != NULL)
+		janus_skywayiot_outbox_clear(session->outbox);
+	janus_skywayiot_bulk_reset(session, 0);
+	janus_mutex_unlock(&delivery_mutex);
 	/* Reset controls */
 	session->has_audio = FALSE;
 	session->has_video = FALSE;
@@ -639,6 +4489,7 @@ void janus_skywayiot_hangup_media(janus_plugin_session *handle) {
 /* Thread to handle incoming messages */
 static void *janus_skywayiot_handler(void *data) {
 	JANUS_LOG(LOG_VERB, "Joining SkywayIoT handler thread\n");
+	janus_skywayiot_thread_policy_apply(JANUS_SKYWAYIOT_THREAD_HANDLER, -1);
 	janus_skywayiot_message *msg = NULL;
 	int error_code = 0;
 	char *error_cause = g_malloc0(512);
@@ -707,6 +4558,103 @@ static void *janus_skywayiot_handler(void *data) {
 			g_snprintf(error_cause, 512, "Invalid value (bitrate should be a positive integer)");
 			goto error;
 		}
+		json_t *device_id = json_object_get(root, "device_id");
+		if(device_id && (!json_is_string(device_id) || strlen(json_string_value(device_id)) == 0 ||
+				strlen(json_string_value(device_id)) > JANUS_SKYWAYIOT_DEVICE_ID_MAX)) {
+			JANUS_LOG(LOG_ERR, "Invalid element (device_id should be a non empty string)\n");
+			error_code = JANUS_SKYWAYIOT_ERROR_INVALID_ELEMENT;
+			g_snprintf(error_cause, 512, "Invalid value (device_id should be a non empty string, up to %d characters)",
+				JANUS_SKYWAYIOT_DEVICE_ID_MAX);
+			goto error;
+		}
+		json_t *chunking = json_object_get(root, "chunking");
+		if(chunking && !json_is_boolean(chunking)) {
+			JANUS_LOG(LOG_ERR, "Invalid element (chunking should be a boolean)\n");
+			error_code = JANUS_SKYWAYIOT_ERROR_INVALID_ELEMENT;
+			g_snprintf(error_cause, 512, "Invalid value (chunking should be a boolean)");
+			goto error;
+		}
+		json_t *delta = json_object_get(root, "delta");
+		if(delta && !json_is_boolean(delta)) {
+			JANUS_LOG(LOG_ERR, "Invalid element (delta should be a boolean)\n");
+			error_code = JANUS_SKYWAYIOT_ERROR_INVALID_ELEMENT;
+			g_snprintf(error_cause, 512, "Invalid value (delta should be a boolean)");
+			goto error;
+		}
+		json_t *compression = json_object_get(root, "compression");
+		janus_skywayiot_codec codec = JANUS_SKYWAYIOT_CODEC_NONE;
+		if(compression) {
+			for(codec = 0; codec < JANUS_SKYWAYIOT_CODEC_MAX; codec++) {
+				if(json_is_string(compression) && !strcasecmp(json_string_value(compression), codec_names[codec]))
+					break;
+			}
+			if(codec == JANUS_SKYWAYIOT_CODEC_MAX || !janus_skywayiot_codec_supported(codec)) {
+				JANUS_LOG(LOG_ERR, "Invalid element (unsupported compression)\n");
+				error_code = JANUS_SKYWAYIOT_ERROR_INVALID_ELEMENT;
+				g_snprintf(error_cause, 512, "Invalid value (compression should be none%s%s)",
+#ifdef HAVE_ZLIB
+					", deflate",
+#else
+					"",
+#endif
+#ifdef HAVE_LIBLZ4
+					", lz4"
+#else
+					""
+#endif
+				);
+				goto error;
+			}
+		}
+		json_t *conflate = json_object_get(root, "conflate");
+		if(conflate && !json_is_boolean(conflate)) {
+			JANUS_LOG(LOG_ERR, "Invalid element (conflate should be a boolean)\n");
+			error_code = JANUS_SKYWAYIOT_ERROR_INVALID_ELEMENT;
+			g_snprintf(error_cause, 512, "Invalid value (conflate should be a boolean)");
+			goto error;
+		}
+		json_t *conflate_rate = json_object_get(root, "conflate_rate");
+		if(conflate_rate && (!json_is_integer(conflate_rate) || json_integer_value(conflate_rate) <= 0)) {
+			JANUS_LOG(LOG_ERR, "Invalid element (conflate_rate should be a positive integer)\n");
+			error_code = JANUS_SKYWAYIOT_ERROR_INVALID_ELEMENT;
+			g_snprintf(error_cause, 512, "Invalid value (conflate_rate should be a positive integer)");
+			goto error;
+		}
+		json_t *subscribe = json_object_get(root, "subscribe");
+		if(subscribe) {
+			const char *invalid = "subscribe should be an array";
+			gboolean valid = json_is_array(subscribe);
+			size_t index = 0;
+			json_t *value = NULL;
+			gint64 window = 0;
+			janus_skywayiot_aggregate aggregate;
+			json_array_foreach(subscribe, index, value) {
+				if(janus_skywayiot_parse_subscription(value, &window, &aggregate, &invalid) == NULL) {
+					valid = FALSE;
+					break;
+				}
+			}
+			if(!valid) {
+				JANUS_LOG(LOG_ERR, "Invalid element (%s)\n", invalid);
+				error_code = JANUS_SKYWAYIOT_ERROR_INVALID_ELEMENT;
+				g_snprintf(error_cause, 512, "Invalid value (%s)", invalid);
+				goto error;
+			}
+		}
+		json_t *unsubscribe = json_object_get(root, "unsubscribe");
+		if(unsubscribe && !janus_skywayiot_is_string_array(unsubscribe)) {
+			JANUS_LOG(LOG_ERR, "Invalid element (unsubscribe should be an array of strings)\n");
+			error_code = JANUS_SKYWAYIOT_ERROR_INVALID_ELEMENT;
+			g_snprintf(error_cause, 512, "Invalid value (unsubscribe should be an array of strings)");
+			goto error;
+		}
+		json_t *sync = json_object_get(root, "sync");
+		if(sync && !json_is_boolean(sync)) {
+			JANUS_LOG(LOG_ERR, "Invalid element (sync should be a boolean)\n");
+			error_code = JANUS_SKYWAYIOT_ERROR_INVALID_ELEMENT;
+			g_snprintf(error_cause, 512, "Invalid value (sync should be a boolean)");
+			goto error;
+		}
 		/* Enforce request */
 		if(audio) {
 			session->audio_active = json_is_true(audio);
@@ -737,6 +4685,58 @@ static void *janus_skywayiot_handler(void *data) {
 				/* FIXME How should we handle a subsequent "no limit" bitrate? */
 			}
 		}
+		if(chunking) {
+			session->envelope = json_is_true(chunking);
+			JANUS_LOG(LOG_VERB, "Setting chunking property: %s\n", session->envelope ? "true" : "false");
+		}
+		if(compression) {
+			/* Compressed messages are flagged in the envelope, so that comes with it */
+			if(codec != JANUS_SKYWAYIOT_CODEC_NONE)
+				session->envelope = TRUE;
+			janus_skywayiot_compression_configure(session, codec);
+		}
+		if(delta) {
+			/* Same as compression, deltas are flagged in the envelope */
+			if(json_is_true(delta))
+				session->envelope = TRUE;
+			janus_skywayiot_delta_configure(session, json_is_true(delta));
+		}
+		if(device_id) {
+			janus_mutex_lock(&sessions_mutex);
+			janus_skywayiot_device_set(session, json_string_value(device_id));
+			janus_mutex_unlock(&sessions_mutex);
+		}
+		if(conflate || conflate_rate)
+			janus_skywayiot_outbox_configure(session, conflate ? json_is_true(conflate) : -1,
+				conflate_rate ? json_integer_value(conflate_rate) : 0);
+		if(unsubscribe || subscribe) {
+			size_t index = 0;
+			json_t *value = NULL;
+			janus_mutex_lock(&sessions_mutex);
+			if(unsubscribe) {
+				json_array_foreach(unsubscribe, index, value)
+					janus_skywayiot_unsubscribe(session, json_string_value(value));
+			}
+			if(subscribe) {
+				json_array_foreach(subscribe, index, value) {
+					gint64 window = 0;
+					janus_skywayiot_aggregate aggregate;
+					const char *invalid = NULL;
+					const char *name = janus_skywayiot_parse_subscription(value, &window, &aggregate, &invalid);
+					janus_skywayiot_topic *topic = janus_skywayiot_subscribe(session, name);
+					janus_skywayiot_throttle_set(session, name, window, aggregate);
+					/* New subscribers get the last value right away, if they can receive it */
+					if(topic != NULL && g_atomic_int_get(&session->data_open))
+						janus_skywayiot_topics_sync(session, topic);
+				}
+			}
+			JANUS_LOG(LOG_VERB, "Subscribed to %u topic(s) and %u filter(s)\n",
+				g_hash_table_size(session->subscriptions), g_hash_table_size(session->wildcards));
+			janus_mutex_unlock(&sessions_mutex);
+		}
+		/* The client says its data channel is open: no need to wait for it to send something */
+		if(sync && json_is_true(sync) && !g_atomic_int_get(&session->data_open))
+			janus_skywayiot_data_opened(session);
 		/* Any SDP to handle? */
 		if(msg_sdp) {
 			JANUS_LOG(LOG_VERB, "This is involving a negotiation (%s) as well:\n%s\n", msg_sdp_type, msg_sdp);
@@ -745,10 +4745,10 @@ static void *janus_skywayiot_handler(void *data) {
 			session->has_data = (strstr(msg_sdp, "DTLS/SCTP") != NULL);
 		}
 
-		if(!audio && !video && !bitrate && !msg_sdp) {
-			JANUS_LOG(LOG_ERR, "No supported attributes (audio, video, bitrate, jsep) found\n");
+		if(!audio && !video && !bitrate && !chunking && !compression && !delta && !device_id && !conflate && !conflate_rate && !subscribe && !unsubscribe && !sync && !msg_sdp) {
+			JANUS_LOG(LOG_ERR, "No supported attributes (audio, video, bitrate, chunking, compression, delta, device_id, conflate, conflate_rate, subscribe, unsubscribe, sync, jsep) found\n");
 			error_code = JANUS_SKYWAYIOT_ERROR_INVALID_ELEMENT;
-			g_snprintf(error_cause, 512, "Message error: no supported attributes (audio, video, bitrate, record, jsep) found");
+			g_snprintf(error_cause, 512, "Message error: no supported attributes (audio, video, bitrate, chunking, compression, delta, device_id, conflate, conflate_rate, subscribe, unsubscribe, sync, jsep) found");
 			goto error;
 		}
 
@@ -828,41 +4828,740 @@ error:
 	return NULL;
 }
 
+/* Mixes the bits of handle and backend ids, which are pointers and counters */
+static guint64 janus_skywayiot_hash64(guint64 x) {
+	x += 0x9E3779B97F4A7C15ULL;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	return x ^ (x >> 31);
+}
+
+static int janus_skywayiot_ring_point_compare(const void *a, const void *b) {
+	guint64 ha = ((const janus_skywayiot_ring_point *)a)->hash, hb = ((const janus_skywayiot_ring_point *)b)->hash;
+	return ha < hb ? -1 : (ha > hb ? 1 : 0);
+}
+
+/* Rebuild the hash ring after a backend joined or left: the caller holds
+ * backends_mutex. Standby backends only get traffic when no active one is left */
+static void janus_skywayiot_ring_rebuild(void) {
+	g_free(backend_ring);
+	backend_ring = NULL;
+	guint active = 0, standby = 0;
+	GList *bl = NULL;
+	if(named_backends != NULL)
+		g_hash_table_remove_all(named_backends);
+	for(bl = backends; bl != NULL; bl = bl->next) {
+		janus_skywayiot_backend *backend = (janus_skywayiot_backend *)bl->data;
+		if(backend->name != NULL) {
+			/* Named backends are out of the ring, they get what's routed to them */
+			GPtrArray *named = g_hash_table_lookup(named_backends, backend->name);
+			if(named == NULL) {
+				named = g_ptr_array_new();
+				g_hash_table_insert(named_backends, backend->name, named);
+			}
+			g_ptr_array_add(named, backend);
+		} else if(backend->standby) {
+			standby++;
+		} else {
+			active++;
+		}
+	}
+	gboolean use_standby = (active == 0 && standby > 0);
+	if(use_standby != backend_ring_standby) {
+		if(use_standby) {
+			JANUS_LOG(LOG_WARN, "No active backend left, failing over to %u standby backend(s)\n", standby);
+		} else {
+			JANUS_LOG(LOG_INFO, "Active backend(s) available again, leaving the standby\n");
+		}
+		backend_ring_standby = use_standby;
+	}
+	backend_ring_size = (use_standby ? standby : active) * JANUS_SKYWAYIOT_RING_VNODES;
+	if(backend_ring_size == 0)
+		return;
+	backend_ring = g_malloc(backend_ring_size * sizeof(janus_skywayiot_ring_point));
+	guint i = 0, v = 0;
+	for(bl = backends; bl != NULL; bl = bl->next) {
+		janus_skywayiot_backend *backend = (janus_skywayiot_backend *)bl->data;
+		if(backend->standby != use_standby || backend->name != NULL)
+			continue;
+		for(v = 0; v < JANUS_SKYWAYIOT_RING_VNODES; v++, i++) {
+			backend_ring[i].hash = janus_skywayiot_hash64(janus_skywayiot_hash64(backend->id) ^ v);
+			backend_ring[i].backend = backend;
+		}
+	}
+	qsort(backend_ring, backend_ring_size, sizeof(janus_skywayiot_ring_point), janus_skywayiot_ring_point_compare);
+}
+
+static void janus_skywayiot_backend_unref(janus_skywayiot_backend *backend) {
+	if(!g_atomic_int_dec_and_test(&backend->ref))
+		return;
+#ifdef HAVE_LIBSSL
+	if(backend->ssl != NULL)
+		SSL_free(backend->ssl);
+#endif
+	close(backend->fd);
+	janus_mutex_destroy(&backend->mutex);
+	if(backend->pending != NULL)
+		g_queue_free_full(backend->pending, (GDestroyNotify)g_free);
+	g_free(backend->inbuf);
+	g_free(backend->name);
+	g_free(backend);
+}
+
+/* Add a newly accepted connection (and its SSL session, if the external
+ * interface does TLS) to the pool: the returned reference belongs to the
+ * listener thread */
+static janus_skywayiot_backend *janus_skywayiot_backend_add(int fd, janus_skywayiot_ext_listener *listener, gpointer tls) {
+	janus_skywayiot_backend *backend = g_malloc0(sizeof(janus_skywayiot_backend));
+	backend->fd = fd;
+#ifdef HAVE_LIBSSL
+	backend->ssl = (SSL *)tls;
+	if(backend->ssl != NULL) {
+		backend->ktls_send = JANUS_SKYWAYIOT_KTLS_SEND(backend->ssl);
+		backend->ktls_recv = JANUS_SKYWAYIOT_KTLS_RECV(backend->ssl);
+		int level = (backend->ktls_send && backend->ktls_recv) ? LOG_INFO : LOG_WARN;
+		JANUS_LOG(level, "TLS backend (%s, %s): kernel TLS for sending %s, for receiving %s\n",
+			SSL_get_version(backend->ssl), SSL_get_cipher_name(backend->ssl),
+			backend->ktls_send ? "on" : "off", backend->ktls_recv ? "on" : "off");
+	}
+#endif
+	backend->listener = listener->index;
+	backend->standby = listener->standby;
+	janus_mutex_init(&backend->mutex);
+	if(failover_buffer > 0)
+		backend->pending = g_queue_new();
+	if(ext_framed)
+		backend->insize = sizeof(janus_skywayiot_frame_header) + ext_max_payload;
+	else if(ext_ndjson)
+		backend->insize = ext_max_payload;
+	if(backend->insize > 0)
+		backend->inbuf = g_malloc(backend->insize);
+	backend->last_heard = janus_get_monotonic_time();
+	/* A backend that stops reading mustn't block its writers for long */
+	struct timeval tv = { .tv_sec = backend_write_timeout / G_USEC_PER_SEC, .tv_usec = backend_write_timeout % G_USEC_PER_SEC };
+	if(setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0)
+		JANUS_LOG(LOG_WARN, "Couldn't set the send timeout for a backend (%s)\n", strerror(errno));
+	g_atomic_int_set(&backend->ref, 1);
+	janus_mutex_lock(&backends_mutex);
+	backend->id = ++backend_next_id;
+	backends = g_list_append(backends, backend);
+	janus_skywayiot_ring_rebuild();
+	guint count = g_list_length(backends);
+	janus_mutex_unlock(&backends_mutex);
+	JANUS_LOG(LOG_INFO, "%s backend %"SCNu64" connected to ext listener %u, %u backend(s) in the pool\n",
+		backend->standby ? "Standby" : "Active", backend->id, listener->index, count);
+	return backend;
+}
+
+/* Take a backend out of the pool, replay what it didn't acknowledge to the
+ * backends now owning those sessions, and release the listener thread reference */
+static void janus_skywayiot_backend_remove(janus_skywayiot_backend *backend) {
+	janus_mutex_lock(&backends_mutex);
+	backends = g_list_remove(backends, backend);
+	janus_skywayiot_ring_rebuild();
+	guint count = g_list_length(backends);
+	/* Threads that picked this backend before the ring changed will look again */
+	janus_mutex_lock(&backend->mutex);
+	backend->closed = TRUE;
+	shutdown(backend->fd, SHUT_RDWR);
+	GQueue *pending = backend->pending;
+	backend->pending = NULL;
+	janus_mutex_unlock(&backend->mutex);
+	/* Lock the new owners of the unacknowledged frames before anybody else can
+	 * find them in the ring: whoever sends to those sessions now waits for the
+	 * replay, so that new frames can't overtake it */
+	GPtrArray *owners = NULL;
+	GList *locked = NULL;
+	if(pending != NULL) {
+		owners = g_ptr_array_sized_new(g_queue_get_length(pending));
+		g_atomic_int_inc(&route_users);
+		GList *fl = NULL;
+		for(fl = pending->head; fl != NULL; fl = fl->next) {
+			janus_skywayiot_pending *frame = (janus_skywayiot_pending *)fl->data;
+			const char *route = !g_atomic_int_get(&stopping) ?
+				janus_skywayiot_route_match(frame->data, frame->len) : NULL;
+			janus_skywayiot_backend *owner = route ? janus_skywayiot_backend_named_locked(route, frame->target) : NULL;
+			if(owner == NULL)
+				owner = janus_skywayiot_backend_for_locked(frame->target);
+			if(owner != NULL && g_list_find(locked, owner) == NULL) {
+				g_atomic_int_inc(&owner->ref);
+				janus_mutex_lock(&owner->mutex);
+				locked = g_list_prepend(locked, owner);
+			}
+			g_ptr_array_add(owners, owner);
+		}
+		janus_skywayiot_route_release();
+	}
+	janus_mutex_unlock(&backends_mutex);
+	JANUS_LOG(LOG_INFO, "Backend %"SCNu64" left the pool, %u backend(s) remaining\n", backend->id, count);
+	if(pending != NULL) {
+		guint replayed = 0, lost = 0, i = 0;
+		janus_skywayiot_pending *frame = NULL;
+		while((frame = g_queue_pop_head(pending)) != NULL) {
+			janus_skywayiot_backend *owner = g_ptr_array_index(owners, i++);
+			GString *line = (owner != NULL && ext_ndjson) ? janus_skywayiot_ndjson_line(frame->target, frame->data, frame->len) : NULL;
+			if(owner != NULL && !owner->closed &&
+					janus_skywayiot_backend_send_locked(owner, JANUS_SKYWAYIOT_FRAME_DATA, frame->target, line, frame->data, frame->len) > 0)
+				replayed++;
+			else
+				lost++;
+			if(line != NULL)
+				g_string_free(line, TRUE);
+			g_free(frame);
+		}
+		g_queue_free(pending);
+		g_ptr_array_free(owners, TRUE);
+		GList *ol = NULL;
+		for(ol = locked; ol != NULL; ol = ol->next) {
+			janus_skywayiot_backend *owner = (janus_skywayiot_backend *)ol->data;
+			janus_mutex_unlock(&owner->mutex);
+			janus_skywayiot_backend_unref(owner);
+		}
+		g_list_free(locked);
+		JANUS_SKYWAYIOT_STATS_ADD(failover_stats.replayed, replayed);
+		JANUS_SKYWAYIOT_STATS_ADD(failover_stats.lost, lost);
+		if(replayed > 0 || lost > 0)
+			JANUS_LOG(LOG_WARN, "Backend %"SCNu64" left %u unacknowledged frame(s): %u replayed, %u lost\n", backend->id, replayed+lost, replayed, lost);
+	}
+	janus_skywayiot_backend_unref(backend);
+}
+
+/* Wait until a backend socket is ready for what we need, for as long as a
+ * blocking write would have (backend_write_timeout): this is for sockets made
+ * non-blocking for TLS reads. A FALSE makes the write fail, and the backend
+ * is dropped, so that the lock its caller holds is released soon anyway */
+static gboolean janus_skywayiot_backend_wait(janus_skywayiot_backend *backend, short events) {
+	struct pollfd pfd = { .fd = backend->fd, .events = events, .revents = 0 };
+	gint64 deadline = janus_get_monotonic_time() + backend_write_timeout;
+	int res = 0;
+	while(TRUE) {
+		int timeout = (int)MAX(0, (deadline - janus_get_monotonic_time()) / 1000);
+		if((res = poll(&pfd, 1, timeout)) >= 0 || errno != EINTR)
+			break;
+	}
+	if(res == 0)
+		JANUS_LOG(LOG_WARN, "Backend %"SCNu64" didn't make room for our writes in time\n", backend->id);
+	return res > 0 && (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) == 0;
+}
+
+/* Write a whole message on a backend connection, whose mutex the caller
+ * holds: one sendmsg instead of copying the payload after the header, and
+ * keep going on short writes. Returns the bytes written, or -1 */
+static int janus_skywayiot_backend_write(janus_skywayiot_backend *backend, struct iovec *iov, int iovcnt) {
+#ifdef HAVE_LIBSSL
+	if(backend->ssl != NULL && !backend->ktls_send) {
+		/* No offload: OpenSSL encrypts and writes (all or nothing, waiting
+		 * for room if the socket is non-blocking because of userspace reads) */
+		int written = 0, i = 0;
+		for(i = 0; i < iovcnt; i++) {
+			if(iov[i].iov_len == 0)
+				continue;
+			int n = SSL_write(backend->ssl, iov[i].iov_base, iov[i].iov_len);
+			if(n <= 0) {
+				int err = SSL_get_error(backend->ssl, n);
+				ERR_clear_error();
+				if((err == SSL_ERROR_WANT_WRITE || err == SSL_ERROR_WANT_READ) &&
+						janus_skywayiot_backend_wait(backend, err == SSL_ERROR_WANT_WRITE ? POLLOUT : POLLIN)) {
+					/* OpenSSL wants the very same write again */
+					i--;
+					continue;
+				}
+				return -1;
+			}
+			written += n;
+		}
+		return written;
+	}
+#endif
+	struct msghdr hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.msg_iov = iov;
+	hdr.msg_iovlen = iovcnt;
+	int written = 0;
+	while(hdr.msg_iovlen > 0) {
+		/* A backend going away must not SIGPIPE the whole gateway */
+		ssize_t n = sendmsg(backend->fd, &hdr, MSG_NOSIGNAL);
+		if(n < 0) {
+			if(errno == EINTR || ((errno == EAGAIN || errno == EWOULDBLOCK) && janus_skywayiot_backend_wait(backend, POLLOUT)))
+				continue;
+			return -1;
+		}
+		written += n;
+		while(hdr.msg_iovlen > 0 && (size_t)n >= hdr.msg_iov->iov_len) {
+			n -= hdr.msg_iov->iov_len;
+			hdr.msg_iov++;
+			hdr.msg_iovlen--;
+		}
+		if(hdr.msg_iovlen > 0) {
+			hdr.msg_iov->iov_base = (char *)hdr.msg_iov->iov_base + n;
+			hdr.msg_iov->iov_len -= n;
+		}
+	}
+	return written;
+}
+
+static void janus_skywayiot_frame_header_init(janus_skywayiot_frame_header *header, guint8 type, guint64 target, int len) {
+	memset(header, 0, sizeof(*header));
+	header->length = htonl(sizeof(*header) - sizeof(header->length) + len);
+	header->type = type;
+	header->target = htobe64(target);
+}
+
+/* The backend owning the session, if any: the caller holds backends_mutex */
+static janus_skywayiot_backend *janus_skywayiot_backend_for_locked(guint64 handle_id) {
+	if(backend_ring_size == 0)
+		return NULL;
+	guint64 hash = janus_skywayiot_hash64(handle_id);
+	guint lo = 0, hi = backend_ring_size;
+	while(lo < hi) {
+		guint mid = lo + (hi-lo)/2;
+		if(backend_ring[mid].hash < hash)
+			lo = mid+1;
+		else
+			hi = mid;
+	}
+	return backend_ring[lo < backend_ring_size ? lo : 0].backend;
+}
+
+/* The backend owning the session, with a reference the caller has to release */
+static janus_skywayiot_backend *janus_skywayiot_backend_for(guint64 handle_id) {
+	janus_mutex_lock(&backends_mutex);
+	janus_skywayiot_backend *backend = janus_skywayiot_backend_for_locked(handle_id);
+	if(backend != NULL)
+		g_atomic_int_inc(&backend->ref);
+	janus_mutex_unlock(&backends_mutex);
+	return backend;
+}
+
+/* A backend with a name, if any: the caller holds backends_mutex. The
+ * sessions of a name are spread across its backends by handle id */
+static janus_skywayiot_backend *janus_skywayiot_backend_named_locked(const char *name, guint64 handle_id) {
+	GPtrArray *named = named_backends ? g_hash_table_lookup(named_backends, name) : NULL;
+	if(named == NULL || named->len == 0)
+		return NULL;
+	return g_ptr_array_index(named, janus_skywayiot_hash64(handle_id) % named->len);
+}
+
+/* A backend with a name, with a reference the caller has to release */
+static janus_skywayiot_backend *janus_skywayiot_backend_named(const char *name, guint64 handle_id) {
+	janus_mutex_lock(&backends_mutex);
+	janus_skywayiot_backend *backend = janus_skywayiot_backend_named_locked(name, handle_id);
+	if(backend != NULL)
+		g_atomic_int_inc(&backend->ref);
+	janus_mutex_unlock(&backends_mutex);
+	return backend;
+}
+
+/* A backend gave itself a name (or, if empty, went back to the ring) */
+static void janus_skywayiot_backend_hello(janus_skywayiot_backend *backend, const char *name, int len) {
+	if(len > 64) {
+		janus_skywayiot_stats_error(JANUS_SKYWAYIOT_ENTRY_EXT_RECEIVE);
+		return;
+	}
+	janus_mutex_lock(&backends_mutex);
+	g_free(backend->name);
+	backend->name = len > 0 ? g_strndup(name, len) : NULL;
+	janus_skywayiot_ring_rebuild();
+	JANUS_LOG(LOG_INFO, "Backend %"SCNu64" is now %s%s\n", backend->id,
+		backend->name ? "named " : "in the ring", backend->name ? backend->name : "");
+	janus_mutex_unlock(&backends_mutex);
+}
+
+/* The value of a top level field of a JSON object, as written (without the
+ * quotes, for strings with nothing escaped), without parsing all of it */
+static gboolean janus_skywayiot_route_json_match(const char *buf, int len, guint16 *best) {
+	const char *p = buf, *end = buf + len;
+	while(p < end && g_ascii_isspace(*p))
+		p++;
+	if(p == end || *p != '{')
+		return FALSE;
+	p++;
+	while(1) {
+		while(p < end && g_ascii_isspace(*p))
+			p++;
+		const char *name_end = janus_skywayiot_json_skip(p, end);
+		if(name_end == NULL || *p != '"')
+			return FALSE;
+		char field[128];
+		int field_len = name_end - p - 2;
+		gboolean wanted = field_len < (int)sizeof(field);
+		if(wanted) {
+			memcpy(field, p + 1, field_len);
+			field[field_len] = '\0';
+		}
+		p = name_end;
+		while(p < end && g_ascii_isspace(*p))
+			p++;
+		if(p == end || *p != ':')
+			return FALSE;
+		p++;
+		while(p < end && g_ascii_isspace(*p))
+			p++;
+		const char *value_end = janus_skywayiot_json_skip(p, end);
+		if(value_end == NULL)
+			return FALSE;
+		GHashTable *values = wanted ? g_hash_table_lookup(route_json, field) : NULL;
+		if(values != NULL) {
+			char value[256], *copy = NULL;
+			int value_len = value_end - p;
+			const char *v = p;
+			if(*p == '"')
+				v = janus_skywayiot_json_string(p, value_len, &value_len, &copy);
+			if(v != NULL && value_len < (int)sizeof(value)) {
+				memcpy(value, v, value_len);
+				value[value_len] = '\0';
+				guint16 route = GPOINTER_TO_UINT(g_hash_table_lookup(values, value));
+				if(route != 0 && (*best == 0 || route < *best))
+					*best = route;
+			}
+			g_free(copy);
+		}
+		p = value_end;
+		while(p < end && g_ascii_isspace(*p))
+			p++;
+		if(p < end && *p == ',') {
+			p++;
+			continue;
+		}
+		return p < end && *p == '}';
+	}
+}
+
+/* Which backend name, if any, a message from a session is routed to */
+static const char *janus_skywayiot_route_match(const char *buf, int len) {
+	if(routes_count == 0 || len <= 0)
+		return NULL;
+	guint16 best = route_by_type[(guint8)buf[0]];
+	guint32 node = 0;
+	int i = 0;
+	for(i = 0; i < len && route_trie_size > 0; i++) {
+		node = route_trie[node].next[(guint8)buf[i]];
+		if(node == 0)
+			break;
+		if(route_trie[node].route != 0 && (best == 0 || route_trie[node].route < best))
+			best = route_trie[node].route;
+	}
+	if(route_json != NULL && (best == 0 || route_json_first < best))
+		janus_skywayiot_route_json_match(buf, len, &best);
+	if(best == 0)
+		return NULL;
+	JANUS_SKYWAYIOT_STATS_ADD(routes[best-1].matched, 1);
+	return routes[best-1].backend;
+}
+
+/* Compile the [route-<name>] categories of the configuration */
+static void janus_skywayiot_routes_load(janus_config *config) {
+	GList *cl = janus_config_get_categories(config), *rules = NULL;
+	for(; cl != NULL; cl = cl->next) {
+		janus_config_category *cat = (janus_config_category *)cl->data;
+		if(cat->name != NULL && !strncasecmp(cat->name, "route-", 6))
+			rules = g_list_append(rules, cat);
+	}
+	routes_count = MIN(g_list_length(rules), G_MAXUINT16 - 1);
+	if(routes_count == 0)
+		return;
+	routes = g_malloc0(routes_count * sizeof(janus_skywayiot_route));
+	route_trie = g_malloc0(sizeof(janus_skywayiot_route_node));
+	route_trie_size = 1;
+	guint index = 0;
+	GList *rl = NULL;
+	for(rl = rules; rl != NULL && index < routes_count; rl = rl->next) {
+		janus_config_category *cat = (janus_config_category *)rl->data;
+		janus_config_item *backend = janus_config_get_item(cat, "backend");
+		janus_config_item *type = janus_config_get_item(cat, "type");
+		janus_config_item *prefix = janus_config_get_item(cat, "prefix");
+		janus_config_item *field = janus_config_get_item(cat, "json_field");
+		janus_config_item *value = janus_config_get_item(cat, "json_value");
+		gboolean has_type = type && type->value, has_prefix = prefix && prefix->value && strlen(prefix->value) > 0,
+			has_json = field && field->value && value && value->value;
+		if(backend == NULL || backend->value == NULL || has_type + has_prefix + has_json != 1) {
+			JANUS_LOG(LOG_WARN, "Route %s needs a backend and one thing to match on (type, prefix or json_field/json_value), skipping it\n", cat->name);
+			continue;
+		}
+		long byte = -1;
+		if(has_type) {
+			char *type_end = NULL;
+			byte = strtol(type->value, &type_end, 0);
+			if(type_end == type->value || *type_end != '\0' || byte < 0 || byte > 255) {
+				JANUS_LOG(LOG_WARN, "Route %s has an invalid type (%s, should be a byte), skipping it\n", cat->name, type->value);
+				continue;
+			}
+		}
+		guint16 route = index + 1;
+		routes[index].name = g_strdup(cat->name + 6);
+		routes[index].backend = g_strdup(backend->value);
+		index++;
+		if(has_type && route_by_type[byte] == 0)
+			route_by_type[byte] = route;
+		if(has_prefix) {
+			guint32 node = 0;
+			const guint8 *c = (const guint8 *)prefix->value;
+			for(; *c != '\0'; c++) {
+				if(route_trie[node].next[*c] == 0) {
+					route_trie = g_realloc(route_trie, (route_trie_size + 1) * sizeof(janus_skywayiot_route_node));
+					memset(&route_trie[route_trie_size], 0, sizeof(janus_skywayiot_route_node));
+					route_trie[node].next[*c] = route_trie_size++;
+				}
+				node = route_trie[node].next[*c];
+			}
+			if(route_trie[node].route == 0)
+				route_trie[node].route = route;
+		}
+		if(has_json) {
+			if(route_json == NULL)
+				route_json = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify)g_hash_table_destroy);
+			GHashTable *values = g_hash_table_lookup(route_json, field->value);
+			if(values == NULL) {
+				values = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+				g_hash_table_insert(route_json, g_strdup(field->value), values);
+			}
+			if(!g_hash_table_contains(values, value->value))
+				g_hash_table_insert(values, g_strdup(value->value), GUINT_TO_POINTER(route));
+			if(route_json_first == 0)
+				route_json_first = route;
+		}
+		JANUS_LOG(LOG_INFO, "Route %s: messages%s%s%s%s%s%s%s%s go to backend %s\n", routes[index-1].name,
+			has_type ? " of type " : "", has_type ? type->value : "",
+			has_prefix ? " starting with " : "", has_prefix ? prefix->value : "",
+			has_json ? " with " : "", has_json ? field->value : "", has_json ? " = " : "", has_json ? value->value : "",
+			routes[index-1].backend);
+	}
+	routes_count = index;
+	g_list_free(rules);
+}
+
+static void janus_skywayiot_routes_free(void) {
+	guint i = 0;
+	for(i = 0; i < routes_count; i++) {
+		g_free(routes[i].name);
+		g_free(routes[i].backend);
+	}
+	g_free(routes);
+	routes = NULL;
+	routes_count = 0;
+	memset(route_by_type, 0, sizeof(route_by_type));
+	g_free(route_trie);
+	route_trie = NULL;
+	route_trie_size = 0;
+	if(route_json != NULL)
+		g_hash_table_destroy(route_json);
+	route_json = NULL;
+	route_json_first = 0;
+}
+
+/**
+ * Write a frame for the backend (handle id, or frame header, followed by the
+ * payload) on the connection of the backend owning the session. Returns the
+ * bytes written (or queued for replay), 0 if no backend is connected at all,
+ * and -1 on errors.
+ */
+static int janus_skywayiot_ext_send(guint64 handle_id, char *buf, int len) {
+	return janus_skywayiot_ext_send_frame(JANUS_SKYWAYIOT_FRAME_DATA, handle_id, buf, len);
+}
+
+/* A message from a session as a line for an NDJSON backend: the payload is
+ * a JSON string if it's text, and base64 if it's not */
+static GString *janus_skywayiot_ndjson_line(guint64 handle_id, const char *buf, int len) {
+	GString *line = g_string_sized_new(len + 64);
+	g_string_append_printf(line, "{\"target\":\"%"SCNu64"\",", handle_id);
+	if(!g_utf8_validate(buf, len, NULL)) {
+		gchar *encoded = g_base64_encode((const guchar *)buf, len);
+		g_string_append_printf(line, "\"payload_base64\":\"%s\"}\n", encoded);
+		g_free(encoded);
+		return line;
+	}
+	g_string_append(line, "\"payload\":\"");
+	int i = 0;
+	for(i = 0; i < len; i++) {
+		guchar c = buf[i];
+		if(c == '"' || c == '\\') {
+			g_string_append_c(line, '\\');
+			g_string_append_c(line, c);
+		} else if(c == '\n') {
+			g_string_append(line, "\\n");
+		} else if(c < 0x20) {
+			g_string_append_printf(line, "\\u%04x", c);
+		} else {
+			g_string_append_c(line, c);
+		}
+	}
+	g_string_append(line, "\"}\n");
+	return line;
+}
+
+/* Write a frame on a backend, whose mutex the caller holds, as the line
+ * passed in NDJSON mode: data frames are counted, and kept for failover */
+static int janus_skywayiot_backend_send_locked(janus_skywayiot_backend *backend, guint8 type, guint64 handle_id,
+		GString *line, char *buf, int len) {
+	gboolean data = (type == JANUS_SKYWAYIOT_FRAME_DATA);
+	janus_skywayiot_frame_header header;
+	struct iovec iov[2] = {
+		{ .iov_base = &handle_id, .iov_len = sizeof(handle_id) },
+		{ .iov_base = buf, .iov_len = len }
+	};
+	int iovcnt = 2;
+	if(ext_framed) {
+		janus_skywayiot_frame_header_init(&header, type, handle_id, len);
+		iov[0].iov_base = &header;
+		iov[0].iov_len = sizeof(header);
+	} else if(line != NULL) {
+		iov[0].iov_base = line->str;
+		iov[0].iov_len = line->len;
+		iovcnt = 1;
+	}
+	if(data)
+		backend->sent++;
+	if(data && backend->pending != NULL) {
+		/* Keep a copy until the backend acknowledges it, to replay it elsewhere if it dies */
+		janus_skywayiot_pending *frame = g_malloc(sizeof(janus_skywayiot_pending) + len);
+		frame->seq = backend->sent;
+		frame->target = handle_id;
+		frame->len = len;
+		memcpy(frame->data, buf, len);
+		g_queue_push_tail(backend->pending, frame);
+		backend->pending_bytes += len;
+		while(backend->pending_bytes > failover_buffer && g_queue_get_length(backend->pending) > 1) {
+			frame = g_queue_pop_head(backend->pending);
+			backend->pending_bytes -= frame->len;
+			g_free(frame);
+			JANUS_SKYWAYIOT_STATS_ADD(failover_stats.overflow, 1);
+		}
+	}
+	int written = janus_skywayiot_backend_write(backend, iov, iovcnt);
+	if(written < 0) {
+		/* Don't keep writing into a dead connection: this wakes up the
+		 * listener thread, which takes the backend out of the pool */
+		shutdown(backend->fd, SHUT_RDWR);
+		if(data && backend->pending != NULL)
+			written = len;
+	}
+	if(written > 0)
+		JANUS_SKYWAYIOT_STATS_ADD(backend->frames_out, 1);
+	return written;
+}
+
+/* Send a frame to the backend in charge of a session (or to one of those the
+ * route names, if any): only data frames are counted, and kept for failover,
+ * any other type needs framed mode */
+static int janus_skywayiot_ext_send_route(guint8 type, guint64 handle_id, const char *route, char *buf, int len) {
+	if(type != JANUS_SKYWAYIOT_FRAME_DATA && !ext_framed)
+		return 0;
+	GString *line = ext_ndjson ? janus_skywayiot_ndjson_line(handle_id, buf, len) : NULL;
+	int attempts = 0;
+	for(attempts = 0; attempts < 2; attempts++) {
+		janus_skywayiot_backend *backend = route ? janus_skywayiot_backend_named(route, handle_id) : NULL;
+		if(route != NULL && backend == NULL)
+			JANUS_SKYWAYIOT_STATS_ADD(relay_stats.route_fallback, 1);
+		if(backend == NULL)
+			backend = janus_skywayiot_backend_for(handle_id);
+		if(backend == NULL)
+			break;
+		janus_mutex_lock(&backend->mutex);
+		if(backend->closed) {
+			/* It just left the pool, the ring already points somewhere else */
+			janus_mutex_unlock(&backend->mutex);
+			janus_skywayiot_backend_unref(backend);
+			continue;
+		}
+		int written = janus_skywayiot_backend_send_locked(backend, type, handle_id, line, buf, len);
+		janus_mutex_unlock(&backend->mutex);
+		janus_skywayiot_backend_unref(backend);
+		if(line != NULL)
+			g_string_free(line, TRUE);
+		return written;
+	}
+	if(line != NULL)
+		g_string_free(line, TRUE);
+	return 0;
+}
+
+static int janus_skywayiot_ext_send_frame(guint8 type, guint64 handle_id, char *buf, int len) {
+	g_atomic_int_inc(&route_users);
+	const char *route = (type == JANUS_SKYWAYIOT_FRAME_DATA && !g_atomic_int_get(&stopping)) ?
+		janus_skywayiot_route_match(buf, len) : NULL;
+	int res = janus_skywayiot_ext_send_route(type, handle_id, route, buf, len);
+	janus_skywayiot_route_release();
+	return res;
+}
+
 /**
  * create external data receiver interface via TCP. The data received from this interface will
  * be relayed to DataChannel
  */
-static int create_ext_data_interface(char *addr, int port) {
-	JANUS_LOG(LOG_INFO, "create data receiver: listener address %s, port %d\n", addr, port);
+static int create_ext_data_interface(char *addr, int port, int listeners, const char *cpus, int max_backends, int standby_port) {
+	JANUS_LOG(LOG_INFO, "create data receiver: listener address %s, port %d, %d listener(s), up to %d backend(s) each\n", addr, port, listeners, max_backends);
+	if(standby_port > 0)
+		JANUS_LOG(LOG_INFO, "create data receiver: standby backend on port %d\n", standby_port);
 
-	/* create a TCP socket for data receiver (it will be transfered via WebRTC DataChannel  */
-	if ((ext_listen_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
-		JANUS_LOG(LOG_WARN, "cannot create socket for data receiver\n");
+	gchar **cpu_list = (cpus != NULL && strlen(cpus) > 0) ? g_strsplit(cpus, ",", -1) : NULL;
+	guint cpu_count = cpu_list ? g_strv_length(cpu_list) : 0;
+
+	ext_stop_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if(ext_stop_fd < 0) {
+		JANUS_LOG(LOG_WARN, "cannot create the stop event for the data receiver (%s)\n", strerror(errno));
+		g_strfreev(cpu_list);
 		return -1;
 	}
 
-	struct sockaddr_in data_sockaddr;      /* sockaddr for data channel */
-	/* bind the socket to any valid IP address and a specific port */
-	memset((char *)&data_sockaddr, 0, sizeof(data_sockaddr));
-	data_sockaddr.sin_family = AF_INET;
-	data_sockaddr.sin_addr.s_addr = inet_addr(addr);
-	data_sockaddr.sin_port = htons(port);
+	int total = listeners + (standby_port > 0 ? 1 : 0);
+	ext_listeners = g_malloc0(total * sizeof(janus_skywayiot_ext_listener));
+	int i = 0;
+	for(i = 0; i < total; i++) {
+		janus_skywayiot_ext_listener *listener = &ext_listeners[i];
+		listener->index = i;
+		listener->cpu = cpu_count > 0 ? atoi(cpu_list[i % cpu_count]) : -1;
+		listener->max_backends = max_backends;
+		if(i == listeners) {
+			/* The last one is the standby listener */
+			listener->standby = TRUE;
+			listener->max_backends = 1;
+		}
 
-	if (bind(ext_listen_fd, (struct sockaddr *)&data_sockaddr, sizeof(data_sockaddr)) < 0) {
-		JANUS_LOG(LOG_WARN, "bind failed for data receiver\n");
-		return -1;
-	}
+		/* create a TCP socket for data receiver (it will be transfered via WebRTC DataChannel  */
+		if ((listener->listen_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+			JANUS_LOG(LOG_WARN, "cannot create socket for data receiver\n");
+			break;
+		}
+		if(listeners > 1 && !listener->standby) {
+			/* all the listeners share the port, and the kernel balances connections among them */
+			int reuse = 1;
+			if(setsockopt(listener->listen_fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0) {
+				JANUS_LOG(LOG_WARN, "cannot set SO_REUSEPORT on data receiver (%s)\n", strerror(errno));
+				close(listener->listen_fd);
+				break;
+			}
+		}
 
-	JANUS_LOG(LOG_INFO, "succeed to create socket for ext data\n");
+		struct sockaddr_in data_sockaddr;      /* sockaddr for data channel */
+		/* bind the socket to any valid IP address and a specific port */
+		memset((char *)&data_sockaddr, 0, sizeof(data_sockaddr));
+		data_sockaddr.sin_family = AF_INET;
+		data_sockaddr.sin_addr.s_addr = inet_addr(addr);
+		data_sockaddr.sin_port = htons(listener->standby ? standby_port : port);
 
-	/* create thread to receive udp datagram for each channel */
-	GError *error = NULL;
-	g_thread_try_new("skywayiot_ext_interface_thread", &thread_receive_ext_data, NULL, &error);
-	if(error != NULL) {
-		JANUS_LOG(LOG_WARN, "Got error %d (%s) while launching the data channel ext interface thread...\n", error->code, error->message ? error->message : "??");
-		return -1;
+		if (bind(listener->listen_fd, (struct sockaddr *)&data_sockaddr, sizeof(data_sockaddr)) < 0) {
+			JANUS_LOG(LOG_WARN, "bind failed for data receiver\n");
+			close(listener->listen_fd);
+			break;
+		}
+
+		JANUS_LOG(LOG_INFO, "succeed to create socket for ext data (listener %d)\n", i);
+
+		/* create thread to receive data from the backends connected to this listener */
+		GError *error = NULL;
+		char tname[16];
+		g_snprintf(tname, sizeof(tname), "skywayiot ext %d", i);
+		listener->thread = g_thread_try_new(tname, &thread_receive_ext_data, listener, &error);
+		if(error != NULL) {
+			JANUS_LOG(LOG_WARN, "Got error %d (%s) while launching the data channel ext interface thread...\n", error->code, error->message ? error->message : "??");
+			g_error_free(error);
+			close(listener->listen_fd);
+			break;
+		}
 	}
-	return 0;
+	g_strfreev(cpu_list);
+	ext_listeners_count = i;
+	return i > 0 ? 0 : -1;
 }
 
 /**
@@ -881,66 +5580,1233 @@ static int create_media_sender(char *addr, int port) {
 	struct hostent *server;
 
 	server = gethostbyname(addr);
+	if(server == NULL) {
+		JANUS_LOG(LOG_WARN, "cannot resolve media sender destination %s\n", addr);
+		close(media_send_fd);
+		media_send_fd = -1;
+		return -1;
+	}
 
 	memset((char *)&g_media_sender, 0, sizeof(g_media_sender));
 	g_media_sender.sin_family = AF_INET;
 	bcopy((char *)server->h_addr, (char *)&g_media_sender.sin_addr.s_addr, server->h_length);
 	g_media_sender.sin_port = htons(port);
 
+	/* there's a single destination, so connect once instead of passing it to every send */
+	if(connect(media_send_fd, (struct sockaddr *)&g_media_sender, sizeof(g_media_sender)) < 0) {
+		JANUS_LOG(LOG_WARN, "cannot connect socket for media sender to %s:%d\n", addr, port);
+		close(media_send_fd);
+		media_send_fd = -1;
+		return -1;
+	}
+
 	JANUS_LOG(LOG_INFO, "succeed to create socket for media sender\n");
 	return 0;
 }
 
+#ifdef HAVE_LIBURING
 /**
- * This thread function will be used to receive data from external TCP interface.
+ * Optional io_uring backend for media forwarding. Packets are copied into
+ * slots of a buffer registered with the kernel and queued as fixed writes on
+ * the (registered, connected) media socket: with SQPOLL a kernel thread picks
+ * them up and forwarding needs no syscalls at all, otherwise submissions are
+ * done every io_uring_batch packets. Completions are reaped lazily, on the
+ * next send, to recycle the slots. The ring is shared by all the Janus media
+ * threads, hence the mutex, which is only held for a memcpy and a few stores.
+ * When batching without SQPOLL, a flusher thread submits whatever has been
+ * queued for longer than io_uring_flush_usecs, so that a pause in the traffic
+ * doesn't leave the tail of a batch in the ring: it only ticks while packets
+ * are flowing, and sleeps on media_ring_cond after a second without any.
  */
-static void *thread_receive_ext_data(void *data /* to avoid warning */) {
-	char recvBuff[65535];
-	int n;
+#define JANUS_SKYWAYIOT_URING_SLOT_SIZE	1500
+#define JANUS_SKYWAYIOT_URING_IDLE		G_USEC_PER_SEC
 
+static struct io_uring media_ring;
+static janus_mutex media_ring_mutex;
+static char *media_ring_buffers = NULL;
+static guint *media_ring_free = NULL;	/* Stack of free slots */
+static guint media_ring_slots = 0, media_ring_free_count = 0;
+static guint media_ring_pending = 0, media_ring_batch = 1;
+static gboolean media_ring_sqpoll = FALSE;
+static janus_condition media_ring_cond;
+static GThread *media_ring_flusher = NULL;
+static gboolean media_ring_stopping = FALSE, media_ring_flusher_idle = FALSE;
+static gint64 media_ring_first_pending = 0, media_ring_flush_usecs = 1000;
+static guint64 media_ring_queued = 0;	/* Packets ever queued, to tell when traffic stopped */
 
-	guint64 handle_id;
-	int handle_id_len = sizeof(handle_id);
-	int data_len = 0;
-	struct sockaddr_in addr;
-	socklen_t addr_len = sizeof(addr);
+static void janus_skywayiot_uring_submit(void) {
+	io_uring_submit(&media_ring);
+	media_ring_pending = 0;
+	JANUS_SKYWAYIOT_STATS_ADD(media_stats.submits, 1);
+}
+
+static void *janus_skywayiot_uring_flusher(void *data) {
+	JANUS_LOG(LOG_VERB, "io_uring flusher started\n");
+	guint64 seen = 0;
+	gint64 last_activity = janus_get_monotonic_time();
+	janus_mutex_lock(&media_ring_mutex);
+	while(!media_ring_stopping) {
+		gint64 now = janus_get_monotonic_time();
+		if(media_ring_pending > 0 && now - media_ring_first_pending >= media_ring_flush_usecs) {
+			janus_skywayiot_uring_submit();
+			JANUS_SKYWAYIOT_STATS_ADD(media_stats.idle_flushes, 1);
+		}
+		if(media_ring_queued != seen) {
+			seen = media_ring_queued;
+			last_activity = now;
+		}
+		if(media_ring_pending == 0 && now - last_activity >= JANUS_SKYWAYIOT_URING_IDLE) {
+			/* No traffic for a while: wait for the next packet to be queued */
+			media_ring_flusher_idle = TRUE;
+			janus_condition_wait(&media_ring_cond, &media_ring_mutex);
+			media_ring_flusher_idle = FALSE;
+			last_activity = janus_get_monotonic_time();
+		} else {
+			gint64 until = media_ring_pending > 0 ?
+				media_ring_first_pending + media_ring_flush_usecs : now + media_ring_flush_usecs;
+			janus_condition_wait_until(&media_ring_cond, &media_ring_mutex, until);
+		}
+	}
+	janus_mutex_unlock(&media_ring_mutex);
+	JANUS_LOG(LOG_VERB, "io_uring flusher stopped\n");
+	return NULL;
+}
+
+static int janus_skywayiot_uring_setup(int entries, int batch, gboolean sqpoll, int flush_usecs) {
+	struct io_uring_params params;
+	memset(&params, 0, sizeof(params));
+	if(sqpoll) {
+		params.flags |= IORING_SETUP_SQPOLL;
+		params.sq_thread_idle = 1000;	/* ms */
+	}
+	int res = io_uring_queue_init_params(entries, &media_ring, &params);
+	if(res < 0) {
+		JANUS_LOG(LOG_WARN, "Couldn't setup io_uring with %d entries (%s)\n", entries, strerror(-res));
+		return -1;
+	}
+	janus_mutex_init(&media_ring_mutex);
+	janus_condition_init(&media_ring_cond);
+	media_ring_slots = entries;
+	media_ring_buffers = g_malloc0((gsize)media_ring_slots * JANUS_SKYWAYIOT_URING_SLOT_SIZE);
+	media_ring_free = g_malloc0(media_ring_slots * sizeof(guint));
+	struct iovec iov = {
+		.iov_base = media_ring_buffers,
+		.iov_len = (size_t)media_ring_slots * JANUS_SKYWAYIOT_URING_SLOT_SIZE
+	};
+	if((res = io_uring_register_buffers(&media_ring, &iov, 1)) < 0 ||
+			(res = io_uring_register_files(&media_ring, &media_send_fd, 1)) < 0) {
+		JANUS_LOG(LOG_WARN, "Couldn't register io_uring buffers/files (%s)\n", strerror(-res));
+		janus_skywayiot_uring_teardown();
+		return -1;
+	}
+	for(media_ring_free_count = 0; media_ring_free_count < media_ring_slots; media_ring_free_count++)
+		media_ring_free[media_ring_free_count] = media_ring_free_count;
+	media_ring_pending = 0;
+	media_ring_batch = batch;
+	media_ring_sqpoll = sqpoll;
+	media_ring_flush_usecs = flush_usecs;
+	media_ring_stopping = FALSE;
+	if(!sqpoll && batch > 1) {
+		GError *error = NULL;
+		media_ring_flusher = g_thread_try_new("skywayiot uring", &janus_skywayiot_uring_flusher, NULL, &error);
+		if(error != NULL) {
+			JANUS_LOG(LOG_WARN, "Couldn't start the io_uring flusher (%d, %s)\n",
+				error->code, error->message ? error->message : "??");
+			g_error_free(error);
+			media_ring_flusher = NULL;
+			janus_skywayiot_uring_teardown();
+			return -1;
+		}
+	}
+	JANUS_LOG(LOG_INFO, "Forwarding media via io_uring (%u slots, batch %u%s)\n",
+		media_ring_slots, media_ring_batch, sqpoll ? ", SQPOLL" : "");
+	return 0;
+}
+
+/* Returns len if the packet was queued, -1 with errno set otherwise */
+static int janus_skywayiot_uring_send(char *buf, int len) {
+	if(len > JANUS_SKYWAYIOT_URING_SLOT_SIZE) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	janus_mutex_lock(&media_ring_mutex);
+	/* Recycle the slots of whatever has completed in the meanwhile */
+	struct io_uring_cqe *cqe = NULL;
+	while(io_uring_peek_cqe(&media_ring, &cqe) == 0 && cqe != NULL) {
+		if(cqe->res < 0 && cqe->res != -EAGAIN)
+			JANUS_SKYWAYIOT_STATS_ADD(media_stats.send_errors, 1);
+		else if(cqe->res == -EAGAIN)
+			JANUS_SKYWAYIOT_STATS_ADD(media_stats.would_block, 1);
+		media_ring_free[media_ring_free_count++] = (guint)cqe->user_data;
+		io_uring_cqe_seen(&media_ring, cqe);
+	}
+	struct io_uring_sqe *sqe = media_ring_free_count > 0 ? io_uring_get_sqe(&media_ring) : NULL;
+	if(sqe == NULL) {
+		janus_mutex_unlock(&media_ring_mutex);
+		errno = EAGAIN;
+		return -1;
+	}
+	guint slot = media_ring_free[--media_ring_free_count];
+	char *slot_buf = media_ring_buffers + (gsize)slot * JANUS_SKYWAYIOT_URING_SLOT_SIZE;
+	memcpy(slot_buf, buf, len);
+	/* Fixed file 0 is media_send_fd, fixed buffer 0 is the whole slots area */
+	io_uring_prep_write_fixed(sqe, 0, slot_buf, len, 0, 0);
+	sqe->flags |= IOSQE_FIXED_FILE;
+	sqe->user_data = slot;
+	media_ring_queued++;
+	if(media_ring_pending++ == 0 && media_ring_flusher != NULL) {
+		/* Start of a batch: the flusher submits it if it doesn't fill up in time */
+		media_ring_first_pending = janus_get_monotonic_time();
+		if(media_ring_flusher_idle)
+			janus_condition_signal(&media_ring_cond);
+	}
+	if(media_ring_sqpoll || media_ring_pending >= media_ring_batch) {
+		/* With SQPOLL this only enters the kernel if the poller went to sleep */
+		janus_skywayiot_uring_submit();
+	}
+	janus_mutex_unlock(&media_ring_mutex);
+	return len;
+}
 
+static void janus_skywayiot_uring_teardown(void) {
+	if(media_ring_flusher != NULL) {
+		janus_mutex_lock(&media_ring_mutex);
+		media_ring_stopping = TRUE;
+		janus_condition_signal(&media_ring_cond);
+		janus_mutex_unlock(&media_ring_mutex);
+		g_thread_join(media_ring_flusher);
+		media_ring_flusher = NULL;
+	}
+	io_uring_queue_exit(&media_ring);
+	g_free(media_ring_buffers);
+	media_ring_buffers = NULL;
+	g_free(media_ring_free);
+	media_ring_free = NULL;
+	media_ring_slots = 0;
+	media_ring_free_count = 0;
+	media_ring_pending = 0;
+	janus_condition_destroy(&media_ring_cond);
+	janus_mutex_destroy(&media_ring_mutex);
+}
+#endif
+
+/* Relay a data message received from a backend */
+static void janus_skywayiot_ext_deliver(janus_skywayiot_backend *backend, guint64 target, gint64 expires,
+		const char *key, int key_len, char *data, int len) {
+	gint64 start = JANUS_SKYWAYIOT_STATS_START();
+	char *key_copy = NULL;
+	if(key == NULL)
+		key = janus_skywayiot_json_key(data, len, &key_len, &key_copy);
 	data_with_handleid parsed = {
-		handle_id: 0,
-		data:      (char *) NULL,
-		data_len:  0
+		handle_id: target,
+		expires:   expires,
+		key:       key,
+		key_len:   key_len,
+		data:      data,
+		data_len:  len
 	};
+	relay_ext_frame(&parsed);
+	g_free(key_copy);
+	backend->received++;
+	JANUS_SKYWAYIOT_STATS_ADD(backend->frames_in, 1);
+	janus_skywayiot_stats_done(JANUS_SKYWAYIOT_ENTRY_EXT_RECEIVE, start, len);
+}
+
+/* A chunk of data read from a raw backend: the handle id, followed by the payload */
+static void janus_skywayiot_ext_receive(janus_skywayiot_backend *backend, char *buf, int n) {
+	if(n <= (int)sizeof(guint64)) {
+		janus_skywayiot_stats_error(JANUS_SKYWAYIOT_ENTRY_EXT_RECEIVE);
+		return;
+	}
+	guint64 target = 0;
+	memcpy(&target, buf, sizeof(guint64));
+	janus_skywayiot_ext_deliver(backend, target, 0, NULL, 0, buf + sizeof(guint64), n - (int)sizeof(guint64));
+}
 
-	listen( ext_listen_fd, 1 ); /* we only accept 1 TCP client, at the same time */
+/* The backend acknowledged all the data frames up to acked */
+static void janus_skywayiot_backend_acked(janus_skywayiot_backend *backend, guint64 acked) {
+	janus_mutex_lock(&backend->mutex);
+	if(backend->pending != NULL) {
+		janus_skywayiot_pending *frame = NULL;
+		while((frame = g_queue_peek_head(backend->pending)) != NULL && frame->seq <= acked) {
+			g_queue_pop_head(backend->pending);
+			backend->pending_bytes -= frame->len;
+			g_free(frame);
+		}
+	}
+	janus_mutex_unlock(&backend->mutex);
+}
+
+/* Handle the complete frames buffered for a framed backend, and keep any
+ * partial one for the next read. Returns FALSE if the stream is corrupt */
+static gboolean janus_skywayiot_ext_receive_framed(janus_skywayiot_backend *backend) {
+	guint offset = 0;
+	gboolean ok = TRUE;
+	while(backend->inlen - offset >= sizeof(janus_skywayiot_frame_header)) {
+		janus_skywayiot_frame_header header;
+		memcpy(&header, backend->inbuf + offset, sizeof(header));
+		guint32 length = ntohl(header.length);
+		header.target = be64toh(header.target);
+		if(length < sizeof(header) - sizeof(header.length) ||
+				length > sizeof(header) - sizeof(header.length) + ext_max_payload) {
+			JANUS_LOG(LOG_ERR, "Invalid frame length %"SCNu32" from backend %"SCNu64"\n", length, backend->id);
+			janus_skywayiot_stats_error(JANUS_SKYWAYIOT_ENTRY_EXT_RECEIVE);
+			ok = FALSE;
+			break;
+		}
+		guint total = sizeof(header.length) + length;
+		if(backend->inlen - offset < total)
+			break;
+		char *payload = backend->inbuf + offset + sizeof(header);
+		int payload_len = total - sizeof(header);
+		gboolean data_frame = header.type == JANUS_SKYWAYIOT_FRAME_DATA || header.type == JANUS_SKYWAYIOT_FRAME_GROUP_DATA ||
+			header.type == JANUS_SKYWAYIOT_FRAME_PUBLISH || header.type == JANUS_SKYWAYIOT_FRAME_DEVICE;
+		gint64 expires = 0;
+		if(data_frame && (header.flags & (JANUS_SKYWAYIOT_FRAME_FLAG_TTL | JANUS_SKYWAYIOT_FRAME_FLAG_DEADLINE))) {
+			if(payload_len < (int)sizeof(guint64)) {
+				janus_skywayiot_stats_error(JANUS_SKYWAYIOT_ENTRY_EXT_RECEIVE);
+				offset += total;
+				continue;
+			}
+			guint64 expiry = 0;
+			memcpy(&expiry, payload, sizeof(expiry));
+			expiry = be64toh(expiry);
+			payload += sizeof(expiry);
+			payload_len -= sizeof(expiry);
+			gint64 now = plugin_clock->now();
+			if(header.flags & JANUS_SKYWAYIOT_FRAME_FLAG_TTL)
+				expires = now + (gint64)MIN(expiry, (guint64)G_MAXINT32) * 1000;
+			else
+				expires = now + ((gint64)MIN(expiry, (guint64)G_MAXINT64 / 2000) - g_get_real_time() / 1000) * 1000;
+			if(expires <= now) {
+				/* Expired before we even got to it: it still counts as received */
+				JANUS_SKYWAYIOT_STATS_ADD(relay_stats.expired_received, 1);
+				backend->received++;
+				JANUS_SKYWAYIOT_STATS_ADD(backend->frames_in, 1);
+				offset += total;
+				continue;
+			}
+		}
+		/* Data frames may start with a key, which is not part of what gets relayed */
+		int key_length = ntohs(header.key_length);
+		if(key_length > payload_len) {
+			janus_skywayiot_stats_error(JANUS_SKYWAYIOT_ENTRY_EXT_RECEIVE);
+			offset += total;
+			continue;
+		}
+		switch(header.type) {
+			case JANUS_SKYWAYIOT_FRAME_DATA:
+				janus_skywayiot_ext_deliver(backend, header.target, expires, key_length ? payload : NULL, key_length,
+					payload + key_length, payload_len - key_length);
+				break;
+			case JANUS_SKYWAYIOT_FRAME_GROUP_DATA:
+				relay_ext_group(header.target, expires, key_length ? payload : NULL, key_length, payload + key_length, payload_len - key_length);
+				backend->received++;
+				JANUS_SKYWAYIOT_STATS_ADD(backend->frames_in, 1);
+				break;
+			case JANUS_SKYWAYIOT_FRAME_PUBLISH: {
+				if(key_length == 0) {
+					janus_skywayiot_stats_error(JANUS_SKYWAYIOT_ENTRY_EXT_RECEIVE);
+					break;
+				}
+				relay_ext_publish(payload, key_length, header.flags, expires, payload + key_length, payload_len - key_length);
+				backend->received++;
+				JANUS_SKYWAYIOT_STATS_ADD(backend->frames_in, 1);
+				break;
+			}
+			case JANUS_SKYWAYIOT_FRAME_DEVICE: {
+				if(key_length == 0) {
+					janus_skywayiot_stats_error(JANUS_SKYWAYIOT_ENTRY_EXT_RECEIVE);
+					break;
+				}
+				relay_ext_device(payload, key_length, expires, payload + key_length, payload_len - key_length);
+				backend->received++;
+				JANUS_SKYWAYIOT_STATS_ADD(backend->frames_in, 1);
+				break;
+			}
+			case JANUS_SKYWAYIOT_FRAME_BULK:
+				relay_ext_bulk(header.target, (header.flags & JANUS_SKYWAYIOT_FRAME_FLAG_LAST) != 0, payload, payload_len);
+				break;
+			case JANUS_SKYWAYIOT_FRAME_GROUP_ADD:
+			case JANUS_SKYWAYIOT_FRAME_GROUP_REMOVE:
+			case JANUS_SKYWAYIOT_FRAME_GROUP_DESTROY:
+				janus_skywayiot_group_control(header.type, header.target, payload, payload_len);
+				break;
+			case JANUS_SKYWAYIOT_FRAME_HELLO:
+				janus_skywayiot_backend_hello(backend, payload, payload_len);
+				break;
+			case JANUS_SKYWAYIOT_FRAME_HEARTBEAT:
+				if(payload_len >= (int)sizeof(guint64)) {
+					guint64 acked = 0;
+					memcpy(&acked, payload, sizeof(acked));
+					janus_skywayiot_backend_acked(backend, be64toh(acked));
+				}
+				break;
+			default:
+				JANUS_SKYWAYIOT_HOT_LOG(LOG_WARN, "Unknown frame type %"SCNu64" from backend %"SCNu64, header.type, backend->id);
+				janus_skywayiot_stats_error(JANUS_SKYWAYIOT_ENTRY_EXT_RECEIVE);
+				break;
+		}
+		offset += total;
+	}
+	if(offset > 0) {
+		memmove(backend->inbuf, backend->inbuf + offset, backend->inlen - offset);
+		backend->inlen -= offset;
+	}
+	return ok;
+}
+
+/* Where the next newline in a buffer is, if any: sixteen bytes at a time
+ * where SSE2 is available, as most of what we get are long-ish lines */
+static const char *janus_skywayiot_find_newline(const char *buf, gsize len) {
+#ifdef __SSE2__
+	const __m128i newline = _mm_set1_epi8('\n');
+	gsize i = 0;
+	for(i = 0; i + 16 <= len; i += 16) {
+		__m128i chunk = _mm_loadu_si128((const __m128i *)(buf + i));
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline));
+		if(mask != 0)
+			return buf + i + __builtin_ctz(mask);
+	}
+	return memchr(buf + i, '\n', len - i);
+#else
+	return memchr(buf, '\n', len);
+#endif
+}
+
+/* Find where the JSON value starting at p ends, without parsing it: NULL
+ * if it's not terminated before end */
+static const char *janus_skywayiot_json_skip(const char *p, const char *end) {
+	if(p >= end)
+		return NULL;
+	if(*p == '"') {
+		for(p++; p < end; p++) {
+			if(*p == '\\')
+				p++;
+			else if(*p == '"')
+				return p + 1;
+		}
+		return NULL;
+	}
+	if(*p == '{' || *p == '[') {
+		int depth = 0;
+		while(p < end) {
+			if(*p == '"') {
+				p = janus_skywayiot_json_skip(p, end);
+				if(p == NULL)
+					return NULL;
+				continue;
+			}
+			if(*p == '{' || *p == '[')
+				depth++;
+			else if((*p == '}' || *p == ']') && --depth == 0)
+				return p + 1;
+			p++;
+		}
+		return NULL;
+	}
+	const char *start = p;
+	while(p < end && *p != ',' && *p != '}' && *p != ']' && *p != ' ' && *p != '\t' && *p != '\r')
+		p++;
+	return p > start ? p : NULL;
+}
+
+/* The contents of a JSON string value: points in the line if there's nothing
+ * to unescape, or to a copy (in *copy, to free) if there is */
+static const char *janus_skywayiot_json_string(const char *value, int len, int *out_len, char **copy) {
+	*copy = NULL;
+	if(len < 2 || value[0] != '"')
+		return NULL;
+	if(memchr(value, '\\', len) == NULL) {
+		*out_len = len - 2;
+		return value + 1;
+	}
+	json_error_t error;
+	json_t *string = json_loadb(value, len, JSON_DECODE_ANY, &error);
+	if(!json_is_string(string)) {
+		json_decref(string);
+		return NULL;
+	}
+	*copy = g_strdup(json_string_value(string));
+	*out_len = strlen(*copy);
+	json_decref(string);
+	return *copy;
+}
+
+/* Handle a line from an NDJSON backend: only the fields we need are looked
+ * for, without building the whole object */
+static void janus_skywayiot_ext_receive_line(janus_skywayiot_backend *backend, const char *line, const char *end) {
+	const char *target = NULL, *payload = NULL, *payload_base64 = NULL, *key = NULL, *ttl = NULL, *hello = NULL;
+	int target_len = 0, payload_len = 0, payload_base64_len = 0, key_len = 0, ttl_len = 0, hello_len = 0;
+	const char *p = line;
+	while(p < end && g_ascii_isspace(*p))
+		p++;
+	if(p == end)
+		return;
+	if(*p != '{')
+		goto invalid;
+	p++;
+	while(1) {
+		while(p < end && g_ascii_isspace(*p))
+			p++;
+		if(p < end && *p == '}')
+			break;
+		const char *name = p, *name_end = janus_skywayiot_json_skip(p, end);
+		if(name_end == NULL || *name != '"')
+			goto invalid;
+		p = name_end;
+		while(p < end && g_ascii_isspace(*p))
+			p++;
+		if(p == end || *p != ':')
+			goto invalid;
+		p++;
+		while(p < end && g_ascii_isspace(*p))
+			p++;
+		const char *value = p, *value_end = janus_skywayiot_json_skip(p, end);
+		if(value_end == NULL)
+			goto invalid;
+		int name_len = name_end - name - 2, value_len = value_end - value;
+		name++;
+		if(name_len == 6 && !memcmp(name, "target", 6)) {
+			target = value;
+			target_len = value_len;
+		} else if(name_len == 7 && !memcmp(name, "payload", 7)) {
+			payload = value;
+			payload_len = value_len;
+		} else if(name_len == 14 && !memcmp(name, "payload_base64", 14)) {
+			payload_base64 = value;
+			payload_base64_len = value_len;
+		} else if(name_len == 3 && !memcmp(name, "key", 3)) {
+			key = value;
+			key_len = value_len;
+		} else if(name_len == 3 && !memcmp(name, "ttl", 3)) {
+			ttl = value;
+			ttl_len = value_len;
+		} else if(name_len == 5 && !memcmp(name, "hello", 5)) {
+			hello = value;
+			hello_len = value_len;
+		}
+		p = value_end;
+		while(p < end && g_ascii_isspace(*p))
+			p++;
+		if(p < end && *p == ',') {
+			p++;
+			continue;
+		}
+		if(p < end && *p == '}')
+			break;
+		goto invalid;
+	}
+	if(hello != NULL && target == NULL) {
+		/* Same as a hello frame */
+		char *copy = NULL;
+		const char *name = janus_skywayiot_json_string(hello, hello_len, &hello_len, &copy);
+		if(name == NULL)
+			goto invalid;
+		janus_skywayiot_backend_hello(backend, name, hello_len);
+		g_free(copy);
+		return;
+	}
+	if(target == NULL || (payload == NULL && payload_base64 == NULL))
+		goto invalid;
+	/* The target may be quoted, for ids a double can't hold */
+	char number[32];
+	if(target[0] == '"') {
+		target++;
+		target_len -= 2;
+	}
+	if(target_len <= 0 || target_len >= (int)sizeof(number))
+		goto invalid;
+	memcpy(number, target, target_len);
+	number[target_len] = '\0';
+	char *number_end = NULL;
+	guint64 handle_id = g_ascii_strtoull(number, &number_end, 10);
+	if(number_end == number || *number_end != '\0')
+		goto invalid;
+	gint64 expires = 0;
+	if(ttl != NULL) {
+		/* A ttl that isn't a number would otherwise count as already expired */
+		if(ttl_len >= (int)sizeof(number))
+			goto invalid;
+		memcpy(number, ttl, ttl_len);
+		number[ttl_len] = '\0';
+		gint64 ms = g_ascii_strtoll(number, &number_end, 10);
+		if(number_end == number || *number_end != '\0' || ms < 0)
+			goto invalid;
+		gint64 now = plugin_clock->now();
+		expires = now + MIN(ms, (gint64)G_MAXINT32) * 1000;
+		if(expires <= now) {
+			JANUS_SKYWAYIOT_STATS_ADD(relay_stats.expired_received, 1);
+			backend->received++;
+			JANUS_SKYWAYIOT_STATS_ADD(backend->frames_in, 1);
+			return;
+		}
+	}
+	char *key_copy = NULL, *payload_copy = NULL;
+	const char *key_value = NULL;
+	if(key != NULL && (key_value = janus_skywayiot_json_string(key, key_len, &key_len, &key_copy)) == NULL)
+		goto invalid;
+	const char *data = NULL;
+	int len = 0;
+	if(payload_base64 != NULL) {
+		int encoded_len = 0;
+		const char *encoded = janus_skywayiot_json_string(payload_base64, payload_base64_len, &encoded_len, &payload_copy);
+		if(encoded != NULL) {
+			char *terminated = g_strndup(encoded, encoded_len);
+			gsize decoded_len = 0;
+			g_free(payload_copy);
+			payload_copy = (char *)g_base64_decode(terminated, &decoded_len);
+			g_free(terminated);
+			data = payload_copy;
+			len = decoded_len;
+		}
+	} else if(payload[0] == '"') {
+		data = janus_skywayiot_json_string(payload, payload_len, &len, &payload_copy);
+	} else {
+		/* Any other JSON value is relayed as the backend wrote it */
+		data = payload;
+		len = payload_len;
+	}
+	if(data == NULL || len == 0) {
+		g_free(key_copy);
+		g_free(payload_copy);
+		goto invalid;
+	}
+	janus_skywayiot_ext_deliver(backend, handle_id, expires, key_value, key_value ? key_len : 0, (char *)data, len);
+	g_free(key_copy);
+	g_free(payload_copy);
+	return;
 
-	while(1 /* fixme: detect plugin termination */ ) {
-		ext_fd = accept( ext_listen_fd, (struct sockaddr *)&addr, &addr_len);
+invalid:
+	JANUS_SKYWAYIOT_HOT_LOG(LOG_WARN, "Invalid line (%"SCNu64" bytes) from backend %"SCNu64, (guint64)(end - line), backend->id);
+	janus_skywayiot_stats_error(JANUS_SKYWAYIOT_ENTRY_EXT_RECEIVE);
+}
 
-		while( ( n = read( ext_fd, recvBuff, sizeof(recvBuff) - 1 ) ) > 0 ) {
-			recvBuff[n] = '\0';
+/* Handle the complete lines buffered for an NDJSON backend, and keep any
+ * partial one for the next read, remembering how much of it was searched
+ * already, so that a long line arriving in many reads isn't searched again
+ * from the start each time. Returns FALSE if a line is too long */
+static gboolean janus_skywayiot_ext_receive_ndjson(janus_skywayiot_backend *backend) {
+	const char *start = backend->inbuf, *end = backend->inbuf + backend->inlen, *newline = NULL;
+	const char *from = start + MIN(backend->inscanned, backend->inlen);
+	while(from < end && (newline = janus_skywayiot_find_newline(from, end - from)) != NULL) {
+		janus_skywayiot_ext_receive_line(backend, start, newline);
+		start = newline + 1;
+		from = start;
+	}
+	backend->inscanned = end - start;
+	guint offset = start - backend->inbuf;
+	if(offset == 0 && backend->inlen == backend->insize) {
+		JANUS_LOG(LOG_ERR, "Line longer than %"SCNu32" bytes from backend %"SCNu64"\n", ext_max_payload, backend->id);
+		janus_skywayiot_stats_error(JANUS_SKYWAYIOT_ENTRY_EXT_RECEIVE);
+		return FALSE;
+	}
+	if(offset > 0) {
+		memmove(backend->inbuf, backend->inbuf + offset, backend->inlen - offset);
+		backend->inlen -= offset;
+	}
+	return TRUE;
+}
 
-			if( n > handle_id_len) {
-				memcpy(&handle_id, recvBuff, (size_t)handle_id_len);
+/* Tell a backend we're alive, and how many of its data frames we got */
+static void janus_skywayiot_backend_heartbeat(janus_skywayiot_backend *backend) {
+	janus_skywayiot_frame_header header;
+	guint64 received = htobe64(backend->received);
+	janus_skywayiot_frame_header_init(&header, JANUS_SKYWAYIOT_FRAME_HEARTBEAT, 0, sizeof(received));
+	struct iovec iov[2] = {
+		{ .iov_base = &header, .iov_len = sizeof(header) },
+		{ .iov_base = &received, .iov_len = sizeof(received) }
+	};
+	janus_mutex_lock(&backend->mutex);
+	if(!backend->closed && janus_skywayiot_backend_write(backend, iov, 2) < 0)
+		shutdown(backend->fd, SHUT_RDWR);
+	janus_mutex_unlock(&backend->mutex);
+}
 
-				data_len = n - handle_id_len;
+/* Read from a backend, through OpenSSL if the kernel doesn't decrypt for us */
+static int janus_skywayiot_backend_read(janus_skywayiot_backend *backend, char *buf, int len) {
+#ifdef HAVE_LIBSSL
+	if(backend->ssl != NULL && !backend->ktls_recv) {
+		/* The SSL session is shared with the writers: the socket is
+		 * non-blocking, so that we never wait for the network holding it */
+		int n = 0, err = SSL_ERROR_NONE;
+		while(TRUE) {
+			janus_mutex_lock(&backend->mutex);
+			n = SSL_read(backend->ssl, buf, len);
+			err = n > 0 ? SSL_ERROR_NONE : SSL_get_error(backend->ssl, n);
+			ERR_clear_error();
+			janus_mutex_unlock(&backend->mutex);
+			/* OpenSSL needs to write something first (e.g., a key update) */
+			if(err != SSL_ERROR_WANT_WRITE || !janus_skywayiot_backend_wait(backend, POLLOUT))
+				break;
+		}
+		if(err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) {
+			/* Partial record, the rest will come */
+			errno = EAGAIN;
+			return -1;
+		} else if(err == SSL_ERROR_ZERO_RETURN) {
+			return 0;
+		} else if(err != SSL_ERROR_NONE) {
+			errno = EIO;
+			return -1;
+		}
+		return n;
+	}
+#endif
+	return read(backend->fd, buf, len);
+}
 
-				parsed.handle_id = handle_id;
-				parsed.data = recvBuff + handle_id_len;
-				parsed.data_len = data_len;
+/* Whether OpenSSL already has decrypted data that poll() can't tell us about */
+static gboolean janus_skywayiot_backend_has_pending(janus_skywayiot_backend *backend) {
+#ifdef HAVE_LIBSSL
+	if(backend->ssl != NULL && !backend->ktls_recv) {
+		janus_mutex_lock(&backend->mutex);
+		gboolean pending = SSL_pending(backend->ssl) > 0;
+		janus_mutex_unlock(&backend->mutex);
+		return pending;
+	}
+#endif
+	return FALSE;
+}
 
-				g_hash_table_foreach(sessions, &relay_ext_to_datachannel, &parsed);
+/* Handle what a backend sent us: returns FALSE if it hung up or sent garbage */
+static gboolean janus_skywayiot_backend_readable(janus_skywayiot_backend *backend, char *recvBuff, int size) {
+	do {
+		int n = 0;
+		if(backend->inbuf != NULL) {
+			n = janus_skywayiot_backend_read( backend, backend->inbuf + backend->inlen, backend->insize - backend->inlen );
+			if(n > 0) {
+				backend->inlen += n;
+				backend->last_heard = janus_get_monotonic_time();
+				if(ext_ndjson ? !janus_skywayiot_ext_receive_ndjson(backend) : !janus_skywayiot_ext_receive_framed(backend))
+					return FALSE;
+				continue;
 			}
+		} else {
+			n = janus_skywayiot_backend_read( backend, recvBuff, size - 1 );
+			if(n > 0) {
+				recvBuff[n] = '\0';
+				janus_skywayiot_ext_receive(backend, recvBuff, n);
+				continue;
+			}
+		}
+		if(n < 0 && (errno == EINTR || errno == EAGAIN))
+			return TRUE;
+		return FALSE;
+	} while(janus_skywayiot_backend_has_pending(backend));
+	return TRUE;
+}
+
+#ifdef HAVE_LIBSSL
+static int janus_skywayiot_tls_setup(const char *cert, const char *key, const char *ca) {
+	ext_tls_ctx = SSL_CTX_new(TLS_server_method());
+	if(ext_tls_ctx == NULL) {
+		JANUS_LOG(LOG_ERR, "Couldn't create the TLS context for the external interface\n");
+		return -1;
+	}
+	SSL_CTX_set_min_proto_version(ext_tls_ctx, TLS1_2_VERSION);
+#ifdef SSL_OP_ENABLE_KTLS
+	/* Let OpenSSL configure kernel TLS on the sockets after the handshake */
+	SSL_CTX_set_options(ext_tls_ctx, SSL_OP_ENABLE_KTLS);
+#else
+	JANUS_LOG(LOG_WARN, "OpenSSL without kernel TLS support, TLS on the external interface will be done in userspace\n");
+#endif
+	if(SSL_CTX_use_certificate_chain_file(ext_tls_ctx, cert) != 1 ||
+			SSL_CTX_use_PrivateKey_file(ext_tls_ctx, key, SSL_FILETYPE_PEM) != 1 ||
+			SSL_CTX_check_private_key(ext_tls_ctx) != 1) {
+		JANUS_LOG(LOG_ERR, "Couldn't load the TLS certificate %s and key %s (%s)\n", cert, key, ERR_reason_error_string(ERR_get_error()));
+		goto error;
+	}
+	if(ca != NULL) {
+		/* Only backends with a certificate signed by this CA are accepted */
+		if(SSL_CTX_load_verify_locations(ext_tls_ctx, ca, NULL) != 1) {
+			JANUS_LOG(LOG_ERR, "Couldn't load the TLS CA %s (%s)\n", ca, ERR_reason_error_string(ERR_get_error()));
+			goto error;
+		}
+		SSL_CTX_set_verify(ext_tls_ctx, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, NULL);
+	}
+	JANUS_LOG(LOG_INFO, "TLS enabled on the external interface%s\n", ca ? " (backends must present a certificate)" : "");
+	return 0;
+
+error:
+	ERR_clear_error();
+	SSL_CTX_free(ext_tls_ctx);
+	ext_tls_ctx = NULL;
+	return -1;
+}
+
+#endif
+
+/* TLS handshake with a backend we just accepted: the socket is made
+ * non-blocking, and the listener thread polls it along with the others and
+ * calls janus_skywayiot_tls_handshake when it's ready, so that a slow or
+ * silent backend can't hold the thread (nor the backends it serves) */
+#define JANUS_SKYWAYIOT_TLS_HANDSHAKE_TIMEOUT	(5 * G_USEC_PER_SEC)
+typedef struct janus_skywayiot_handshake {
+	int fd;
+	gpointer tls;
+	short events;		/* What the handshake is waiting for */
+	gint64 deadline;
+} janus_skywayiot_handshake;
+
+#ifdef HAVE_LIBSSL
+static gpointer janus_skywayiot_tls_start(int fd) {
+	if(fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) < 0) {
+		JANUS_LOG(LOG_WARN, "Couldn't make a TLS backend socket non-blocking (%s)\n", strerror(errno));
+		return NULL;
+	}
+	SSL *ssl = SSL_new(ext_tls_ctx);
+	if(ssl == NULL || SSL_set_fd(ssl, fd) != 1) {
+		JANUS_LOG(LOG_WARN, "Couldn't start a TLS session for a backend\n");
+		ERR_clear_error();
+		if(ssl != NULL)
+			SSL_free(ssl);
+		return NULL;
+	}
+	SSL_set_accept_state(ssl);
+	return ssl;
+}
+#endif
+
+/* Move a handshake forward: 1 when it's done, 0 if it's waiting for the
+ * socket (handshake->events says how), -1 if it failed (the SSL session is
+ * freed, the socket is left to the caller) */
+static int janus_skywayiot_tls_handshake(janus_skywayiot_handshake *handshake) {
+#ifdef HAVE_LIBSSL
+	SSL *ssl = (SSL *)handshake->tls;
+	int res = SSL_do_handshake(ssl);
+	if(res == 1) {
+		/* Back to blocking I/O, unless OpenSSL does the reads: those happen with
+		 * the backend lock held, and mustn't wait for a record arriving in pieces */
+		if(JANUS_SKYWAYIOT_KTLS_RECV(ssl) && fcntl(handshake->fd, F_SETFL, fcntl(handshake->fd, F_GETFL) & ~O_NONBLOCK) < 0) {
+			JANUS_LOG(LOG_WARN, "Couldn't make a TLS backend socket blocking again (%s)\n", strerror(errno));
+			SSL_free(ssl);
+			handshake->tls = NULL;
+			return -1;
 		}
+		return 1;
+	}
+	int err = SSL_get_error(ssl, res);
+	if((err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) && janus_get_monotonic_time() < handshake->deadline) {
+		handshake->events = (err == SSL_ERROR_WANT_READ) ? POLLIN : POLLOUT;
+		return 0;
+	}
+	unsigned long reason = ERR_get_error();
+	JANUS_LOG(LOG_WARN, "TLS handshake with a backend failed (%s)\n", reason ? ERR_reason_error_string(reason) :
+		(err == SSL_ERROR_WANT_READ || err == SSL_ERROR_WANT_WRITE) ? "timeout" : "hangup");
+	ERR_clear_error();
+	SSL_free(ssl);
+	handshake->tls = NULL;
+#endif
+	return -1;
+}
+
+/**
+ * This thread function will be used to receive data from external TCP interface.
+ * It polls the listening socket (as long as there's room in the pool) and the
+ * backends it accepted, so one thread per listener serves all its backends.
+ * With heartbeats, it also sends ours and drops the backends that went quiet:
+ * that's done on the real clock, as the backends are real processes.
+ */
+static void *thread_receive_ext_data(void *data) {
+	janus_skywayiot_ext_listener *listener = (janus_skywayiot_ext_listener *)data;
+	char recvBuff[65535];
+	struct sockaddr_in addr;
+	socklen_t addr_len = sizeof(addr);
+
+	janus_skywayiot_thread_policy_apply(JANUS_SKYWAYIOT_THREAD_EXT, listener->cpu);
+
+	/* Backends accepted by this listener, those still in the TLS handshake
+	 * (together no more than max_backends), and the descriptors we poll
+	 * (those, the listening socket and the stop event) */
+	janus_skywayiot_backend **conns = g_malloc0(listener->max_backends * sizeof(janus_skywayiot_backend *));
+	janus_skywayiot_handshake *handshakes = g_malloc0(listener->max_backends * sizeof(janus_skywayiot_handshake));
+	struct pollfd *fds = g_malloc0((listener->max_backends + 2) * sizeof(struct pollfd));
+	guint count = 0, handshaking = 0, i = 0;
 
-		/* socket HANG */
-		close(ext_fd);
-		ext_fd = -1;
+	listen( listener->listen_fd, listener->max_backends );
+	gint64 next_heartbeat = janus_get_monotonic_time() + heartbeat_interval;
 
-		sleep(1);
+	while(!g_atomic_int_get(&stopping)) {
+		guint nfds = 0;
+		fds[nfds].fd = ext_stop_fd;
+		fds[nfds].events = POLLIN;
+		fds[nfds].revents = 0;
+		nfds++;
+		for(i = 0; i < count; i++) {
+			fds[nfds].fd = conns[i]->fd;
+			fds[nfds].events = POLLIN;
+			fds[nfds].revents = 0;
+			nfds++;
+		}
+		guint polled = count;
+		gint64 next_deadline = 0;
+		for(i = 0; i < handshaking; i++) {
+			fds[nfds].fd = handshakes[i].fd;
+			fds[nfds].events = handshakes[i].events;
+			fds[nfds].revents = 0;
+			nfds++;
+			if(next_deadline == 0 || handshakes[i].deadline < next_deadline)
+				next_deadline = handshakes[i].deadline;
+		}
+		/* When the pool is full, further backends wait in the accept queue */
+		gboolean accepting = count + handshaking < listener->max_backends;
+		if(accepting) {
+			fds[nfds].fd = listener->listen_fd;
+			fds[nfds].events = POLLIN;
+			fds[nfds].revents = 0;
+			nfds++;
+		}
+		gint64 wakeup = heartbeat_interval > 0 ? next_heartbeat : 0;
+		if(next_deadline > 0 && (wakeup == 0 || next_deadline < wakeup))
+			wakeup = next_deadline;
+		int timeout = -1;
+		if(wakeup > 0)
+			timeout = MAX(0, (int)((wakeup - janus_get_monotonic_time() + 999) / 1000));
+		if(poll(fds, nfds, timeout) < 0) {
+			if(errno != EINTR) {
+				JANUS_LOG(LOG_ERR, "Error polling the ext listener %u (%s)\n", listener->index, strerror(errno));
+				plugin_clock->sleep(G_USEC_PER_SEC);
+			}
+			continue;
+		}
+		if(fds[0].revents != 0)
+			break;
+		/* Backwards, so that the last backend can take the place of one that hung up */
+		for(i = count; i > 0; i--) {
+			if(fds[i].revents == 0)
+				continue;
+			janus_skywayiot_backend *backend = conns[i-1];
+			if(janus_skywayiot_backend_readable(backend, recvBuff, sizeof(recvBuff)))
+				continue;
+			/* socket HANG (or garbage): its sessions move to the other backends */
+			janus_skywayiot_backend_remove(backend);
+			conns[i-1] = conns[--count];
+		}
+		if(heartbeat_interval > 0 && janus_get_monotonic_time() >= next_heartbeat) {
+			gint64 now = janus_get_monotonic_time();
+			for(i = count; i > 0; i--) {
+				janus_skywayiot_backend *backend = conns[i-1];
+				if(now - backend->last_heard > heartbeat_misses * heartbeat_interval) {
+					JANUS_LOG(LOG_WARN, "Backend %"SCNu64" missed %d heartbeats, failing over\n", backend->id, heartbeat_misses);
+					JANUS_SKYWAYIOT_STATS_ADD(failover_stats.timeouts, 1);
+					janus_skywayiot_backend_remove(backend);
+					conns[i-1] = conns[--count];
+					continue;
+				}
+				janus_skywayiot_backend_heartbeat(backend);
+			}
+			next_heartbeat = now + heartbeat_interval;
+		}
+		/* Handshakes that can move forward (or took too long), backwards too */
+		gint64 now = janus_get_monotonic_time();
+		for(i = handshaking; i > 0; i--) {
+			janus_skywayiot_handshake *handshake = &handshakes[i-1];
+			if(fds[1 + polled + i-1].revents == 0 && now < handshake->deadline)
+				continue;
+			int res = janus_skywayiot_tls_handshake(handshake);
+			if(res == 0)
+				continue;
+			if(res > 0) {
+				conns[count++] = janus_skywayiot_backend_add(handshake->fd, listener, handshake->tls);
+			} else {
+				close(handshake->fd);
+			}
+			handshakes[i-1] = handshakes[--handshaking];
+		}
+		if(accepting && (fds[nfds-1].revents & POLLIN)) {
+			int fd = accept( listener->listen_fd, (struct sockaddr *)&addr, &addr_len);
+			if(fd < 0) {
+				/* e.g., out of descriptors: don't spin on it */
+				JANUS_LOG(LOG_WARN, "Couldn't accept a backend on ext listener %u (%s)\n", listener->index, strerror(errno));
+				plugin_clock->sleep(G_USEC_PER_SEC);
+				continue;
+			}
+#ifdef HAVE_LIBSSL
+			if(ext_tls_ctx != NULL) {
+				janus_skywayiot_handshake *handshake = &handshakes[handshaking];
+				handshake->fd = fd;
+				handshake->tls = janus_skywayiot_tls_start(fd);
+				handshake->events = POLLIN;
+				handshake->deadline = janus_get_monotonic_time() + JANUS_SKYWAYIOT_TLS_HANDSHAKE_TIMEOUT;
+				if(handshake->tls == NULL)
+					close(fd);
+				else
+					handshaking++;
+				continue;
+			}
+#endif
+			conns[count++] = janus_skywayiot_backend_add(fd, listener, NULL);
+		}
+	}
+	/* The plugin is going away: so are our backends */
+	for(i = count; i > 0; i--)
+		janus_skywayiot_backend_remove(conns[i-1]);
+#ifdef HAVE_LIBSSL
+	for(i = 0; i < handshaking; i++) {
+		SSL_free((SSL *)handshakes[i].tls);
+		close(handshakes[i].fd);
 	}
+#endif
+	close(listener->listen_fd);
+	listener->listen_fd = -1;
+	g_free(fds);
+	g_free(handshakes);
+	g_free(conns);
 	return NULL;
 }
 
+/**
+ * Dispatch a frame received from the external interface. Unicast frames are
+ * looked up directly in the sessions table, so their cost doesn't grow with
+ * the number of sessions: only broadcasts need to walk all of them.
+ */
+static void relay_ext_frame(data_with_handleid *frame) {
+	janus_mutex_lock(&sessions_mutex);
+	if(frame->handle_id == JANUS_SKYWAYIOT_BROADCAST_ID) {
+		JANUS_SKYWAYIOT_STATS_ADD(relay_stats.broadcast, 1);
+		g_hash_table_foreach(sessions, &relay_ext_to_datachannel, frame);
+	} else {
+		janus_skywayiot_session *session = g_hash_table_lookup(sessions, (gpointer)frame->handle_id);
+		if(session != NULL) {
+			JANUS_SKYWAYIOT_STATS_ADD(relay_stats.unicast, 1);
+			relay_ext_to_datachannel(session->handle, session, frame);
+		} else {
+			JANUS_SKYWAYIOT_STATS_ADD(relay_stats.unknown_target, 1);
+		}
+	}
+	janus_mutex_unlock(&sessions_mutex);
+}
+
+/**
+ * Group management commands from the backend: membership is indexed both
+ * ways, by group (for the fan-out) and by session (to leave on destroy).
+ */
+static void janus_skywayiot_group_control(guint8 type, guint64 group_id, char *payload, int len) {
+	int count = len / (int)sizeof(guint64), i = 0, changed = 0;
+	janus_mutex_lock(&sessions_mutex);
+	janus_skywayiot_group *group = g_hash_table_lookup(groups, &group_id);
+	if(type == JANUS_SKYWAYIOT_FRAME_GROUP_ADD && group == NULL) {
+		group = g_malloc0(sizeof(janus_skywayiot_group));
+		group->id = group_id;
+		group->members = g_hash_table_new(NULL, NULL);
+		g_hash_table_insert(groups, &group->id, group);
+		JANUS_LOG(LOG_VERB, "Created group %"SCNu64"\n", group_id);
+	}
+	if(group == NULL) {
+		janus_mutex_unlock(&sessions_mutex);
+		JANUS_SKYWAYIOT_HOT_LOG(LOG_WARN, "No such group %"SCNu64, group_id);
+		return;
+	}
+	if(type == JANUS_SKYWAYIOT_FRAME_GROUP_DESTROY) {
+		GHashTableIter iter;
+		gpointer value;
+		g_hash_table_iter_init(&iter, group->members);
+		while(g_hash_table_iter_next(&iter, NULL, &value)) {
+			janus_skywayiot_session *session = (janus_skywayiot_session *)value;
+			session->groups = g_list_remove(session->groups, group);
+		}
+		g_hash_table_remove(groups, &group_id);
+		janus_mutex_unlock(&sessions_mutex);
+		JANUS_LOG(LOG_VERB, "Destroyed group %"SCNu64"\n", group_id);
+		return;
+	}
+	for(i = 0; i < count; i++) {
+		guint64 handle_id = 0;
+		memcpy(&handle_id, payload + i*sizeof(guint64), sizeof(guint64));
+		handle_id = be64toh(handle_id);
+		if(type == JANUS_SKYWAYIOT_FRAME_GROUP_ADD) {
+			janus_skywayiot_session *session = g_hash_table_lookup(sessions, (gpointer)handle_id);
+			if(session == NULL || g_hash_table_contains(group->members, session->handle))
+				continue;
+			g_hash_table_insert(group->members, session->handle, session);
+			session->groups = g_list_prepend(session->groups, group);
+			changed++;
+		} else {
+			janus_skywayiot_session *session = g_hash_table_lookup(group->members, (gpointer)handle_id);
+			if(session == NULL)
+				continue;
+			g_hash_table_remove(group->members, session->handle);
+			session->groups = g_list_remove(session->groups, group);
+			changed++;
+		}
+	}
+	JANUS_LOG(LOG_VERB, "Group %"SCNu64": %d of %d session(s) %s, %u member(s) now\n",
+		group_id, changed, count, type == JANUS_SKYWAYIOT_FRAME_GROUP_ADD ? "added" : "removed", g_hash_table_size(group->members));
+	janus_mutex_unlock(&sessions_mutex);
+}
+
+/* Relay a message to the subscribers of a topic, and retain it if asked to */
+static void relay_ext_publish(const char *name, int name_len, guint8 flags, gint64 expires, char *data, int len) {
+	char short_name[256], *topic_name = short_name;
+	if(name_len < (int)sizeof(short_name)) {
+		memcpy(short_name, name, name_len);
+		short_name[name_len] = '\0';
+	} else {
+		topic_name = g_strndup(name, name_len);
+	}
+	janus_mutex_lock(&sessions_mutex);
+	gboolean retain = (flags & JANUS_SKYWAYIOT_FRAME_FLAG_RETAIN) != 0;
+	janus_skywayiot_topic *topic = janus_skywayiot_topic_get(topic_name, retain && len > 0);
+	GArray *matches = len > 0 ? janus_skywayiot_wildcard_matches(topic_name) : NULL;
+	guint i = 0;
+	for(i = 0; matches != NULL && i < matches->len; i++) {
+		janus_skywayiot_wildcard_match *match = &g_array_index(matches, janus_skywayiot_wildcard_match, i);
+		janus_skywayiot_session *session = match->session;
+		if(topic != NULL && g_hash_table_contains(topic->subscribers, session->handle))
+			continue;	/* It gets it as a subscriber of the topic below */
+		janus_skywayiot_throttle *throttle = g_hash_table_size(session->throttles) > 0 ?
+			g_hash_table_lookup(session->throttles, match->wildcard->filter) : NULL;
+		if(throttle != NULL)
+			janus_skywayiot_throttle_push(throttle, name, name_len, expires, data, len);
+		else
+			janus_skywayiot_deliver(session, expires, name, name_len, data, len);
+	}
+	if(topic == NULL && matches != NULL && matches->len > 0)
+		JANUS_SKYWAYIOT_STATS_ADD(relay_stats.published, 1);
+	if(topic != NULL) {
+		JANUS_SKYWAYIOT_STATS_ADD(relay_stats.published, 1);
+		GHashTableIter iter;
+		gpointer value;
+		if(len > 0) {
+			g_hash_table_iter_init(&iter, topic->subscribers);
+			while(g_hash_table_iter_next(&iter, NULL, &value)) {
+				janus_skywayiot_session *session = (janus_skywayiot_session *)value;
+				janus_skywayiot_throttle *throttle = g_hash_table_size(session->throttles) > 0 ?
+					g_hash_table_lookup(session->throttles, topic_name) : NULL;
+				if(throttle != NULL)
+					janus_skywayiot_throttle_push(throttle, name, name_len, expires, data, len);
+				else
+					janus_skywayiot_deliver(session, expires, name, name_len, data, len);
+			}
+		}
+		if(retain) {
+			janus_skywayiot_topic_retain(topic, expires, data, len);
+			janus_skywayiot_topic_release(topic);
+		}
+	}
+	janus_mutex_unlock(&sessions_mutex);
+	if(topic_name != short_name)
+		g_free(topic_name);
+}
+
+/* Relay a message to a device, or keep it in its spool until it's back */
+static void relay_ext_device(const char *device, int device_len, gint64 expires, char *data, int len) {
+	char short_id[JANUS_SKYWAYIOT_DEVICE_ID_MAX+1];
+	if(device_len > JANUS_SKYWAYIOT_DEVICE_ID_MAX || len == 0) {
+		janus_skywayiot_stats_error(JANUS_SKYWAYIOT_ENTRY_EXT_RECEIVE);
+		return;
+	}
+	memcpy(short_id, device, device_len);
+	short_id[device_len] = '\0';
+	char *key_copy = NULL;
+	int key_len = 0;
+	const char *key = janus_skywayiot_json_key(data, len, &key_len, &key_copy);
+	GQueue relays = G_QUEUE_INIT;
+	janus_mutex_lock(&sessions_mutex);
+	janus_skywayiot_session *session = g_hash_table_lookup(devices, short_id);
+	janus_mutex_lock(&delivery_mutex);
+	janus_skywayiot_spool *spool = janus_skywayiot_spool_get(short_id, FALSE);
+	if(session != NULL && g_atomic_int_get(&session->data_open) && (spool == NULL || spool->header->count == 0)) {
+		/* Connected and caught up: no need to go through the spool */
+		janus_skywayiot_deliver_locked(session, expires, key, key_len, data, len, &relays);
+	} else if(spool != NULL || (spool = janus_skywayiot_spool_get(short_id, TRUE)) != NULL) {
+		/* Keep it in order after what's still spooled */
+		janus_skywayiot_spool_append(spool, expires, data, len);
+		if(spool->session != NULL)
+			janus_skywayiot_spool_schedule(spool);
+	} else {
+		JANUS_SKYWAYIOT_STATS_ADD(relay_stats.unknown_target, 1);
+	}
+	/* Spools nobody drains go back to the recently written ones (or are
+	 * closed), so that devices that never come back don't each keep a mapping */
+	if(spool != NULL)
+		janus_skywayiot_spool_release(spool);
+	janus_mutex_unlock(&delivery_mutex);
+	janus_skywayiot_relay_queued(&relays);
+	janus_mutex_unlock(&sessions_mutex);
+	g_free(key_copy);
+}
+
+/* Queue a bulk chunk for a session, to be sent when its window has room */
+static void relay_ext_bulk(guint64 handle_id, gboolean last, char *payload, int len) {
+	if(len < (int)(2*sizeof(guint32))) {
+		janus_skywayiot_stats_error(JANUS_SKYWAYIOT_ENTRY_EXT_RECEIVE);
+		return;
+	}
+	guint32 transfer = 0, seq = 0;
+	memcpy(&transfer, payload, sizeof(guint32));
+	memcpy(&seq, payload + sizeof(guint32), sizeof(guint32));
+	transfer = ntohl(transfer);
+	seq = ntohl(seq);
+	payload += 2*sizeof(guint32);
+	len -= 2*sizeof(guint32);
+	janus_mutex_lock(&sessions_mutex);
+	janus_skywayiot_session *session = g_hash_table_lookup(sessions, (gpointer)handle_id);
+	if(session == NULL || !session->envelope || !session->media_ready ||
+			len + (int)sizeof(janus_skywayiot_bulk_header) > max_message_size) {
+		/* Bulk chunks must fit in a message, as they're acknowledged one by one */
+		janus_mutex_unlock(&sessions_mutex);
+		JANUS_SKYWAYIOT_STATS_ADD(relay_stats.unknown_target, 1);
+		return;
+	}
+	guint32 credit[4];
+	gboolean resume = FALSE;
+	janus_mutex_lock(&delivery_mutex);
+	janus_skywayiot_bulk *bulk = session->bulk;
+	if(bulk == NULL || bulk->transfer != transfer) {
+		/* New transfer: whatever was left of the previous one is abandoned */
+		janus_skywayiot_bulk_reset(session, transfer);
+		bulk = session->bulk;
+	}
+	if(seq - bulk->acked >= bulk_window || seq != bulk->next + g_queue_get_length(&bulk->queue)) {
+		/* The backend didn't wait for credit, or skipped a chunk: tell it
+		 * where to resume from (once, as what follows will be dropped too),
+		 * or the transfer would never get past the gap */
+		bulk->overflow++;
+		JANUS_SKYWAYIOT_STATS_ADD(relay_stats.bulk_overflow, 1);
+		if(!bulk->resuming) {
+			bulk->resuming = TRUE;
+			janus_skywayiot_bulk_credit(bulk, credit);
+			resume = TRUE;
+		}
+	} else {
+		janus_skywayiot_bulk_chunk *chunk = g_malloc(sizeof(janus_skywayiot_bulk_chunk) + len);
+		chunk->seq = seq;
+		chunk->last = last;
+		chunk->len = len;
+		memcpy(chunk->data, payload, len);
+		g_queue_push_tail(&bulk->queue, chunk);
+		bulk->resuming = FALSE;
+		janus_skywayiot_bulk_schedule(session);
+	}
+	janus_mutex_unlock(&delivery_mutex);
+	janus_mutex_unlock(&sessions_mutex);
+	if(resume)
+		janus_skywayiot_ext_send_frame(JANUS_SKYWAYIOT_FRAME_CREDIT, handle_id, (char *)credit, sizeof(credit));
+}
+
+/* Relay a frame to all the members of a group */
+static void relay_ext_group(guint64 group_id, gint64 expires, const char *key, int key_len, char *data, int len) {
+	char *key_copy = NULL;
+	if(key == NULL)
+		key = janus_skywayiot_json_key(data, len, &key_len, &key_copy);
+	janus_mutex_lock(&sessions_mutex);
+	janus_skywayiot_group *group = g_hash_table_lookup(groups, &group_id);
+	if(group != NULL) {
+		JANUS_SKYWAYIOT_STATS_ADD(relay_stats.group, 1);
+		GHashTableIter iter;
+		gpointer value;
+		g_hash_table_iter_init(&iter, group->members);
+		while(g_hash_table_iter_next(&iter, NULL, &value))
+			janus_skywayiot_deliver((janus_skywayiot_session *)value, expires, key, key_len, data, len);
+	} else {
+		JANUS_SKYWAYIOT_STATS_ADD(relay_stats.unknown_target, 1);
+	}
+	janus_mutex_unlock(&sessions_mutex);
+	g_free(key_copy);
+}
+
 /**
  * This is helper function to relay data from external to DataChannel
  * When handle is ``0xffffffffffffffff``, data will be broadcasted to
@@ -951,8 +6817,7 @@ static void relay_ext_to_datachannel(gpointer handle, gpointer session, gpointer
 
 	guint64 handle_id = (guint64)handle;
 
-	if(_data->handle_id == 0xffffffffffffffff || handle_id == _data->handle_id) {
-		gateway->relay_data(handle, (void *)_data->data, _data->data_len);
-	}
+	if(_data->handle_id == JANUS_SKYWAYIOT_BROADCAST_ID || handle_id == _data->handle_id)
+		janus_skywayiot_deliver((janus_skywayiot_session *)session, _data->expires, _data->key, _data->key_len, _data->data, _data->data_len);
 }
 